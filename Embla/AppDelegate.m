@@ -18,6 +18,7 @@
 
 #import "AppDelegate.h"
 #import "Common.h"
+#import "QueryService.h"
 
 #import <WebKit/WKWebsiteDataStore.h>
 
@@ -59,6 +60,11 @@
         [DEFAULTS setObject:NEW_MALE_VOICE_ID forKey:@"VoiceID"];
     }
     
+    // The name of the most recently trained hotword model used to be
+    // stored to select it. All models are loaded at once now, so the
+    // setting is gone.
+    [DEFAULTS removeObjectForKey:@"HotwordModelName"];
+    
 #ifdef DEBUG
     // Dump app-specific defaults to standard output
     NSArray *defaultKeys = [startingDefaults allKeys];
@@ -117,6 +123,8 @@
 
 - (void)applicationDidBecomeActive:(UIApplication *)application {
     DLog(@"Application did become active");
+    // Have a connection to the query server ready for the first query
+    [[QueryService sharedInstance] preconnect];
 }
 
 - (void)applicationWillTerminate:(UIApplication *)application {
@@ -156,12 +164,15 @@
         @"VoiceActivation": @(YES),
         @"UseLocation": @(YES),
         @"PrivacyMode": @(NO),
+        @"SpeculativeQueries": @(NO),
         @"VoiceID": DEFAULT_VOICE_ID,
         @"SpeechSpeed": [NSNumber numberWithFloat:1.0f],
         @"QueryServer": DEFAULT_QUERY_SERVER,
         @"Speech2TextServer": DEFAULT_SPEECH2TEXT_SERVER,
         @"HotwordDetector": DEFAULT_HOTWORD_DETECTOR,
-        @"HotwordModel": DEFAULT_HOTWORD_MODEL
+        @"HotwordModel": DEFAULT_HOTWORD_MODEL,
+        // Snowboy sensitivity of each hotword model, by file name
+        @"HotwordSensitivities": @{ DEFAULT_HOTWORD_MODEL: @(DEFAULT_HOTWORD_SENSITIVITY) }
     };
 }
 
@@ -0,0 +1,227 @@
+# This file is part of the Embla iOS app
+# Copyright (c) 2019-2023 Miðeind ehf.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+
+
+"""
+Packs the app's sound clips into a single file, VoiceAssets.pack, which
+the app memory-maps once at launch (see VoiceAssetPack.h). Run by the
+"Pack voice assets" build phase, which writes the pack to the derived
+files directory and bundles it from there:
+
+    $ python3 Embla/Audio/pack_voices.py Embla/Audio VoiceAssets.pack [VoiceAssets.xcfilelist]
+
+The build phase declares the clips as its inputs in VoiceAssets.xcfilelist,
+so it only runs when one of them changes. Given the list, the packer fails
+if it doesn't name exactly the clips packed. After adding or removing a
+clip, update the list:
+
+    $ python3 Embla/Audio/pack_voices.py --list-inputs Embla/Audio > Embla/Audio/VoiceAssets.xcfilelist
+
+WAV files directly in the audio directory are UI sounds, shared by all
+voices. Each subdirectory holds the clips spoken by one voice, named
+<clip>-<voice>.wav, e.g. Dora/dunno01-dora.wav. Voices are named after
+their directory in lowercase ASCII, the way -[NSString icelandic_asciify]
+spells voice IDs.
+
+Layout, all integers little-endian:
+
+    Header      magic "EMVA", version, voice count, clip count (u32 each)
+    Voices      voice count names, 16 bytes each, NUL-padded
+    Clips       clip count names, likewise
+    Entries     voice count x clip count entries of 32 bytes, by voice
+                then clip: WAV offset (u64) and size (u32), offset of the
+                PCM within the WAV (u32), frames, sample rate (u32 each),
+                channels, bits per sample (u16 each) and flags (u32)
+    Data        canonical 44-byte header WAV files of 16-bit PCM, each
+                starting on a 16-byte boundary
+
+An entry with flags 0 means the voice doesn't have that clip. UI sounds
+are stored once and every voice's entry refers to them. If the contents
+don't change, the output file is only touched, so it isn't copied again
+when the bundle is built next.
+"""
+
+import os
+import struct
+import sys
+
+MAGIC = b"EMVA"
+VERSION = 1
+NAME_SIZE = 16
+ALIGNMENT = 16
+
+FLAG_PRESENT = 1
+FLAG_VOICED = 2
+
+
+def read_wav(path):
+    """Returns (channels, sample rate, bits per sample, PCM data)."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[0:4] != b"RIFF" or data[8:12] != b"WAVE":
+        raise ValueError(f"{path}: not a WAV file")
+    fmt = pcm = None
+    pos = 12
+    while pos + 8 <= len(data):
+        chunk_id, size = struct.unpack_from("<4sI", data, pos)
+        body = data[pos + 8 : pos + 8 + size]
+        if chunk_id == b"fmt ":
+            fmt = struct.unpack_from("<HHIIHH", body)
+        elif chunk_id == b"data":
+            pcm = body
+        pos += 8 + size + (size & 1)
+    if fmt is None or pcm is None:
+        raise ValueError(f"{path}: missing fmt or data chunk")
+    audio_format, channels, sample_rate, _, _, bits = fmt
+    if audio_format != 1 or bits != 16:
+        raise ValueError(f"{path}: only 16-bit PCM is supported")
+    frames = len(pcm) // (2 * channels)
+    return channels, sample_rate, bits, pcm[: frames * 2 * channels]
+
+
+def canonical_wav(channels, sample_rate, bits, pcm):
+    block_align = channels * bits // 8
+    header = struct.pack(
+        "<4sI4s4sIHHIIHH4sI",
+        b"RIFF", 36 + len(pcm), b"WAVE",
+        b"fmt ", 16, 1, channels, sample_rate, sample_rate * block_align, block_align, bits,
+        b"data", len(pcm),
+    )
+    return header + pcm
+
+
+def encode_name(name):
+    raw = name.encode("ascii")
+    if len(raw) >= NAME_SIZE:
+        raise ValueError(f"Name too long: {name}")
+    return raw.ljust(NAME_SIZE, b"\0")
+
+
+def collect(audio_dir):
+    """Returns ({clip: path} of UI sounds, {voice: {clip: path}})."""
+    shared = {}
+    voices = {}
+    for entry in sorted(os.listdir(audio_dir)):
+        path = os.path.join(audio_dir, entry)
+        if os.path.isdir(path):
+            voice = entry.lower()
+            clips = voices.setdefault(voice, {})
+            suffix = "-" + voice + ".wav"
+            for fn in sorted(os.listdir(path)):
+                if fn.lower().endswith(suffix):
+                    clips[fn[: -len(suffix)]] = os.path.join(path, fn)
+        elif entry.lower().endswith(".wav"):
+            shared[entry[:-4]] = path
+    return shared, voices
+
+
+def input_list(audio_dir):
+    """Lines of the build phase's input file list, the clips relative to the project."""
+    shared, voices = collect(audio_dir)
+    paths = list(shared.values()) + [p for clips in voices.values() for p in clips.values()]
+    root = os.path.dirname(os.path.dirname(os.path.abspath(audio_dir)))
+    return sorted("$(SRCROOT)/" + os.path.relpath(os.path.abspath(p), root).replace(os.sep, "/") for p in paths)
+
+
+def check_input_list(audio_dir, list_path):
+    with open(list_path, encoding="utf-8") as f:
+        listed = sorted(line.strip() for line in f if line.strip() and not line.startswith("#"))
+    if listed != input_list(audio_dir):
+        raise ValueError(
+            f"{list_path} doesn't list the clips packed, update it with "
+            f"python3 Embla/Audio/pack_voices.py --list-inputs Embla/Audio > Embla/Audio/VoiceAssets.xcfilelist"
+        )
+
+
+def pack(audio_dir):
+    shared, voices = collect(audio_dir)
+    voice_names = sorted(voices)
+    clip_names = sorted(shared) + sorted({c for clips in voices.values() for c in clips} - set(shared))
+
+    header_size = 16 + NAME_SIZE * (len(voice_names) + len(clip_names))
+    entries_size = 32 * len(voice_names) * len(clip_names)
+    offset = header_size + entries_size
+    blobs = []
+    placed = {}
+
+    def place(path, flags):
+        nonlocal offset
+        if path not in placed:
+            channels, sample_rate, bits, pcm = read_wav(path)
+            wav = canonical_wav(channels, sample_rate, bits, pcm)
+            offset += -offset % ALIGNMENT
+            placed[path] = (offset, len(wav), len(pcm) // (2 * channels), sample_rate, channels, bits)
+            blobs.append((offset, wav))
+            offset += len(wav)
+        wav_offset, size, frames, sample_rate, channels, bits = placed[path]
+        return struct.pack("<QIIIIHHI", wav_offset, size, 44, frames, sample_rate, channels, bits, flags)
+
+    entries = []
+    for voice in voice_names:
+        for clip in clip_names:
+            if clip in voices[voice]:
+                entries.append(place(voices[voice][clip], FLAG_PRESENT | FLAG_VOICED))
+            elif clip in shared:
+                entries.append(place(shared[clip], FLAG_PRESENT))
+            else:
+                entries.append(bytes(32))
+
+    out = bytearray(struct.pack("<4sIII", MAGIC, VERSION, len(voice_names), len(clip_names)))
+    for name in voice_names + clip_names:
+        out += encode_name(name)
+    for e in entries:
+        out += e
+    for blob_offset, wav in blobs:
+        out += bytes(blob_offset - len(out))
+        out += wav
+    return bytes(out), voice_names, clip_names
+
+
+def main():
+    if len(sys.argv) == 3 and sys.argv[1] == "--list-inputs":
+        print("\n".join(input_list(sys.argv[2])))
+        return
+    if len(sys.argv) not in (3, 4):
+        print(f"usage: {sys.argv[0]} <audio directory> <output file> [<input file list>]\n"
+              f"       {sys.argv[0]} --list-inputs <audio directory>", file=sys.stderr)
+        sys.exit(1)
+    audio_dir, out_path = sys.argv[1:3]
+    try:
+        if len(sys.argv) == 4:
+            check_input_list(audio_dir, sys.argv[3])
+        data, voice_names, clip_names = pack(audio_dir)
+    except (OSError, ValueError) as e:
+        print(f"error: {e}", file=sys.stderr)
+        sys.exit(1)
+
+    if os.path.exists(out_path):
+        with open(out_path, "rb") as f:
+            if f.read() == data:
+                # Newer than its inputs, so the build phase is up to date
+                os.utime(out_path)
+                return
+    tmp_path = out_path + ".tmp"
+    with open(tmp_path, "wb") as f:
+        f.write(data)
+    os.replace(tmp_path, out_path)
+    print(
+        f"Packed {len(clip_names)} clips for {len(voice_names)} voices "
+        f"({', '.join(voice_names)}) into {out_path}, {len(data)} bytes"
+    )
+
+
+if __name__ == "__main__":
+    main()
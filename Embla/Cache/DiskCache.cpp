@@ -0,0 +1,392 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DiskCache.h"
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DISK_CACHE_INDEX_NAME       "index"
+#define DISK_CACHE_INDEX_MAGIC      0x43444d45u // "EMDC"
+#define DISK_CACHE_INDEX_VERSION    1u
+#define DISK_CACHE_MAX_KEY_LENGTH   (1u << 20)
+// Changes to keys and blobs after which the index is saved without waiting for sync()
+#define DISK_CACHE_MAX_UNSAVED      16
+
+namespace embla {
+
+// Files
+
+static uint64_t ContentHash(const uint8_t *data, size_t size) {
+    // FNV-1a, with collisions resolved by comparing contents in put()
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ data[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static bool WriteFile(const std::string &path, const void *data, size_t size) {
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(data, 1, size, f) == size;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+static std::shared_ptr<MappedBlob> MapFile(const std::string &path, uint64_t expectedSize) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size == expectedSize && expectedSize > 0) {
+        p = mmap(nullptr, (size_t)expectedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+        return nullptr;
+    }
+    return std::make_shared<MappedBlob>(p, (size_t)expectedSize);
+}
+
+MappedBlob::~MappedBlob() {
+    munmap((void *)_data, _size);
+}
+
+// Cache
+
+DiskCache::DiskCache(const std::string &directory, uint64_t maxBytes) : _directory(directory), _maxBytes(maxBytes) {
+    mkdir(_directory.c_str(), 0755);
+    if (!loadIndex()) {
+        _lru.clear();
+        _blobs.clear();
+        _keys.clear();
+        _stats = DiskCacheStats();
+        _dirty = true;
+    }
+    removeOrphans();
+    // The limit may have been lowered since the index was written
+    std::lock_guard<std::mutex> lock(_mutex);
+    evictLocked(0);
+    if (_dirty) {
+        saveLocked();
+    }
+}
+
+DiskCache::~DiskCache() {
+    sync();
+}
+
+std::string DiskCache::blobPath(uint64_t hash) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64, hash);
+    return _directory + "/" + name;
+}
+
+void DiskCache::touch(BlobRef blob) {
+    if (blob != _lru.begin()) {
+        _lru.splice(_lru.begin(), _lru, blob);
+        _dirty = true;
+    }
+}
+
+std::shared_ptr<MappedBlob> DiskCache::get(const std::string &key) {
+    return get(std::vector<std::string>{ key });
+}
+
+std::shared_ptr<MappedBlob> DiskCache::get(const std::vector<std::string> &keys) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _dirty = true;
+    for (const std::string &key : keys) {
+        auto it = _keys.find(key);
+        if (it == _keys.end()) {
+            continue;
+        }
+        BlobRef blob = it->second;
+        std::shared_ptr<MappedBlob> mapped = MapFile(blobPath(blob->hash), blob->size);
+        if (!mapped) {
+            // Deleted or damaged behind our back
+            dropLocked(blob);
+            changedLocked();
+            continue;
+        }
+        touch(blob);
+        _stats.hits++;
+        return mapped;
+    }
+    _stats.misses++;
+    return nullptr;
+}
+
+bool DiskCache::contains(const std::string &key) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _keys.count(key) > 0;
+}
+
+void DiskCache::linkLocked(const std::string &key, BlobRef blob) {
+    auto it = _keys.find(key);
+    if (it != _keys.end()) {
+        if (it->second == blob) {
+            return;
+        }
+        // Key moves to another blob, which may leave the old one unreferenced
+        BlobRef old = it->second;
+        old->keys.erase(std::find(old->keys.begin(), old->keys.end(), key));
+        _keys.erase(it);
+        if (old->keys.empty()) {
+            dropLocked(old);
+        }
+    }
+    blob->keys.push_back(key);
+    _keys[key] = blob;
+}
+
+bool DiskCache::put(const std::vector<std::string> &keys, const uint8_t *data, size_t size) {
+    if (keys.empty() || size == 0 || size > _maxBytes) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // Find the blob if already stored, stepping past any hash collisions
+    uint64_t hash = ContentHash(data, size);
+    BlobRef blob = _lru.end();
+    for (auto it = _blobs.find(hash); it != _blobs.end(); it = _blobs.find(++hash)) {
+        std::shared_ptr<MappedBlob> existing = MapFile(blobPath(hash), it->second->size);
+        if (existing && existing->size() == size && memcmp(existing->data(), data, size) == 0) {
+            blob = it->second;
+            break;
+        }
+    }
+
+    if (blob == _lru.end()) {
+        evictLocked(size);
+        if (!WriteFile(blobPath(hash), data, size)) {
+            return false;
+        }
+        _lru.push_front(Blob{hash, size, {}});
+        blob = _lru.begin();
+        _blobs[hash] = blob;
+        _stats.bytes += size;
+        _stats.inserts++;
+    }
+    touch(blob);
+    for (const std::string &key : keys) {
+        linkLocked(key, blob);
+    }
+    changedLocked();
+    return true;
+}
+
+bool DiskCache::alias(const std::string &existingKey, const std::string &key) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _keys.find(existingKey);
+    if (it == _keys.end()) {
+        return false;
+    }
+    linkLocked(key, it->second);
+    changedLocked();
+    return true;
+}
+
+void DiskCache::remove(const std::string &key) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _keys.find(key);
+    if (it == _keys.end()) {
+        return;
+    }
+    BlobRef blob = it->second;
+    blob->keys.erase(std::find(blob->keys.begin(), blob->keys.end(), key));
+    _keys.erase(it);
+    if (blob->keys.empty()) {
+        dropLocked(blob);
+    }
+    changedLocked();
+}
+
+void DiskCache::clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    while (!_lru.empty()) {
+        dropLocked(_lru.begin());
+    }
+    // Not batched, as the user asked for it
+    saveLocked();
+}
+
+// Make room for incoming bytes
+void DiskCache::evictLocked(uint64_t incoming) {
+    while (!_lru.empty() && _stats.bytes + incoming > _maxBytes) {
+        dropLocked(std::prev(_lru.end()));
+        _stats.evictions++;
+    }
+}
+
+void DiskCache::dropLocked(BlobRef blob) {
+    unlink(blobPath(blob->hash).c_str());
+    for (const std::string &key : blob->keys) {
+        _keys.erase(key);
+    }
+    _stats.bytes -= blob->size;
+    _blobs.erase(blob->hash);
+    _lru.erase(blob);
+    _dirty = true;
+}
+
+// Save the index once enough changes have piled up, see DiskCache.h
+void DiskCache::changedLocked() {
+    _dirty = true;
+    if (++_unsaved >= DISK_CACHE_MAX_UNSAVED) {
+        saveLocked();
+    }
+}
+
+void DiskCache::sync() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_dirty) {
+        saveLocked();
+    }
+}
+
+DiskCacheStats DiskCache::stats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    DiskCacheStats s = _stats;
+    s.blobs = _lru.size();
+    s.keys = _keys.size();
+    return s;
+}
+
+// Index
+
+// Native byte order, as the index never leaves the device. Layout:
+// magic, version, hits, misses, blob count, then for each blob, most
+// recently used first: hash, size, key count and the keys, each
+// preceded by its length.
+
+template <typename T>
+static void Put(std::string &out, T value) {
+    out.append((const char *)&value, sizeof(T));
+}
+
+template <typename T>
+static bool Get(FILE *f, T &value) {
+    return fread(&value, sizeof(T), 1, f) == 1;
+}
+
+void DiskCache::saveLocked() {
+    std::string out;
+    Put<uint32_t>(out, DISK_CACHE_INDEX_MAGIC);
+    Put<uint32_t>(out, DISK_CACHE_INDEX_VERSION);
+    Put<uint64_t>(out, _stats.hits);
+    Put<uint64_t>(out, _stats.misses);
+    Put<uint32_t>(out, (uint32_t)_lru.size());
+    for (const Blob &blob : _lru) {
+        Put<uint64_t>(out, blob.hash);
+        Put<uint64_t>(out, blob.size);
+        Put<uint32_t>(out, (uint32_t)blob.keys.size());
+        for (const std::string &key : blob.keys) {
+            Put<uint32_t>(out, (uint32_t)key.size());
+            out.append(key);
+        }
+    }
+    if (WriteFile(_directory + "/" DISK_CACHE_INDEX_NAME, out.data(), out.size())) {
+        _dirty = false;
+        _unsaved = 0;
+    }
+}
+
+bool DiskCache::loadIndex() {
+    FILE *f = fopen((_directory + "/" DISK_CACHE_INDEX_NAME).c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    uint32_t magic = 0, version = 0, count = 0;
+    bool ok = Get(f, magic) && magic == DISK_CACHE_INDEX_MAGIC && Get(f, version) &&
+              version == DISK_CACHE_INDEX_VERSION && Get(f, _stats.hits) && Get(f, _stats.misses) && Get(f, count);
+    for (uint32_t i = 0; ok && i < count; i++) {
+        Blob blob;
+        uint32_t keyCount = 0;
+        ok = Get(f, blob.hash) && Get(f, blob.size) && Get(f, keyCount) && !_blobs.count(blob.hash);
+        for (uint32_t k = 0; ok && k < keyCount; k++) {
+            uint32_t length = 0;
+            ok = Get(f, length) && length <= DISK_CACHE_MAX_KEY_LENGTH;
+            if (ok) {
+                std::string key(length, '\0');
+                ok = fread(&key[0], 1, length, f) == length;
+                blob.keys.push_back(std::move(key));
+            }
+        }
+        if (!ok) {
+            break;
+        }
+        // Skip blobs whose file has gone missing or changed size
+        struct stat st;
+        if (blob.keys.empty() || stat(blobPath(blob.hash).c_str(), &st) != 0 || (uint64_t)st.st_size != blob.size) {
+            _dirty = true;
+            continue;
+        }
+        _lru.push_back(std::move(blob));
+        BlobRef ref = std::prev(_lru.end());
+        _blobs[ref->hash] = ref;
+        _stats.bytes += ref->size;
+        for (const std::string &key : ref->keys) {
+            _keys[key] = ref;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+void DiskCache::removeOrphans() {
+    DIR *dir = opendir(_directory.c_str());
+    if (!dir) {
+        return;
+    }
+    std::vector<std::string> orphans;
+    while (struct dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == ".." || name == DISK_CACHE_INDEX_NAME) {
+            continue;
+        }
+        char *end = nullptr;
+        uint64_t hash = strtoull(name.c_str(), &end, 16);
+        if (name.size() != 16 || *end != '\0' || !_blobs.count(hash)) {
+            orphans.push_back(_directory + "/" + name);
+        }
+    }
+    closedir(dir);
+    for (const std::string &path : orphans) {
+        unlink(path.c_str());
+    }
+}
+
+} // namespace embla
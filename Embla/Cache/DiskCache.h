@@ -0,0 +1,149 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Size-bounded, content-addressed cache of blobs on disk.
+
+    Each blob is stored once, in a file named after a hash of its
+    contents, and any number of keys can refer to it. For speech audio
+    this means that e.g. an answer's audio URL and its text, voice and
+    speed both lead to the same file. Once the cache grows beyond its
+    size limit, the least recently used blobs are evicted along with
+    their keys.
+
+    Lookups return the blob memory-mapped rather than read into memory.
+    A mapping stays valid even if the blob is evicted in the meantime.
+    The index (keys, blobs in LRU order and the hit and miss counts) is
+    kept in a single file which is replaced atomically when saved, so
+    the cache survives restarts. Rewriting it costs far more than
+    storing a blob, so changes are batched and the index is only saved
+    every so many changes, on sync() and when the cache is closed. A
+    crash loses at most the changes since: blob files not in the index
+    are removed when the cache is opened, and entries whose file has
+    been evicted are skipped. Thread safe.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace embla {
+
+// Read-only memory mapping of a cached blob, unmapped when destroyed
+class MappedBlob {
+public:
+    MappedBlob(const void *data, size_t size) : _data(data), _size(size) {}
+    ~MappedBlob();
+
+    MappedBlob(const MappedBlob &) = delete;
+    MappedBlob &operator=(const MappedBlob &) = delete;
+
+    const uint8_t *data() const { return (const uint8_t *)_data; }
+    size_t size() const { return _size; }
+
+private:
+    const void *_data;
+    size_t _size;
+};
+
+struct DiskCacheStats {
+    uint64_t hits = 0;          // Lookups found, since the cache was created (persisted)
+    uint64_t misses = 0;        // Lookups not found, likewise
+    uint64_t inserts = 0;       // Blobs written, this session
+    uint64_t evictions = 0;     // Blobs evicted, this session
+    uint64_t bytes = 0;         // Current size of all blobs
+    size_t blobs = 0;
+    size_t keys = 0;
+
+    double hitRate() const { return hits + misses ? (double)hits / (hits + misses) : 0.0; }
+};
+
+class DiskCache {
+public:
+    // Opens the cache in directory, which is created if needed.
+    DiskCache(const std::string &directory, uint64_t maxBytes);
+    ~DiskCache();
+
+    DiskCache(const DiskCache &) = delete;
+    DiskCache &operator=(const DiskCache &) = delete;
+
+    // The blob for key, or null. Counts as a hit or a miss.
+    std::shared_ptr<MappedBlob> get(const std::string &key);
+
+    // The blob for the first of keys that is cached, or null. Counts as
+    // a single hit or miss.
+    std::shared_ptr<MappedBlob> get(const std::vector<std::string> &keys);
+
+    // Whether key is cached, without counting it as a lookup.
+    bool contains(const std::string &key) const;
+
+    // Store a blob under one or more keys, evicting as needed. Blobs
+    // larger than the whole cache are not stored. Returns success.
+    bool put(const std::vector<std::string> &keys, const uint8_t *data, size_t size);
+
+    // Refer an additional key to the blob of an existing one.
+    bool alias(const std::string &existingKey, const std::string &key);
+
+    void remove(const std::string &key);
+    void clear();
+
+    // Write the index if anything changed since it was last written.
+    // Changes are otherwise only saved once enough of them pile up.
+    void sync();
+
+    DiskCacheStats stats() const;
+
+private:
+    struct Blob {
+        uint64_t hash;
+        uint64_t size;
+        std::vector<std::string> keys;
+    };
+    typedef std::list<Blob>::iterator BlobRef;
+
+    std::string blobPath(uint64_t hash) const;
+    void touch(BlobRef blob);
+    void evictLocked(uint64_t incoming);
+    void dropLocked(BlobRef blob);
+    void linkLocked(const std::string &key, BlobRef blob);
+    void changedLocked();
+    bool loadIndex();
+    void saveLocked();
+    void removeOrphans();
+
+    const std::string _directory;
+    const uint64_t _maxBytes;
+    mutable std::mutex _mutex;
+
+    // Most recently used first
+    std::list<Blob> _lru;
+    std::unordered_map<uint64_t, BlobRef> _blobs;
+    std::unordered_map<std::string, BlobRef> _keys;
+    bool _dirty = false;
+    unsigned _unsaved = 0;      // Changes to keys and blobs since the index was saved
+    DiskCacheStats _stats;
+};
+
+} // namespace embla
@@ -30,6 +30,8 @@
 
 // Hotword detection
 #define DEFAULT_HOTWORD_DETECTOR        @"Snowboy"
+// For models without an entry in the HotwordSensitivities defaults
+#define DEFAULT_HOTWORD_SENSITIVITY     0.5f
 
 // Speech synthesis
 #define DEFAULT_VOICE_ID                @"Guðrún"
@@ -115,9 +115,10 @@
         // Decode base64 data and write to directory
         NSData *decodedData = [[NSData alloc] initWithBase64EncodedString:base64String options:0];
         NSString *filename = [NSString stringWithFormat:@"%@.pmdl", resp[@"name"]];
+        // Models in Documents are loaded along with the default one, this one
+        // as soon as the hotword detector next starts listening
         DLog(@"Writing model %@", filename);
         [self writeFile:filename withData:decodedData];
-        [DEFAULTS setObject:filename forKey:@"HotwordModelName"];
     }];
     
     [uploadTask resume];
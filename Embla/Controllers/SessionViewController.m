@@ -30,8 +30,11 @@
 #import "JSExecutor.h"
 #import "Reachability.h"
 #import "NSString+Additions.h"
-#import "UIImage+Additions.h"
 #import "QueryService.h"
+#import "VoiceAssets.h"
+#import "EarconPlayer.h"
+#import "ImagePipeline.h"
+#import "SessionTrace.h"
 
 static NSString * const kIntroMessage = \
 @"Segðu „Hæ Embla“ eða smelltu á hnappinn til þess að tala við Emblu.";
@@ -68,7 +71,6 @@ static NSString * const kSessionButtonLabelActive = \
 @interface SessionViewController () <QuerySessionDelegate>
 {
     AVAudioPlayer *player;
-    NSMutableDictionary *uiSounds;
     CADisplayLink *displayLink;
     Reachability *reach;
 }
@@ -77,6 +79,9 @@ static NSString * const kSessionButtonLabelActive = \
 @property (nonatomic, weak) IBOutlet SessionButton *button;
 @property (nonatomic, retain) QuerySession *currentSession;
 @property BOOL connected;
+// Incremented whenever the log is cleared, so that images arriving late
+// aren't added to a log that has since moved on. Main thread only.
+@property NSUInteger logGeneration;
 
 @end
 
@@ -103,7 +108,7 @@ static NSString * const kSessionButtonLabelActive = \
     self.overrideUserInterfaceStyle = UIUserInterfaceStyleLight;
     
     // Preload/pre-initialize the following to prevent any delay when session is activated
-    [self preloadSounds];
+    [EarconPlayer sharedInstance];
     
     // Receive messages from hotword detector
     [[self detector] setDelegate:self];
@@ -180,7 +185,7 @@ static NSString * const kSessionButtonLabelActive = \
 #pragma GCC diagnostic pop
         UINavigationController *navCtrl = (UINavigationController *)rootVC;
         if (navCtrl.topViewController == self) {
-            [[self detector] startListening];
+            [self startHotwordListening];
         }
     }
     // Update state of hotword detection bar button item and intro message
@@ -188,6 +193,13 @@ static NSString * const kSessionButtonLabelActive = \
     self.textView.text = [self introMessage];
 }
 
+// Listen for hotword and keep a speech recognition call ready, so that
+// audio can be sent as soon as the hotword is heard
+- (void)startHotwordListening {
+    [[self detector] startListening];
+    [[SpeechRecognitionService sharedInstance] prewarm];
+}
+
 - (void)teardown {
     DLog(@"Main view teardown");
     
@@ -197,7 +209,9 @@ static NSString * const kSessionButtonLabelActive = \
         self.currentSession = nil;
     }
     player = nil; // Silence any sound being played
+    [[EarconPlayer sharedInstance] stop];
     [[self detector] stopListening];
+    [[SpeechRecognitionService sharedInstance] cooldown];
     [[UIApplication sharedApplication] setIdleTimerDisabled:NO];
 }
 
@@ -249,7 +263,7 @@ static NSString * const kSessionButtonLabelActive = \
     if (self.currentSession && !self.currentSession.terminated) {
         [self.currentSession terminate];
         self.currentSession = nil;
-        [self playUISound:@"conn"];
+        [self playUISound:VoiceClipConn];
         [self log:kNoInternetConnectivityMessage];
     }
 }
@@ -281,10 +295,23 @@ static NSString * const kSessionButtonLabelActive = \
 
 #pragma mark - ActivationListenerDelegate
 
-- (void)didHearHotword:(NSString *)phrase {
-    if (!(self.currentSession && !self.currentSession.terminated)) {
-        [[self detector] stopListening];
-        [self startSession];
+- (void)didHearHotword:(NSString *)phrase atIndex:(NSUInteger)index endingAtSample:(uint64_t)position {
+    DLog(@"Heard hotword %lu (%@)", (unsigned long)index, phrase);
+    // All hotwords currently start a query session. Heard while an answer
+    // is playing, the hotword cuts it short (barge-in).
+    BOOL live = self.currentSession && !self.currentSession.terminated;
+    if (live && self.currentSession.isPlaying) {
+        DLog(@"Hotword interrupts answer playback");
+        [self.currentSession terminate];
+        live = NO;
+    }
+    if (!live) {
+        SessionTrace *trace = [SessionTrace sharedInstance];
+        [trace startQuery];
+        [trace mark:"Hotword"];
+        [trace beginSpan:"Session start"];
+        // Speech recognition picks up right where the hotword ended
+        [self startSessionFromSamplePosition:position];
     }
 }
 
@@ -297,9 +324,10 @@ static NSString * const kSessionButtonLabelActive = \
     DLog(@"Hotword activation: %d", enabled);
     
     if (enabled && (!self.currentSession || self.currentSession.terminated)) {
-        [[self detector] startListening];
+        [self startHotwordListening];
     } else {
         [[self detector] stopListening];
+        [[SpeechRecognitionService sharedInstance] cooldown];
     }
     self.micItem.image = [UIImage systemImageNamed:enabled ? @"mic.fill" : @"mic.slash.fill"];
     self.textView.text = [self introMessage];
@@ -317,7 +345,7 @@ static NSString * const kSessionButtonLabelActive = \
 
 - (IBAction)buttonPressed:(id)sender {
     if (self.currentSession && !self.currentSession.terminated) {
-        [self playUISound:@"rec_cancel"];
+        [self playUISound:VoiceClipRecCancel];
         [self endSession];
     } else {
         // Make sure that we have permission to access the mic
@@ -329,14 +357,18 @@ static NSString * const kSessionButtonLabelActive = \
         if ([[SpeechRecognitionService sharedInstance] hasAPIKey] == NO) {
             [self clearLog];
             [self log:kNoSpeechAPIKeyMessage];
-            [self playUISound:@"rec_cancel"];
+            [self playUISound:VoiceClipRecCancel];
             return;
         }
+        SessionTrace *trace = [SessionTrace sharedInstance];
+        [trace startQuery];
+        [trace mark:"Button"];
+        [trace beginSpan:"Session start"];
         [self startSession];
     }
 }
 
-- (void)startSession {
+- (BOOL)prepareSession {
     // Terminate any ongoing session
     if (self.currentSession && !self.currentSession.terminated) {
         [self.currentSession terminate];
@@ -346,8 +378,15 @@ static NSString * const kSessionButtonLabelActive = \
     
     // Abort if no internet connection
     if (!self.connected) {
-        [self playUISound:@"conn"];
+        [self playUISound:VoiceClipConn];
         [self log:kNoInternetConnectivityMessage];
+        return NO;
+    }
+    return YES;
+}
+
+- (void)startSession {
+    if (![self prepareSession]) {
         return;
     }
     
@@ -355,7 +394,7 @@ static NSString * const kSessionButtonLabelActive = \
     [[self detector] stopListening];
     
     // Start new session
-    [self playUISound:@"rec_begin"];
+    [self playUISound:VoiceClipRecBegin];
     [self.button setAccessibilityLabel:kSessionButtonLabelActive];
     [self.button expand];
     self.currentSession = [[QuerySession alloc] initWithDelegate:self];
@@ -365,6 +404,29 @@ static NSString * const kSessionButtonLabelActive = \
     });
 }
 
+// Start session without interrupting audio capture, beginning with audio
+// already recorded from the given position onwards.
+- (void)startSessionFromSamplePosition:(uint64_t)position {
+    if (![self prepareSession]) {
+        [[self detector] stopListening];
+        return;
+    }
+    
+    // Capture is already running, so rather than waiting for the UI sound
+    // to finish, speech recognition is spared the part of the recording
+    // it can be heard in
+    [self playUISound:VoiceClipRecBegin];
+    [[AudioRecordingService sharedInstance] skipSoundPlayedNow:
+        [[VoiceAssets sharedInstance] durationOfClip:VoiceClipRecBegin]];
+    [self.button setAccessibilityLabel:kSessionButtonLabelActive];
+    [self.button expand];
+    self.currentSession = [[QuerySession alloc] initWithDelegate:self];
+    // Session takes over the running capture before hotword detection is
+    // paused, so the recording service is never stopped in between
+    [self.currentSession startFromSamplePosition:position];
+    [[self detector] stopListening];
+}
+
 - (void)endSession {
     if (self.currentSession && !self.currentSession.terminated) {
         [self.currentSession terminate];
@@ -393,7 +455,7 @@ static NSString * const kSessionButtonLabelActive = \
 - (void)sessionDidReceiveTranscripts:(NSArray<NSString *> *)alternatives {
     [self clearLog];
     if (!alternatives || ![alternatives count]) {
-        [self playUISound:@"rec_cancel"];
+        [self playUISound:VoiceClipRecCancel];
         return;
     }
     
@@ -402,12 +464,12 @@ static NSString * const kSessionButtonLabelActive = \
     NSString *cmd;
     if ((cmd = [self _containsCancelCommand:alternatives])) {
         [self log:@"%@", [cmd sentenceCapitalizedString]];
-        [self playUISound:@"rec_cancel"];
+        [self playUISound:VoiceClipRecCancel];
         [self.currentSession terminate];
     }
     else if ((cmd = [self _containsDisableVoiceActivationCommand:alternatives])) {
         [self log:@"%@", [cmd sentenceCapitalizedString]];
-        [self playUISound:@"rec_confirm"];
+        [self playUISound:VoiceClipRecConfirm];
         if ([DEFAULTS boolForKey:@"VoiceActivation"]) {
             [self toggleVoiceActivation:self];
         }
@@ -417,7 +479,7 @@ static NSString * const kSessionButtonLabelActive = \
     else {
         NSString *questionStr = [[alternatives firstObject] sentenceCapitalizedString];
         [self log:@"%@", questionStr];
-        [self playUISound:@"rec_confirm"];
+        [self playUISound:VoiceClipRecConfirm];
     }
 }
 
@@ -435,23 +497,25 @@ static NSString * const kSessionButtonLabelActive = \
 
     // We have received a JS command
     if (cmd) {
-        id synthesisCompletionHandler = ^(NSURLResponse *response, id responseObject, NSError *error) {
-            NSDictionary *respDict = (NSDictionary *)responseObject;
-            NSString *audioURLStr = [respDict objectForKey:@"audio_url"];
-            if ([[respDict objectForKey:@"err"] boolValue] || !audioURLStr || !self.currentSession) {
-                return;
-            }
-            [self.currentSession playRemoteURL:audioURLStr];
-        };
-        
         [[JSExecutor sharedInstance] run:cmd completionHandler:^(id res, NSError *err) {
             // Put JS eval result into text field on main thread
             NSString *str = err ? [NSString stringWithFormat:@"%@ - %@", [err localizedDescription], err.userInfo] : [NSString stringWithFormat:@"%@", res];
             [self clearLog];
             [self log:str];
-            // Speech synthesise text via Greynir API and play
+            // Play cached speech for the result if there, otherwise
+            // speech synthesise text via Greynir API and play
+            if ([self.currentSession playCachedSpeechForText:str]) {
+                return;
+            }
             [[QueryService sharedInstance] requestSpeechSynthesis:str
-                                                completionHandler:synthesisCompletionHandler];
+                                                completionHandler:^(NSURLResponse *response, id responseObject, NSError *error) {
+                NSDictionary *respDict = (NSDictionary *)responseObject;
+                NSString *audioURLStr = [respDict objectForKey:@"audio_url"];
+                if ([[respDict objectForKey:@"err"] boolValue] || !audioURLStr || !self.currentSession) {
+                    return;
+                }
+                [self.currentSession playRemoteURL:audioURLStr text:str];
+            }];
         }];
         return;
     }
@@ -466,9 +530,19 @@ static NSString * const kSessionButtonLabelActive = \
                         [[aStr sentenceCapitalizedString] periodTerminatedString],
                         srcStr];
     if (imgURL) {
-        NSData *data = [NSData dataWithContentsOfURL:imgURL];
-        UIImage *img = [[UIImage alloc] initWithData:data];
-        [self logString:logStr withImage:img];
+        // Show the answer right away, then add the image once it has been
+        // fetched and decoded, if the log still shows this answer
+        [self log:logStr];
+        [[NSOperationQueue mainQueue] addOperationWithBlock:^{
+            NSUInteger generation = self.logGeneration;
+            [[ImagePipeline sharedInstance] imageForURL:imgURL
+                                                  width:self.textView.bounds.size.width
+                                      completionHandler:^(UIImage *img, NSError *err) {
+                if (img && generation == self.logGeneration) {
+                    [self logString:logStr withImage:img];
+                }
+            }];
+        }];
         return;
     }
     [self log:logStr];
@@ -491,16 +565,18 @@ static NSString * const kSessionButtonLabelActive = \
 #ifdef DEBUG
         [self log:[error localizedDescription]];
 #endif
-        [self playUISound:@"err"];
+        [self playUISound:VoiceClipErr];
     } else {
         [self log:kNoInternetConnectivityMessage];
-        [self playUISound:@"conn"];
+        [self playUISound:VoiceClipConn];
     }
     [self.currentSession terminate];
     self.currentSession = nil;
 }
 
 - (void)sessionDidTerminate {
+    [[SessionTrace sharedInstance] finishQuery];
+    
     // Upload session audio to server
 //    NSUInteger audioSize = [self.currentSession.totalAudioData length];
 //    if (audioSize && audioSize <= MAX_SESSION_AUDIO_SIZE) {
@@ -512,11 +588,15 @@ static NSString * const kSessionButtonLabelActive = \
     
     // Update UI controls on the main thread
     [[NSOperationQueue mainQueue] addOperationWithBlock:^{
+        // A new session may have started in the meantime, e.g. by barge-in
+        if (self.currentSession && !self.currentSession.terminated) {
+            return;
+        }
         [self.button contract];
         [self.button stopAnimating];
         [self.button stopWaveform];
         if ([DEFAULTS boolForKey:@"VoiceActivation"]) {
-            [[self detector] startListening];
+            [self startHotwordListening];
         }
         if ([self.textView.text isEqualToString:@""]) {
             self.textView.text = [self introMessage];
@@ -524,6 +604,13 @@ static NSString * const kSessionButtonLabelActive = \
     }];
 }
 
+// Listen for the hotword over the answer, its echo being cancelled
+- (void)sessionWillStartInterruptiblePlayback {
+    if ([DEFAULTS boolForKey:@"VoiceActivation"]) {
+        [self startHotwordListening];
+    }
+}
+
 #pragma mark - Local commands
 
 - (void)cancelCommandReceived:(NSNotification *)notification {
@@ -568,6 +655,7 @@ static NSString * const kSessionButtonLabelActive = \
     [[NSOperationQueue mainQueue] addOperationWithBlock:^{
         [self.textView setContentOffset:CGPointZero animated:NO];
         self.textView.text = @"";
+        self.logGeneration++;
     }];
 }
 
@@ -600,10 +688,10 @@ static NSString * const kSessionButtonLabelActive = \
     NSMutableAttributedString *attributedString = [[NSMutableAttributedString alloc] initWithString:s
                                                                                          attributes:attrs];
     NSTextAttachment *imageAttachment = [NSTextAttachment new];
-    float tvWidth = self.textView.bounds.size.width;
-    UIImage *finalImg = [UIImage imageWithImage:img scaledToWidth:tvWidth];
-
-    imageAttachment.image = finalImg;
+    // The image is already decoded at about this width, so it's only scaled when drawn
+    CGFloat tvWidth = self.textView.bounds.size.width;
+    imageAttachment.image = img;
+    imageAttachment.bounds = CGRectMake(0, 0, tvWidth, img.size.height * tvWidth / MAX(img.size.width, 1.0));
 
     NSAttributedString *stringWithImage = [NSAttributedString attributedStringWithAttachment:imageAttachment];
     [attributedString replaceCharactersInRange:NSMakeRange([s length], 0) withAttributedString:stringWithImage];
@@ -621,56 +709,29 @@ static NSString * const kSessionButtonLabelActive = \
 
 #pragma mark - UI sounds
 
-- (void)playUISound:(NSString *)fileName {
-    NSArray *voiceSounds = @[@"err", @"conn", @"dunno"];
+- (void)playUISound:(VoiceClip)clip {
+    VoiceAssets *assets = [VoiceAssets sharedInstance];
+    float speed = [DEFAULTS floatForKey:@"SpeechSpeed"];
+    BOOL adjustRate = [assets isVoicedClip:clip] && speed != 1.0;
     
-    BOOL adjustRate = NO;
-    if ([voiceSounds containsObject:fileName]) {
-        NSString *suffix = [[[DEFAULTS stringForKey:@"VoiceID"] icelandic_asciify] lowercaseString];
-        fileName = [NSString stringWithFormat:@"%@-%@", fileName, suffix];
-        adjustRate = YES;
+    // AVAudioPlayer keeps the pitch of voiced clips at other speeds, which
+    // the earcon player can't, so they, and any clip it fails to start, are
+    // played by AVAudioPlayer instead
+    if (!adjustRate && [[EarconPlayer sharedInstance] playClip:clip]) {
+        return;
     }
     
-    if ([uiSounds objectForKey:fileName]) {
-        player = [[AVAudioPlayer alloc] initWithData:uiSounds[fileName] error:nil];
+    NSData *data = [assets dataForClip:clip];
+    if (data) {
+        player = [[AVAudioPlayer alloc] initWithData:data error:nil];
         [player setVolume:1.0];
-        float speed = [DEFAULTS floatForKey:@"SpeechSpeed"];
-        if (speed != 1.0 && adjustRate) {
+        if (adjustRate) {
             player.enableRate = YES;
             player.rate = speed;
         }
         [player play];
     } else {
-        DLog(@"Unable to play audio file '%@'", fileName);
-    }
-}
-
-// Preload audio files into memory so there isn't even the slightest delay when first played
-- (void)preloadSounds {
-    uiSounds = [NSMutableDictionary new];
-    
-    NSMutableArray *files = [@[@"rec_begin", @"rec_cancel", @"rec_confirm",
-                              @"err-dora", @"conn-dora", @"err-karl", @"conn-karl",
-                              @"err-gudrun", @"conn-gudrun", @"err-gunnar", @"conn-gunnar"] mutableCopy];
-    
-    for (int i = 1; i < 8; i++) {
-        [files addObject:[NSString stringWithFormat:@"dunno%02d-dora", i]];
-        [files addObject:[NSString stringWithFormat:@"dunno%02d-karl", i]];
-        [files addObject:[NSString stringWithFormat:@"dunno%02d-gudrun", i]];
-        [files addObject:[NSString stringWithFormat:@"dunno%02d-gunnar", i]];
-    }
-    
-    // Load files into memory, make the OS cache them
-    for (NSString *fileName in files) {
-        NSURL *url = [[NSBundle mainBundle] URLForResource:fileName withExtension:@"wav"];
-        if ([[NSFileManager defaultManager] fileExistsAtPath:[url path]]) {
-            uiSounds[fileName] = [NSData dataWithContentsOfURL:url options:NSDataReadingMappedAlways error:nil];
-            if (![uiSounds objectForKey:fileName]) {
-                DLog(@"Error loading audio file %@", fileName);
-            }
-        } else {
-            DLog(@"Unable to load non-existent audio file '%@'", fileName);
-        }
+        DLog(@"Unable to play UI sound %d", (int)clip);
     }
 }
 
@@ -20,6 +20,8 @@
 #import "AppDelegate.h"
 #import "Common.h"
 #import "QueryService.h"
+#import "SpeechAudioCache.h"
+#import "ImagePipeline.h"
 
 #define QUERY_SERVER_PRESETS \
 @[DEFAULT_QUERY_SERVER,\
@@ -243,6 +245,9 @@
 
 // Send HTTP request to query server asking for the deletion of the device's query history
 - (void)clearHistory {
+    // Cached answer audio and images are part of the history
+    [[SpeechAudioCache sharedInstance] clear];
+    [[ImagePipeline sharedInstance] clear];
     [[QueryService sharedInstance] clearUserData:NO completionHandler:^(NSURLResponse *response, id responseObject, NSError *err) {
          if (err == nil && [[responseObject objectForKey:@"valid"] boolValue]) {
              NSString *msg = @"Öllum fyrirspurnum frá þessu tæki hefur nú verið eytt.";
@@ -257,6 +262,8 @@
 
 // Send HTTP request to query server asking for the deletion of all user data associated w. device
 - (void)clearAllUserData {
+    [[SpeechAudioCache sharedInstance] clear];
+    [[ImagePipeline sharedInstance] clear];
     [[QueryService sharedInstance] clearUserData:YES completionHandler:^(NSURLResponse *response, id responseObject, NSError *err) {
          if (err == nil && [[responseObject objectForKey:@"valid"] boolValue]) {
              NSString *msg = @"Öllum gögnum sem tengjast þessu tæki hefur nú verið eytt.";
@@ -0,0 +1,91 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Circular buffer holding the most recent audio, addressed by absolute
+    sample position. Appending never fails: once full, the oldest samples
+    are overwritten. Not thread safe, all access must happen on a single
+    thread or queue.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+namespace embla {
+
+template <typename T>
+class AudioHistoryBuffer {
+    static_assert(std::is_trivially_copyable<T>::value, "AudioHistoryBuffer requires trivially copyable samples");
+
+public:
+    explicit AudioHistoryBuffer(size_t capacity) : _buffer(std::max<size_t>(1, capacity)) {}
+
+    size_t capacity() const { return _buffer.size(); }
+
+    // Total number of samples ever appended, i.e. the position of the next sample.
+    uint64_t position() const { return _position; }
+
+    // Position of the oldest sample still held.
+    uint64_t oldestPosition() const { return _position - std::min<uint64_t>(_position, _buffer.size()); }
+
+    void append(const T *samples, size_t count) {
+        size_t capacity = _buffer.size();
+        if (count > capacity) {
+            _position += count - capacity;
+            samples += count - capacity;
+            count = capacity;
+        }
+        size_t offset = (size_t)(_position % capacity);
+        size_t first = std::min(count, capacity - offset);
+        memcpy(_buffer.data() + offset, samples, first * sizeof(T));
+        memcpy(_buffer.data(), samples + first, (count - first) * sizeof(T));
+        _position += count;
+    }
+
+    // Number of samples available from the given position onwards. Positions
+    // older than the history are clamped to the oldest sample held.
+    size_t availableSince(uint64_t position) const {
+        position = std::max(position, oldestPosition());
+        return position < _position ? (size_t)(_position - position) : 0;
+    }
+
+    // Copy up to maxCount samples starting at the given position (clamped as
+    // above) into dst. Returns the number of samples copied.
+    size_t copySince(uint64_t position, T *dst, size_t maxCount) const {
+        position = std::max(position, oldestPosition());
+        size_t count = std::min(availableSince(position), maxCount);
+        size_t capacity = _buffer.size();
+        size_t offset = (size_t)(position % capacity);
+        size_t first = std::min(count, capacity - offset);
+        memcpy(dst, _buffer.data() + offset, first * sizeof(T));
+        memcpy(dst + first, _buffer.data(), (count - first) * sizeof(T));
+        return count;
+    }
+
+private:
+    std::vector<T> _buffer;
+    uint64_t _position = 0;
+};
+
+} // namespace embla
@@ -0,0 +1,133 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Wait-free single-producer/single-consumer ring buffer for PCM samples.
+
+    The producer is the real-time Core Audio thread, which must never
+    block or allocate, so all storage is allocated up front and the only
+    synchronization is a pair of atomic indices. Exactly one thread may
+    write and exactly one (other) thread may read at any given time.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+
+namespace embla {
+
+template <typename T>
+class AudioRingBuffer {
+    static_assert(std::is_trivially_copyable<T>::value, "AudioRingBuffer requires trivially copyable samples");
+
+public:
+    // Capacity is rounded up to the nearest power of two so that
+    // index wrapping is a mask rather than a modulo operation.
+    explicit AudioRingBuffer(size_t minCapacity)
+        : _capacity(roundUpPowerOfTwo(minCapacity)), _mask(_capacity - 1), _buffer(new T[_capacity]) {}
+
+    AudioRingBuffer(const AudioRingBuffer &) = delete;
+    AudioRingBuffer &operator=(const AudioRingBuffer &) = delete;
+
+    size_t capacity() const { return _capacity; }
+
+    // Number of samples that can currently be read.
+    size_t availableToRead() const {
+        return _writeIndex.load(std::memory_order_acquire) - _readIndex.load(std::memory_order_acquire);
+    }
+
+    // Number of samples that can currently be written without overflowing.
+    size_t availableToWrite() const { return _capacity - availableToRead(); }
+
+    // Total number of samples discarded by the producer because the consumer
+    // fell too far behind. Monotonically increasing.
+    uint64_t droppedCount() const { return _dropped.load(std::memory_order_relaxed); }
+
+    // Producer side
+
+    // Write up to count samples. Never blocks. If the buffer is full, the
+    // samples that do not fit are dropped and counted. Returns number written.
+    size_t write(const T *src, size_t count) {
+        const size_t w = _writeIndex.load(std::memory_order_relaxed);
+        const size_t r = _readIndex.load(std::memory_order_acquire);
+        const size_t space = _capacity - (w - r);
+        const size_t n = std::min(count, space);
+        if (n < count) {
+            _dropped.fetch_add(count - n, std::memory_order_relaxed);
+        }
+        copyIn(w, src, n);
+        _writeIndex.store(w + n, std::memory_order_release);
+        return n;
+    }
+
+    // Consumer side
+
+    // Read up to count samples into dst. Never blocks. Returns number read.
+    size_t read(T *dst, size_t count) {
+        const size_t r = _readIndex.load(std::memory_order_relaxed);
+        const size_t w = _writeIndex.load(std::memory_order_acquire);
+        const size_t n = std::min(count, w - r);
+        copyOut(r, dst, n);
+        _readIndex.store(r + n, std::memory_order_release);
+        return n;
+    }
+
+    // Throw away everything currently readable.
+    void discard() { _readIndex.store(_writeIndex.load(std::memory_order_acquire), std::memory_order_release); }
+
+private:
+    static size_t roundUpPowerOfTwo(size_t n) {
+        size_t p = 1;
+        while (p < n) {
+            p <<= 1;
+        }
+        return p;
+    }
+
+    void copyIn(size_t index, const T *src, size_t n) {
+        const size_t start = index & _mask;
+        const size_t first = std::min(n, _capacity - start);
+        memcpy(_buffer.get() + start, src, first * sizeof(T));
+        memcpy(_buffer.get(), src + first, (n - first) * sizeof(T));
+    }
+
+    void copyOut(size_t index, T *dst, size_t n) const {
+        const size_t start = index & _mask;
+        const size_t first = std::min(n, _capacity - start);
+        memcpy(dst, _buffer.get() + start, first * sizeof(T));
+        memcpy(dst + first, _buffer.get(), (n - first) * sizeof(T));
+    }
+
+    const size_t _capacity;
+    const size_t _mask;
+    std::unique_ptr<T[]> _buffer;
+
+    // Indices increase monotonically and are masked on access. Keep them
+    // on separate cache lines so producer and consumer don't false share.
+    alignas(64) std::atomic<size_t> _writeIndex{0};
+    alignas(64) std::atomic<size_t> _readIndex{0};
+    alignas(64) std::atomic<uint64_t> _dropped{0};
+};
+
+} // namespace embla
@@ -0,0 +1,102 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ChunkAssembler.h"
+#include <algorithm>
+#include <cstring>
+
+namespace embla {
+
+ChunkAssembler::ChunkAssembler(size_t chunkSamples, size_t slotCount, ChunkHandler handler)
+    : _chunkSamples(std::max<size_t>(1, chunkSamples)), _slotCount(slotCount), _handler(std::move(handler)),
+      _storage(_chunkSamples * (slotCount + 1)), _inUse(new std::atomic<bool>[slotCount + 1]) {
+    for (size_t i = 0; i <= slotCount; i++) {
+        _inUse[i] = false;
+    }
+    _current = acquireSlot();
+}
+
+int16_t *ChunkAssembler::slotData(int slot) {
+    size_t index = (slot == TransientSlot) ? _slotCount : (size_t)slot;
+    return _storage.data() + index * _chunkSamples;
+}
+
+// Find a free slot, round robin so that recently released slots are
+// reused last. Falls back to the scratch slot if the pool is exhausted.
+int ChunkAssembler::acquireSlot() {
+    for (size_t i = 0; i < _slotCount; i++) {
+        size_t slot = (_nextSearch + i) % _slotCount;
+        bool expected = false;
+        if (_inUse[slot].compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            _nextSearch = (slot + 1) % _slotCount;
+            return (int)slot;
+        }
+    }
+    return TransientSlot;
+}
+
+void ChunkAssembler::push(const int16_t *samples, size_t count) {
+    _stats.samples += count;
+    while (count > 0) {
+        size_t n = std::min(count, _chunkSamples - _filled);
+        memcpy(slotData(_current) + _filled, samples, n * sizeof(int16_t));
+        _filled += n;
+        samples += n;
+        count -= n;
+        if (_filled == _chunkSamples) {
+            emit();
+        }
+    }
+}
+
+void ChunkAssembler::emit() {
+    int slot = _current;
+    size_t count = _filled;
+    _stats.chunks++;
+    if (slot == TransientSlot) {
+        _stats.transientChunks++;
+    }
+
+    // Move on to a fresh slot before handing this one over
+    _current = acquireSlot();
+    _filled = 0;
+
+    if (_handler) {
+        _handler(slotData(slot), count, slot);
+    } else {
+        release(slot);
+    }
+}
+
+void ChunkAssembler::flush() {
+    if (_filled > 0) {
+        emit();
+    }
+}
+
+void ChunkAssembler::reset() {
+    _filled = 0;
+}
+
+void ChunkAssembler::release(int slot) {
+    if (slot >= 0 && (size_t)slot < _slotCount) {
+        _inUse[slot].store(false, std::memory_order_release);
+    }
+}
+
+} // namespace embla
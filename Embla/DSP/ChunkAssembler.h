@@ -0,0 +1,100 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Assembles incoming PCM into fixed-size chunks, e.g. the 100 ms
+    frames sent to the streaming speech recognition API.
+
+    Samples are written straight into one of a fixed pool of chunk
+    slots, all allocated up front. A completed slot is handed to the
+    chunk handler and stays reserved until the consumer releases it,
+    so it can be passed on without copying (e.g. wrapped in an NSData
+    which releases the slot when deallocated). Any remainder is carried
+    over into the next slot. If every slot is still in use, the chunk is
+    assembled in a scratch slot instead and the handler is told to copy
+    it. No memory is allocated once the assembler has been created.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace embla {
+
+struct ChunkAssemblerStats {
+    uint64_t chunks = 0;            // Chunks emitted
+    uint64_t transientChunks = 0;   // Chunks emitted from the scratch slot because the pool was exhausted
+    uint64_t samples = 0;           // Samples pushed
+};
+
+class ChunkAssembler {
+public:
+    // Passed as slot to the chunk handler when the samples are only valid
+    // for the duration of the call and must be copied.
+    static const int TransientSlot = -1;
+
+    // The handler must call release(slot) once it's done with a chunk,
+    // unless slot is TransientSlot.
+    typedef std::function<void(const int16_t *samples, size_t count, int slot)> ChunkHandler;
+
+    ChunkAssembler(size_t chunkSamples, size_t slotCount, ChunkHandler handler);
+
+    ChunkAssembler(const ChunkAssembler &) = delete;
+    ChunkAssembler &operator=(const ChunkAssembler &) = delete;
+
+    // Append samples, emitting a chunk every time one fills up.
+    void push(const int16_t *samples, size_t count);
+
+    // Emit the remainder, if any, as a short chunk.
+    void flush();
+
+    // Discard the remainder.
+    void reset();
+
+    // Return a slot to the pool. May be called from any thread.
+    void release(int slot);
+
+    size_t chunkSamples() const { return _chunkSamples; }
+    size_t buffered() const { return _filled; }
+    ChunkAssemblerStats stats() const { return _stats; }
+
+private:
+    int16_t *slotData(int slot);
+    int acquireSlot();
+    void emit();
+
+    const size_t _chunkSamples;
+    const size_t _slotCount;
+    ChunkHandler _handler;
+
+    // slotCount slots followed by the scratch slot
+    std::vector<int16_t> _storage;
+    std::unique_ptr<std::atomic<bool>[]> _inUse;
+
+    int _current = TransientSlot;
+    size_t _filled = 0;
+    size_t _nextSearch = 0;
+
+    ChunkAssemblerStats _stats;
+};
+
+} // namespace embla
@@ -0,0 +1,221 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "EarconMixer.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#define SAMPLE_SCALE    (1.0f / 32768.0f)
+
+namespace embla {
+
+EarconMixer::EarconMixer(uint32_t sampleRate, size_t maxVoices)
+    : _sampleRate(std::max<uint32_t>(1, sampleRate)), _voices(std::max<size_t>(1, maxVoices)) {}
+
+int EarconMixer::addClip(const int16_t *samples, size_t frames, uint16_t channels, uint32_t sampleRate) {
+    if (frames == 0 || channels < 1 || channels > 2 || sampleRate == 0) {
+        return -1;
+    }
+    Clip clip = { _pool.size(), frames, channels, sampleRate };
+    _pool.insert(_pool.end(), samples, samples + frames * channels);
+    _clips.push_back(clip);
+    return (int)_clips.size() - 1;
+}
+
+// Commands
+
+bool EarconMixer::push(const Command &command) {
+    std::lock_guard<std::mutex> lock(_producerMutex);
+    size_t tail = _queueTail.load(std::memory_order_relaxed);
+    if (tail - _queueHead.load(std::memory_order_acquire) >= QueueSize) {
+        _dropped++;
+        return false;
+    }
+    _queue[tail % QueueSize] = command;
+    _queueTail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool EarconMixer::trigger(int clip, float gain, uint64_t atFrame) {
+    if (clip < 0 || (size_t)clip >= _clips.size()) {
+        return false;
+    }
+    return push({ clip, gain, atFrame });
+}
+
+void EarconMixer::stopAll() {
+    push({ -1, 0.0f, Now });
+}
+
+bool EarconMixer::idle() const {
+    return !_playing.load(std::memory_order_acquire) &&
+           _queueHead.load(std::memory_order_acquire) == _queueTail.load(std::memory_order_acquire);
+}
+
+void EarconMixer::apply(const Command &command) {
+    if (command.clip < 0) {
+        for (Voice &v : _voices) {
+            v.clip = -1;
+        }
+        return;
+    }
+
+    // A free voice, or else the one started longest ago
+    Voice *voice = &_voices[0];
+    for (Voice &v : _voices) {
+        if (v.clip < 0) {
+            voice = &v;
+            break;
+        }
+        if (v.started < voice->started) {
+            voice = &v;
+        }
+    }
+    if (voice->clip >= 0) {
+        _stolen++;
+    }
+
+    const Clip &clip = _clips[(size_t)command.clip];
+    uint64_t position = _position.load(std::memory_order_relaxed);
+    voice->clip = command.clip;
+    voice->position = 0.0;
+    voice->step = (double)clip.sampleRate / _sampleRate;
+    voice->gain = command.gain;
+    voice->delay = 0;
+    voice->started = ++_startCount;
+    if (command.atFrame > position) {
+        voice->delay = (size_t)(command.atFrame - position);
+    } else if (command.atFrame != Now && command.atFrame < position) {
+        _late++;
+    }
+    _triggers++;
+}
+
+// Rendering
+
+// Cubic Hermite (Catmull-Rom) through four neighbouring samples, t in [0, 1)
+static inline float Hermite(float xm1, float x0, float x1, float x2, float t) {
+    float c1 = 0.5f * (x1 - xm1);
+    float c2 = xm1 - 2.5f * x0 + 2.0f * x1 - 0.5f * x2;
+    float c3 = 0.5f * (x2 - xm1) + 1.5f * (x0 - x1);
+    return ((c3 * t + c2) * t + c1) * t + x0;
+}
+
+void EarconMixer::mix(Voice &voice, float *const *outputs, size_t channels, size_t frames) {
+    const Clip &clip = _clips[(size_t)voice.clip];
+    const int16_t *samples = _pool.data() + clip.offset;
+    const float gain = voice.gain * SAMPLE_SCALE;
+    const long last = (long)clip.frames - 1;
+
+    size_t i = std::min(voice.delay, frames);
+    voice.delay -= i;
+
+    // Clip frame f, channel c, with silence beyond either end
+    auto at = [&](long f, size_t c) -> float {
+        return f < 0 || f > last ? 0.0f : (float)samples[(size_t)f * clip.channels + c];
+    };
+
+    if (voice.step == 1.0 && voice.position == std::floor(voice.position)) {
+        // Sample for sample
+        size_t f = (size_t)voice.position;
+        size_t n = std::min(frames - i, clip.frames - f);
+        for (size_t k = 0; k < n; k++, f++) {
+            if (clip.channels == 1) {
+                float s = samples[f] * gain;
+                for (size_t c = 0; c < channels; c++) {
+                    outputs[c][i + k] += s;
+                }
+            } else if (channels == 1) {
+                outputs[0][i + k] += 0.5f * (samples[2 * f] + samples[2 * f + 1]) * gain;
+            } else {
+                outputs[0][i + k] += samples[2 * f] * gain;
+                outputs[1][i + k] += samples[2 * f + 1] * gain;
+            }
+        }
+        voice.position = (double)f;
+    } else {
+        for (; i < frames && voice.position < clip.frames; i++) {
+            long f = (long)voice.position;
+            float t = (float)(voice.position - f);
+            float l = Hermite(at(f - 1, 0), at(f, 0), at(f + 1, 0), at(f + 2, 0), t) * gain;
+            if (clip.channels == 1) {
+                for (size_t c = 0; c < channels; c++) {
+                    outputs[c][i] += l;
+                }
+            } else {
+                size_t rc = 1;
+                float r = Hermite(at(f - 1, rc), at(f, rc), at(f + 1, rc), at(f + 2, rc), t) * gain;
+                if (channels == 1) {
+                    outputs[0][i] += 0.5f * (l + r);
+                } else {
+                    outputs[0][i] += l;
+                    outputs[1][i] += r;
+                }
+            }
+            voice.position += voice.step;
+        }
+    }
+    if (voice.position >= clip.frames) {
+        voice.clip = -1;
+    }
+}
+
+bool EarconMixer::render(float *const *outputs, size_t channels, size_t frames) {
+    size_t head = _queueHead.load(std::memory_order_relaxed);
+    size_t tail = _queueTail.load(std::memory_order_acquire);
+    for (; head != tail; head++) {
+        apply(_queue[head % QueueSize]);
+    }
+    _queueHead.store(head, std::memory_order_release);
+
+    for (size_t c = 0; c < channels; c++) {
+        memset(outputs[c], 0, frames * sizeof(float));
+    }
+    bool playing = false;
+    bool remaining = false;
+    for (Voice &v : _voices) {
+        if (v.clip >= 0) {
+            mix(v, outputs, channels, frames);
+            playing = true;
+            remaining = remaining || v.clip >= 0;
+        }
+    }
+    if (playing) {
+        for (size_t c = 0; c < channels; c++) {
+            for (size_t i = 0; i < frames; i++) {
+                outputs[c][i] = std::min(1.0f, std::max(-1.0f, outputs[c][i]));
+            }
+        }
+    }
+    _position.fetch_add(frames, std::memory_order_release);
+    _playing.store(remaining, std::memory_order_release);
+    return playing;
+}
+
+EarconMixerStats EarconMixer::stats() const {
+    EarconMixerStats s;
+    s.triggers = _triggers;
+    s.late = _late;
+    s.stolen = _stolen;
+    s.dropped = _dropped;
+    s.frames = framePosition();
+    return s;
+}
+
+} // namespace embla
@@ -0,0 +1,145 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Mixer for short UI sounds (earcons), rendered by an output callback
+    that keeps running so a sound starts with the next buffer rather
+    than after a player has been set up.
+
+    Clips are 16-bit PCM, copied into a single contiguous pool when
+    added, which must happen before rendering starts. trigger() queues a
+    clip to start either as soon as possible or at a given output frame,
+    which is sample accurate. Clips at a different sample rate are
+    resampled with 4-point cubic Hermite interpolation, those at the
+    output rate are mixed sample for sample. Up to maxVoices clips play
+    at once, after which the oldest is cut off.
+
+    Triggers reach the render thread through a lock-free queue, so
+    render() never blocks or allocates. Any thread may call trigger()
+    and stopAll(). render() must only be called from one thread.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace embla {
+
+struct EarconMixerStats {
+    uint64_t triggers = 0;      // Clips started
+    uint64_t late = 0;          // Clips started after the frame they were triggered for
+    uint64_t stolen = 0;        // Clips cut off to make room for another
+    uint64_t dropped = 0;       // Commands lost because the queue was full
+    uint64_t frames = 0;        // Frames rendered
+};
+
+class EarconMixer {
+public:
+    // Frame to pass to trigger() to start as soon as possible
+    static const uint64_t Now = 0;
+
+    EarconMixer(uint32_t sampleRate, size_t maxVoices = 8);
+
+    EarconMixer(const EarconMixer &) = delete;
+    EarconMixer &operator=(const EarconMixer &) = delete;
+
+    // Add a clip of interleaved samples to the pool. Must not be called
+    // once rendering has started. Returns the clip's ID, or -1 if invalid.
+    int addClip(const int16_t *samples, size_t frames, uint16_t channels, uint32_t sampleRate);
+
+    // Start a clip at the given output frame (see framePosition()).
+    // Returns false if the clip doesn't exist or the queue is full.
+    bool trigger(int clip, float gain = 1.0f, uint64_t atFrame = Now);
+
+    // Stop everything playing, from the next buffer on.
+    void stopAll();
+
+    // Mix frames of output into non-interleaved float buffers, one per
+    // channel. Mono clips go to every channel, stereo clips to the first
+    // two (or are downmixed for mono output). Returns whether anything
+    // was playing, so callers can flag silence.
+    bool render(float *const *outputs, size_t channels, size_t frames);
+
+    // Whether nothing was left playing after the last render() and nothing
+    // has been triggered since, so output may be stopped until the next
+    // trigger(). Only reliable on the thread that triggers.
+    bool idle() const;
+
+    // Number of frames rendered so far, i.e. the frame the next render() starts at.
+    uint64_t framePosition() const { return _position.load(std::memory_order_acquire); }
+
+    uint32_t sampleRate() const { return _sampleRate; }
+    size_t clipCount() const { return _clips.size(); }
+    // Size of the pool, in samples
+    size_t poolSize() const { return _pool.size(); }
+
+    EarconMixerStats stats() const;
+
+private:
+    struct Clip {
+        size_t offset;          // Into the pool, in samples
+        size_t frames;
+        uint16_t channels;
+        uint32_t sampleRate;
+    };
+
+    struct Command {
+        int clip;               // -1 to stop all
+        float gain;
+        uint64_t atFrame;
+    };
+
+    struct Voice {
+        int clip = -1;          // -1 when idle
+        double position = 0.0;  // In clip frames
+        double step = 1.0;      // Clip frames per output frame
+        float gain = 1.0f;
+        size_t delay = 0;       // Output frames until the clip starts
+        uint64_t started = 0;   // Order of starting, for stealing the oldest
+    };
+
+    bool push(const Command &command);
+    void apply(const Command &command);
+    void mix(Voice &voice, float *const *outputs, size_t channels, size_t frames);
+
+    const uint32_t _sampleRate;
+    std::vector<int16_t> _pool;
+    std::vector<Clip> _clips;
+    std::vector<Voice> _voices;
+    uint64_t _startCount = 0;
+
+    // Single-producer queue, with producers serialized by the mutex
+    static const size_t QueueSize = 64;
+    Command _queue[QueueSize];
+    std::atomic<size_t> _queueHead{0};     // Next to read, owned by the render thread
+    std::atomic<size_t> _queueTail{0};     // Next to write
+    std::mutex _producerMutex;
+
+    std::atomic<uint64_t> _position{0};
+    std::atomic<bool> _playing{false};     // Voices left after the last render()
+    std::atomic<uint64_t> _triggers{0};
+    std::atomic<uint64_t> _late{0};
+    std::atomic<uint64_t> _stolen{0};
+    std::atomic<uint64_t> _dropped{0};
+};
+
+} // namespace embla
@@ -0,0 +1,579 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "EchoCanceller.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// The foreground filter takes over the background's coefficients when its
+// error is lower by more than the variability of the difference between
+// the two filters' errors allows for by chance, and the background filter
+// is put back to the foreground's when its error is higher by this many
+// times as much. The difference is tracked per block and smoothed over a
+// short and a long time span.
+#define AEC_UPDATE_SHORT            0.5f
+#define AEC_UPDATE_LONG             0.25f
+#define AEC_BACKTRACK               4.0f
+#define AEC_SMOOTHING_SHORT         0.6f
+#define AEC_SMOOTHING_LONG          0.85f
+// Far end power (per sample, full scale 1.0) below which it counts as silent
+#define AEC_MIN_FAR_POWER           1e-7f
+// Regularization of the step normalization, relative to the mean power per bin
+#define AEC_REGULARIZATION          0.01f
+// Share of a bin's far end power counted towards its neighbours' in the step
+// normalization. The error spectrum of a block leaks into the bins around
+// each peak, which would otherwise take huge steps where the far end is weak,
+// as it is between the harmonics of a voice.
+#define AEC_POWER_SPREAD            0.5f
+// Talking over the far end (double talk) would throw the background filter
+// off, so once it has adapted its step shrinks when its error stands out
+// from the residual echo expected of it by more than AEC_DOUBLE_TALK_MARGIN.
+// The expected residual is the echo estimate scaled by the leak: the lowest
+// ratio of the foreground filter's error to its echo estimate over the last
+// windows of blocks, times AEC_LEAK_BIAS as that ratio is mostly higher.
+// Near end audio only adds to the error and pauses every syllable or so.
+// After a change of echo path the error stays up, and the leak is let grow
+// by AEC_LEAK_GROWTH per window, slowly enough to ride out double talk
+// without pauses that fall while the far end is playing.
+#define AEC_LEAK_WINDOWS            4
+#define AEC_LEAK_WINDOW_BLOCKS      16
+#define AEC_LEAK_SMOOTHING          0.7f
+#define AEC_LEAK_BIAS               3.0f
+#define AEC_LEAK_GROWTH             1.5f
+#define AEC_MIN_LEAK                0.0005f
+#define AEC_DOUBLE_TALK_MARGIN      10.0f
+// Steps at the full step size, in filter lengths, before it starts shrinking
+#define AEC_MIN_ADAPTATION          4
+// Share of the largest partition's step that every partition takes at least
+#define AEC_PROPORTION_FLOOR        0.1f
+// Smoothing of the energies behind the echo return loss enhancement statistic
+#define AEC_ERLE_SMOOTHING          0.98f
+
+namespace embla {
+
+static size_t RoundUpPowerOfTwo(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+static inline int16_t ToSample(float x) {
+    x = std::round(x * 32768.0f);
+    return (int16_t)std::min(32767.0f, std::max(-32768.0f, x));
+}
+
+// Canceller
+
+EchoCanceller::EchoCanceller(const EchoCancellerConfig &config)
+    : _blockSize(RoundUpPowerOfTwo(std::max<size_t>(8, config.blockSize))),
+      _fftSize(2 * _blockSize),
+      _bins(_blockSize + 1),
+      _partitions(std::max<size_t>(1, (config.filterLength + _blockSize - 1) / _blockSize)),
+      _stepSize(std::min(1.0f, std::max(0.0f, config.stepSize))),
+      _farSpectra(_partitions * _bins),
+      _farPower(_bins),
+      _farWindow(_fftSize),
+      _background(_partitions * _bins),
+      _foreground(_partitions * _bins),
+      _twiddles(_fftSize / 2),
+      _bitReverse(_fftSize),
+      _work(_fftSize),
+      _nearBlock(_blockSize),
+      _backgroundEcho(_blockSize),
+      _foregroundEcho(_blockSize),
+      _error(_blockSize),
+      _proportions(_partitions),
+      _leakWindows(AEC_LEAK_WINDOWS, 1.0f) {
+    for (size_t i = 0; i < _fftSize / 2; i++) {
+        double angle = -2.0 * M_PI * i / _fftSize;
+        _twiddles[i] = Complex((float)cos(angle), (float)sin(angle));
+    }
+    size_t bits = 0;
+    while (((size_t)1 << bits) < _fftSize) {
+        bits++;
+    }
+    for (size_t i = 0; i < _fftSize; i++) {
+        uint32_t r = 0;
+        for (size_t b = 0; b < bits; b++) {
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        _bitReverse[i] = r;
+    }
+}
+
+void EchoCanceller::process(int16_t *near, const int16_t *far, size_t count) {
+    for (size_t i = 0; i + _blockSize <= count; i += _blockSize) {
+        processBlock(near + i, far + i);
+    }
+}
+
+void EchoCanceller::restart() {
+    std::fill(_farSpectra.begin(), _farSpectra.end(), Complex());
+    std::fill(_farPower.begin(), _farPower.end(), 0.0f);
+    std::fill(_farWindow.begin(), _farWindow.end(), 0.0f);
+    _gainShort = _varianceShort = _gainLong = _varianceLong = 0.0f;
+}
+
+void EchoCanceller::reset() {
+    restart();
+    std::fill(_background.begin(), _background.end(), Complex());
+    std::fill(_foreground.begin(), _foreground.end(), Complex());
+    std::fill(_leakWindows.begin(), _leakWindows.end(), 1.0f);
+    _leakWindowBlocks = 0;
+    _leakErrorEnergy = _leakEchoEnergy = 0.0f;
+    _leak = 1.0f;
+    _adaptation = 0.0f;
+    _nearEnergy = _outputEnergy = 0.0f;
+    _stats = EchoCancellerStats();
+}
+
+EchoCancellerStats EchoCanceller::stats() const {
+    EchoCancellerStats stats = _stats;
+    if (_nearEnergy > 0.0f) {
+        stats.erleDb = 10.0f * log10f((_nearEnergy + 1e-10f) / (_outputEnergy + 1e-10f));
+    }
+    return stats;
+}
+
+// Blocks
+
+void EchoCanceller::processBlock(int16_t *near, const int16_t *far) {
+    const size_t B = _blockSize;
+    _stats.blocks++;
+
+    // Overlap-save: the spectrum of the previous and current far end block
+    // gives the echo of the current block with partitions of B taps
+    std::copy(_farWindow.begin() + B, _farWindow.end(), _farWindow.begin());
+    for (size_t i = 0; i < B; i++) {
+        _farWindow[B + i] = far[i] / 32768.0f;
+    }
+    for (size_t i = 0; i < _fftSize; i++) {
+        _work[i] = Complex(_farWindow[i], 0.0f);
+    }
+    fft(_work.data(), false);
+    _newest = (_newest + _partitions - 1) % _partitions;
+    std::copy(_work.begin(), _work.begin() + _bins, _farSpectra.begin() + _newest * _bins);
+
+    float totalFarPower = 0.0f;
+    std::fill(_farPower.begin(), _farPower.end(), 0.0f);
+    for (size_t p = 0; p < _partitions; p++) {
+        const Complex *x = &_farSpectra[p * _bins];
+        for (size_t k = 0; k < _bins; k++) {
+            _farPower[k] += std::norm(x[k]);
+        }
+    }
+    for (size_t k = 0; k < _bins; k++) {
+        totalFarPower += _farPower[k];
+    }
+
+    // Nothing played within the filter's reach: pass the audio through.
+    // Parseval puts the per sample power at total / (fftSize * fftSize / 2).
+    float farPowerPerSample = totalFarPower / (_fftSize * (float)_fftSize / 2 * _partitions);
+    if (farPowerPerSample < AEC_MIN_FAR_POWER) {
+        return;
+    }
+    _stats.activeBlocks++;
+
+    for (size_t i = 0; i < B; i++) {
+        _nearBlock[i] = near[i] / 32768.0f;
+    }
+    echoEstimate(_background, _backgroundEcho.data());
+    echoEstimate(_foreground, _foregroundEcho.data());
+
+    float nearEnergy = 0.0f, backgroundEnergy = 0.0f, foregroundEnergy = 0.0f, difference = 0.0f;
+    for (size_t i = 0; i < B; i++) {
+        _error[i] = _nearBlock[i] - _backgroundEcho[i];
+        float e = _nearBlock[i] - _foregroundEcho[i];
+        float d = _foregroundEcho[i] - _backgroundEcho[i];
+        nearEnergy += _nearBlock[i] * _nearBlock[i];
+        backgroundEnergy += _error[i] * _error[i];
+        foregroundEnergy += e * e;
+        difference += d * d;
+    }
+
+    // Let the better filter produce the output, if it's better by more than chance
+    float gain = foregroundEnergy - backgroundEnergy;
+    float variance = foregroundEnergy * difference;
+    const float s1 = AEC_SMOOTHING_SHORT, s2 = AEC_SMOOTHING_LONG;
+    _gainShort = s1 * _gainShort + (1.0f - s1) * gain;
+    _varianceShort = s1 * s1 * _varianceShort + (1.0f - s1) * (1.0f - s1) * variance;
+    _gainLong = s2 * _gainLong + (1.0f - s2) * gain;
+    _varianceLong = s2 * s2 * _varianceLong + (1.0f - s2) * (1.0f - s2) * variance;
+    if (gain * std::fabs(gain) > variance ||
+        _gainShort * std::fabs(_gainShort) > AEC_UPDATE_SHORT * _varianceShort ||
+        _gainLong * std::fabs(_gainLong) > AEC_UPDATE_LONG * _varianceLong) {
+        _foreground = _background;
+        std::copy(_backgroundEcho.begin(), _backgroundEcho.end(), _foregroundEcho.begin());
+        _gainShort = _varianceShort = _gainLong = _varianceLong = 0.0f;
+        _stats.foregroundUpdates++;
+    } else if (-gain * std::fabs(gain) > AEC_BACKTRACK * variance ||
+               -_gainShort * std::fabs(_gainShort) > AEC_BACKTRACK * _varianceShort ||
+               -_gainLong * std::fabs(_gainLong) > AEC_BACKTRACK * _varianceLong) {
+        _background = _foreground;
+        for (size_t i = 0; i < B; i++) {
+            _error[i] = _nearBlock[i] - _foregroundEcho[i];
+        }
+        std::copy(_foregroundEcho.begin(), _foregroundEcho.end(), _backgroundEcho.begin());
+        _gainShort = _varianceShort = _gainLong = _varianceLong = 0.0f;
+        _stats.backgroundResets++;
+    }
+
+    float outputEnergy = 0.0f, echoEnergy = 0.0f;
+    for (size_t i = 0; i < B; i++) {
+        float e = _nearBlock[i] - _foregroundEcho[i];
+        outputEnergy += e * e;
+        echoEnergy += _foregroundEcho[i] * _foregroundEcho[i];
+        near[i] = ToSample(e);
+    }
+    const float a = AEC_ERLE_SMOOTHING;
+    _nearEnergy = a * _nearEnergy + (1.0f - a) * nearEnergy;
+    _outputEnergy = a * _outputEnergy + (1.0f - a) * outputEnergy;
+    trackLeak(outputEnergy, echoEnergy);
+
+    adapt();
+    constrain(_nextConstrained);
+    _nextConstrained = (_nextConstrained + 1) % _partitions;
+}
+
+// Sum of the far end spectra filtered by each partition, back in the
+// time domain. The last block of the inverse transform is the echo.
+void EchoCanceller::echoEstimate(const std::vector<Complex> &filter, float *echo) {
+    std::fill(_work.begin(), _work.begin() + _bins, Complex());
+    for (size_t p = 0; p < _partitions; p++) {
+        const Complex *x = &_farSpectra[((_newest + p) % _partitions) * _bins];
+        const Complex *w = &filter[p * _bins];
+        for (size_t k = 0; k < _bins; k++) {
+            _work[k] += w[k] * x[k];
+        }
+    }
+    for (size_t k = _bins; k < _fftSize; k++) {
+        _work[k] = std::conj(_work[_fftSize - k]);
+    }
+    fft(_work.data(), true);
+    for (size_t i = 0; i < _blockSize; i++) {
+        echo[i] = _work[_blockSize + i].real();
+    }
+}
+
+// Lowest ratio of the foreground's error to its echo estimate, over the
+// blocks where the estimate stands out from the noise
+void EchoCanceller::trackLeak(float errorEnergy, float echoEnergy) {
+    if (echoEnergy < AEC_MIN_FAR_POWER * _blockSize) {
+        return;
+    }
+    const float a = AEC_LEAK_SMOOTHING;
+    _leakErrorEnergy = a * _leakErrorEnergy + (1.0f - a) * errorEnergy;
+    _leakEchoEnergy = a * _leakEchoEnergy + (1.0f - a) * echoEnergy;
+    float &window = _leakWindows[0];
+    window = std::min(window, _leakErrorEnergy / _leakEchoEnergy);
+    float leak = AEC_LEAK_BIAS * *std::min_element(_leakWindows.begin(), _leakWindows.end());
+    if (++_leakWindowBlocks == AEC_LEAK_WINDOW_BLOCKS) {
+        std::rotate(_leakWindows.rbegin(), _leakWindows.rbegin() + 1, _leakWindows.rend());
+        _leakWindows[0] = 1.0f;
+        _leakWindowBlocks = 0;
+        _leak = std::min(leak, _leak * AEC_LEAK_GROWTH);
+    } else {
+        _leak = std::min(leak, _leak);
+    }
+    _leak = std::min(1.0f, std::max(AEC_MIN_LEAK, _leak));
+}
+
+// Normalized gradient step of the background filter, per bin
+void EchoCanceller::adapt() {
+    const size_t B = _blockSize;
+    float step = _stepSize;
+    if (_adaptation < AEC_MIN_ADAPTATION * _partitions) {
+        _adaptation += _stepSize;
+    } else {
+        float echoEnergy = 0.0f, errorEnergy = 0.0f;
+        for (size_t i = 0; i < B; i++) {
+            echoEnergy += _backgroundEcho[i] * _backgroundEcho[i];
+            errorEnergy += _error[i] * _error[i];
+        }
+        // The smoothed ratio lags behind the onset of near end audio, the
+        // block's own ratio doesn't
+        float ratio = std::max(_leakErrorEnergy / (_leakEchoEnergy + 1e-20f),
+                               errorEnergy / (echoEnergy + 1e-20f));
+        step *= std::min(1.0f, AEC_DOUBLE_TALK_MARGIN * _leak / (ratio + 1e-20f));
+    }
+
+    for (size_t i = 0; i < B; i++) {
+        _work[i] = Complex();
+        _work[B + i] = Complex(_error[i], 0.0f);
+    }
+    fft(_work.data(), false);
+
+    float meanPower = 0.0f;
+    for (size_t k = 0; k < _bins; k++) {
+        meanPower += _farPower[k];
+    }
+    meanPower /= _bins;
+    const float regularization = AEC_REGULARIZATION * meanPower + 1e-10f;
+    for (size_t k = 0; k < _bins; k++) {
+        float power = _farPower[k];
+        if (k > 0) {
+            power = std::max(power, AEC_POWER_SPREAD * _farPower[k - 1]);
+        }
+        if (k + 1 < _bins) {
+            power = std::max(power, AEC_POWER_SPREAD * _farPower[k + 1]);
+        }
+        _work[k] *= step / (power + regularization);
+    }
+
+    // Proportionate steps: partitions holding more of the echo path take
+    // larger steps, which speeds up convergence on the bulk delay and decay
+    // of a room's response
+    float maxNorm = 0.0f, sum = 0.0f;
+    for (size_t p = 0; p < _partitions; p++) {
+        const Complex *w = &_background[p * _bins];
+        float norm = 0.0f;
+        for (size_t k = 0; k < _bins; k++) {
+            norm += std::norm(w[k]);
+        }
+        _proportions[p] = std::sqrt(norm + 1e-6f);
+        maxNorm = std::max(maxNorm, _proportions[p]);
+    }
+    for (size_t p = 0; p < _partitions; p++) {
+        _proportions[p] += AEC_PROPORTION_FLOOR * maxNorm;
+        sum += _proportions[p];
+    }
+    for (size_t p = 0; p < _partitions; p++) {
+        const Complex *x = &_farSpectra[((_newest + p) % _partitions) * _bins];
+        Complex *w = &_background[p * _bins];
+        const float proportion = _partitions * _proportions[p] / sum;
+        for (size_t k = 0; k < _bins; k++) {
+            w[k] += proportion * std::conj(x[k]) * _work[k];
+        }
+    }
+}
+
+// Keep a partition's impulse response within its first block, so that the
+// circular convolution stays linear. One partition is constrained per block.
+void EchoCanceller::constrain(size_t partition) {
+    Complex *w = &_background[partition * _bins];
+    std::copy(w, w + _bins, _work.begin());
+    for (size_t k = _bins; k < _fftSize; k++) {
+        _work[k] = std::conj(_work[_fftSize - k]);
+    }
+    fft(_work.data(), true);
+    for (size_t i = 0; i < _blockSize; i++) {
+        _work[i] = Complex(_work[i].real(), 0.0f);
+        _work[_blockSize + i] = Complex();
+    }
+    fft(_work.data(), false);
+    std::copy(_work.begin(), _work.begin() + _bins, w);
+}
+
+// In place iterative radix-2 FFT. The inverse is scaled by 1/N.
+void EchoCanceller::fft(Complex *data, bool inverse) {
+    const size_t n = _fftSize;
+    for (size_t i = 0; i < n; i++) {
+        size_t j = _bitReverse[i];
+        if (i < j) {
+            std::swap(data[i], data[j]);
+        }
+    }
+    for (size_t half = 1; half < n; half <<= 1) {
+        size_t stride = n / (2 * half);
+        for (size_t start = 0; start < n; start += 2 * half) {
+            for (size_t i = 0; i < half; i++) {
+                Complex t = _twiddles[i * stride];
+                if (inverse) {
+                    t = std::conj(t);
+                }
+                Complex u = data[start + i];
+                Complex v = data[start + i + half] * t;
+                data[start + i] = u + v;
+                data[start + i + half] = u - v;
+            }
+        }
+    }
+    if (inverse) {
+        const float scale = 1.0f / n;
+        for (size_t i = 0; i < n; i++) {
+            data[i] *= scale;
+        }
+    }
+}
+
+// Reference
+
+EchoReference::EchoReference(int sampleRate, double seconds, double leadSeconds, double resyncSeconds)
+    : _sampleRate(sampleRate),
+      _leadSeconds(leadSeconds),
+      _resyncSamples(resyncSeconds * sampleRate),
+      _buffer(std::max<size_t>(1, (size_t)(seconds * sampleRate))) {}
+
+void EchoReference::setRecordingTime(uint64_t position, double time) {
+    uint32_t sequence = _clockSequence.load(std::memory_order_relaxed);
+    _clockSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    _clockPosition.store(position, std::memory_order_relaxed);
+    _clockTime.store(time, std::memory_order_relaxed);
+    _clockValid.store(true, std::memory_order_relaxed);
+    _clockSequence.store(sequence + 2, std::memory_order_release);
+}
+
+void EchoReference::clearRecordingTime() {
+    uint32_t sequence = _clockSequence.load(std::memory_order_relaxed);
+    _clockSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    _clockValid.store(false, std::memory_order_relaxed);
+    _clockSequence.store(sequence + 2, std::memory_order_release);
+}
+
+size_t EchoReference::read(uint64_t position, int16_t *dst, size_t count) const {
+    // Only the newer half of the buffer is read, leaving the other half
+    // to the writer, which may be ahead of the reader
+    const uint64_t end = _end.load(std::memory_order_acquire);
+    const uint64_t start = std::max(end - std::min<uint64_t>(end, _buffer.size() / 2),
+                                    _begin.load(std::memory_order_relaxed));
+    size_t played = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t p = position + i;
+        if (p >= start && p < end) {
+            dst[i] = _buffer[p % _buffer.size()];
+            played++;
+        } else {
+            dst[i] = 0;
+        }
+    }
+    return played;
+}
+
+bool EchoReference::activeAt(uint64_t position, size_t tail) const {
+    const uint64_t end = _end.load(std::memory_order_acquire);
+    return end > 0 && end + tail > position;
+}
+
+void EchoReference::write(double time, const float *samples, size_t count, double sampleRate) {
+    if (count == 0 || sampleRate <= 0.0) {
+        return;
+    }
+    const double ratio = _sampleRate / sampleRate;
+    uint32_t sequence;
+    uint64_t clockPosition;
+    double clockTime;
+    bool valid;
+    do {
+        sequence = _clockSequence.load(std::memory_order_acquire);
+        clockPosition = _clockPosition.load(std::memory_order_relaxed);
+        clockTime = _clockTime.load(std::memory_order_relaxed);
+        valid = _clockValid.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((sequence & 1) || sequence != _clockSequence.load(std::memory_order_relaxed));
+    if (!valid) {
+        _dropped.fetch_add((uint64_t)(count * ratio), std::memory_order_relaxed);
+        _writerRestart.store(true, std::memory_order_relaxed);
+        return;
+    }
+
+    // A new stretch of audio starts on a whole sample, so that audio at the
+    // recording rate is copied as it is rather than interpolated
+    double position = clockPosition + (time - clockTime - _leadSeconds) * _sampleRate;
+    bool continued = true;
+    if (_writerRestart.exchange(false, std::memory_order_relaxed)) {
+        _writePosition = std::round(position);
+        continued = false;
+    } else if (std::fabs(position - _writePosition) > _resyncSamples) {
+        _writePosition = std::round(position);
+        continued = false;
+        _resyncs.fetch_add(1, std::memory_order_relaxed);
+    }
+    place(_writePosition, samples, count, sampleRate, continued);
+    _writePosition += count * ratio;
+    _lastSample = samples[count - 1];
+}
+
+// Resample with linear interpolation onto the sample positions covered,
+// interpolating from the last sample of the previous write when continuing
+// it. Samples before the end of what has been placed already are skipped.
+void EchoReference::place(double position, const float *samples, size_t count, double sampleRate, bool continued) {
+    if (position < 0.0) {
+        return;
+    }
+    const double step = sampleRate / _sampleRate;
+    const size_t capacity = _buffer.size();
+    uint64_t end = _end.load(std::memory_order_relaxed);
+    uint64_t first = (uint64_t)std::ceil(position);
+    uint64_t last = (uint64_t)std::floor(position + (count - 1) / step) + 1;
+    if (last <= end) {
+        return;
+    }
+    uint64_t p = end;
+    if (!continued || p + 1 < first) {
+        p = std::max(first, end);
+    }
+    // Silence in between, if playback left a gap. The reader uses the half
+    // of the buffer before the end, so the gap is cleared and published
+    // half a buffer at a time. Once all of the buffer is silent, the rest
+    // of a long gap is skipped.
+    const uint64_t half = std::max<uint64_t>(1, capacity / 2);
+    uint64_t cleared = 0;
+    while (end < p) {
+        uint64_t n = std::min(p - end, half);
+        if (cleared >= capacity) {
+            n = p - end;
+        } else {
+            for (uint64_t q = end; q < end + n; q++) {
+                _buffer[q % capacity] = 0;
+            }
+            cleared += n;
+        }
+        end += n;
+        _end.store(end, std::memory_order_release);
+    }
+    if (_begin.load(std::memory_order_relaxed) == UINT64_MAX) {
+        _begin.store(p, std::memory_order_relaxed);
+    }
+    const uint64_t placed = last - p;
+    for (; p < last; p++) {
+        double s = (p - position) * step;
+        float value;
+        if (s < 0.0) {
+            // Between the previous write and this one
+            float t = (float)(s + 1.0);
+            value = _lastSample + t * (samples[0] - _lastSample);
+        } else {
+            size_t i = std::min((size_t)s, count - 1);
+            float t = (float)(s - i);
+            float next = samples[std::min(i + 1, count - 1)];
+            value = samples[i] + t * (next - samples[i]);
+        }
+        _buffer[p % capacity] = ToSample(value);
+    }
+    _written.fetch_add(placed, std::memory_order_relaxed);
+    _end.store(last, std::memory_order_release);
+}
+
+void EchoReference::restartWriter() {
+    _writerRestart.store(true, std::memory_order_relaxed);
+}
+
+EchoReferenceStats EchoReference::stats() const {
+    EchoReferenceStats stats;
+    stats.written = _written.load(std::memory_order_relaxed);
+    stats.resyncs = _resyncs.load(std::memory_order_relaxed);
+    stats.dropped = _dropped.load(std::memory_order_relaxed);
+    return stats;
+}
+
+} // namespace embla
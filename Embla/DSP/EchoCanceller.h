@@ -0,0 +1,234 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Acoustic echo cancellation, so the hotword can be heard while an
+    answer is playing (barge-in).
+
+    The microphone picks up the answer played through the speaker.
+    EchoCanceller models the echo path from the played audio (the far
+    end) to the microphone (the near end) with a partitioned-block
+    frequency-domain adaptive filter, i.e. block NLMS carried out in
+    the frequency domain, and subtracts its estimate of the echo from
+    the recorded audio. The filter covers filterLength samples of echo
+    in partitions of blockSize samples, so its cost grows with the
+    number of partitions rather than with the number of taps.
+
+    Two filters run side by side. The background filter adapts on every
+    block. The foreground filter, which produces the output, takes over
+    the background's coefficients when they cancel clearly more of the
+    echo, and the background filter is put back to the foreground's when
+    it does clearly worse. Talking over the answer (double talk) would
+    throw the background filter off, so its step shrinks while its error
+    stands well above the residual echo expected of it, and meanwhile the
+    foreground keeps cancelling the echo.
+
+    EchoReference holds the played audio, resampled to the recording
+    rate and placed at the sample positions of the recording where its
+    echo is expected, so the canceller can be given the far end matching
+    each block of recorded audio. The player writes to it and the
+    recording side reads from it, each on their own thread.
+
+    Neither allocates after construction.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace embla {
+
+struct EchoCancellerConfig {
+    size_t blockSize = 128;         // Samples per block, a power of two
+    size_t filterLength = 2048;     // Echo covered, in samples. Rounded up to whole blocks.
+    float stepSize = 0.5f;          // Adaptation step of the background filter, 0-1
+};
+
+struct EchoCancellerStats {
+    uint64_t blocks = 0;
+    uint64_t activeBlocks = 0;      // Blocks with far end audio in the filter
+    uint64_t foregroundUpdates = 0; // Background coefficients taken over by the foreground filter
+    uint64_t backgroundResets = 0;  // Background filter put back to the foreground after diverging
+    float erleDb = 0.0f;            // Smoothed echo return loss enhancement while the far end is active
+};
+
+class EchoCanceller {
+public:
+    explicit EchoCanceller(const EchoCancellerConfig &config = EchoCancellerConfig());
+
+    EchoCanceller(const EchoCanceller &) = delete;
+    EchoCanceller &operator=(const EchoCanceller &) = delete;
+
+    // Remove the echo of far from near, in place. far holds the far end
+    // audio for the same sample positions as near. count must be a
+    // multiple of blockSize(), any remainder is left untouched.
+    void process(int16_t *near, const int16_t *far, size_t count);
+
+    // Forget the far end audio seen so far but keep the echo path, for
+    // when processing resumes after a break.
+    void restart();
+
+    // Forget the echo path as well
+    void reset();
+
+    size_t blockSize() const { return _blockSize; }
+    size_t filterLength() const { return _blockSize * _partitions; }
+
+    EchoCancellerStats stats() const;
+
+private:
+    typedef std::complex<float> Complex;
+
+    void processBlock(int16_t *near, const int16_t *far);
+    void echoEstimate(const std::vector<Complex> &filter, float *echo);
+    void trackLeak(float errorEnergy, float echoEnergy);
+    void adapt();
+    void constrain(size_t partition);
+    void fft(Complex *data, bool inverse);
+
+    const size_t _blockSize;
+    const size_t _fftSize;          // Twice the block size
+    const size_t _bins;             // Non-redundant bins of a real signal's spectrum
+    const size_t _partitions;
+    const float _stepSize;
+
+    // Far end spectra of the last _partitions blocks, newest at _newest
+    std::vector<Complex> _farSpectra;
+    size_t _newest = 0;
+    std::vector<float> _farPower;   // Per bin, summed over the partitions
+    std::vector<float> _farWindow;  // Previous and current block of far end audio
+    std::vector<Complex> _background;
+    std::vector<Complex> _foreground;
+    size_t _nextConstrained = 0;
+
+    std::vector<Complex> _twiddles;
+    std::vector<uint32_t> _bitReverse;
+    std::vector<Complex> _work;
+    std::vector<float> _nearBlock;
+    std::vector<float> _backgroundEcho;
+    std::vector<float> _foregroundEcho;
+    std::vector<float> _error;
+    std::vector<float> _proportions;  // Step of each partition, relative to the mean
+
+    // How much lower the background filter's error is than the foreground's,
+    // and the variance of that, smoothed over a short and a long span
+    float _gainShort = 0.0f;
+    float _varianceShort = 0.0f;
+    float _gainLong = 0.0f;
+    float _varianceLong = 0.0f;
+    // Smoothed energy in and out while the far end is active
+    float _nearEnergy = 0.0f;
+    float _outputEnergy = 0.0f;
+
+    // Leak of the echo into the error: the lowest ratio of error to echo
+    // estimate in each of the last windows of blocks, newest first
+    std::vector<float> _leakWindows;
+    size_t _leakWindowBlocks = 0;
+    float _leakErrorEnergy = 0.0f;
+    float _leakEchoEnergy = 0.0f;
+    float _leak = 1.0f;
+    float _adaptation = 0.0f;       // Sum of the steps taken at the full step size
+    EchoCancellerStats _stats;
+};
+
+struct EchoReferenceStats {
+    uint64_t written = 0;           // Samples placed, at the recording rate
+    uint64_t resyncs = 0;           // Times the writer jumped to a new position
+    uint64_t dropped = 0;           // Samples not placed because the recording clock was unknown
+};
+
+class EchoReference {
+public:
+    // Holds seconds of audio at sampleRate, the recording rate. Played
+    // audio is placed leadSeconds ahead of where its echo is expected, so
+    // that timing errors don't put it after the echo. The canceller's
+    // filter must cover the lead as well as the echo itself.
+    EchoReference(int sampleRate, double seconds, double leadSeconds, double resyncSeconds = 0.02);
+
+    EchoReference(const EchoReference &) = delete;
+    EchoReference &operator=(const EchoReference &) = delete;
+
+    int sampleRate() const { return _sampleRate; }
+
+    // Recording side
+
+    // The recorded sample at position reached the microphone at time, in
+    // seconds on the same clock as the player's times. Called for each
+    // block recorded.
+    void setRecordingTime(uint64_t position, double time);
+
+    // Recording has stopped, so times can't be placed until it starts again
+    void clearRecordingTime();
+
+    // Copy the far end audio for count samples from position into dst,
+    // with silence where nothing was played. Returns the number of
+    // samples that fell within played audio.
+    size_t read(uint64_t position, int16_t *dst, size_t count) const;
+
+    // Whether played audio ends less than tail samples before position,
+    // i.e. whether a filter of that length has anything to cancel
+    bool activeAt(uint64_t position, size_t tail) const;
+
+    // Player side
+
+    // Mono audio at sampleRate that reaches the speaker from time on.
+    // Consecutive writes continue where the previous one ended, so jitter
+    // in the times doesn't shift the audio. The writer only jumps to the
+    // position given by the time when it is off by more than resyncSeconds,
+    // e.g. after playback has stalled.
+    void write(double time, const float *samples, size_t count, double sampleRate);
+
+    // Start afresh with the next write, e.g. for a new player
+    void restartWriter();
+
+    EchoReferenceStats stats() const;
+
+private:
+    void place(double position, const float *samples, size_t count, double sampleRate, bool continued);
+
+    const int _sampleRate;
+    const double _leadSeconds;
+    const double _resyncSamples;
+    std::vector<int16_t> _buffer;
+
+    // Recording clock, published as a seqlock: odd while being changed
+    std::atomic<uint32_t> _clockSequence{0};
+    std::atomic<uint64_t> _clockPosition{0};
+    std::atomic<double> _clockTime{0.0};
+    std::atomic<bool> _clockValid{false};
+
+    // Position after the last sample placed. Samples before it are never
+    // written again, which is what lets the reader go without a lock.
+    std::atomic<uint64_t> _end{0};
+    // Position of the first sample ever placed
+    std::atomic<uint64_t> _begin{UINT64_MAX};
+
+    // Writer state
+    std::atomic<bool> _writerRestart{true};
+    double _writePosition = 0.0;
+    float _lastSample = 0.0f;
+    std::atomic<uint64_t> _written{0};
+    std::atomic<uint64_t> _resyncs{0};
+    std::atomic<uint64_t> _dropped{0};
+};
+
+} // namespace embla
@@ -0,0 +1,401 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FlacEncoder.h"
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+
+#define FLAC_MAX_FIXED_ORDER        4
+#define FLAC_MAX_PARTITION_ORDER    8
+#define FLAC_STREAMINFO_LENGTH      34
+
+namespace embla {
+
+// Checksums
+
+static const std::array<uint8_t, 256> &Crc8Table() {
+    static const std::array<uint8_t, 256> table = [] {
+        std::array<uint8_t, 256> t;
+        for (int i = 0; i < 256; i++) {
+            uint8_t crc = (uint8_t)i;
+            for (int b = 0; b < 8; b++) {
+                crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+            }
+            t[i] = crc;
+        }
+        return t;
+    }();
+    return table;
+}
+
+static const std::array<uint16_t, 256> &Crc16Table() {
+    static const std::array<uint16_t, 256> table = [] {
+        std::array<uint16_t, 256> t;
+        for (int i = 0; i < 256; i++) {
+            uint16_t crc = (uint16_t)(i << 8);
+            for (int b = 0; b < 8; b++) {
+                crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1);
+            }
+            t[i] = crc;
+        }
+        return t;
+    }();
+    return table;
+}
+
+static uint8_t Crc8(const uint8_t *data, size_t length) {
+    const std::array<uint8_t, 256> &table = Crc8Table();
+    uint8_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[crc ^ data[i]];
+    }
+    return crc;
+}
+
+static uint16_t Crc16(const uint8_t *data, size_t length) {
+    const std::array<uint16_t, 256> &table = Crc16Table();
+    uint16_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc = (uint16_t)((crc << 8) ^ table[(crc >> 8) ^ data[i]]);
+    }
+    return crc;
+}
+
+// Bit writer
+
+void FlacEncoder::putBits(uint32_t value, int bits) {
+    if (bits == 0) {
+        return;
+    }
+    _bitBuffer = (_bitBuffer << bits) | (value & (uint32_t)((1ULL << bits) - 1));
+    _bitCount += bits;
+    while (_bitCount >= 8) {
+        _bitCount -= 8;
+        _out.push_back((uint8_t)(_bitBuffer >> _bitCount));
+    }
+}
+
+// Unary coded quotient (zeros terminated by a one) followed by param low bits
+void FlacEncoder::putRice(uint32_t folded, int param) {
+    uint32_t quotient = folded >> param;
+    uint32_t low = folded & ((1u << param) - 1);
+    if (quotient + 1 + param <= 32) {
+        putBits((1u << param) | low, (int)quotient + 1 + param);
+        return;
+    }
+    for (; quotient >= 32; quotient -= 32) {
+        putBits(0, 32);
+    }
+    putBits(1, (int)quotient + 1);
+    putBits(low, param);
+}
+
+void FlacEncoder::alignToByte() {
+    if (_bitCount > 0) {
+        putBits(0, 8 - _bitCount);
+    }
+}
+
+// Encoder
+
+FlacEncoder::FlacEncoder(int sampleRate, size_t blockSize)
+    : _sampleRate(sampleRate), _blockSize(std::min<size_t>(std::max<size_t>(16, blockSize), 65535)),
+      _residual(_blockSize), _folded(_blockSize) {
+    _out.reserve(maxEncodedSize(_blockSize));
+    Crc8Table();
+    Crc16Table();
+}
+
+size_t FlacEncoder::maxEncodedSize(size_t count) {
+    // Stream header, then per frame a header of at most 16 bytes, a
+    // verbatim subframe and the CRC-16
+    size_t frames = count / 16 + 1;
+    return 8 + FLAC_STREAMINFO_LENGTH + frames * 20 + count * sizeof(int16_t);
+}
+
+void FlacEncoder::reset() {
+    _headerPending = true;
+    _frameNumber = 0;
+}
+
+const std::vector<uint8_t> &FlacEncoder::encode(const int16_t *samples, size_t count) {
+    _out.clear();
+    if (_headerPending) {
+        writeStreamHeader();
+        _headerPending = false;
+    }
+    while (count > 0) {
+        size_t n = std::min(count, _blockSize);
+        encodeFrame(samples, n);
+        samples += n;
+        count -= n;
+    }
+    _stats.bytes += _out.size();
+    return _out;
+}
+
+void FlacEncoder::writeStreamHeader() {
+    putBits('f', 8);
+    putBits('L', 8);
+    putBits('a', 8);
+    putBits('C', 8);
+    // Last metadata block flag, type 0 (STREAMINFO) and length
+    putBits(1, 1);
+    putBits(0, 7);
+    putBits(FLAC_STREAMINFO_LENGTH, 24);
+    // Min and max block size. Min and max frame size are unknown.
+    putBits((uint32_t)_blockSize, 16);
+    putBits((uint32_t)_blockSize, 16);
+    putBits(0, 24);
+    putBits(0, 24);
+    // Sample rate, mono, 16 bits per sample
+    putBits((uint32_t)_sampleRate, 20);
+    putBits(0, 3);
+    putBits(15, 5);
+    // Total samples and MD5 signature are unknown for a live stream
+    putBits(0, 4);
+    putBits(0, 32);
+    for (int i = 0; i < 4; i++) {
+        putBits(0, 32);
+    }
+}
+
+static uint32_t SampleRateCode(int sampleRate) {
+    switch (sampleRate) {
+        case 8000:  return 4;
+        case 16000: return 5;
+        case 22050: return 6;
+        case 24000: return 7;
+        case 32000: return 8;
+        case 44100: return 9;
+        case 48000: return 10;
+        case 96000: return 11;
+        default:    return 0; // From STREAMINFO
+    }
+}
+
+void FlacEncoder::writeFrameHeader(size_t count) {
+    size_t start = _out.size();
+    putBits(0x3FFE, 14);    // Sync code
+    putBits(0, 1);
+    putBits(0, 1);          // Fixed block size, frames are numbered
+    putBits(count <= 256 ? 6 : 7, 4);
+    putBits(SampleRateCode(_sampleRate), 4);
+    putBits(0, 4);          // Mono
+    putBits(4, 3);          // 16 bits per sample
+    putBits(0, 1);
+
+    // Frame number, UTF-8 style variable length coding
+    uint64_t n = _frameNumber++;
+    if (n < 0x80) {
+        putBits((uint32_t)n, 8);
+    } else {
+        int extra = 1;
+        while (extra < 6 && n >= (1ULL << (6 + 5 * extra))) {
+            extra++;
+        }
+        uint32_t lead = (0xFF00u >> (extra + 1)) & 0xFF;
+        putBits(lead | (uint32_t)(n >> (6 * extra)), 8);
+        for (int i = extra - 1; i >= 0; i--) {
+            putBits(0x80 | (uint32_t)((n >> (6 * i)) & 0x3F), 8);
+        }
+    }
+
+    putBits((uint32_t)(count - 1), count <= 256 ? 8 : 16);
+    putBits(Crc8(_out.data() + start, _out.size() - start), 8);
+}
+
+// Residuals of the fixed polynomial predictor of the given order
+static void FixedResidual(const int16_t *x, size_t count, int order, int32_t *residual) {
+    for (size_t i = order; i < count; i++) {
+        int32_t r;
+        switch (order) {
+            case 0:  r = x[i]; break;
+            case 1:  r = x[i] - x[i - 1]; break;
+            case 2:  r = x[i] - 2 * x[i - 1] + x[i - 2]; break;
+            case 3:  r = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]; break;
+            default: r = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]; break;
+        }
+        residual[i] = r;
+    }
+}
+
+// Pick the predictor order with the smallest total absolute residual,
+// computing all orders in a single pass as the reference encoder does.
+static int BestFixedOrder(const int16_t *x, size_t count) {
+    int maxOrder = (int)std::min<size_t>(FLAC_MAX_FIXED_ORDER, count - 1);
+    uint64_t total[FLAC_MAX_FIXED_ORDER + 1] = {0};
+    for (size_t i = FLAC_MAX_FIXED_ORDER; i < count; i++) {
+        int32_t e0 = x[i];
+        int32_t e1 = e0 - x[i - 1];
+        int32_t e2 = e1 - (x[i - 1] - x[i - 2]);
+        int32_t e3 = e2 - (x[i - 1] - 2 * x[i - 2] + x[i - 3]);
+        int32_t e4 = e3 - (x[i - 1] - 3 * x[i - 2] + 3 * x[i - 3] - x[i - 4]);
+        total[0] += (uint32_t)abs(e0);
+        total[1] += (uint32_t)abs(e1);
+        total[2] += (uint32_t)abs(e2);
+        total[3] += (uint32_t)abs(e3);
+        total[4] += (uint32_t)abs(e4);
+    }
+    int best = 0;
+    for (int order = 1; order <= maxOrder; order++) {
+        if (total[order] < total[best]) {
+            best = order;
+        }
+    }
+    return best;
+}
+
+// Rice parameter minimizing the estimated size of a partition of n
+// folded residuals summing to sum. Returns the estimated size in bits.
+static uint64_t BestRiceParam(uint64_t sum, size_t n, int maxParam, int *param) {
+    int k = 0;
+    while (k < maxParam && ((uint64_t)n << (k + 1)) < sum) {
+        k++;
+    }
+    uint64_t best = UINT64_MAX;
+    for (int candidate = std::max(0, k - 1); candidate <= std::min(maxParam, k + 1); candidate++) {
+        uint64_t bits = (uint64_t)n * (candidate + 1) + (sum >> candidate);
+        if (bits < best) {
+            best = bits;
+            *param = candidate;
+        }
+    }
+    return best;
+}
+
+void FlacEncoder::writeSubframe(const int16_t *x, size_t count) {
+    putBits(0, 1); // Padding
+
+    bool constant = true;
+    for (size_t i = 1; i < count && constant; i++) {
+        constant = (x[i] == x[0]);
+    }
+    if (constant) {
+        putBits(0, 6);
+        putBits(0, 1);
+        putBits((uint16_t)x[0], 16);
+        return;
+    }
+
+    int order = count > FLAC_MAX_FIXED_ORDER ? BestFixedOrder(x, count) : 0;
+    FixedResidual(x, count, order, _residual.data());
+    uint64_t sum = 0;
+    for (size_t i = order; i < count; i++) {
+        int32_t r = _residual[i];
+        _folded[i] = ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+        sum += _folded[i];
+    }
+
+    // Finest partitioning the block size allows, with each partition
+    // longer than the warmup
+    int maxPartitionOrder = 0;
+    while (maxPartitionOrder < FLAC_MAX_PARTITION_ORDER && (count % (2u << maxPartitionOrder)) == 0 &&
+           (count >> (maxPartitionOrder + 1)) > (size_t)order) {
+        maxPartitionOrder++;
+    }
+
+    // Partition sums at the finest level, merged pairwise for coarser ones
+    uint64_t sums[1 << FLAC_MAX_PARTITION_ORDER];
+    size_t partitions = (size_t)1 << maxPartitionOrder;
+    size_t partitionLength = count >> maxPartitionOrder;
+    for (size_t p = 0; p < partitions; p++) {
+        uint64_t s = 0;
+        for (size_t i = std::max<size_t>(p * partitionLength, order); i < (p + 1) * partitionLength; i++) {
+            s += _folded[i];
+        }
+        sums[p] = s;
+    }
+
+    const int maxParam = 30;
+    uint64_t bestBits = UINT64_MAX;
+    int bestPartitionOrder = 0;
+    int bestParams[1 << FLAC_MAX_PARTITION_ORDER];
+    int params[1 << FLAC_MAX_PARTITION_ORDER];
+    for (int po = maxPartitionOrder; po >= 0; po--) {
+        size_t parts = (size_t)1 << po;
+        size_t length = count >> po;
+        uint64_t bits = 0;
+        bool escaped = false;
+        for (size_t p = 0; p < parts; p++) {
+            size_t n = length - (p == 0 ? order : 0);
+            bits += BestRiceParam(sums[p], n, maxParam, &params[p]);
+            escaped |= params[p] > 14;
+        }
+        bits += parts * (escaped ? 5 : 4);
+        if (bits < bestBits) {
+            bestBits = bits;
+            bestPartitionOrder = po;
+            std::copy(params, params + parts, bestParams);
+        }
+        // Merge for the next coarser level
+        for (size_t p = 0; p < parts / 2; p++) {
+            sums[p] = sums[2 * p] + sums[2 * p + 1];
+        }
+    }
+
+    uint64_t fixedBits = 16ULL * order + 6 + bestBits;
+    uint64_t verbatimBits = 16ULL * count;
+    if (fixedBits >= verbatimBits) {
+        _stats.verbatimFrames++;
+        putBits(1, 6);
+        putBits(0, 1);
+        for (size_t i = 0; i < count; i++) {
+            putBits((uint16_t)x[i], 16);
+        }
+        return;
+    }
+
+    putBits(8 | order, 6);
+    putBits(0, 1);
+    for (int i = 0; i < order; i++) {
+        putBits((uint16_t)x[i], 16);
+    }
+    writeResidual(count, order, bestPartitionOrder, bestParams);
+}
+
+void FlacEncoder::writeResidual(size_t count, int order, int partitionOrder, const int *params) {
+    size_t parts = (size_t)1 << partitionOrder;
+    size_t length = count >> partitionOrder;
+    bool rice2 = false;
+    for (size_t p = 0; p < parts; p++) {
+        rice2 |= params[p] > 14;
+    }
+    putBits(rice2 ? 1 : 0, 2);
+    putBits((uint32_t)partitionOrder, 4);
+    for (size_t p = 0; p < parts; p++) {
+        putBits((uint32_t)params[p], rice2 ? 5 : 4);
+        for (size_t i = std::max<size_t>(p * length, order); i < (p + 1) * length; i++) {
+            putRice(_folded[i], params[p]);
+        }
+    }
+}
+
+void FlacEncoder::encodeFrame(const int16_t *samples, size_t count) {
+    size_t start = _out.size();
+    writeFrameHeader(count);
+    writeSubframe(samples, count);
+    alignToByte();
+    uint16_t crc = Crc16(_out.data() + start, _out.size() - start);
+    putBits(crc, 16);
+    _stats.frames++;
+    _stats.samples += count;
+}
+
+} // namespace embla
@@ -0,0 +1,99 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Streaming FLAC encoder for speech sent to the recognition server.
+
+    Each block of 16-bit mono PCM, e.g. one 100 ms chunk, is encoded as
+    a single self-contained FLAC frame. The first block of a stream is
+    preceded by the "fLaC" marker and a STREAMINFO block, so the output
+    of successive encode() calls concatenates to a valid FLAC stream.
+    Each frame uses whichever of a constant subframe, a fixed
+    polynomial predictor (order 0-4) with partitioned Rice coding, or
+    verbatim samples is smallest. This is roughly what the reference
+    encoder does at its fastest settings, which is what matters on the
+    phone: it roughly halves the upload for speech at a small fraction
+    of real-time CPU. Lossless, so recognition accuracy is unaffected.
+
+    No memory is allocated once the output buffer has grown to fit the
+    largest frame.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace embla {
+
+struct FlacEncoderStats {
+    uint64_t frames = 0;
+    uint64_t samples = 0;
+    uint64_t bytes = 0;             // Output bytes, including the stream header
+    uint64_t verbatimFrames = 0;    // Frames that didn't compress
+};
+
+class FlacEncoder {
+public:
+    // blockSize is the nominal number of samples per encode() call. Only
+    // the last block of a stream may be shorter. Maximum is 65535.
+    FlacEncoder(int sampleRate, size_t blockSize);
+
+    // Encode a block. Blocks longer than blockSize are split into several
+    // frames. The returned buffer is valid until the next call.
+    const std::vector<uint8_t> &encode(const int16_t *samples, size_t count);
+
+    // Start a new stream, i.e. write the stream header again before the next frame.
+    void reset();
+
+    // Upper bound on the size of an encoded block, stream header included.
+    static size_t maxEncodedSize(size_t count);
+
+    int sampleRate() const { return _sampleRate; }
+    size_t blockSize() const { return _blockSize; }
+    FlacEncoderStats stats() const { return _stats; }
+
+private:
+    void writeStreamHeader();
+    void writeFrameHeader(size_t count);
+    void writeSubframe(const int16_t *samples, size_t count);
+    void writeResidual(size_t count, int order, int partitionOrder, const int *params);
+    void encodeFrame(const int16_t *samples, size_t count);
+
+    void putBits(uint32_t value, int bits);
+    void putRice(uint32_t folded, int param);
+    void alignToByte();
+
+    const int _sampleRate;
+    const size_t _blockSize;
+
+    std::vector<uint8_t> _out;
+    uint64_t _bitBuffer = 0;
+    int _bitCount = 0;
+    uint64_t _frameNumber = 0;
+    bool _headerPending = true;
+
+    // Per block scratch, sized for blockSize
+    std::vector<int32_t> _residual;
+    std::vector<uint32_t> _folded;
+
+    FlacEncoderStats _stats;
+};
+
+} // namespace embla
@@ -0,0 +1,123 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "JitterBuffer.h"
+#include <algorithm>
+#include <cstring>
+
+namespace embla {
+
+JitterBuffer::JitterBuffer(double prebufferSeconds) : _prebufferSeconds(prebufferSeconds) {}
+
+void JitterBuffer::push(const uint8_t *packet, size_t size, double duration) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    // Reclaim the consumed front once it's more than half the buffer
+    if (_head > 0 && _head * 2 >= _bytes.size()) {
+        _bytes.erase(_bytes.begin(), _bytes.begin() + _head);
+        _head = 0;
+    }
+    _bytes.insert(_bytes.end(), packet, packet + size);
+    _packets.push_back({size, duration});
+    _buffered += duration;
+    _stats.packets++;
+    _stats.bytes += size;
+    _stats.maxBuffered = std::max(_stats.maxBuffered, _buffered);
+}
+
+void JitterBuffer::finish() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _finished = true;
+}
+
+bool JitterBuffer::readyLocked() const {
+    if (_packets.empty()) {
+        return false;
+    }
+    return _playing || _finished || _buffered >= _prebufferSeconds;
+}
+
+size_t JitterBuffer::pop(uint8_t *dst, size_t maxBytes, size_t maxPackets, uint32_t *packetSizes, size_t &bytes) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    bytes = 0;
+    if (!readyLocked()) {
+        if (_playing && _packets.empty() && !_finished) {
+            // Ran dry mid-stream, so build up a cushion again before resuming
+            _stats.underruns++;
+            _playing = false;
+        }
+        return 0;
+    }
+    _playing = true;
+
+    // A packet that could never fit is dropped rather than blocking playback for good
+    if (_packets.front().size > maxBytes) {
+        _head += _packets.front().size;
+        _buffered -= _packets.front().duration;
+        _packets.pop_front();
+    }
+
+    size_t count = 0;
+    while (count < maxPackets && !_packets.empty() && bytes + _packets.front().size <= maxBytes) {
+        const Packet &packet = _packets.front();
+        memcpy(dst + bytes, _bytes.data() + _head, packet.size);
+        packetSizes[count++] = (uint32_t)packet.size;
+        bytes += packet.size;
+        _head += packet.size;
+        _buffered -= packet.duration;
+        _packets.pop_front();
+    }
+    if (_packets.empty()) {
+        _bytes.clear();
+        _head = 0;
+        _buffered = 0.0;
+    }
+    return count;
+}
+
+bool JitterBuffer::ready() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return readyLocked();
+}
+
+bool JitterBuffer::drained() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _finished && _packets.empty();
+}
+
+double JitterBuffer::buffered() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _buffered;
+}
+
+void JitterBuffer::reset() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _bytes.clear();
+    _head = 0;
+    _packets.clear();
+    _buffered = 0.0;
+    _playing = false;
+    _finished = false;
+    _stats = JitterBufferStats();
+}
+
+JitterBufferStats JitterBuffer::stats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
+
+} // namespace embla
@@ -0,0 +1,97 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Jitter buffer for compressed audio packets arriving over the network.
+
+    Absorbs uneven arrival so that playback, once started, doesn't run
+    dry every time the network stalls. Playback is held back until
+    prebufferSeconds of audio are buffered or the stream has ended, and
+    the same applies again after an underrun. Packets are stored back to
+    back in a single byte buffer. Thread safe: the network side pushes,
+    the audio side pops.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace embla {
+
+struct JitterBufferStats {
+    uint64_t packets = 0;       // Packets pushed
+    uint64_t bytes = 0;
+    uint64_t underruns = 0;     // Times playback ran dry before the end of the stream
+    double maxBuffered = 0.0;   // Most audio buffered at once, in seconds
+};
+
+class JitterBuffer {
+public:
+    explicit JitterBuffer(double prebufferSeconds);
+
+    JitterBuffer(const JitterBuffer &) = delete;
+    JitterBuffer &operator=(const JitterBuffer &) = delete;
+
+    // Producer side
+
+    void push(const uint8_t *packet, size_t size, double duration);
+    // No more packets will arrive, so whatever is left can be played.
+    void finish();
+
+    // Consumer side
+
+    // Copy whole packets into dst, at most maxBytes and maxPackets of them,
+    // storing their sizes in packetSizes and the total in bytes. Returns the
+    // number of packets, which is 0 while prebuffering.
+    size_t pop(uint8_t *dst, size_t maxBytes, size_t maxPackets, uint32_t *packetSizes, size_t &bytes);
+
+    // Whether pop() would return packets.
+    bool ready() const;
+    // Whether the stream has ended and everything has been popped.
+    bool drained() const;
+    // Seconds of audio buffered.
+    double buffered() const;
+
+    void reset();
+
+    JitterBufferStats stats() const;
+
+private:
+    struct Packet {
+        size_t size;
+        double duration;
+    };
+
+    bool readyLocked() const;
+
+    const double _prebufferSeconds;
+    mutable std::mutex _mutex;
+    std::vector<uint8_t> _bytes;
+    size_t _head = 0;
+    std::deque<Packet> _packets;
+    double _buffered = 0.0;
+    bool _playing = false;
+    bool _finished = false;
+    JitterBufferStats _stats;
+};
+
+} // namespace embla
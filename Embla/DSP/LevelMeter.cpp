@@ -0,0 +1,207 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "LevelMeter.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace embla {
+
+// Kernels
+
+LevelMeasurement measureLevelReference(const int16_t *samples, size_t count) {
+    LevelMeasurement m;
+    m.count = count;
+    for (size_t i = 0; i < count; i++) {
+        int32_t s = samples[i];
+        uint32_t a = (uint32_t)(s < 0 ? -s : s);
+        m.peak = std::max(m.peak, a);
+        m.sumSquares += (uint64_t)(s * s);
+    }
+    return m;
+}
+
+// The vector kernels compute |s| in 16 bits, where |-32768| wraps to
+// 0x8000 and is read back as unsigned, and sum pairs of squares in 32
+// bits, which can reach 2^31 and is likewise read back as unsigned.
+
+#if defined(__AVX2__)
+
+const char *levelKernelName() {
+    return "avx2";
+}
+
+LevelMeasurement measureLevel(const int16_t *samples, size_t count) {
+    __m256i peak = _mm256_setzero_si256();
+    __m256i sum = _mm256_setzero_si256();
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(samples + i));
+        peak = _mm256_max_epu16(peak, _mm256_abs_epi16(x));
+        __m256i sq = _mm256_madd_epi16(x, x);
+        sum = _mm256_add_epi64(sum, _mm256_unpacklo_epi32(sq, zero));
+        sum = _mm256_add_epi64(sum, _mm256_unpackhi_epi32(sq, zero));
+    }
+    alignas(32) uint16_t peaks[16];
+    alignas(32) uint64_t sums[4];
+    _mm256_store_si256((__m256i *)peaks, peak);
+    _mm256_store_si256((__m256i *)sums, sum);
+
+    LevelMeasurement m = measureLevelReference(samples + i, count - i);
+    m.count = count;
+    for (int j = 0; j < 16; j++) {
+        m.peak = std::max<uint32_t>(m.peak, peaks[j]);
+    }
+    m.sumSquares += sums[0] + sums[1] + sums[2] + sums[3];
+    return m;
+}
+
+#elif defined(__SSE2__)
+
+const char *levelKernelName() {
+    return "sse2";
+}
+
+LevelMeasurement measureLevel(const int16_t *samples, size_t count) {
+    // SSE2 only has a signed 16-bit max, so peaks are kept biased by 0x8000
+    const __m128i bias = _mm_set1_epi16((int16_t)0x8000);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i peak = bias;
+    __m128i sum = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(samples + i));
+        __m128i sign = _mm_srai_epi16(x, 15);
+        __m128i abs = _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+        peak = _mm_max_epi16(peak, _mm_xor_si128(abs, bias));
+        __m128i sq = _mm_madd_epi16(x, x);
+        sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(sq, zero));
+        sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(sq, zero));
+    }
+    alignas(16) uint16_t peaks[8];
+    alignas(16) uint64_t sums[2];
+    _mm_store_si128((__m128i *)peaks, _mm_xor_si128(peak, bias));
+    _mm_store_si128((__m128i *)sums, sum);
+
+    LevelMeasurement m = measureLevelReference(samples + i, count - i);
+    m.count = count;
+    for (int j = 0; j < 8; j++) {
+        m.peak = std::max<uint32_t>(m.peak, peaks[j]);
+    }
+    m.sumSquares += sums[0] + sums[1];
+    return m;
+}
+
+#elif defined(__ARM_NEON)
+
+const char *levelKernelName() {
+    return "neon";
+}
+
+LevelMeasurement measureLevel(const int16_t *samples, size_t count) {
+    uint16x8_t peak = vdupq_n_u16(0);
+    uint64x2_t sum = vdupq_n_u64(0);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t x = vld1q_s16(samples + i);
+        peak = vmaxq_u16(peak, vreinterpretq_u16_s16(vabsq_s16(x)));
+        // Each 32-bit square is at most 2^30, so pairs fit in 32 bits unsigned
+        int32x4_t lo = vmull_s16(vget_low_s16(x), vget_low_s16(x));
+        int32x4_t hi = vmull_s16(vget_high_s16(x), vget_high_s16(x));
+        uint32x4_t pairs = vaddq_u32(vreinterpretq_u32_s32(lo), vreinterpretq_u32_s32(hi));
+        sum = vpadalq_u32(sum, pairs);
+    }
+    uint16_t peaks[8];
+    uint64_t sums[2];
+    vst1q_u16(peaks, peak);
+    vst1q_u64(sums, sum);
+
+    LevelMeasurement m = measureLevelReference(samples + i, count - i);
+    m.count = count;
+    for (int j = 0; j < 8; j++) {
+        m.peak = std::max<uint32_t>(m.peak, peaks[j]);
+    }
+    m.sumSquares += sums[0] + sums[1];
+    return m;
+}
+
+#else
+
+const char *levelKernelName() {
+    return "scalar";
+}
+
+LevelMeasurement measureLevel(const int16_t *samples, size_t count) {
+    return measureLevelReference(samples, count);
+}
+
+#endif
+
+// Meter
+
+const float LevelMeter::minDbfs = -120.0f;
+
+static float ToDbfs(float level) {
+    return level > 1e-6f ? 20.0f * log10f(level) : LevelMeter::minDbfs;
+}
+
+LevelMeter::LevelMeter(int sampleRate, int releaseMs)
+    : _samplesPerRelease(std::max(1.0, (double)sampleRate * releaseMs / 1000.0)) {}
+
+float LevelMeter::releaseFactor(size_t count) {
+    if (count != _releaseCount) {
+        _releaseCount = count;
+        _releaseFactor = (float)exp(-(double)count / _samplesPerRelease);
+    }
+    return _releaseFactor;
+}
+
+void LevelMeter::process(const int16_t *samples, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    LevelMeasurement m = measureLevel(samples, count);
+    _peak = m.peak / 32768.0f;
+    _rms = (float)sqrt((double)m.sumSquares / count) / 32768.0f;
+    _smoothed = std::max(_peak, _smoothed * releaseFactor(count));
+}
+
+void LevelMeter::reset() {
+    _peak = _rms = _smoothed = 0.0f;
+}
+
+float LevelMeter::peakDbfs() const {
+    return ToDbfs(_peak);
+}
+
+float LevelMeter::rmsDbfs() const {
+    return ToDbfs(_rms);
+}
+
+float LevelMeter::smoothedDbfs() const {
+    return ToDbfs(_smoothed);
+}
+
+} // namespace embla
@@ -0,0 +1,86 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Audio level metering for the microphone input.
+
+    measureLevel() computes the absolute peak and the sum of squares of
+    a block of 16-bit PCM in a single vectorized pass (AVX2, SSE2 or
+    NEON, with a scalar fallback). LevelMeter builds on it to provide
+    peak, RMS and a smoothed level with instant attack and exponential
+    release. Conversion to dBFS only happens when a level is queried,
+    not for every block.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace embla {
+
+struct LevelMeasurement {
+    uint32_t peak = 0;          // Absolute peak, 0-32768
+    uint64_t sumSquares = 0;
+    size_t count = 0;
+};
+
+// Single pass over the samples. Exact, i.e. identical to the scalar reference.
+LevelMeasurement measureLevel(const int16_t *samples, size_t count);
+
+// Plain scalar implementation, for verification and benchmarking
+LevelMeasurement measureLevelReference(const int16_t *samples, size_t count);
+
+// Name of the instruction set measureLevel() was compiled for
+const char *levelKernelName();
+
+class LevelMeter {
+public:
+    // Smoothed level decays by 1/e over releaseMs of audio.
+    LevelMeter(int sampleRate, int releaseMs);
+
+    void process(const int16_t *samples, size_t count);
+    void reset();
+
+    // Most recent block, linear 0.0-1.0
+    float peak() const { return _peak; }
+    float rms() const { return _rms; }
+    // Peak with release applied, linear 0.0-1.0
+    float smoothed() const { return _smoothed; }
+
+    // The above in dBFS, floored at minDbfs for silence
+    float peakDbfs() const;
+    float rmsDbfs() const;
+    float smoothedDbfs() const;
+
+    static const float minDbfs;
+
+private:
+    float releaseFactor(size_t count);
+
+    const double _samplesPerRelease;
+    float _peak = 0.0f;
+    float _rms = 0.0f;
+    float _smoothed = 0.0f;
+
+    // Decay factor for the most recent block size, as these rarely change
+    size_t _releaseCount = 0;
+    float _releaseFactor = 1.0f;
+};
+
+} // namespace embla
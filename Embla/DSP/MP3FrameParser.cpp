@@ -0,0 +1,194 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MP3FrameParser.h"
+#include <algorithm>
+#include <cstring>
+
+namespace embla {
+
+// Headers
+
+static const int BitrateTable[2][3][15] = {
+    // MPEG-1, layers I, II and III
+    {
+        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+    },
+    // MPEG-2 and 2.5
+    {
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+    },
+};
+
+static const int SampleRateTable[3][3] = {
+    {44100, 48000, 32000},  // MPEG-1
+    {22050, 24000, 16000},  // MPEG-2
+    {11025, 12000, 8000},   // MPEG-2.5
+};
+
+bool ParseMP3FrameHeader(const uint8_t *p, MP3FrameInfo &info) {
+    if (p[0] != 0xFF || (p[1] & 0xE0) != 0xE0) {
+        return false;
+    }
+    int versionBits = (p[1] >> 3) & 3;
+    int layerBits = (p[1] >> 1) & 3;
+    int bitrateIndex = p[2] >> 4;
+    int sampleRateIndex = (p[2] >> 2) & 3;
+    int padding = (p[2] >> 1) & 1;
+    int channelMode = p[3] >> 6;
+    int emphasis = p[3] & 3;
+    // Free format bitrate isn't supported
+    if (versionBits == 1 || layerBits == 0 || bitrateIndex == 0 || bitrateIndex == 15 || sampleRateIndex == 3 ||
+        emphasis == 2) {
+        return false;
+    }
+
+    int versionRow = versionBits == 3 ? 0 : (versionBits == 2 ? 1 : 2);
+    info.version = versionBits == 3 ? 10 : (versionBits == 2 ? 20 : 25);
+    info.layer = 4 - layerBits;
+    info.bitrate = BitrateTable[versionRow == 0 ? 0 : 1][info.layer - 1][bitrateIndex];
+    info.sampleRate = SampleRateTable[versionRow][sampleRateIndex];
+    info.channels = channelMode == 3 ? 1 : 2;
+
+    if (info.layer == 1) {
+        info.samplesPerFrame = 384;
+        info.size = (size_t)((12 * info.bitrate * 1000 / info.sampleRate + padding) * 4);
+    } else {
+        info.samplesPerFrame = (info.layer == 3 && info.version != 10) ? 576 : 1152;
+        info.size = (size_t)(info.samplesPerFrame / 8 * info.bitrate * 1000 / info.sampleRate + padding);
+    }
+    return info.size > 4;
+}
+
+// Parser
+
+MP3FrameParser::MP3FrameParser(FrameHandler handler) : _handler(std::move(handler)) {}
+
+void MP3FrameParser::reset() {
+    _buffer.clear();
+    _pos = 0;
+    _skip = 0;
+    _started = false;
+    _synced = false;
+    _format = MP3FrameInfo();
+    _stats = MP3FrameParserStats();
+}
+
+bool MP3FrameParser::matchesFormat(const MP3FrameInfo &info) const {
+    return info.version == _format.version && info.layer == _format.layer && info.sampleRate == _format.sampleRate &&
+           info.channels == _format.channels;
+}
+
+void MP3FrameParser::push(const uint8_t *data, size_t length) {
+    // Drop what has been consumed before appending
+    if (_pos > 0) {
+        _buffer.erase(_buffer.begin(), _buffer.begin() + _pos);
+        _pos = 0;
+    }
+    _buffer.insert(_buffer.end(), data, data + length);
+    parse(false);
+}
+
+void MP3FrameParser::finish() {
+    parse(true);
+    _stats.skippedBytes += _buffer.size() - _pos;
+    _buffer.clear();
+    _pos = 0;
+}
+
+void MP3FrameParser::parse(bool final) {
+    while (_pos < _buffer.size()) {
+        size_t available = _buffer.size() - _pos;
+        const uint8_t *p = _buffer.data() + _pos;
+
+        if (_skip > 0) {
+            size_t n = std::min(_skip, available);
+            _skip -= n;
+            _pos += n;
+            _stats.skippedBytes += n;
+            continue;
+        }
+
+        // ID3v2 tag at the start of the stream
+        if (!_started) {
+            if (available < 10 && !final) {
+                return;
+            }
+            _started = true;
+            if (available >= 10 && memcmp(p, "ID3", 3) == 0) {
+                size_t size = ((size_t)(p[6] & 0x7F) << 21) | ((size_t)(p[7] & 0x7F) << 14) |
+                              ((size_t)(p[8] & 0x7F) << 7) | (size_t)(p[9] & 0x7F);
+                _skip = 10 + size + ((p[5] & 0x10) ? 10 : 0);
+                continue;
+            }
+        }
+
+        if (available < 4) {
+            return;
+        }
+        MP3FrameInfo info;
+        if (!ParseMP3FrameHeader(p, info) || (_synced && !matchesFormat(info))) {
+            // Skip ahead to the next possible sync byte
+            const uint8_t *next = (const uint8_t *)memchr(p + 1, 0xFF, available - 1);
+            size_t n = next ? (size_t)(next - p) : available;
+            _pos += n;
+            _stats.skippedBytes += n;
+            continue;
+        }
+
+        if (!_synced) {
+            // Confirm by the header of the following frame, unless this is the end
+            if (available < info.size + 4) {
+                if (!final || available < info.size) {
+                    return;
+                }
+            } else {
+                MP3FrameInfo next;
+                if (!ParseMP3FrameHeader(p + info.size, next) || next.version != info.version ||
+                    next.layer != info.layer || next.sampleRate != info.sampleRate) {
+                    _pos++;
+                    _stats.skippedBytes++;
+                    continue;
+                }
+            }
+            _synced = true;
+            _format = info;
+        } else if (available < info.size) {
+            if (final) {
+                // Truncated last frame
+                _stats.skippedBytes += available;
+                _pos = _buffer.size();
+            }
+            return;
+        }
+
+        _stats.frames++;
+        _stats.frameBytes += info.size;
+        _stats.duration += info.duration();
+        _pos += info.size;
+        if (_handler) {
+            _handler(p, info);
+        }
+    }
+}
+
+} // namespace embla
@@ -0,0 +1,95 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Incremental MPEG audio frame parser, for playing synthesized speech
+    while it downloads.
+
+    Bytes are pushed in whatever pieces they arrive in, and each complete
+    frame is passed to the frame handler as soon as all of it is there,
+    along with what its header says (sample rate, channels, duration).
+    A leading ID3v2 tag and any garbage between frames are skipped. The
+    first frame is only accepted once the header of the frame after it
+    has been seen, so a stray sync pattern can't lock onto the wrong
+    format. After that, frames whose headers don't match the stream's
+    format are treated as garbage.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace embla {
+
+struct MP3FrameInfo {
+    int version = 0;            // 10 for MPEG-1, 20 for MPEG-2, 25 for MPEG-2.5
+    int layer = 0;              // 1-3
+    int bitrate = 0;            // kbit/s
+    int sampleRate = 0;
+    int channels = 0;
+    int samplesPerFrame = 0;
+    size_t size = 0;            // Frame length in bytes, header included
+
+    double duration() const { return sampleRate ? (double)samplesPerFrame / sampleRate : 0.0; }
+};
+
+// Parse the 4-byte frame header at p. Returns false if it isn't a valid header.
+bool ParseMP3FrameHeader(const uint8_t *p, MP3FrameInfo &info);
+
+struct MP3FrameParserStats {
+    uint64_t frames = 0;
+    uint64_t frameBytes = 0;
+    uint64_t skippedBytes = 0;  // ID3 tags and garbage
+    double duration = 0.0;      // Seconds of audio in the frames emitted
+};
+
+class MP3FrameParser {
+public:
+    typedef std::function<void(const uint8_t *frame, const MP3FrameInfo &info)> FrameHandler;
+
+    explicit MP3FrameParser(FrameHandler handler);
+
+    // Append data, emitting every frame that is now complete.
+    void push(const uint8_t *data, size_t length);
+
+    // End of stream. Emits the last frame, which can't be confirmed by a following header.
+    void finish();
+
+    void reset();
+
+    bool synced() const { return _synced; }
+    MP3FrameParserStats stats() const { return _stats; }
+
+private:
+    void parse(bool final);
+    bool matchesFormat(const MP3FrameInfo &info) const;
+
+    FrameHandler _handler;
+    std::vector<uint8_t> _buffer;
+    size_t _pos = 0;
+    size_t _skip = 0;           // Bytes of an ID3 tag still to be skipped
+    bool _started = false;      // Past the point where an ID3v2 tag may appear
+    bool _synced = false;
+    MP3FrameInfo _format;
+    MP3FrameParserStats _stats;
+};
+
+} // namespace embla
@@ -0,0 +1,200 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "VADGate.h"
+#include "LevelMeter.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__APPLE__)
+#include <Accelerate/Accelerate.h>
+#endif
+
+namespace embla {
+
+static size_t SamplesForMs(int sampleRate, int ms) {
+    return (size_t)std::max(1, sampleRate * ms / 1000);
+}
+
+VADGate::VADGate(const VADGateConfig &config, SampleHandler handler, StateHandler stateHandler)
+    : _config(config), _handler(std::move(handler)), _stateHandler(std::move(stateHandler)) {
+    size_t frameSamples = SamplesForMs(config.sampleRate, config.frameMs);
+    _frame.resize(frameSamples);
+    _scratch.resize(frameSamples);
+    _preRoll.resize(std::max(frameSamples, SamplesForMs(config.sampleRate, config.preRollMs)));
+    _hangoverFrames = std::max(0, config.hangoverMs / std::max(1, config.frameMs));
+    _noiseFloorDbfs = config.minEnergyDbfs;
+    _noiseFloorRisePerFrame = config.noiseFloorRiseDbPerSec * config.frameMs / 1000.0f;
+}
+
+// Analysis
+
+void VADGate::analyzeFrame(const int16_t *samples, size_t count, float *scratch, float &energyDbfs,
+                           float &zeroCrossingRate) {
+    if (count == 0) {
+        energyDbfs = -120.0f;
+        zeroCrossingRate = 0.0f;
+        return;
+    }
+#if defined(__APPLE__)
+    // Convert once, then let vDSP do mean square and zero crossings
+    vDSP_vflt16(samples, 1, scratch, 1, count);
+    float meanSquare = 0.0f;
+    vDSP_measqv(scratch, 1, &meanSquare, count);
+    vDSP_Length lastCrossing = 0, crossings = 0;
+    vDSP_nzcros(scratch, 1, count, &lastCrossing, &crossings, count);
+    meanSquare /= 32768.0f * 32768.0f;
+#else
+    // Energy from the vectorized level kernel, zero crossings from a
+    // branch-free loop that the compiler can auto-vectorize
+    (void)scratch;
+    uint64_t sumSquares = measureLevel(samples, count).sumSquares;
+    uint32_t crossings = 0;
+    for (size_t i = 1; i < count; i++) {
+        crossings += (uint32_t)((samples[i - 1] ^ samples[i]) < 0);
+    }
+    float meanSquare = (float)((double)sumSquares / count / (32768.0 * 32768.0));
+#endif
+    energyDbfs = meanSquare > 1e-12f ? 10.0f * log10f(meanSquare) : -120.0f;
+    zeroCrossingRate = (float)crossings / count;
+}
+
+bool VADGate::isSpeech(float energyDbfs, float zeroCrossingRate) const {
+    float threshold = std::max(_noiseFloorDbfs + _config.thresholdDb, _config.minEnergyDbfs);
+    return energyDbfs >= threshold && zeroCrossingRate >= _config.minZeroCrossingRate &&
+           zeroCrossingRate <= _config.maxZeroCrossingRate;
+}
+
+// Gating
+
+void VADGate::push(const int16_t *samples, size_t count) {
+    _stats.samples += count;
+    while (count > 0) {
+        size_t n = std::min(count, _frame.size() - _frameFilled);
+        memcpy(_frame.data() + _frameFilled, samples, n * sizeof(int16_t));
+        _frameFilled += n;
+        _position += n;
+        samples += n;
+        count -= n;
+        if (_frameFilled == _frame.size()) {
+            processFrame();
+            _frameFilled = 0;
+        }
+    }
+}
+
+void VADGate::processFrame() {
+    float energy, zcr;
+    analyzeFrame(_frame.data(), _frame.size(), _scratch.data(), energy, zcr);
+    bool speech = isSpeech(energy, zcr);
+
+    // Noise floor drops immediately to quieter frames and creeps up slowly,
+    // so it follows the ambience without being dragged up much by speech
+    if (_stats.frames == 0 || energy < _noiseFloorDbfs) {
+        _noiseFloorDbfs = std::max(energy, _config.minEnergyDbfs - _config.thresholdDb);
+    } else {
+        _noiseFloorDbfs += _noiseFloorRisePerFrame;
+    }
+
+    _stats.frames++;
+    if (speech) {
+        _stats.speechFrames++;
+    }
+
+    if (_open) {
+        emit(_frame.data(), _frame.size(), _position);
+        if (speech) {
+            _hangoverLeft = _hangoverFrames;
+        } else if (--_hangoverLeft <= 0) {
+            setOpen(false);
+        }
+        return;
+    }
+
+    appendPreRoll(_frame.data(), _frame.size());
+    _onsetCount = speech ? _onsetCount + 1 : 0;
+    if (_onsetCount >= _config.onsetFrames) {
+        setOpen(true);
+        emitPreRoll();
+    }
+}
+
+void VADGate::setOpen(bool open) {
+    _open = open;
+    _onsetCount = 0;
+    _hangoverLeft = _hangoverFrames;
+    if (open) {
+        _stats.openings++;
+    }
+    if (_stateHandler) {
+        _stateHandler(open);
+    }
+}
+
+void VADGate::appendPreRoll(const int16_t *samples, size_t count) {
+    size_t capacity = _preRoll.size();
+    if (count >= capacity) {
+        samples += count - capacity;
+        count = capacity;
+    }
+    size_t first = std::min(count, capacity - _preRollPos);
+    memcpy(_preRoll.data() + _preRollPos, samples, first * sizeof(int16_t));
+    memcpy(_preRoll.data(), samples + first, (count - first) * sizeof(int16_t));
+    _preRollPos = (_preRollPos + count) % capacity;
+    _preRollFilled = std::min(capacity, _preRollFilled + count);
+}
+
+void VADGate::emitPreRoll() {
+    // Oldest samples start at the write position once the buffer has wrapped.
+    // The pre-roll ends with the frame that opened the gate.
+    size_t capacity = _preRoll.size();
+    size_t start = (_preRollPos + capacity - _preRollFilled) % capacity;
+    size_t first = std::min(_preRollFilled, capacity - start);
+    emit(_preRoll.data() + start, first, _position - (_preRollFilled - first));
+    emit(_preRoll.data(), _preRollFilled - first, _position);
+    _preRollPos = 0;
+    _preRollFilled = 0;
+}
+
+void VADGate::emit(const int16_t *samples, size_t count, uint64_t end) {
+    if (count == 0) {
+        return;
+    }
+    _stats.passedSamples += count;
+    if (_handler) {
+        _handler(samples, count, end);
+    }
+}
+
+void VADGate::reset() {
+    _open = false;
+    _onsetCount = 0;
+    _hangoverLeft = 0;
+    _frameFilled = 0;
+    _preRollPos = 0;
+    _preRollFilled = 0;
+}
+
+VADGateStats VADGate::stats() const {
+    VADGateStats s = _stats;
+    s.noiseFloorDbfs = _noiseFloorDbfs;
+    return s;
+}
+
+} // namespace embla
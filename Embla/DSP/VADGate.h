@@ -0,0 +1,122 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Cheap energy and zero-crossing voice activity gate.
+
+    Sits in front of the hotword detector so that the (comparatively
+    expensive) detection pipeline only runs while there is plausible
+    speech. Audio is analysed in short frames against an adaptive noise
+    floor. While the gate is closed, frames are kept in a pre-roll
+    buffer which is emitted ahead of the first open frame, so the start
+    of an utterance isn't lost to the gate's reaction time. The gate
+    stays open for a hangover period after the last speech frame.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace embla {
+
+struct VADGateConfig {
+    int sampleRate = 16000;
+    int frameMs = 10;
+    int preRollMs = 500;            // Audio emitted ahead of the frame that opened the gate
+    int hangoverMs = 700;           // How long the gate stays open after the last speech frame
+    int onsetFrames = 2;            // Consecutive speech frames required to open the gate
+    float thresholdDb = 9.0f;       // Required energy above the noise floor
+    float minEnergyDbfs = -60.0f;   // Frames quieter than this are never speech
+    float noiseFloorRiseDbPerSec = 2.0f; // How fast the noise floor follows louder ambience
+    float minZeroCrossingRate = 0.01f;  // Below this: low frequency rumble, hum, handling noise
+    float maxZeroCrossingRate = 0.45f;  // Above this: clicks and broadband noise
+};
+
+struct VADGateStats {
+    uint64_t frames = 0;
+    uint64_t speechFrames = 0;
+    uint64_t openings = 0;
+    uint64_t samples = 0;           // Total samples pushed
+    uint64_t passedSamples = 0;     // Samples emitted, including pre-roll
+    float noiseFloorDbfs = 0.0f;
+
+    // Fraction of audio passed on to the detector
+    double dutyCycle() const { return samples ? (double)passedSamples / samples : 0.0; }
+};
+
+class VADGate {
+public:
+    // End is the input position just past the emitted samples, counted in
+    // samples pushed since the gate was created
+    typedef std::function<void(const int16_t *samples, size_t count, uint64_t end)> SampleHandler;
+    typedef std::function<void(bool open)> StateHandler;
+
+    // The state handler is optional and is called before the pre-roll is
+    // emitted when the gate opens, and after the last frame when it closes.
+    VADGate(const VADGateConfig &config, SampleHandler handler, StateHandler stateHandler = nullptr);
+
+    // Analyse samples, emitting those that pass the gate.
+    void push(const int16_t *samples, size_t count);
+
+    // Close the gate and discard buffered audio and onset/hangover state.
+    // The noise floor estimate is kept.
+    void reset();
+
+    bool isOpen() const { return _open; }
+    VADGateStats stats() const;
+
+    // Frame energy (dBFS) and zero-crossing rate (crossings per sample)
+    static void analyzeFrame(const int16_t *samples, size_t count, float *scratch, float &energyDbfs,
+                             float &zeroCrossingRate);
+
+private:
+    void processFrame();
+    bool isSpeech(float energyDbfs, float zeroCrossingRate) const;
+    void appendPreRoll(const int16_t *samples, size_t count);
+    void emitPreRoll();
+    void emit(const int16_t *samples, size_t count, uint64_t end);
+    void setOpen(bool open);
+
+    VADGateConfig _config;
+    SampleHandler _handler;
+    StateHandler _stateHandler;
+
+    // Frame currently being filled
+    std::vector<int16_t> _frame;
+    std::vector<float> _scratch;
+    size_t _frameFilled = 0;
+    uint64_t _position = 0;         // Samples pushed, never reset
+
+    // Circular pre-roll buffer, only written while the gate is closed
+    std::vector<int16_t> _preRoll;
+    size_t _preRollPos = 0;
+    size_t _preRollFilled = 0;
+
+    bool _open = false;
+    int _onsetCount = 0;
+    int _hangoverFrames = 0;
+    int _hangoverLeft = 0;
+    float _noiseFloorDbfs;
+    float _noiseFloorRisePerFrame;
+
+    VADGateStats _stats;
+};
+
+} // namespace embla
@@ -19,10 +19,22 @@
 
 #import <Foundation/Foundation.h>
 
+#ifdef __cplusplus
+namespace embla {
+class EchoReference;
+}
+#endif
+
 @protocol AudioRecordingServiceDelegate <NSObject>
 
 - (void)processSampleData:(NSData *)data;
 
+@optional
+// Sample data is delivered on the main thread unless the delegate
+// implements this and returns YES, in which case it is delivered on
+// the recording service's private consumer queue.
+- (BOOL)processesSampleDataOffMainThread;
+
 @end
 
 @interface AudioRecordingService : NSObject
@@ -34,6 +46,33 @@
 - (OSStatus)prepare;
 - (OSStatus)prepareWithSampleRate:(double)sampleRate;
 - (OSStatus)start;
+// Audio captured before stopping is still handed to the delegate, not dropped
 - (OSStatus)stop;
+- (BOOL)isRunning;
+
+// Total number of samples recorded so far. Can be passed to
+// setDelegate:replayingFromSample: to pick up from this point.
+- (uint64_t)samplePosition;
+
+// Sample position just past the audio being delivered. Only meaningful to
+// a delegate that processes sample data off the main thread, from within
+// processSampleData:, where it tells the delegate where its audio lies.
+- (uint64_t)deliveredSamplePosition;
+
+// Make delegate the recipient of audio, first replaying recent audio
+// recorded since the given sample position (as much of it as is still
+// held in the history) and then continuing with live audio.
+- (void)setDelegate:(id<AudioRecordingServiceDelegate>)delegate replayingFromSample:(uint64_t)position;
+
+// Leave the audio recorded while a sound starting to play now reaches the
+// microphone out of what's delivered to the delegate, e.g. an earcon that
+// speech recognition shouldn't hear. It's still kept in the history.
+- (void)skipSoundPlayedNow:(NSTimeInterval)duration;
+
+#ifdef __cplusplus
+// Audio played while recording is written here, so that its echo can be
+// removed from the recorded audio before it reaches the delegate
+- (embla::EchoReference *)echoReference;
+#endif
 
 @end
@@ -0,0 +1,548 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ * Adapted from Apache 2-licensed code Copyright (C) 2016 Google Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Singleton wrapper class for Core Audio recording sessions.
+ 
+    The real-time recording callback renders into a preallocated buffer
+    and pushes the samples into a lock-free ring buffer. A consumer on
+    a separate serial queue drains the ring buffer and hands the audio
+    over to the delegate, so the audio thread never allocates or blocks.
+ 
+    The consumer also keeps a history of the last few seconds of audio.
+    A new delegate can take over from a previous one and have the audio
+    recorded since a given sample position replayed to it first, so that
+    capture doesn't need to stop while ownership changes hands.
+ 
+    Audio played while recording, e.g. an answer that can be interrupted
+    with the hotword, is written to an echo reference by the player. The
+    recording callback stamps the recorded audio with the time it reached
+    the microphone, so the reference can be lined up with it, and while
+    there is played audio the consumer removes its echo before anything
+    else sees the recorded audio.
+*/
+
+#import <AVFoundation/AVFoundation.h>
+#import "AudioRecordingService.h"
+#import "AudioRingBuffer.h"
+#import "AudioHistoryBuffer.h"
+#import "EchoCanceller.h"
+#import "Common.h"
+#import <mach/mach_time.h>
+#import <atomic>
+
+// Largest number of frames we will ever be asked to render in one callback
+#define REC_MAX_FRAMES_PER_SLICE    4096
+// Ring buffer holds this many seconds of audio before the producer starts dropping
+#define REC_RING_BUFFER_SECONDS     2
+// How often the consumer drains the ring buffer
+#define REC_DRAIN_INTERVAL_MS       10
+// Seconds of recent audio kept for replay to a new delegate
+#define REC_HISTORY_SECONDS         5
+// Replayed history is delivered in blocks of this size
+#define REC_REPLAY_BLOCK_MS         100
+// Skipped sounds are taken to echo around the room for this long
+#define REC_SKIP_TAIL_SECONDS       0.05
+// Echo cancellation. The filter covers the echo of a room as well as the
+// lead of the reference, which absorbs error in the reported latencies.
+#define REC_ECHO_BLOCK_SIZE         128
+#define REC_ECHO_FILTER_LENGTH      2048
+#define REC_ECHO_REFERENCE_SECONDS  2.0
+#define REC_ECHO_LEAD_SECONDS       0.03
+
+@interface AudioRecordingService ()
+{
+    AudioComponentInstance remoteIOUnit;
+    BOOL audioComponentInitialized;
+    
+    // Preallocated storage used on the real-time audio thread
+    AudioBufferList renderBufferList;
+    int16_t *renderBuffer;
+    std::unique_ptr<embla::AudioRingBuffer<int16_t>> ringBuffer;
+    
+    // Consumer side
+    dispatch_queue_t consumerQueue;
+    dispatch_source_t drainTimer;
+    int16_t *drainBuffer;
+    size_t drainBufferSize;
+    std::unique_ptr<embla::AudioHistoryBuffer<int16_t>> history;
+    std::atomic<uint64_t> historyPosition;
+    uint64_t deliveredPosition; // Consumer queue only
+    // Span of the history not delivered, see skipSoundPlayedNow:
+    uint64_t skipStart;
+    uint64_t skipEnd;
+    BOOL running;
+    
+    // Echo cancellation. The recording callback counts the samples it has
+    // captured since start, the first of which lands at captureStart in
+    // the history. Both are set before the unit starts.
+    std::unique_ptr<embla::EchoCanceller> echoCanceller;
+    std::unique_ptr<embla::EchoReference> echoReference;
+    int16_t *farBuffer;
+    BOOL cancellingEcho;
+    uint64_t captureStart;
+    uint64_t capturedSamples;
+    double inputLatency;
+    double hostTimeScale;
+}
+@end
+
+@implementation AudioRecordingService
+
++ (instancetype)sharedInstance {
+    static AudioRecordingService *instance = nil;
+    if (!instance) {
+        instance = [self new];
+    }
+    return instance;
+}
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        renderBuffer = (int16_t *)calloc(REC_MAX_FRAMES_PER_SLICE, sizeof(int16_t));
+        renderBufferList.mNumberBuffers = 1;
+        renderBufferList.mBuffers[0].mNumberChannels = 1;
+        renderBufferList.mBuffers[0].mDataByteSize = REC_MAX_FRAMES_PER_SLICE * sizeof(int16_t);
+        renderBufferList.mBuffers[0].mData = renderBuffer;
+        
+        size_t capacity = (size_t)(REC_SAMPLE_RATE * REC_RING_BUFFER_SECONDS);
+        ringBuffer.reset(new embla::AudioRingBuffer<int16_t>(capacity));
+        
+        drainBufferSize = ringBuffer->capacity();
+        drainBuffer = (int16_t *)calloc(drainBufferSize, sizeof(int16_t));
+        consumerQueue = dispatch_queue_create("is.mideind.Embla.audioconsumer", DISPATCH_QUEUE_SERIAL);
+        
+        history.reset(new embla::AudioHistoryBuffer<int16_t>((size_t)(REC_SAMPLE_RATE * REC_HISTORY_SECONDS)));
+        historyPosition = 0;
+        
+        embla::EchoCancellerConfig config;
+        config.blockSize = REC_ECHO_BLOCK_SIZE;
+        config.filterLength = REC_ECHO_FILTER_LENGTH;
+        echoCanceller.reset(new embla::EchoCanceller(config));
+        echoReference.reset(new embla::EchoReference((int)REC_SAMPLE_RATE, REC_ECHO_REFERENCE_SECONDS,
+                                                     REC_ECHO_LEAD_SECONDS));
+        farBuffer = (int16_t *)calloc(drainBufferSize, sizeof(int16_t));
+        
+        mach_timebase_info_data_t timebase;
+        mach_timebase_info(&timebase);
+        hostTimeScale = (double)timebase.numer / timebase.denom / NSEC_PER_SEC;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    if (remoteIOUnit) {
+        AudioComponentInstanceDispose(remoteIOUnit);
+    }
+    if (drainTimer) {
+        dispatch_source_cancel(drainTimer);
+    }
+    free(renderBuffer);
+    free(drainBuffer);
+    free(farBuffer);
+}
+
+#pragma mark - CoreAudio Callback
+
+// Generate clean error message using 4 char codes if appropriate
+static OSStatus CheckError(OSStatus error, const char *operation) {
+    if (error == noErr) {
+        return error;
+    }
+    char errorString[20];
+    // See if it appears to be a 4-char-code
+    *(UInt32 *)(errorString + 1) = CFSwapInt32HostToBig(error);
+    if (isprint(errorString[1]) && isprint(errorString[2]) && isprint(errorString[3]) && isprint(errorString[4])) {
+        errorString[0] = errorString[5] = '\'';
+        errorString[6] = '\0';
+    } else {
+        // No, format it as an integer
+        sprintf(errorString, "%d", (int)error);
+    }
+    fprintf(stderr, "Error: %s (%s)\n", operation, errorString);
+    return error;
+}
+
+// Callback invoked when audio data is received from the input source.
+// Runs on the real-time audio thread: no allocation, no locks, no Obj-C messaging.
+static OSStatus RecordingCallback(void *inRefCon,
+                                  AudioUnitRenderActionFlags *ioActionFlags,
+                                  const AudioTimeStamp *inTimeStamp,
+                                  UInt32 inBusNumber,
+                                  UInt32 inNumberFrames,
+                                  AudioBufferList *ioData) {
+    AudioRecordingService *audioController = (__bridge AudioRecordingService *)inRefCon;
+    
+    if (inNumberFrames > REC_MAX_FRAMES_PER_SLICE) {
+        return kAudioUnitErr_TooManyFramesToProcess;
+    }
+    
+    // Render into our preallocated buffer
+    AudioBufferList *bufferList = &audioController->renderBufferList;
+    bufferList->mBuffers[0].mDataByteSize = inNumberFrames * 2; // 16-bit audio
+    bufferList->mBuffers[0].mData = audioController->renderBuffer;
+    
+    // Get the recorded samples
+    OSStatus status = AudioUnitRender(audioController->remoteIOUnit, ioActionFlags, inTimeStamp, inBusNumber,
+                                      inNumberFrames, bufferList);
+    if (status != noErr) {
+        return status;
+    }
+    
+    // Note when these samples reached the microphone, for lining played
+    // audio up with its echo. Dropped samples would throw this off, but
+    // the reference catches up within a few blocks.
+    if (inTimeStamp->mFlags & kAudioTimeStampHostTimeValid) {
+        double time = inTimeStamp->mHostTime * audioController->hostTimeScale - audioController->inputLatency;
+        audioController->echoReference->setRecordingTime(audioController->captureStart +
+                                                         audioController->capturedSamples, time);
+    }
+    audioController->capturedSamples += inNumberFrames;
+    
+    // Hand samples over to the consumer queue. If it has fallen behind,
+    // the ring buffer drops the overflow and keeps count.
+    audioController->ringBuffer->write((const int16_t *)bufferList->mBuffers[0].mData,
+                                       bufferList->mBuffers[0].mDataByteSize / 2);
+    
+    return noErr;
+}
+
+#pragma mark - Consumer
+
+// Drain ring buffer and deliver whatever has accumulated to the delegate.
+// Always invoked on the consumer queue.
+- (void)_drainRingBuffer {
+    // While played audio may echo, only whole blocks are taken so that
+    // all of them go through the echo canceller
+    uint64_t position = history->position();
+    BOOL cancelling = echoReference->activeAt(position, echoCanceller->filterLength());
+    size_t count = drainBufferSize;
+    if (cancelling) {
+        size_t blockSize = echoCanceller->blockSize();
+        count = ringBuffer->availableToRead() / blockSize * blockSize;
+    }
+    count = ringBuffer->read(drainBuffer, count);
+    if (count == 0) {
+        return;
+    }
+    [self _cancelEcho:cancelling count:count position:position];
+    history->append(drainBuffer, count);
+    historyPosition = history->position();
+    
+    NSData *data = [NSData dataWithBytes:drainBuffer length:count * sizeof(int16_t)];
+    [self _deliverSampleData:data end:historyPosition];
+}
+
+- (void)_cancelEcho:(BOOL)cancelling count:(size_t)count position:(uint64_t)position {
+    if (cancelling) {
+        if (!cancellingEcho) {
+            // Keep the echo path learnt during earlier playback
+            echoCanceller->restart();
+        }
+        echoReference->read(position, farBuffer, count);
+        echoCanceller->process(drainBuffer, farBuffer, count);
+    } else if (cancellingEcho) {
+        embla::EchoCancellerStats stats = echoCanceller->stats();
+        embla::EchoReferenceStats referenceStats = echoReference->stats();
+        DLog(@"Echo cancellation: %.1f dB ERLE, %llu foreground updates, %llu background resets, "
+             "%llu reference resyncs",
+             stats.erleDb, stats.foregroundUpdates, stats.backgroundResets, referenceStats.resyncs);
+    }
+    cancellingEcho = cancelling;
+}
+
+// Deliver what's either side of the span being skipped
+- (void)_deliverSampleData:(NSData *)data end:(uint64_t)end {
+    uint64_t start = end - [data length] / sizeof(int16_t);
+    if (start >= skipEnd || end <= skipStart) {
+        [self _sendSampleData:data end:end];
+        return;
+    }
+    if (start < skipStart) {
+        NSRange before = NSMakeRange(0, (skipStart - start) * sizeof(int16_t));
+        [self _sendSampleData:[data subdataWithRange:before] end:skipStart];
+    }
+    if (end > skipEnd) {
+        NSRange after = NSMakeRange((skipEnd - start) * sizeof(int16_t), (end - skipEnd) * sizeof(int16_t));
+        [self _sendSampleData:[data subdataWithRange:after] end:end];
+    }
+}
+
+- (void)_sendSampleData:(NSData *)data end:(uint64_t)end {
+    deliveredPosition = end;
+    id<AudioRecordingServiceDelegate> delegate = self.delegate;
+    if ([delegate respondsToSelector:@selector(processesSampleDataOffMainThread)] &&
+        [delegate processesSampleDataOffMainThread]) {
+        [delegate processSampleData:data];
+        return;
+    }
+    
+    // Notify delegate on main thread
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [self.delegate processSampleData:data];
+    });
+}
+
+- (uint64_t)samplePosition {
+    return historyPosition;
+}
+
+- (uint64_t)deliveredSamplePosition {
+    return deliveredPosition;
+}
+
+- (void)skipSoundPlayedNow:(NSTimeInterval)duration {
+    // The sound reaches the microphone once the output latency has passed,
+    // and the history up to the input latency and a drain or so later
+    AVAudioSession *session = [AVAudioSession sharedInstance];
+    double earliest = session.IOBufferDuration + session.outputLatency;
+    double latest = earliest + duration + inputLatency + session.IOBufferDuration + REC_DRAIN_INTERVAL_MS / 1000.0 +
+        REC_SKIP_TAIL_SECONDS;
+    dispatch_sync(consumerQueue, ^{
+        uint64_t now = self->history->position();
+        self->skipStart = now + (uint64_t)(earliest * REC_SAMPLE_RATE);
+        self->skipEnd = now + (uint64_t)(latest * REC_SAMPLE_RATE);
+        DLog(@"Skipping %.2f seconds of recorded audio for a sound played", (latest - earliest));
+    });
+}
+
+- (embla::EchoReference *)echoReference {
+    return echoReference.get();
+}
+
+- (void)setDelegate:(id<AudioRecordingServiceDelegate>)delegate replayingFromSample:(uint64_t)position {
+    // Switch delegates on the consumer queue, between two drains, so the
+    // new delegate gets the replayed history followed by live audio with
+    // no gap or overlap in between.
+    dispatch_sync(consumerQueue, ^{
+        [self _drainRingBuffer];
+        self.delegate = delegate;
+        
+        size_t available = self->history->availableSince(position);
+        if (available == 0) {
+            return;
+        }
+        DLog(@"Replaying %.2f seconds of recorded audio to new delegate", available / REC_SAMPLE_RATE);
+        uint64_t pos = self->history->position() - available;
+        size_t blockSize = (size_t)(REC_SAMPLE_RATE * REC_REPLAY_BLOCK_MS / 1000);
+        NSMutableData *block = [NSMutableData dataWithLength:blockSize * sizeof(int16_t)];
+        while (available > 0) {
+            size_t count = self->history->copySince(pos, (int16_t *)[block mutableBytes], blockSize);
+            pos += count;
+            [self _deliverSampleData:[NSData dataWithBytes:[block bytes] length:count * sizeof(int16_t)] end:pos];
+            available -= count;
+        }
+    });
+}
+
+- (void)_startDrainTimer {
+    if (drainTimer) {
+        return;
+    }
+    // Anything left over from a previous recording session is stale, and
+    // the next sample captured is the next in the history
+    dispatch_sync(consumerQueue, ^{
+        self->ringBuffer->discard();
+        self->captureStart = self->history->position();
+        self->capturedSamples = 0;
+    });
+    inputLatency = [AVAudioSession sharedInstance].inputLatency;
+    drainTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, consumerQueue);
+    uint64_t interval = REC_DRAIN_INTERVAL_MS * NSEC_PER_MSEC;
+    dispatch_source_set_timer(drainTimer, dispatch_time(DISPATCH_TIME_NOW, interval), interval, interval / 10);
+    __weak AudioRecordingService *weakSelf = self;
+    dispatch_source_set_event_handler(drainTimer, ^{
+        [weakSelf _drainRingBuffer];
+    });
+    dispatch_resume(drainTimer);
+}
+
+- (void)_stopDrainTimer {
+    if (!drainTimer) {
+        return;
+    }
+    dispatch_source_cancel(drainTimer);
+    drainTimer = nil;
+    // The unit has stopped, so one last drain hands over everything that
+    // was captured. Only a partial block of echo cancelled audio is left,
+    // to be discarded on the next start.
+    dispatch_sync(consumerQueue, ^{
+        [self _drainRingBuffer];
+    });
+    echoReference->clearRecordingTime();
+    uint64_t dropped = ringBuffer->droppedCount();
+    if (dropped) {
+        DLog(@"Audio consumer fell behind, %llu samples dropped in total", (unsigned long long)dropped);
+    }
+}
+
+#pragma mark - Initialization
+
+- (OSStatus)prepare {
+    return [self prepareWithSampleRate:REC_SAMPLE_RATE];
+}
+
+// Configure audio recording session
+- (OSStatus)prepareWithSampleRate:(double)specifiedSampleRate {
+    OSStatus status = noErr;
+    
+    AVAudioSession *session = [AVAudioSession sharedInstance];
+    
+    // Set up audio session for recording and playback.
+    [session setMode:AVAudioSessionModeDefault error:nil];
+    NSError *error;
+    AVAudioSessionCategoryOptions opts = \
+    AVAudioSessionCategoryOptionDefaultToSpeaker
+    |AVAudioSessionCategoryOptionAllowBluetooth
+    |AVAudioSessionCategoryOptionAllowBluetoothA2DP;
+    
+    BOOL ok = [session setCategory:AVAudioSessionCategoryPlayAndRecord
+                       withOptions:opts
+                             error:&error];
+    if (!ok) {
+        DLog(@"Failed to change audio session category: %@", [error localizedDescription]);
+    }
+    [[AVAudioSession sharedInstance] overrideOutputAudioPort:AVAudioSessionPortOverrideNone error:nil];
+    
+    // Buffer configuration breaks audio via Bluetooth and should not be set!
+    // [session setPreferredIOBufferDuration:10 error:&error];
+    
+    double sampleRate = session.sampleRate;
+    DLog(@"Hardware sample rate = %f, using specified rate = %f", sampleRate, specifiedSampleRate);
+    sampleRate = specifiedSampleRate;
+    if (!audioComponentInitialized) {
+        audioComponentInitialized = YES;
+        // Describe the RemoteIO unit
+        AudioComponentDescription audioComponentDescription;
+        audioComponentDescription.componentType = kAudioUnitType_Output;
+        audioComponentDescription.componentSubType = kAudioUnitSubType_RemoteIO;
+        audioComponentDescription.componentManufacturer = kAudioUnitManufacturer_Apple;
+        audioComponentDescription.componentFlags = 0;
+        audioComponentDescription.componentFlagsMask = 0;
+        
+        // Get the RemoteIO unit
+        AudioComponent remoteIOComponent = AudioComponentFindNext(NULL, &audioComponentDescription);
+        status = AudioComponentInstanceNew(remoteIOComponent, &(self->remoteIOUnit));
+        if (CheckError(status, "Couldn't get RemoteIO unit instance")) {
+            self->remoteIOUnit = NULL;
+            return status;
+        }
+    }
+    
+    UInt32 oneFlag = 1;
+//    AudioUnitElement bus0 = 0;
+    AudioUnitElement bus1 = 1;
+    
+    // Configure the RemoteIO unit for input
+    status = AudioUnitSetProperty(self->remoteIOUnit, kAudioOutputUnitProperty_EnableIO, kAudioUnitScope_Input, bus1,
+                                  &oneFlag, sizeof(oneFlag));
+    if (CheckError(status, "Couldn't enable RemoteIO input")) {
+        return status;
+    }
+    
+    AudioStreamBasicDescription asbd;
+    memset(&asbd, 0, sizeof(asbd));
+    asbd.mSampleRate = sampleRate;
+    asbd.mFormatID = kAudioFormatLinearPCM;
+    asbd.mFormatFlags = kAudioFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked;
+    asbd.mBytesPerPacket = 2;
+    asbd.mFramesPerPacket = 1;
+    asbd.mBytesPerFrame = 2;
+    asbd.mChannelsPerFrame = 1;
+    asbd.mBitsPerChannel = 16;
+    
+    // Set format for output (bus 0) on the RemoteIO's input scope
+//    status = AudioUnitSetProperty(self->remoteIOUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, bus0,
+//                                  &asbd, sizeof(asbd));
+//    if (CheckError(status, "Couldn't set the ASBD for RemoteIO on input scope/bus 0")) {
+//        return status;
+//    }
+    
+    // Set format for mic input (bus 1) on RemoteIO's output scope
+    status = AudioUnitSetProperty(self->remoteIOUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, bus1,
+                                  &asbd, sizeof(asbd));
+    if (CheckError(status, "Couldn't set the ASBD for RemoteIO on output scope/bus 1")) {
+        return status;
+    }
+    
+    // Make sure the render callback is never asked for more frames than we've preallocated.
+    // This fails harmlessly if the unit has already been initialized by a previous call.
+    UInt32 maxFrames = REC_MAX_FRAMES_PER_SLICE;
+    AudioUnitSetProperty(self->remoteIOUnit, kAudioUnitProperty_MaximumFramesPerSlice, kAudioUnitScope_Global,
+                         0, &maxFrames, sizeof(maxFrames));
+    
+    // Set the recording callback
+    AURenderCallbackStruct callbackStruct;
+    callbackStruct.inputProc = RecordingCallback;
+    callbackStruct.inputProcRefCon = (__bridge void *)self;
+    status = AudioUnitSetProperty(self->remoteIOUnit, kAudioOutputUnitProperty_SetInputCallback, kAudioUnitScope_Global,
+                                  bus1, &callbackStruct, sizeof(callbackStruct));
+    if (CheckError(status, "Couldn't set RemoteIO's render callback on bus 0")) {
+        return status;
+    }
+    
+    // Initialize the RemoteIO unit
+    status = AudioUnitInitialize(self->remoteIOUnit);
+    if (CheckError(status, "Couldn't initialize the RemoteIO unit")) {
+        return status;
+    }
+    
+    return status;
+}
+
+#pragma mark -
+
+- (BOOL)isRunning {
+    return running;
+}
+
+// Start recording session. Does nothing if already running.
+- (OSStatus)start {
+    if (self->remoteIOUnit) {
+        if (running) {
+            return noErr;
+        }
+        // The timer goes first so that it's set up before the first sample
+        // arrives, and is stopped again if the unit doesn't start
+        [self _startDrainTimer];
+        OSStatus status = AudioOutputUnitStart(self->remoteIOUnit);
+        running = (status == noErr);
+        if (!running) {
+            DLog(@"Unable to start audio unit: %d", (int)status);
+            [self _stopDrainTimer];
+        }
+        return status;
+    }
+    return -1;
+}
+
+// Stop recording session. Audio captured up to this point is still added
+// to the history and delivered to the delegate.
+- (OSStatus)stop {
+    if (self->remoteIOUnit) {
+        OSStatus status = AudioOutputUnitStop(self->remoteIOUnit);
+        [self _stopDrainTimer];
+        running = NO;
+        return status;
+    }
+    return -1;
+}
+
+@end
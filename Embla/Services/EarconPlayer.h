@@ -16,23 +16,21 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
-#import "UIImage+Additions.h"
+#import <Foundation/Foundation.h>
+#import "VoiceAssets.h"
 
-@implementation UIImage (Additions)
+@interface EarconPlayer : NSObject
 
-+ (UIImage*)imageWithImage:(UIImage *)sourceImage scaledToWidth:(float)width {
-    float oldWidth = sourceImage.size.width;
-    float scaleFactor = width / oldWidth;
-    
-    float newHeight = sourceImage.size.height * scaleFactor;
-    float newWidth = oldWidth * scaleFactor;
-    
-    UIGraphicsBeginImageContext(CGSizeMake(newWidth, newHeight));
-    [sourceImage drawInRect:CGRectMake(0, 0, newWidth, newHeight)];
-    UIImage *newImage = UIGraphicsGetImageFromCurrentImageContext();
-    UIGraphicsEndImageContext();
-    
-    return newImage;
-}
++ (instancetype)sharedInstance;
+
+// Start a UI sound or voice clip with the next output buffer, always at
+// 1.0x, as changing speed by resampling would change the pitch too. Voice
+// clips at another SpeechSpeed are left to AVAudioPlayer, which keeps the
+// pitch. Returns NO if the clip isn't in the pool or audio output can't
+// be started, in which case it isn't played.
+- (BOOL)playClip:(VoiceClip)clip;
+
+// Silence anything playing
+- (void)stop;
 
 @end
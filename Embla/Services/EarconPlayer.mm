@@ -0,0 +1,196 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Plays UI sounds through an AVAudioEngine source node which renders
+    from an EarconMixer, so a sound starts with the next output buffer
+    instead of waiting for an AVAudioPlayer to parse the WAV header and
+    set itself up. The engine keeps running between sounds, as they come
+    in bursts during a session, and is stopped once nothing has played
+    for a while so audio output isn't kept awake in between sessions.
+    The UI sounds, and the connection and error clips of every voice,
+    are copied from the voice asset pack into the mixer's pool once,
+    when the player is created. See EarconMixer.h.
+*/
+
+#import "EarconPlayer.h"
+#import "Common.h"
+#import "EarconMixer.h"
+#import <AVFoundation/AVFoundation.h>
+#import <memory>
+#import <unordered_map>
+
+// Used if the audio session doesn't report a sample rate
+#define EARCON_DEFAULT_SAMPLE_RATE  48000
+#define EARCON_MAX_VOICES           4
+#define EARCON_CHANNELS             2
+// Seconds without a sound after which the engine is stopped
+#define EARCON_IDLE_STOP_SECONDS    10.0
+
+// Clips copied into the pool
+static const VoiceClip kEarconClips[] = {
+    VoiceClipRecBegin, VoiceClipRecCancel, VoiceClipRecConfirm, VoiceClipConn, VoiceClipErr
+};
+
+@interface EarconPlayer ()
+{
+    std::unique_ptr<embla::EarconMixer> mixer;
+    // Mixer clip IDs by the clip's location in the voice asset pack
+    std::unordered_map<const uint8_t *, int> clipIDs;
+    AVAudioEngine *engine;
+    AVAudioSourceNode *sourceNode;
+    // Incremented on each idle check scheduled, so only the last one stops the engine
+    NSUInteger idleCheck;
+}
+@end
+
+@implementation EarconPlayer
+
++ (instancetype)sharedInstance {
+    static EarconPlayer *instance = nil;
+    if (!instance) {
+        instance = [self new];
+    }
+    return instance;
+}
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        double sampleRate = [[AVAudioSession sharedInstance] sampleRate];
+        if (sampleRate <= 0) {
+            sampleRate = EARCON_DEFAULT_SAMPLE_RATE;
+        }
+        mixer.reset(new embla::EarconMixer((uint32_t)sampleRate, EARCON_MAX_VOICES));
+        [self _fillPool];
+        [self _setUpEngine:sampleRate];
+        if ([self _start]) {
+            [self _scheduleIdleStop];
+        }
+        
+        // Output stops when e.g. the route or the session category changes
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(_configurationChanged:)
+                                                     name:AVAudioEngineConfigurationChangeNotification
+                                                   object:engine];
+    }
+    return self;
+}
+
+- (void)_fillPool {
+    const embla::VoiceAssetPack &pack = [[VoiceAssets sharedInstance] pack];
+    for (size_t v = 0; v < pack.voiceCount(); v++) {
+        for (VoiceClip clip : kEarconClips) {
+            const embla::VoiceClipData *data = pack.clip(v, (embla::VoiceClip)clip);
+            // UI sounds are shared by all voices, so only added once
+            if (data == nullptr || clipIDs.count(data->wav)) {
+                continue;
+            }
+            int clipID = mixer->addClip(data->samples, data->frames, data->channels, data->sampleRate);
+            if (clipID >= 0) {
+                clipIDs[data->wav] = clipID;
+            }
+        }
+    }
+    DLog(@"Earcon pool: %zu clips, %zu bytes", mixer->clipCount(), mixer->poolSize() * sizeof(int16_t));
+}
+
+- (void)_setUpEngine:(double)sampleRate {
+    engine = [AVAudioEngine new];
+    AVAudioFormat *format = [[AVAudioFormat alloc] initStandardFormatWithSampleRate:sampleRate
+                                                                           channels:EARCON_CHANNELS];
+    // The render block runs on the audio thread, so it only touches the mixer
+    embla::EarconMixer *m = mixer.get();
+    sourceNode = [[AVAudioSourceNode alloc] initWithFormat:format
+                                               renderBlock:^OSStatus(BOOL *isSilence,
+                                                                     const AudioTimeStamp *timestamp,
+                                                                     AVAudioFrameCount frameCount,
+                                                                     AudioBufferList *outputData) {
+        float *outputs[EARCON_CHANNELS];
+        size_t channels = MIN(outputData->mNumberBuffers, EARCON_CHANNELS);
+        for (size_t c = 0; c < channels; c++) {
+            outputs[c] = (float *)outputData->mBuffers[c].mData;
+        }
+        *isSilence = !m->render(outputs, channels, frameCount);
+        return noErr;
+    }];
+    [engine attachNode:sourceNode];
+    [engine connect:sourceNode to:[engine mainMixerNode] format:format];
+}
+
+- (BOOL)_start {
+    if ([engine isRunning]) {
+        return YES;
+    }
+    NSError *err;
+    [engine prepare];
+    if (![engine startAndReturnError:&err]) {
+        DLog(@"Unable to start earcon output: %@", [err localizedDescription]);
+        return NO;
+    }
+    return YES;
+}
+
+- (void)_scheduleIdleStop {
+    NSUInteger check = ++idleCheck;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(EARCON_IDLE_STOP_SECONDS * NSEC_PER_SEC)),
+                   dispatch_get_main_queue(), ^{
+        if (check != self->idleCheck || ![self->engine isRunning]) {
+            return;
+        }
+        if (!self->mixer->idle()) {
+            [self _scheduleIdleStop];
+            return;
+        }
+        DLog(@"Stopping idle earcon output");
+        [self->engine stop];
+    });
+}
+
+- (void)_configurationChanged:(NSNotification *)notification {
+    dispatch_async(dispatch_get_main_queue(), ^{
+        // Output stopped while idle is started again by the next sound
+        if (self->mixer->idle()) {
+            return;
+        }
+        DLog(@"Audio configuration changed, restarting earcon output");
+        [self _start];
+    });
+}
+
+#pragma mark -
+
+- (BOOL)playClip:(VoiceClip)clip {
+    const embla::VoiceClipData *data = [[VoiceAssets sharedInstance] clipData:clip];
+    auto it = data ? clipIDs.find(data->wav) : clipIDs.end();
+    if (it == clipIDs.end() || ![self _start] || !mixer->trigger(it->second)) {
+        return NO;
+    }
+    [self _scheduleIdleStop];
+    return YES;
+}
+
+- (void)stop {
+    // Nothing renders while the engine is stopped, so there's nothing to
+    // silence and the command would only wait in the queue
+    if ([engine isRunning]) {
+        mixer->stopAll();
+    }
+}
+
+@end
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ChunkAggregator.h"
+#include <algorithm>
+#include <cstring>
+
+namespace embla {
+
+static size_t SamplesForMs(int sampleRate, int ms) {
+    return (size_t)std::max(1, sampleRate * ms / 1000);
+}
+
+ChunkAggregator::ChunkAggregator(const ChunkAggregatorConfig &config, ChunkHandler handler,
+                                 PowerStateProvider powerStateProvider)
+    : _config(config), _handler(std::move(handler)), _powerStateProvider(std::move(powerStateProvider)) {
+    int maxMs = std::max({config.normalWindowMs, config.reducedWindowMs, config.minimalWindowMs});
+    _buffer.resize(SamplesForMs(config.sampleRate, maxMs));
+    updateWindow();
+}
+
+int ChunkAggregator::windowMsForPowerState(const ChunkAggregatorConfig &config, const PowerState &state) {
+    bool lowBattery = !state.charging && state.batteryLevel >= 0.0f && state.batteryLevel < config.lowBatteryLevel;
+    if (state.lowPowerMode || lowBattery || state.thermal == ThermalState::Serious ||
+        state.thermal == ThermalState::Critical) {
+        return config.minimalWindowMs;
+    }
+    if (state.thermal == ThermalState::Fair) {
+        return config.reducedWindowMs;
+    }
+    return config.normalWindowMs;
+}
+
+void ChunkAggregator::updateWindow() {
+    int ms = _config.normalWindowMs;
+    if (_powerStateProvider) {
+        ms = windowMsForPowerState(_config, _powerStateProvider());
+    }
+    _windowMs = ms;
+    _windowSamples = std::min(SamplesForMs(_config.sampleRate, ms), _buffer.size());
+    _samplesSincePowerPoll = 0;
+}
+
+void ChunkAggregator::push(const int16_t *samples, size_t count, uint64_t end) {
+    _stats.inputBlocks++;
+    _stats.samples += count;
+
+    while (count > 0) {
+        size_t n = std::min(count, _windowSamples - _filled);
+        memcpy(_buffer.data() + _filled, samples, n * sizeof(int16_t));
+        _filled += n;
+        _samplesSincePowerPoll += n;
+        samples += n;
+        count -= n;
+        _end = end - count;
+        if (_filled >= _windowSamples) {
+            flush();
+            // Window size only changes on a window boundary, which blocks
+            // of arbitrary size rarely end on
+            if (_samplesSincePowerPoll >= SamplesForMs(_config.sampleRate, _config.powerPollIntervalMs)) {
+                updateWindow();
+            }
+        }
+    }
+}
+
+void ChunkAggregator::flush() {
+    if (_filled == 0) {
+        return;
+    }
+    _stats.emittedChunks++;
+    if (_handler) {
+        _handler(_buffer.data(), _filled, _end);
+    }
+    _filled = 0;
+}
+
+void ChunkAggregator::reset() {
+    _filled = 0;
+}
+
+ChunkAggregatorStats ChunkAggregator::stats() const {
+    ChunkAggregatorStats s = _stats;
+    s.windowMs = _windowMs;
+    return s;
+}
+
+} // namespace embla
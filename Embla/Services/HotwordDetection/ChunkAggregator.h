@@ -0,0 +1,116 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Batches incoming PCM into fixed-size detection windows before they
+    are handed to the hotword engine.
+
+    RemoteIO may deliver audio in blocks of only a few milliseconds, and
+    every RunDetection() call has a fixed overhead. Larger windows mean
+    fewer calls and less CPU at the cost of detection latency, so the
+    window size adapts to the device's power and thermal state, which
+    is supplied by an injectable provider.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace embla {
+
+enum class ThermalState { Nominal, Fair, Serious, Critical };
+
+struct PowerState {
+    bool lowPowerMode = false;
+    bool charging = false;
+    float batteryLevel = 1.0f; // 0.0-1.0, negative if unknown
+    ThermalState thermal = ThermalState::Nominal;
+};
+
+struct ChunkAggregatorConfig {
+    int sampleRate = 16000;
+    int normalWindowMs = 30;        // Plugged in or healthy battery, cool device
+    int reducedWindowMs = 60;       // Device warming up
+    int minimalWindowMs = 100;      // Low power mode, low battery or hot device
+    float lowBatteryLevel = 0.2f;
+    int powerPollIntervalMs = 5000; // How much audio passes between power state checks
+};
+
+struct ChunkAggregatorStats {
+    uint64_t inputBlocks = 0;       // Blocks pushed, i.e. calls we'd make without aggregation
+    uint64_t emittedChunks = 0;     // Calls actually made
+    uint64_t samples = 0;           // Total samples pushed
+    int windowMs = 0;               // Current window size
+
+    // Detector invocations per second of audio avoided by aggregating
+    double invocationsSavedPerSecond(int sampleRate) const {
+        if (samples == 0 || sampleRate <= 0) {
+            return 0.0;
+        }
+        double seconds = (double)samples / sampleRate;
+        return ((double)inputBlocks - (double)emittedChunks) / seconds;
+    }
+};
+
+class ChunkAggregator {
+public:
+    // End is the position just past the last sample of the chunk
+    typedef std::function<void(const int16_t *samples, size_t count, uint64_t end)> ChunkHandler;
+    typedef std::function<PowerState()> PowerStateProvider;
+
+    // If no power state provider is given the normal window is always used.
+    ChunkAggregator(const ChunkAggregatorConfig &config, ChunkHandler handler,
+                    PowerStateProvider powerStateProvider = nullptr);
+
+    // Append samples, emitting a chunk each time a window fills up. End is
+    // the position just past the last sample, in whatever units the caller
+    // counts its audio in, and is handed on with the chunks.
+    void push(const int16_t *samples, size_t count, uint64_t end);
+
+    // Emit whatever is buffered, even if the window isn't full.
+    void flush();
+
+    // Discard buffered samples without emitting them.
+    void reset();
+
+    int windowMs() const { return _windowMs; }
+    ChunkAggregatorStats stats() const;
+
+    // Window size policy for a given power state
+    static int windowMsForPowerState(const ChunkAggregatorConfig &config, const PowerState &state);
+
+private:
+    void updateWindow();
+
+    ChunkAggregatorConfig _config;
+    ChunkHandler _handler;
+    PowerStateProvider _powerStateProvider;
+
+    std::vector<int16_t> _buffer; // Sized for the largest window
+    size_t _filled = 0;
+    uint64_t _end = 0;              // Position just past the last buffered sample
+    size_t _windowSamples = 0;
+    int _windowMs = 0;
+    uint64_t _samplesSincePowerPoll = 0;
+
+    ChunkAggregatorStats _stats;
+};
+
+} // namespace embla
@@ -0,0 +1,155 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DetectionWorker.h"
+#include <algorithm>
+#include <cstring>
+
+namespace embla {
+
+typedef std::chrono::steady_clock Clock;
+
+static double MillisecondsBetween(Clock::time_point a, Clock::time_point b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+DetectionWorker::DetectionWorker(HotwordEngine *engine, HotwordCallback callback, size_t queueCapacity,
+                                 size_t maxBlockSamples)
+    : _engine(engine), _callback(std::move(callback)), _maxBlockSamples(maxBlockSamples),
+      _blocks(std::max<size_t>(queueCapacity, 1)) {
+    for (Block &b : _blocks) {
+        b.samples.resize(maxBlockSamples);
+    }
+    _thread = std::thread(&DetectionWorker::run, this);
+}
+
+DetectionWorker::~DetectionWorker() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cond.notify_one();
+    _thread.join();
+}
+
+bool DetectionWorker::submit(const int16_t *samples, size_t count, uint64_t end) {
+    bool ok = true;
+    while (count > 0) {
+        size_t n = std::min(count, _maxBlockSamples);
+        ok = submitBlock(samples, n, end - (count - n)) && ok;
+        samples += n;
+        count -= n;
+    }
+    return ok;
+}
+
+bool DetectionWorker::submitBlock(const int16_t *samples, size_t count, uint64_t end) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stats.submittedBlocks++;
+        if (_count == _blocks.size()) {
+            // Backpressure: the worker is behind, reject rather than queue unbounded
+            _stats.droppedBlocks++;
+            return false;
+        }
+        Block &b = _blocks[(_head + _count) % _blocks.size()];
+        memcpy(b.samples.data(), samples, count * sizeof(int16_t));
+        b.count = count;
+        b.end = end;
+        b.enqueued = Clock::now();
+        _count++;
+        _stats.queueDepth = _count;
+        _stats.maxQueueDepth = std::max(_stats.maxQueueDepth, _count);
+    }
+    _cond.notify_one();
+    return true;
+}
+
+void DetectionWorker::flush() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _head = (_head + _count) % _blocks.size();
+    _count = 0;
+    _stats.queueDepth = 0;
+}
+
+void DetectionWorker::resetEngine() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _resetRequested = true;
+}
+
+DetectionWorkerStats DetectionWorker::stats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
+
+void DetectionWorker::run() {
+    // Scratch copy so the engine runs without holding the lock
+    std::vector<int16_t> scratch(_maxBlockSamples);
+
+    for (;;) {
+        size_t count;
+        uint64_t blockEnd;
+        bool reset;
+        Clock::time_point enqueued;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [this] { return _stop || _count > 0; });
+            if (_stop) {
+                return;
+            }
+            Block &b = _blocks[_head];
+            count = b.count;
+            blockEnd = b.end;
+            enqueued = b.enqueued;
+            memcpy(scratch.data(), b.samples.data(), count * sizeof(int16_t));
+            _head = (_head + 1) % _blocks.size();
+            _count--;
+            _stats.queueDepth = _count;
+            reset = _resetRequested;
+            _resetRequested = false;
+        }
+
+        if (reset) {
+            _engine->reset();
+        }
+
+        Clock::time_point start = Clock::now();
+        int result = _engine->runDetection(scratch.data(), (int)count);
+        Clock::time_point end = Clock::now();
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            double latency = MillisecondsBetween(start, end);
+            _stats.processedBlocks++;
+            _stats.lastLatencyMs = latency;
+            _stats.maxLatencyMs = std::max(_stats.maxLatencyMs, latency);
+            _totalLatencyMs += latency;
+            _stats.meanLatencyMs = _totalLatencyMs / _stats.processedBlocks;
+            _stats.maxQueueWaitMs = std::max(_stats.maxQueueWaitMs, MillisecondsBetween(enqueued, start));
+            if (result > 0) {
+                _stats.detections++;
+            }
+        }
+
+        if (result > 0 && _callback) {
+            _callback(result, blockEnd);
+        }
+    }
+}
+
+} // namespace embla
@@ -0,0 +1,116 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Runs hotword detection on a dedicated worker thread.
+
+    Audio is submitted in PCM blocks which are copied into a fixed pool
+    of preallocated slots and queued for the worker. The queue is bounded:
+    when the worker can't keep up, new blocks are rejected and counted as
+    dropped rather than letting latency grow without limit. The hotword
+    callback is invoked on the worker thread and it is up to the caller
+    to bounce it to wherever it needs to go. Blocks carry the position of
+    their audio so the callback can tell where the hotword ended, rather
+    than when the detector got round to it.
+*/
+
+#pragma once
+
+#include "HotwordEngine.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace embla {
+
+struct DetectionWorkerStats {
+    uint64_t submittedBlocks = 0;
+    uint64_t processedBlocks = 0;
+    uint64_t droppedBlocks = 0;
+    uint64_t detections = 0;
+    size_t queueDepth = 0;          // Blocks currently waiting
+    size_t maxQueueDepth = 0;       // High water mark
+    double lastLatencyMs = 0.0;     // Duration of most recent engine call
+    double meanLatencyMs = 0.0;     // Mean duration of engine calls
+    double maxLatencyMs = 0.0;      // Slowest engine call
+    double maxQueueWaitMs = 0.0;    // Longest time a block spent waiting in the queue
+};
+
+class DetectionWorker {
+public:
+    // End is the position just past the block the hotword was detected in
+    typedef std::function<void(int hotwordIndex, uint64_t end)> HotwordCallback;
+
+    // The engine is not owned and must outlive the worker. maxBlockSamples
+    // is the largest block that can be submitted without being split.
+    DetectionWorker(HotwordEngine *engine, HotwordCallback callback, size_t queueCapacity = 32,
+                    size_t maxBlockSamples = 4096);
+    ~DetectionWorker();
+
+    DetectionWorker(const DetectionWorker &) = delete;
+    DetectionWorker &operator=(const DetectionWorker &) = delete;
+
+    // Queue samples for detection, end being the position just past the
+    // last sample. Blocks larger than maxBlockSamples are split. Returns
+    // false if (part of) the audio was dropped because the queue was full.
+    // Safe to call from any single producer thread.
+    bool submit(const int16_t *samples, size_t count, uint64_t end);
+
+    // Drop all queued blocks that haven't been processed yet.
+    void flush();
+
+    // Ask the worker to reset the engine before processing the next block.
+    void resetEngine();
+
+    DetectionWorkerStats stats() const;
+
+private:
+    struct Block {
+        std::vector<int16_t> samples;
+        size_t count = 0;
+        uint64_t end = 0;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
+    bool submitBlock(const int16_t *samples, size_t count, uint64_t end);
+    void run();
+
+    HotwordEngine *_engine;
+    HotwordCallback _callback;
+    const size_t _maxBlockSamples;
+
+    // Circular queue of preallocated blocks, guarded by _mutex
+    std::vector<Block> _blocks;
+    size_t _head = 0;
+    size_t _count = 0;
+    bool _resetRequested = false;
+    bool _stop = false;
+
+    DetectionWorkerStats _stats;
+    double _totalLatencyMs = 0.0;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _cond;
+    std::thread _thread;
+};
+
+} // namespace embla
@@ -20,7 +20,10 @@
 
 @protocol HotwordDetectorDelegate <NSObject>
 
-- (void)didHearHotword:(NSString *)phrase;
+// Index identifies which of the detector's hotwords was heard,
+// 0 being the default hotword. Position is the recording sample
+// position (see AudioRecordingService) at which the hotword ended.
+- (void)didHearHotword:(NSString *)phrase atIndex:(NSUInteger)index endingAtSample:(uint64_t)position;
 
 @end
 
@@ -0,0 +1,43 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Minimal abstract interface to a hotword detection engine. Lets the
+    detection pipeline be driven by snowboy::SnowboyDetect on device and
+    by any other implementation elsewhere.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+namespace embla {
+
+class HotwordEngine {
+public:
+    virtual ~HotwordEngine() = default;
+
+    // Same return value semantics as snowboy::SnowboyDetect::RunDetection():
+    // -2 silence, -1 error, 0 no event, N > 0 hotword N triggered.
+    virtual int runDetection(const int16_t *samples, int count) = 0;
+
+    // Reset internal detection state, e.g. after a gap in the audio stream.
+    virtual void reset() = 0;
+};
+
+} // namespace embla
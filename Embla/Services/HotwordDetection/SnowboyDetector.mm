@@ -16,20 +16,84 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+    Snowboy hotword detector. Audio is handed off to a dedicated
+    detection worker thread so that inference never competes with
+    the main thread. Only the hotword event itself is raised on main.
+    A voice activity gate keeps the detector idle while there is
+    nothing that sounds like speech.
+
+    The bundled default model is loaded together with any user-trained
+    models found in the Documents directory. Snowboy runs them all in a
+    single pass over the audio, sharing its front end, and reports the
+    index of the model that fired. Models trained, replaced or removed
+    since, or sensitivities changed, are picked up the next time
+    listening starts, when the detector is set up anew.
+*/
+
 #import "Common.h"
 #import "SnowboyDetector.h"
+#import "DetectionWorker.h"
+#import "ChunkAggregator.h"
+#import "VADGate.h"
 #import <Snowboy/Snowboy.h>
+#import <UIKit/UIKit.h>
+#import <atomic>
+#import <memory>
 
 // Snowboy detector configuration
-#define SNOWBOY_SENSITIVITY     "0.5"
+#define SNOWBOY_MODEL_EXTENSION @"pmdl"
 #define SNOWBOY_AUDIO_GAIN      1.0
 #define SNOWBOY_APPLY_FRONTEND  FALSE  // Should be false for pmdl, true for umdl
 
+// Max number of audio blocks waiting for the detection worker
+#define SNOWBOY_QUEUE_CAPACITY  32
+
+// Detection window sizes (ms). Larger windows mean fewer RunDetection
+// calls and less CPU, but the hotword is reported slightly later.
+#define SNOWBOY_WINDOW_NORMAL_MS    30
+#define SNOWBOY_WINDOW_REDUCED_MS   60  // Device is warming up
+#define SNOWBOY_WINDOW_MINIMAL_MS   100 // Low power mode, low battery or hot device
+
+// Voice activity gate. The pre-roll must cover the part of the hotword
+// spoken before the gate reacts, the hangover the pauses within it.
+#define SNOWBOY_VAD_PREROLL_MS      500
+#define SNOWBOY_VAD_HANGOVER_MS     700
+#define SNOWBOY_VAD_THRESHOLD_DB    9.0f
+
+// Adapts the Snowboy C++ detector to the engine interface used by the worker
+class SnowboyEngine : public embla::HotwordEngine {
+public:
+    explicit SnowboyEngine(snowboy::SnowboyDetect *detect) : _detect(detect) {}
+    int runDetection(const int16_t *samples, int count) override { return _detect->RunDetection(samples, count); }
+    void reset() override { _detect->Reset(); }
+
+private:
+    snowboy::SnowboyDetect *_detect;
+};
+
 @interface SnowboyDetector()
 {
     snowboy::SnowboyDetect* _snowboyDetect;
+    std::unique_ptr<SnowboyEngine> _engine;
+    std::unique_ptr<embla::DetectionWorker> _worker;
+    std::unique_ptr<embla::ChunkAggregator> _aggregator;
+    std::unique_ptr<embla::VADGate> _gate;
+    std::atomic<bool> _pipelineNeedsReset;
+    // Set on the main thread, read on the consumer queue as well
+    std::atomic<bool> _listening;
+    // Recording sample position of the gate's first input sample, so that
+    // positions in the pipeline are recording positions. Consumer queue only.
+    uint64_t _gateOrigin;
+    
+    // Battery state is observed on the main thread and read by the aggregator
+    std::atomic<float> _batteryLevel;
+    std::atomic<bool> _charging;
 }
 @property (weak) id <HotwordDetectorDelegate>delegate;
+@property (strong) NSArray<NSString *> *modelNames;
+// Models and sensitivities the detector was set up with, see _modelSignature
+@property (copy) NSString *modelSignature;
 @property (readonly) BOOL isListening;
 @property BOOL inited;
 
@@ -46,55 +110,169 @@
 }
 
 - (BOOL)startListening {
-    // TODO: Maybe re-initialise every time listening is resumed?
+    // No audio reaches the detector while it isn't listening, so it can be
+    // torn down then and set up again with the current models
+    NSString *signature = [self _modelSignature];
+    if (self.inited && !_listening && ![signature isEqualToString:self.modelSignature]) {
+        DLog(@"Hotword models changed, reloading Snowboy");
+        [self _tearDown];
+    }
+    
     if (!self.inited) {
-        _snowboyDetect = NULL;
+        BOOL firstSetUp = (self.modelSignature == nil);
         
         NSString *commonPath = [[NSBundle mainBundle] pathForResource:@"common" ofType:@"res"];
-        NSString *modelPath = [self _modelPath];
+        NSArray<NSString *> *modelPaths = [self _modelPaths];
         
-        if (![[NSFileManager defaultManager] fileExistsAtPath:commonPath] ||
-            ![[NSFileManager defaultManager] fileExistsAtPath:modelPath]) {
+        if (![[NSFileManager defaultManager] fileExistsAtPath:commonPath] || ![modelPaths count]) {
             DLog(@"Unable to init Snowboy, bundle resources missing");
             return FALSE;
         }
         
-        DLog(@"Initing Snowboy hotword detector with model %@", modelPath);
+        // Model names in the order Snowboy indexes them
+        NSMutableArray<NSString *> *names = [NSMutableArray array];
+        NSMutableArray<NSString *> *sensitivities = [NSMutableArray array];
+        for (NSString *path in modelPaths) {
+            NSString *name = [path lastPathComponent];
+            [names addObject:name];
+            [sensitivities addObject:[self _sensitivityForModel:name]];
+        }
+        self.modelNames = names;
+        NSString *modelStr = [modelPaths componentsJoinedByString:@","];
+        NSString *sensitivityStr = [sensitivities componentsJoinedByString:@","];
+        
+        DLog(@"Initing Snowboy hotword detector with models %@, sensitivities %@", modelStr, sensitivityStr);
         
         // Create and configure Snowboy C++ detector object
         _snowboyDetect = new snowboy::SnowboyDetect(std::string([commonPath UTF8String]),
-                                                    std::string([modelPath UTF8String]));
-        _snowboyDetect->SetSensitivity(SNOWBOY_SENSITIVITY);
+                                                    std::string([modelStr UTF8String]));
+        _snowboyDetect->SetSensitivity(std::string([sensitivityStr UTF8String]));
         _snowboyDetect->SetAudioGain(SNOWBOY_AUDIO_GAIN);
         _snowboyDetect->ApplyFrontend(SNOWBOY_APPLY_FRONTEND);
         
-        [[AudioRecordingService sharedInstance] prepare];
+        // Detection runs on its own thread, only the hotword event goes to main
+        __weak SnowboyDetector *weakSelf = self;
+        _engine.reset(new SnowboyEngine(_snowboyDetect));
+        _worker.reset(new embla::DetectionWorker(_engine.get(), [weakSelf](int hotwordIndex, uint64_t end) {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                [weakSelf _didDetectHotword:hotwordIndex endingAtSample:end];
+            });
+        }, SNOWBOY_QUEUE_CAPACITY));
+        
+        // Batch small RemoteIO buffers into detection windows sized to the power state
+        embla::ChunkAggregatorConfig config;
+        config.sampleRate = (int)REC_SAMPLE_RATE;
+        config.normalWindowMs = SNOWBOY_WINDOW_NORMAL_MS;
+        config.reducedWindowMs = SNOWBOY_WINDOW_REDUCED_MS;
+        config.minimalWindowMs = SNOWBOY_WINDOW_MINIMAL_MS;
+        embla::DetectionWorker *worker = _worker.get();
+        _aggregator.reset(new embla::ChunkAggregator(config, [worker](const int16_t *samples, size_t count,
+                                                                      uint64_t end) {
+            worker->submit(samples, count, end);
+        }, [weakSelf]() {
+            return [weakSelf _powerState];
+        }));
+        if (firstSetUp) {
+            [self _observePowerState];
+        }
+        
+        // Only wake the detector for audio that might be speech. The engine
+        // is reset when the gate opens since the audio it gets is not
+        // contiguous with what it saw last, and the partial window is
+        // flushed when it closes so the tail of an utterance is examined.
+        embla::VADGateConfig vadConfig;
+        vadConfig.sampleRate = (int)REC_SAMPLE_RATE;
+        vadConfig.preRollMs = SNOWBOY_VAD_PREROLL_MS;
+        vadConfig.hangoverMs = SNOWBOY_VAD_HANGOVER_MS;
+        vadConfig.thresholdDb = SNOWBOY_VAD_THRESHOLD_DB;
+        embla::ChunkAggregator *aggregator = _aggregator.get();
+        const uint64_t *gateOrigin = &_gateOrigin;
+        _gate.reset(new embla::VADGate(vadConfig, [aggregator, gateOrigin](const int16_t *samples, size_t count,
+                                                                           uint64_t end) {
+            aggregator->push(samples, count, *gateOrigin + end);
+        }, [aggregator, worker](bool open) {
+            if (open) {
+                aggregator->reset();
+                worker->resetEngine();
+            } else {
+                aggregator->flush();
+            }
+        }));
+        
+        if (firstSetUp) {
+            [[AudioRecordingService sharedInstance] prepare];
+        }
         
         // Start listening
+        self.modelSignature = signature;
         self.inited = TRUE;
     }
     
     [self _startListening];
     
-    _isListening = TRUE;
+    _listening = true;
     
     return TRUE;
 }
 
-- (NSString *)_modelPath {
-    NSString *modelPath;
-    // Use model specified in defaults, if any
-    NSString *modelName = [DEFAULTS stringForKey:@"HotwordModelName"];
-    if (modelName != nil && [modelName isEqualToString:DEFAULT_HOTWORD_MODEL] == NO) {
-        NSArray *paths = NSSearchPathForDirectoriesInDomains(NSDocumentDirectory, NSUserDomainMask, YES);
-        NSString *documentsDirectory = [paths objectAtIndex:0];
-        modelPath = [NSString stringWithFormat:@"%@/%@", documentsDirectory, modelName];
+// Default model first, followed by user-trained models in Documents
+- (NSArray<NSString *> *)_modelPaths {
+    NSMutableArray<NSString *> *modelPaths = [NSMutableArray array];
+    NSString *defaultPath = [[NSBundle mainBundle] pathForResource:DEFAULT_HOTWORD_MODEL ofType:nil];
+    if (defaultPath && [[NSFileManager defaultManager] fileExistsAtPath:defaultPath]) {
+        [modelPaths addObject:defaultPath];
     }
-    // Otherwise, fall back to default model
-    if (modelName == nil || ![[NSFileManager defaultManager] fileExistsAtPath:modelPath]) {
-        modelPath = [[NSBundle mainBundle] pathForResource:DEFAULT_HOTWORD_MODEL ofType:nil];
+    
+    NSArray *paths = NSSearchPathForDirectoriesInDomains(NSDocumentDirectory, NSUserDomainMask, YES);
+    NSString *documentsDirectory = [paths objectAtIndex:0];
+    NSArray *files = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:documentsDirectory error:nil];
+    for (NSString *filename in [files sortedArrayUsingSelector:@selector(compare:)]) {
+        // Paths are passed to Snowboy as a comma-separated list
+        if (![[filename pathExtension] isEqualToString:SNOWBOY_MODEL_EXTENSION] ||
+            [filename isEqualToString:DEFAULT_HOTWORD_MODEL] ||
+            [filename rangeOfString:@","].location != NSNotFound) {
+            continue;
+        }
+        [modelPaths addObject:[documentsDirectory stringByAppendingPathComponent:filename]];
+    }
+    return modelPaths;
+}
+
+// Model paths, modification dates and sensitivities, which change when a
+// model is trained, replaced or removed, or a sensitivity is changed
+- (NSString *)_modelSignature {
+    NSMutableArray<NSString *> *parts = [NSMutableArray array];
+    for (NSString *path in [self _modelPaths]) {
+        NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:path error:nil];
+        [parts addObject:[NSString stringWithFormat:@"%@ %.3f %@", path,
+                          [[attributes fileModificationDate] timeIntervalSinceReferenceDate],
+                          [self _sensitivityForModel:[path lastPathComponent]]]];
+    }
+    return [parts componentsJoinedByString:@"\n"];
+}
+
+// Free the detector, the worker thread first since it runs the engine
+- (void)_tearDown {
+    _gate.reset();
+    _aggregator.reset();
+    _worker.reset();
+    _engine.reset();
+    delete _snowboyDetect;
+    _snowboyDetect = NULL;
+    self.inited = FALSE;
+}
+
+- (NSString *)_sensitivityForModel:(NSString *)modelName {
+    NSDictionary *sensitivities = [DEFAULTS dictionaryForKey:@"HotwordSensitivities"];
+    id value = sensitivities[modelName];
+    if ([value isKindOfClass:[NSNumber class]]) {
+        return [NSString stringWithFormat:@"%.2f", [value floatValue]];
     }
-    return modelPath;
+    return [NSString stringWithFormat:@"%.2f", DEFAULT_HOTWORD_SENSITIVITY];
+}
+
+- (BOOL)isListening {
+    return _listening;
 }
 
 - (void)_startListening {
@@ -103,22 +281,114 @@
 }
 
 - (void)stopListening {
-    [[AudioRecordingService sharedInstance] stop];
-    _isListening = FALSE;
+    // If a query session has already taken over the audio, leave capture
+    // running so there's no gap between hotword and query
+    AudioRecordingService *recorder = [AudioRecordingService sharedInstance];
+    if (recorder.delegate == self) {
+        [recorder setDelegate:nil];
+        [recorder stop];
+    }
+    _listening = false;
+    if (_worker) {
+        // Don't run detection on stale audio when listening resumes
+        _pipelineNeedsReset = true;
+        _worker->flush();
+        _worker->resetEngine();
+        embla::DetectionWorkerStats stats = _worker->stats();
+        DLog(@"Snowboy: %llu blocks processed, %llu dropped, max queue depth %zu, "
+             "mean latency %.2f ms, max latency %.2f ms",
+             stats.processedBlocks, stats.droppedBlocks, stats.maxQueueDepth,
+             stats.meanLatencyMs, stats.maxLatencyMs);
+    }
+}
+
+#pragma mark - Power state
+
+- (void)_observePowerState {
+    [UIDevice currentDevice].batteryMonitoringEnabled = YES;
+    [self _batteryStateChanged:nil];
+    [[NSNotificationCenter defaultCenter] addObserver:self
+                                             selector:@selector(_batteryStateChanged:)
+                                                 name:UIDeviceBatteryLevelDidChangeNotification
+                                               object:nil];
+    [[NSNotificationCenter defaultCenter] addObserver:self
+                                             selector:@selector(_batteryStateChanged:)
+                                                 name:UIDeviceBatteryStateDidChangeNotification
+                                               object:nil];
+}
+
+- (void)_batteryStateChanged:(NSNotification *)notification {
+    UIDevice *device = [UIDevice currentDevice];
+    _batteryLevel = device.batteryLevel; // -1.0 if unknown
+    _charging = (device.batteryState == UIDeviceBatteryStateCharging ||
+                 device.batteryState == UIDeviceBatteryStateFull);
+}
+
+// Called on the recording service's consumer queue
+- (embla::PowerState)_powerState {
+    NSProcessInfo *info = [NSProcessInfo processInfo];
+    embla::PowerState state;
+    state.lowPowerMode = info.lowPowerModeEnabled;
+    state.batteryLevel = _batteryLevel;
+    state.charging = _charging;
+    switch (info.thermalState) {
+        case NSProcessInfoThermalStateFair:
+            state.thermal = embla::ThermalState::Fair;
+            break;
+        case NSProcessInfoThermalStateSerious:
+            state.thermal = embla::ThermalState::Serious;
+            break;
+        case NSProcessInfoThermalStateCritical:
+            state.thermal = embla::ThermalState::Critical;
+            break;
+        default:
+            state.thermal = embla::ThermalState::Nominal;
+            break;
+    }
+    return state;
+}
+
+#pragma mark - AudioRecordingServiceDelegate
+
+// Receive audio straight from the recording service's consumer queue
+- (BOOL)processesSampleDataOffMainThread {
+    return YES;
 }
 
 - (void)processSampleData:(NSData *)data {
-    dispatch_async(dispatch_get_main_queue(),^{
-        const int16_t *bytes = (int16_t *)[data bytes];
-        const int len = (int)[data length]/2; // 16-bit audio
-        int result = _snowboyDetect->RunDetection((const int16_t *)bytes, len);
-        if (result == 1) {
-            DLog(@"Snowboy: Hotword detected");
-            if (self.delegate) {
-                [self.delegate didHearHotword:[DEFAULTS stringForKey:@"HotwordModelName"]];
-            }
-        }
-    });
+    if (!_listening || !_gate) {
+        return;
+    }
+    if (_pipelineNeedsReset.exchange(false)) {
+        embla::ChunkAggregatorStats stats = _aggregator->stats();
+        DLog(@"Snowboy: %d ms detection window, %.1f detector calls per second saved",
+             stats.windowMs, stats.invocationsSavedPerSecond((int)REC_SAMPLE_RATE));
+        embla::VADGateStats vadStats = _gate->stats();
+        DLog(@"Snowboy: VAD duty cycle %.1f%%, %llu openings, noise floor %.1f dBFS",
+             vadStats.dutyCycle() * 100.0, vadStats.openings, vadStats.noiseFloorDbfs);
+        _gate->reset();
+        _aggregator->reset();
+    }
+    const int16_t *samples = (const int16_t *)[data bytes];
+    const size_t len = [data length]/2; // 16-bit audio
+    // Worked out afresh for each block, since delivered audio can skip ahead
+    uint64_t end = [[AudioRecordingService sharedInstance] deliveredSamplePosition];
+    _gateOrigin = end - len - _gate->stats().samples;
+    _gate->push(samples, len);
+}
+
+// Called on main thread. Snowboy hotword indices are 1-based. The hotword
+// ended within the detection window ending at the given sample position.
+- (void)_didDetectHotword:(int)hotwordIndex endingAtSample:(uint64_t)end {
+    if (!_listening || hotwordIndex < 1 || (NSUInteger)hotwordIndex > [self.modelNames count]) {
+        return;
+    }
+    NSUInteger index = hotwordIndex - 1;
+    NSString *modelName = self.modelNames[index];
+    DLog(@"Snowboy: Hotword detected (%@)", modelName);
+    if (self.delegate) {
+        [self.delegate didHearHotword:modelName atIndex:index endingAtSample:end];
+    }
 }
 
 @end
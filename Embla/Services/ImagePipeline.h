@@ -16,11 +16,20 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
-#import <Foundation/Foundation.h>
 #import <UIKit/UIKit.h>
 
-@interface UIImage (Additions)
+@interface ImagePipeline : NSObject
 
-+ (UIImage*)imageWithImage:(UIImage *) sourceImage scaledToWidth:(float)width;
++ (instancetype)sharedInstance;
+
+// Fetch the image at url in the background and decode it no wider than
+// width points at the screen scale. The handler is called on the main
+// queue, with an error if the image couldn't be fetched or decoded.
+- (void)imageForURL:(NSURL *)url
+              width:(CGFloat)width
+  completionHandler:(void (^)(UIImage *image, NSError *error))handler;
+
+// Empty the memory and disk caches
+- (void)clear;
 
 @end
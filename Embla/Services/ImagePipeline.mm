@@ -0,0 +1,210 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Fetches and decodes answer images without blocking the caller or
+    holding them in memory at full resolution.
+
+    Images are decoded with ImageIO straight to the width they're shown
+    at, which for JPEG means a scaled decode, so the full-size bitmap is
+    never created (see ImageDownsampler.h, and Tools/ImageBench for the
+    same approach measured with libjpeg and libpng). Decoded images are
+    kept in a memory cache bounded by their bitmap size, keyed by URL and
+    pixel width, and the fetched files in a disk cache keyed by URL, so
+    that they can be decoded again at another size. See DiskCache.h.
+*/
+
+#import "ImagePipeline.h"
+#import "Common.h"
+#import "DiskCache.h"
+#import "ImageDownsampler.h"
+#import <ImageIO/ImageIO.h>
+#import <memory>
+
+// Maximum size of decoded images in memory (bytes)
+#define IMAGE_MEMORY_CACHE_MAX_BYTES    (16 * 1024 * 1024)
+// Maximum size of the cache on disk (bytes)
+#define IMAGE_DISK_CACHE_MAX_BYTES      (30 * 1024 * 1024)
+// Subdirectory of the caches directory
+#define IMAGE_DISK_CACHE_DIRECTORY      @"Images"
+
+@interface ImagePipeline ()
+{
+    std::unique_ptr<embla::DiskCache> diskCache;
+}
+@property (nonatomic, strong) NSCache<NSString *, UIImage *> *memoryCache;
+@property (nonatomic, strong) dispatch_queue_t decodeQueue;
+@property (nonatomic) CGFloat scale;
+@end
+
+@implementation ImagePipeline
+
++ (instancetype)sharedInstance {
+    static ImagePipeline *instance = nil;
+    if (!instance) {
+        instance = [self new];
+    }
+    return instance;
+}
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        NSString *caches = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) firstObject];
+        NSString *path = [caches stringByAppendingPathComponent:IMAGE_DISK_CACHE_DIRECTORY];
+        diskCache.reset(new embla::DiskCache([path fileSystemRepresentation], IMAGE_DISK_CACHE_MAX_BYTES));
+        
+        self.memoryCache = [NSCache new];
+        self.memoryCache.totalCostLimit = IMAGE_MEMORY_CACHE_MAX_BYTES;
+        // Images are decoded one at a time, to bound peak memory use
+        self.decodeQueue = dispatch_queue_create("is.mideind.Embla.images", DISPATCH_QUEUE_SERIAL);
+        self.scale = [[UIScreen mainScreen] scale];
+        
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(_sync)
+                                                     name:UIApplicationDidEnterBackgroundNotification
+                                                   object:nil];
+    }
+    return self;
+}
+
+- (void)_sync {
+    diskCache->sync();
+}
+
+#pragma mark - Fetch
+
+- (void)imageForURL:(NSURL *)url
+              width:(CGFloat)width
+  completionHandler:(void (^)(UIImage *image, NSError *error))handler {
+    uint32_t pixelWidth = (uint32_t)ceil(MAX(width, 1.0) * self.scale);
+    NSString *key = [NSString stringWithFormat:@"%@\x1f%u", [url absoluteString], pixelWidth];
+    UIImage *cached = [self.memoryCache objectForKey:key];
+    if (cached) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            handler(cached, nil);
+        });
+        return;
+    }
+    
+    void (^decode)(NSData *) = ^(NSData *data) {
+        dispatch_async(self.decodeQueue, ^{
+            UIImage *image = [self _decodeData:data maxPixelWidth:pixelWidth];
+            NSError *error = nil;
+            if (image) {
+                CGImageRef cgImage = [image CGImage];
+                [self.memoryCache setObject:image
+                                     forKey:key
+                                       cost:CGImageGetBytesPerRow(cgImage) * CGImageGetHeight(cgImage)];
+            } else {
+                NSString *msg = [NSString stringWithFormat:@"Unable to decode image %@", [url absoluteString]];
+                error = [NSError errorWithDomain:@"Embla" code:0 userInfo:@{ NSLocalizedDescriptionKey: msg }];
+            }
+            dispatch_async(dispatch_get_main_queue(), ^{
+                handler(image, error);
+            });
+        });
+    };
+    
+    std::string diskKey([[url absoluteString] UTF8String]);
+    std::shared_ptr<embla::MappedBlob> blob = diskCache->get(diskKey);
+    if (blob) {
+        DLog(@"Image disk cache hit for %@", [url absoluteString]);
+        // The deallocator block holds a reference to the mapping
+        decode([[NSData alloc] initWithBytesNoCopy:(void *)blob->data()
+                                            length:blob->size()
+                                       deallocator:^(void *bytes, NSUInteger length) {
+            (void)blob;
+        }]);
+        return;
+    }
+    
+    NSURLSessionDataTask *task = [[NSURLSession sharedSession] dataTaskWithURL:url
+                                                             completionHandler:^(NSData *data,
+                                                                                 NSURLResponse *response,
+                                                                                 NSError *error) {
+        NSInteger status = [response isKindOfClass:[NSHTTPURLResponse class]] ?
+            [(NSHTTPURLResponse *)response statusCode] : 200;
+        if (error || [data length] == 0 || status != 200) {
+            DLog(@"Failed to fetch image %@: %@", [url absoluteString], error);
+            if (!error) {
+                NSString *msg = [NSString stringWithFormat:@"Unable to fetch image %@", [url absoluteString]];
+                error = [NSError errorWithDomain:@"Embla" code:0 userInfo:@{ NSLocalizedDescriptionKey: msg }];
+            }
+            dispatch_async(dispatch_get_main_queue(), ^{
+                handler(nil, error);
+            });
+            return;
+        }
+        self->diskCache->put({ diskKey }, (const uint8_t *)[data bytes], [data length]);
+        decode(data);
+    }];
+    [task resume];
+}
+
+#pragma mark - Decode
+
+- (UIImage *)_decodeData:(NSData *)data maxPixelWidth:(uint32_t)maxWidth {
+    NSDictionary *sourceOptions = @{ (id)kCGImageSourceShouldCache: @NO };
+    CGImageSourceRef source = CGImageSourceCreateWithData((__bridge CFDataRef)data,
+                                                          (__bridge CFDictionaryRef)sourceOptions);
+    if (!source) {
+        return nil;
+    }
+    // Size from the header, as displayed, i.e. rotated if so tagged
+    NSDictionary *props = CFBridgingRelease(CGImageSourceCopyPropertiesAtIndex(source, 0, NULL));
+    uint32_t width = [props[(id)kCGImagePropertyPixelWidth] unsignedIntValue];
+    uint32_t height = [props[(id)kCGImagePropertyPixelHeight] unsignedIntValue];
+    int orientation = [props[(id)kCGImagePropertyOrientation] intValue];
+    if (orientation >= 5 && orientation <= 8) {
+        std::swap(width, height);
+    }
+    embla::ImageSize size = embla::downsampledSize(width, height, maxWidth);
+    if (size.width == 0) {
+        CFRelease(source);
+        return nil;
+    }
+    
+    // The thumbnail is decoded at the given size, immediately, rather
+    // than lazily the first time it's drawn on the main thread
+    NSDictionary *options = @{
+        (id)kCGImageSourceCreateThumbnailFromImageAlways: @YES,
+        (id)kCGImageSourceCreateThumbnailWithTransform: @YES,
+        (id)kCGImageSourceShouldCacheImmediately: @YES,
+        (id)kCGImageSourceThumbnailMaxPixelSize: @(MAX(size.width, size.height))
+    };
+    CGImageRef cgImage = CGImageSourceCreateThumbnailAtIndex(source, 0, (__bridge CFDictionaryRef)options);
+    CFRelease(source);
+    if (!cgImage) {
+        return nil;
+    }
+    UIImage *image = [UIImage imageWithCGImage:cgImage scale:self.scale orientation:UIImageOrientationUp];
+    CGImageRelease(cgImage);
+    DLog(@"Decoded %ux%u image at %zux%zu", width, height, CGImageGetWidth([image CGImage]),
+         CGImageGetHeight([image CGImage]));
+    return image;
+}
+
+#pragma mark - Clear
+
+- (void)clear {
+    [self.memoryCache removeAllObjects];
+    diskCache->clear();
+}
+
+@end
@@ -21,10 +21,22 @@
 
 @interface QueryService : NSObject
 
+// DNS, connect, TLS, time to first byte and total time (ms) of the most
+// recent request, along with whether its connection was reused
+@property (nonatomic, strong) NSDictionary *lastRequestTimings;
+
 + (instancetype)sharedInstance;
 
-- (void)sendQuery:(id)query
-completionHandler:(void (^)(NSURLResponse *response, id responseObject, NSError *error))completionHandler;
+- (void)preconnect;
+
+// Returns the running task, which may be cancelled
+- (NSURLSessionDataTask *)sendQuery:(id)query
+                  completionHandler:(void (^)(NSURLResponse *response, id responseObject, NSError *error))completionHandler;
+// Unlogged queries ask the server not to log them, e.g. speculative ones
+// that may never be used. They are otherwise the same as any other query.
+- (NSURLSessionDataTask *)sendQuery:(id)query
+                           unlogged:(BOOL)unlogged
+                  completionHandler:(void (^)(NSURLResponse *response, id responseObject, NSError *error))completionHandler;
 
 - (void)requestSpeechSynthesis:(NSString *)str
              completionHandler:(void (^)(NSURLResponse *response, id responseObject, NSError *error))completionHandler;
@@ -18,6 +18,11 @@
 
 /*
     Singleton wrapper class for sending requests to the query API.
+ 
+    Requests to each server go through a single long-lived session
+    manager, so that NSURLSession can keep connections alive and
+    multiplex requests over HTTP/2 instead of paying for DNS, TCP and
+    TLS every time. Timing metrics are logged for every request.
 */
 
 #import "QueryService.h"
@@ -31,6 +36,16 @@
 
 // Number of seconds before a query server request should time out
 #define QUERY_SERVICE_REQ_TIMEOUT   25.0f
+// Don't pre-connect again if the previous attempt was this recent (seconds)
+#define QUERY_SERVICE_PRECONNECT_INTERVAL   30.0
+
+@interface QueryService ()
+
+// Session managers keyed by server base URL
+@property (nonatomic, strong) NSMutableDictionary<NSString *, AFURLSessionManager *> *managers;
+@property (nonatomic, strong) NSDate *lastPreconnect;
+
+@end
 
 @implementation QueryService
 
@@ -38,18 +53,107 @@
     static QueryService *instance = nil;
     if (!instance) {
         instance = [self new];
+        instance.managers = [NSMutableDictionary new];
     }
     return instance;
 }
 
-#pragma mark - Util
+#pragma mark - Session
 
-- (NSString *)_APIEndpoint:(NSString *)path {
+- (NSString *)_server {
     NSString *server = [DEFAULTS stringForKey:@"QueryServer"];
     if ([server length] == 0 || [server hasPrefix:@"http"] == NO) {
         server = DEFAULT_QUERY_SERVER;
     }
-    return [NSString stringWithFormat:@"%@%@", server, path];
+    return server;
+}
+
+// Returns the shared session manager for the server of the given URL
+- (AFURLSessionManager *)_sessionManagerForURL:(NSURL *)url {
+    NSString *key = [NSString stringWithFormat:@"%@://%@:%@", url.scheme, url.host, url.port ? url.port : @""];
+    AFURLSessionManager *manager = self.managers[key];
+    if (manager) {
+        return manager;
+    }
+    
+    NSURLSessionConfiguration *configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
+    [configuration setTimeoutIntervalForRequest:QUERY_SERVICE_REQ_TIMEOUT];
+    manager = [[AFURLSessionManager alloc] initWithSessionConfiguration:configuration];
+    [manager setTaskDidFinishCollectingMetricsBlock:^(NSURLSession *session, NSURLSessionTask *task,
+                                                      NSURLSessionTaskMetrics *metrics) {
+        [self _logMetrics:metrics forTask:task];
+    }];
+    DLog(@"Created session manager for %@", key);
+    self.managers[key] = manager;
+    return manager;
+}
+
+- (NSURLSessionDataTask *)_runRequest:(NSURLRequest *)req
+                    completionHandler:(void (^)(NSURLResponse *response, id responseObject, NSError *error))completionHandler {
+    AFURLSessionManager *manager = [self _sessionManagerForURL:req.URL];
+    NSURLSessionDataTask *dataTask = [manager dataTaskWithRequest:req
+                                                   uploadProgress:nil
+                                                 downloadProgress:nil
+                                                completionHandler:completionHandler];
+    [dataTask resume];
+    return dataTask;
+}
+
+// Open a connection to the query server ahead of the first query,
+// so that it's already set up when the user asks something
+- (void)preconnect {
+    if (self.lastPreconnect && -[self.lastPreconnect timeIntervalSinceNow] < QUERY_SERVICE_PRECONNECT_INTERVAL) {
+        return;
+    }
+    self.lastPreconnect = [NSDate date];
+    
+    NSMutableURLRequest *req = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:[self _server]]];
+    [req setHTTPMethod:@"HEAD"];
+    DLog(@"Pre-connecting to %@", [req.URL absoluteString]);
+    [self _runRequest:req completionHandler:^(NSURLResponse *response, id responseObject, NSError *error) {
+        // Only the connection matters, not what the server makes of the request
+        if ([error.domain isEqualToString:NSURLErrorDomain]) {
+            DLog(@"Pre-connect failed: %@", [error localizedDescription]);
+        }
+    }];
+}
+
+#pragma mark - Metrics
+
+static double IntervalMs(NSDate *start, NSDate *end) {
+    return (start && end) ? [end timeIntervalSinceDate:start] * 1000 : 0;
+}
+
+- (void)_logMetrics:(NSURLSessionTaskMetrics *)metrics forTask:(NSURLSessionTask *)task {
+    NSURLSessionTaskTransactionMetrics *m = [metrics.transactionMetrics lastObject];
+    if (!m) {
+        return;
+    }
+    NSDictionary *timings = @{
+        @"path": task.originalRequest.URL.path ? task.originalRequest.URL.path : @"",
+        @"dns_ms": @(IntervalMs(m.domainLookupStartDate, m.domainLookupEndDate)),
+        @"connect_ms": @(IntervalMs(m.connectStartDate, m.connectEndDate)),
+        @"tls_ms": @(IntervalMs(m.secureConnectionStartDate, m.secureConnectionEndDate)),
+        @"ttfb_ms": @(IntervalMs(m.requestStartDate, m.responseStartDate)),
+        @"total_ms": @(metrics.taskInterval.duration * 1000),
+        @"reused": @(m.reusedConnection),
+        @"protocol": m.networkProtocolName ? m.networkProtocolName : @"?"
+    };
+    DLog(@"%@ %@: dns %.0f ms, connect %.0f ms, tls %.0f ms, ttfb %.0f ms, total %.0f ms (%@%@)",
+         task.originalRequest.HTTPMethod, timings[@"path"],
+         [timings[@"dns_ms"] doubleValue], [timings[@"connect_ms"] doubleValue], [timings[@"tls_ms"] doubleValue],
+         [timings[@"ttfb_ms"] doubleValue], [timings[@"total_ms"] doubleValue],
+         timings[@"protocol"], m.reusedConnection ? @", reused" : @"");
+    
+    dispatch_async(dispatch_get_main_queue(), ^{
+        self.lastRequestTimings = timings;
+    });
+}
+
+#pragma mark - Util
+
+- (NSString *)_APIEndpoint:(NSString *)path {
+    return [NSString stringWithFormat:@"%@%@", [self _server], path];
 }
 
 - (NSString *)_APIKeyForQueryServer {
@@ -85,7 +189,13 @@
 
 #pragma mark - Query
 
-- (void)sendQuery:(id)query completionHandler:(void (^)(NSURLResponse *response, id responseObject, NSError *error))completionHandler {
+- (NSURLSessionDataTask *)sendQuery:(id)query completionHandler:(void (^)(NSURLResponse *response, id responseObject, NSError *error))completionHandler {
+    return [self sendQuery:query unlogged:NO completionHandler:completionHandler];
+}
+
+- (NSURLSessionDataTask *)sendQuery:(id)query
+                           unlogged:(BOOL)unlogged
+                  completionHandler:(void (^)(NSURLResponse *response, id responseObject, NSError *error))completionHandler {
     BOOL isString = [query isKindOfClass:[NSString class]];
     NSAssert(isString || [query isKindOfClass:[NSArray class]], @"Query argument passed to sendQuery must be string or array.");
     
@@ -93,10 +203,6 @@
     NSArray *alternatives = isString ? @[query] : query;
     NSString *qstr = [alternatives componentsJoinedByString:@"|"];
     
-    NSURLSessionConfiguration *configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
-    [configuration setTimeoutIntervalForRequest:QUERY_SERVICE_REQ_TIMEOUT];
-    AFURLSessionManager *manager = [[AFURLSessionManager alloc] initWithSessionConfiguration:configuration];
-    
     NSString *apiEndpoint = [self _APIEndpoint:QUERY_API_PATH];
     
     // Query key/value pairs
@@ -135,6 +241,12 @@
         // Client type and version
         parameters[@"client_type"] = CLIENT_TYPE;
         parameters[@"client_version"] = CLIENT_VERSION;
+        
+        if (unlogged) {
+            // Keep the client info, so the answer is the same as it
+            // would be for a logged query
+            parameters[@"private"] = @"1";
+        }
     }
     
     // Create request
@@ -147,16 +259,12 @@
         
     if (req == nil) {
         DLog(@"%@", [err localizedDescription]);
-        return;
+        return nil;
     }
     DLog(@"Sending request %@\n%@", [req description], [parameters description]);
     
     // Run task with request
-    NSURLSessionDataTask *dataTask = [manager dataTaskWithRequest:req
-                                                   uploadProgress:nil
-                                                 downloadProgress:nil
-                                                completionHandler:completionHandler];
-    [dataTask resume];
+    return [self _runRequest:req completionHandler:completionHandler];
 }
 
 #pragma mark - Speech synthesis
@@ -164,10 +272,6 @@
 - (void)requestSpeechSynthesis:(NSString *)str
              completionHandler:(void (^)(NSURLResponse *response, id responseObject, NSError *error))completionHandler {
     
-    NSURLSessionConfiguration *configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
-    [configuration setTimeoutIntervalForRequest:QUERY_SERVICE_REQ_TIMEOUT];
-    AFURLSessionManager *manager = [[AFURLSessionManager alloc] initWithSessionConfiguration:configuration];
-    
     NSString *voiceName = [DEFAULTS stringForKey:@"VoiceID"];
     
     NSDictionary *parameters = @{
@@ -194,11 +298,7 @@
     DLog(@"Sending request %@\n%@", [req description], [parameters description]);
     
     // Run task with request
-    NSURLSessionDataTask *dataTask = [manager dataTaskWithRequest:req
-                                                   uploadProgress:nil
-                                                 downloadProgress:nil
-                                                completionHandler:completionHandler];
-    [dataTask resume];
+    [self _runRequest:req completionHandler:completionHandler];
 }
 
 #pragma mark - Clear user data & history
@@ -211,11 +311,6 @@
     NSString *uniqueID = [[[UIDevice currentDevice] identifierForVendor] UUIDString];
     NSString *version = [[NSBundle mainBundle] objectForInfoDictionaryKey:@"CFBundleVersion"];
         
-    // Configure session
-    NSURLSessionConfiguration *configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
-    [configuration setTimeoutIntervalForRequest:QUERY_SERVICE_REQ_TIMEOUT];
-    AFURLSessionManager *manager = [[AFURLSessionManager alloc] initWithSessionConfiguration:configuration];
-    
     NSString *action = allData ? @"clear_all" : @"clear";
     NSDictionary *parameters = @{   @"action": action,
                                     @"client_id": uniqueID,
@@ -225,8 +320,7 @@
     
     // Create request
     NSError *err = nil;
-    NSString *server = [DEFAULTS objectForKey:@"QueryServer"];
-    NSString *remoteURLStr = [NSString stringWithFormat:@"%@%@", server, CLEAR_QHISTORY_API_PATH];
+    NSString *remoteURLStr = [self _APIEndpoint:CLEAR_QHISTORY_API_PATH];
     NSMutableURLRequest *req = [[[AFHTTPRequestSerializer serializer] requestWithMethod:@"POST"
                                                                               URLString:remoteURLStr
                                                                              parameters:parameters
@@ -241,11 +335,7 @@
     DLog(@"Sending request %@\n%@", [req description], [parameters description]);
     
     // Run task with request
-    NSURLSessionDataTask *dataTask = [manager dataTaskWithRequest:req
-                                                   uploadProgress:nil
-                                                 downloadProgress:nil
-                                                completionHandler:completionHandler];
-    [dataTask resume];
+    [self _runRequest:req completionHandler:completionHandler];
 }
 
 #pragma mark - Upload audio data
@@ -294,10 +384,6 @@
 
 - (void)requestVoicesWithCompletionHandler:(void (^)(NSURLResponse *response, id responseObject, NSError *error))completionHandler {
     
-    NSURLSessionConfiguration *configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
-    [configuration setTimeoutIntervalForRequest:QUERY_SERVICE_REQ_TIMEOUT];
-    AFURLSessionManager *manager = [[AFURLSessionManager alloc] initWithSessionConfiguration:configuration];
-    
     // Create request
     NSError *err = nil;
     NSURLRequest *req = [[AFHTTPRequestSerializer serializer] requestWithMethod:@"GET"
@@ -311,11 +397,7 @@
     DLog(@"Sending request %@", [req description]);
     
     // Run task with request
-    NSURLSessionDataTask *dataTask = [manager dataTaskWithRequest:req
-                                                   uploadProgress:nil
-                                                 downloadProgress:nil
-                                                completionHandler:completionHandler];
-    [dataTask resume];
+    [self _runRequest:req completionHandler:completionHandler];
 }
 
 @end
@@ -0,0 +1,38 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#import <Foundation/Foundation.h>
+
+// Records where the time goes in each query, in debug builds, and writes
+// it out in the Chrome trace event format. See LatencyTracer.h. Names
+// must be string literals. Safe to call from any thread.
+@interface SessionTrace : NSObject
+
++ (instancetype)sharedInstance;
+
+// Start tracing a new query. Spans and marks belong to the latest one.
+- (void)startQuery;
+
+- (void)beginSpan:(const char *)name;
+- (void)endSpan:(const char *)name;
+- (void)mark:(const char *)name;
+
+// End the query and write the trace to Caches/Traces/latency.json
+- (void)finishQuery;
+
+@end
@@ -0,0 +1,108 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Query latency tracing for the app. Each query is traced as a
+    "Session" span from when it's started (hotword or button) to when
+    the session ends, with spans and marks for each stage in between.
+    In debug builds, the trace is written out after every query, for
+    chrome://tracing or Perfetto, and to be summarized with
+    Tools/TraceBench.
+*/
+
+#import "SessionTrace.h"
+#import "Common.h"
+#import "LatencyTracer.h"
+#import <atomic>
+
+// Subdirectory of the caches directory
+#define SESSION_TRACE_DIRECTORY     @"Traces"
+#define SESSION_TRACE_FILENAME      @"latency.json"
+
+@interface SessionTrace ()
+{
+    embla::LatencyTracer *tracer;
+    std::atomic<uint64_t> queryID;
+}
+@property (nonatomic, strong) dispatch_queue_t writeQueue;
+@end
+
+@implementation SessionTrace
+
++ (instancetype)sharedInstance {
+    static SessionTrace *instance = nil;
+    if (!instance) {
+        instance = [self new];
+    }
+    return instance;
+}
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        tracer = &embla::LatencyTracer::shared();
+#ifdef DEBUG
+        tracer->setEnabled(true);
+#endif
+        queryID = 0;
+        self.writeQueue = dispatch_queue_create("is.mideind.Embla.trace", DISPATCH_QUEUE_SERIAL);
+    }
+    return self;
+}
+
+- (void)startQuery {
+    tracer->begin("Session", queryID.fetch_add(1, std::memory_order_relaxed) + 1);
+}
+
+- (void)beginSpan:(const char *)name {
+    tracer->begin(name, queryID.load(std::memory_order_relaxed));
+}
+
+- (void)endSpan:(const char *)name {
+    tracer->end(name, queryID.load(std::memory_order_relaxed));
+}
+
+- (void)mark:(const char *)name {
+    tracer->instant(name, queryID.load(std::memory_order_relaxed));
+}
+
+- (void)finishQuery {
+    if (!tracer->enabled()) {
+        return;
+    }
+    [self endSpan:"Session"];
+    
+    // Export off the main thread, the rings hold a few hundred queries' worth
+    dispatch_async(self.writeQueue, ^{
+        std::string json = embla::LatencyTracer::chromeTraceJSON(self->tracer->events());
+        NSString *caches = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) firstObject];
+        NSString *dir = [caches stringByAppendingPathComponent:SESSION_TRACE_DIRECTORY];
+        [[NSFileManager defaultManager] createDirectoryAtPath:dir
+                                  withIntermediateDirectories:YES
+                                                   attributes:nil
+                                                        error:nil];
+        NSString *path = [dir stringByAppendingPathComponent:SESSION_TRACE_FILENAME];
+        NSData *data = [NSData dataWithBytes:json.data() length:json.size()];
+        if ([data writeToFile:path atomically:YES]) {
+            embla::LatencyTracerStats s = self->tracer->stats();
+            DLog(@"Wrote latency trace to %@ (%llu events, %llu overwritten)", path, s.events, s.overwritten);
+        }
+    });
+}
+
+@end
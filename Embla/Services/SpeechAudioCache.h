@@ -0,0 +1,44 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#import <Foundation/Foundation.h>
+
+@interface SpeechAudioCache : NSObject
+
+// Lookups since the cache was created, and their hit rate (0.0-1.0)
+@property (readonly) NSUInteger hits;
+@property (readonly) NSUInteger misses;
+@property (readonly) double hitRate;
+
++ (instancetype)sharedInstance;
+
+// Cached audio for text spoken with the current voice and speed. The
+// data is mapped from disk rather than copied.
+- (NSData *)audioForText:(NSString *)text;
+
+// Cached audio for an answer, by its text if known and else by its audio
+// URL, counted as one lookup. Audio found by URL only, e.g. stored before
+// the text was known, is then also stored under the text.
+- (NSData *)audioForText:(NSString *)text url:(NSURL *)url;
+
+// Store downloaded audio under its URL and, if known, the text spoken.
+- (void)storeAudio:(NSData *)data forURL:(NSURL *)url text:(NSString *)text;
+
+- (void)clear;
+
+@end
@@ -0,0 +1,172 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Singleton wrapper around the on-disk cache for synthesized speech.
+ 
+    Many answers are spoken over and over (the time, common weather
+    phrases, output of JS commands), so their audio is kept in the
+    caches directory, keyed by the text along with the voice and speed
+    it was spoken with, and by the URL it was downloaded from. Both keys
+    refer to the same file. See DiskCache.h.
+*/
+
+#import "SpeechAudioCache.h"
+#import "Common.h"
+#import "DiskCache.h"
+#import <UIKit/UIKit.h>
+#import <memory>
+
+// Maximum size of the cache on disk (bytes)
+#define SPEECH_AUDIO_CACHE_MAX_BYTES    (20 * 1024 * 1024)
+// Subdirectory of the caches directory
+#define SPEECH_AUDIO_CACHE_DIRECTORY    @"SpeechAudio"
+
+@interface SpeechAudioCache ()
+{
+    std::unique_ptr<embla::DiskCache> cache;
+}
+@end
+
+@implementation SpeechAudioCache
+
++ (instancetype)sharedInstance {
+    static SpeechAudioCache *instance = nil;
+    if (!instance) {
+        instance = [self new];
+    }
+    return instance;
+}
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        NSString *caches = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) firstObject];
+        NSString *path = [caches stringByAppendingPathComponent:SPEECH_AUDIO_CACHE_DIRECTORY];
+        cache.reset(new embla::DiskCache([path fileSystemRepresentation], SPEECH_AUDIO_CACHE_MAX_BYTES));
+        DLog(@"Speech audio cache: %@", [self _description]);
+        
+        // Lookups reorder the LRU list, which is only written out from time to time
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(_sync)
+                                                     name:UIApplicationDidEnterBackgroundNotification
+                                                   object:nil];
+    }
+    return self;
+}
+
+- (void)_sync {
+    cache->sync();
+}
+
+- (NSString *)_description {
+    embla::DiskCacheStats s = cache->stats();
+    return [NSString stringWithFormat:@"%zu files, %llu bytes, %llu hits, %llu misses (hit rate %.0f%%)",
+            s.blobs, s.bytes, s.hits, s.misses, s.hitRate() * 100];
+}
+
+#pragma mark - Keys
+
+- (std::string)_keyForText:(NSString *)text {
+    NSString *voiceName = [DEFAULTS stringForKey:@"VoiceID"];
+    NSString *voiceSpeed = [NSString stringWithFormat:@"%.2f", [DEFAULTS floatForKey:@"SpeechSpeed"]];
+    NSString *key = [NSString stringWithFormat:@"text\x1f%@\x1f%@\x1f%@", voiceName, voiceSpeed, text];
+    return std::string([key UTF8String]);
+}
+
+- (std::string)_keyForURL:(NSURL *)url {
+    NSString *key = [NSString stringWithFormat:@"url\x1f%@", [url absoluteString]];
+    return std::string([key UTF8String]);
+}
+
+#pragma mark - Lookup
+
+- (NSData *)_audioForKeys:(const std::vector<std::string> &)keys {
+    std::shared_ptr<embla::MappedBlob> blob = cache->get(keys);
+    if (!blob) {
+        return nil;
+    }
+    // The deallocator block holds a reference to the mapping, which
+    // is unmapped once the data and the block are released
+    return [[NSData alloc] initWithBytesNoCopy:(void *)blob->data()
+                                        length:blob->size()
+                                   deallocator:^(void *bytes, NSUInteger length) {
+        (void)blob;
+    }];
+}
+
+- (NSData *)audioForText:(NSString *)text {
+    if ([text length] == 0) {
+        return nil;
+    }
+    std::vector<std::string> keys = { [self _keyForText:text] };
+    NSData *data = [self _audioForKeys:keys];
+    DLog(@"Speech audio cache %@ for text '%@'", data ? @"hit" : @"miss", text);
+    return data;
+}
+
+- (NSData *)audioForText:(NSString *)text url:(NSURL *)url {
+    std::vector<std::string> keys;
+    if ([text length]) {
+        keys.push_back([self _keyForText:text]);
+    }
+    if (url) {
+        keys.push_back([self _keyForURL:url]);
+    }
+    if (keys.empty()) {
+        return nil;
+    }
+    NSData *data = [self _audioForKeys:keys];
+    if (data && keys.size() > 1 && !cache->contains(keys[0])) {
+        cache->alias(keys[1], keys[0]);
+    }
+    DLog(@"Speech audio cache %@ for '%@', %@", data ? @"hit" : @"miss", text, [url absoluteString]);
+    return data;
+}
+
+- (void)storeAudio:(NSData *)data forURL:(NSURL *)url text:(NSString *)text {
+    if ([data length] == 0 || url == nil) {
+        return;
+    }
+    std::vector<std::string> keys = { [self _keyForURL:url] };
+    if ([text length]) {
+        keys.push_back([self _keyForText:text]);
+    }
+    cache->put(keys, (const uint8_t *)[data bytes], [data length]);
+    DLog(@"Stored %lu bytes of speech audio, cache now %@", (unsigned long)[data length], [self _description]);
+}
+
+- (void)clear {
+    cache->clear();
+}
+
+#pragma mark - Statistics
+
+- (NSUInteger)hits {
+    return (NSUInteger)cache->stats().hits;
+}
+
+- (NSUInteger)misses {
+    return (NSUInteger)cache->stats().misses;
+}
+
+- (double)hitRate {
+    return cache->stats().hitRate();
+}
+
+@end
@@ -27,8 +27,19 @@ typedef void (^SpeechRecognitionCompletionHandler)(StreamingRecognizeResponse *o
 @property(nonatomic, assign) double sampleRate;
 @property(nonatomic, assign) BOOL interimResults;
 @property(nonatomic, assign) BOOL singleUtterance;
+// Encoding of the audio passed to streamAudioData:, Linear16 or Flac
+@property(nonatomic, assign) RecognitionConfig_AudioEncoding audioEncoding;
+
+// Seconds from first audio sent to first recognition result in the most
+// recent session, or negative if none has been received
+@property(nonatomic, assign) NSTimeInterval lastTimeToFirstResult;
 
 + (instancetype)sharedInstance;
+// Open the channel and keep a call ready, until cooldown is called or
+// there has been no activity for a while. Ending a session counts as
+// activity, as does calling prewarm again.
+- (void)prewarm;
+- (void)cooldown;
 - (void)streamAudioData:(NSData *)audioData withCompletion:(SpeechRecognitionCompletionHandler)completion;
 - (void)stopStreaming;
 - (BOOL)isStreaming;
@@ -19,27 +19,97 @@
 
 /*
     Singleton wrapper class for Google's gRPC-based speech recognition API.
+ 
+    A single client, and thereby a single pooled HTTP/2 channel, is used
+    for the lifetime of the app. While warm-up is requested (i.e. the
+    hotword detector is listening) a streaming call is kept open ahead of
+    time with the recognition config already sent, so that a session only
+    has to attach its audio to it. Warm calls are replaced before the
+    server gives up on them for lack of audio, but only for a while after
+    the last activity (listening starting or a session ending). After
+    that no stream is kept open, and the next session opens its own call
+    on the existing channel.
 */
 
 #import "SpeechRecognitionService.h"
 #import "Common.h"
 #import "Keys.h"
 #import <GRPCClient/GRPCCall.h>
+#import <GRPCClient/GRPCCallOptions.h>
+#import <GRPCClient/GRPCTransport.h>
 #import <ProtoRPC/ProtoRPC.h>
-#import <RxLibrary/GRXBufferedPipe.h>
 
 // Phrases sent to API as part of speech context. Should make speech recognition
 // more likely to identify these words. Doesn't seem to work for Icelandic. :/
 #define PHRASES_ARRAY   @[] // Empty for now
 
+// Unused warm calls are replaced after this many seconds, well before
+// the server times out a stream that hasn't received any audio
+#define SPEECH2TEXT_WARM_CALL_LIFETIME  8.0
+// No warm call is kept open once there has been no activity for this many seconds
+#define SPEECH2TEXT_WARM_IDLE_TIMEOUT   60.0
+// HTTP/2 keepalive ping interval and timeout for the channel (seconds)
+#define SPEECH2TEXT_KEEPALIVE_INTERVAL  20.0
+#define SPEECH2TEXT_KEEPALIVE_TIMEOUT   5.0
+
+// Stand-in servers used for testing don't speak TLS. Only these exact host
+// names go without it, as the API key is sent along with every call.
+#define SPEECH2TEXT_INSECURE_HOSTS      @[@"localhost", @"127.0.0.1", @"::1"]
+
+@class SpeechRecognitionCall;
+
+@interface SpeechRecognitionService ()
+- (void)_call:(SpeechRecognitionCall *)c
+    receivedResponse:(StreamingRecognizeResponse *)response
+               error:(NSError *)error
+                done:(BOOL)done;
+@end
+
+// An open streaming call, either warm (no audio sent yet) or in use.
+// Handles its own responses, on the main queue.
+@interface SpeechRecognitionCall : NSObject <GRPCProtoResponseHandler>
+@property(nonatomic, weak) SpeechRecognitionService *service;
+@property(nonatomic, strong) GRPCStreamingProtoCall *call;
+@property(nonatomic, strong) NSDate *opened;
+@property(nonatomic, copy) SpeechRecognitionCompletionHandler completion;
+@property(nonatomic) BOOL finished;
+@end
+
+@implementation SpeechRecognitionCall
+
+- (dispatch_queue_t)dispatchQueue {
+    return dispatch_get_main_queue();
+}
+
+- (void)didReceiveProtoMessage:(GPBMessage *)message {
+    [self.service _call:self receivedResponse:(StreamingRecognizeResponse *)message error:nil done:NO];
+}
+
+- (void)didCloseWithTrailingMetadata:(NSDictionary *)trailingMetadata error:(NSError *)error {
+    [self.service _call:self receivedResponse:nil error:error done:YES];
+}
+
+@end
+
 @interface SpeechRecognitionService ()
 
 @property(readonly) BOOL streaming;
+@property(nonatomic, strong) NSString *host;
 @property(nonatomic, strong) Speech *client;
-@property(nonatomic, strong) GRXBufferedPipe *writer;
-@property(nonatomic, strong) GRPCProtoCall *call;
+@property(nonatomic, strong) GRPCCallOptions *callOptions;
+@property(nonatomic, strong) StreamingRecognizeRequest *configRequest;
+@property(nonatomic, strong) SpeechRecognitionCall *warmCall;
+@property(nonatomic, strong) SpeechRecognitionCall *activeCall;
+@property(nonatomic, strong) NSTimer *warmCallTimer;
+@property(nonatomic) BOOL keepWarm;
+@property(nonatomic, strong) NSDate *lastActivity;
 @property(nonatomic, strong) NSString *apiKey;
 
+// Time to first result instrumentation
+@property(nonatomic, strong) NSDate *firstAudioSent;
+@property(nonatomic) BOOL firstResultReceived;
+@property(nonatomic) BOOL attachedToWarmCall;
+
 @end
 
 @implementation SpeechRecognitionService
@@ -61,60 +131,237 @@
         instance.sampleRate = REC_SAMPLE_RATE;
         instance.singleUtterance = YES;
         instance.interimResults = YES;
+        instance.audioEncoding = RecognitionConfig_AudioEncoding_Flac;
+        instance.lastTimeToFirstResult = -1;
     }
     return instance;
 }
 
-- (void)streamAudioData:(NSData *)audioData withCompletion:(SpeechRecognitionCompletionHandler)completion {
+#pragma mark - Configuration
 
-    if (!_streaming) {
-        // If we aren't already streaming, set up a gRPC connection
-        NSString *host = DEFAULT_SPEECH2TEXT_SERVER;
-//        if (!host || [host length] < 5) { // No domain is going to be shorter than 5 chars
-//            host = DEFAULT_SPEECH2TEXT_SERVER;
-//        }
-        _client = [[Speech alloc] initWithHost:host];
-        _writer = [[GRXBufferedPipe alloc] init];
-        _call = [_client RPCToStreamingRecognizeWithRequestsWriter:_writer
-                                                      eventHandler:
-        ^(BOOL done, StreamingRecognizeResponse *response, NSError *error) {
-            completion(response, error);
-        }];
-        
+// Changing the configuration invalidates the prebuilt config request and any warm call
+- (void)setSampleRate:(double)sampleRate {
+    _sampleRate = sampleRate;
+    [self _configDidChange];
+}
+
+- (void)setInterimResults:(BOOL)interimResults {
+    _interimResults = interimResults;
+    [self _configDidChange];
+}
+
+- (void)setSingleUtterance:(BOOL)singleUtterance {
+    _singleUtterance = singleUtterance;
+    [self _configDidChange];
+}
+
+- (void)setAudioEncoding:(RecognitionConfig_AudioEncoding)audioEncoding {
+    _audioEncoding = audioEncoding;
+    [self _configDidChange];
+}
+
+- (void)_configDidChange {
+    self.configRequest = nil;
+    [self _discardWarmCall];
+}
+
+- (StreamingRecognizeRequest *)_configRequest {
+    if (self.configRequest) {
+        return self.configRequest;
+    }
+    RecognitionConfig *recognitionConfig = [RecognitionConfig message];
+    recognitionConfig.encoding = self.audioEncoding;
+    recognitionConfig.sampleRateHertz = self.sampleRate;
+    recognitionConfig.languageCode = SPEECH2TEXT_LANGUAGE;
+    recognitionConfig.maxAlternatives = NUM_SPEECH2TEXT_ALTERNATIVES;
+    
+//    SpeechContext *sc = [SpeechContext new];
+//    [sc setPhrasesArray:[PHRASES_ARRAY mutableCopy]];
+//    recognitionConfig.speechContextsArray = [@[sc] mutableCopy];
+    
+    StreamingRecognitionConfig *streamingRecognitionConfig = [StreamingRecognitionConfig message];
+    streamingRecognitionConfig.config = recognitionConfig;
+    streamingRecognitionConfig.singleUtterance = self.singleUtterance;
+    streamingRecognitionConfig.interimResults = self.interimResults;
+    
+    StreamingRecognizeRequest *streamingRecognizeRequest = [StreamingRecognizeRequest message];
+    streamingRecognizeRequest.streamingConfig = streamingRecognitionConfig;
+    self.configRequest = streamingRecognizeRequest;
+    return streamingRecognizeRequest;
+}
+
+#pragma mark - Channel
+
+// The client is created once and reused, so all calls share one channel
+- (Speech *)_client {
+    NSString *host = [DEFAULTS stringForKey:@"Speech2TextServer"];
+    if (!host || [host length] < 5) { // No domain is going to be shorter than 5 chars
+        host = DEFAULT_SPEECH2TEXT_SERVER;
+    }
+    if (self.client && [host isEqualToString:self.host]) {
+        return self.client;
+    }
+    
+    // Calls with the same host and options share a channel
+    GRPCMutableCallOptions *options = [GRPCMutableCallOptions new];
+    options.keepaliveInterval = SPEECH2TEXT_KEEPALIVE_INTERVAL;
+    options.keepaliveTimeout = SPEECH2TEXT_KEEPALIVE_TIMEOUT;
+    if ([SPEECH2TEXT_INSECURE_HOSTS containsObject:[self _hostName:host]]) {
+        options.transport = GRPCDefaultTransportImplList.core_insecure;
+    }
+    options.initialMetadata = @{
         // Authenticate using an API key obtained from the Google Cloud Console
-        _call.requestHeaders[@"X-Goog-Api-Key"] = self.apiKey;
+        @"x-goog-api-key": self.apiKey,
         // Specify the bundle ID in case the API key has a bundle ID restriction
-        _call.requestHeaders[@"X-Ios-Bundle-Identifier"] = [[NSBundle mainBundle] bundleIdentifier];
-        
+        @"x-ios-bundle-identifier": [[NSBundle mainBundle] bundleIdentifier] ?: @""
+    };
+    
+    DLog(@"Creating speech recognition client for %@", host);
+    self.host = host;
+    self.callOptions = options;
+    self.client = [[Speech alloc] initWithHost:host callOptions:options];
+    [self _discardWarmCall];
+    return self.client;
+}
+
+// Open a streaming call and send the recognition config. The completion
+// handler of whichever session attaches to the call receives its events.
+// Host name without the port, e.g. "localhost" for "localhost:50051"
+// and "::1" for "[::1]:50051"
+- (NSString *)_hostName:(NSString *)host {
+    if ([host hasPrefix:@"["]) {
+        NSRange end = [host rangeOfString:@"]"];
+        return end.location == NSNotFound ? host : [host substringWithRange:NSMakeRange(1, end.location - 1)];
+    }
+    NSArray<NSString *> *parts = [host componentsSeparatedByString:@":"];
+    // More than one colon is an IPv6 address without a port
+    return [parts count] == 2 ? parts[0] : host;
+}
+
+- (SpeechRecognitionCall *)_openCall {
+    SpeechRecognitionCall *c = [SpeechRecognitionCall new];
+    c.service = self;
+    c.opened = [NSDate date];
+    Speech *client = [self _client];
+    c.call = [client streamingRecognizeWithResponseHandler:c callOptions:self.callOptions];
+    [c.call start];
+    
+    // Send an initial request message to configure the service
+    [c.call writeMessage:[self _configRequest]];
+    return c;
+}
+
+- (void)_call:(SpeechRecognitionCall *)c
+    receivedResponse:(StreamingRecognizeResponse *)response
+               error:(NSError *)error
+                done:(BOOL)done {
+    if (c == nil) {
+        return;
+    }
+    if (done || error) {
+        c.finished = YES;
+    }
+    
+    // Warm call ended before anyone attached to it, e.g. timed out
+    if (c == self.warmCall) {
+        if (c.finished) {
+            DLog(@"Warm speech recognition call ended: %@", [error localizedDescription]);
+            self.warmCall = nil;
+        }
+        return;
+    }
+    if (c != self.activeCall || !c.completion) {
+        return;
+    }
+    
+    if (!self.firstResultReceived && [response.resultsArray count]) {
+        self.firstResultReceived = YES;
+        self.lastTimeToFirstResult = [[NSDate date] timeIntervalSinceDate:self.firstAudioSent];
+        DLog(@"Time to first speech recognition result: %.0f ms (%@ call)",
+             self.lastTimeToFirstResult * 1000, self.attachedToWarmCall ? @"warm" : @"cold");
+    }
+    c.completion(response, error);
+}
+
+#pragma mark - Warm call
+
+- (void)prewarm {
+    self.keepWarm = YES;
+    self.lastActivity = [NSDate date];
+    if (!self.warmCallTimer) {
+        self.warmCallTimer = [NSTimer scheduledTimerWithTimeInterval:1.0
+                                                              target:self
+                                                            selector:@selector(_refreshWarmCall)
+                                                            userInfo:nil
+                                                             repeats:YES];
+    }
+    [self _refreshWarmCall];
+}
+
+- (void)cooldown {
+    self.keepWarm = NO;
+    [self.warmCallTimer invalidate];
+    self.warmCallTimer = nil;
+    [self _discardWarmCall];
+}
+
+// Make sure there is a fresh warm call, unless a session is streaming
+// or there has been no activity for a while
+- (void)_refreshWarmCall {
+    if (!self.keepWarm || _streaming || ![self hasAPIKey]) {
+        return;
+    }
+    if (-[self.lastActivity timeIntervalSinceNow] > SPEECH2TEXT_WARM_IDLE_TIMEOUT) {
+        if (self.warmCallTimer) {
+            DLog(@"No activity for %.0f s, no longer keeping a speech recognition call warm",
+                 SPEECH2TEXT_WARM_IDLE_TIMEOUT);
+            [self.warmCallTimer invalidate];
+            self.warmCallTimer = nil;
+        }
+        [self _discardWarmCall];
+        return;
+    }
+    if (self.warmCall && !self.warmCall.finished &&
+        -[self.warmCall.opened timeIntervalSinceNow] < SPEECH2TEXT_WARM_CALL_LIFETIME) {
+        return;
+    }
+    [self _discardWarmCall];
+    self.warmCall = [self _openCall];
+}
+
+- (void)_discardWarmCall {
+    if (self.warmCall) {
+        SpeechRecognitionCall *c = self.warmCall;
+        self.warmCall = nil;
+        [c.call cancel];
+    }
+}
+
+#pragma mark - Streaming
+
+- (void)streamAudioData:(NSData *)audioData withCompletion:(SpeechRecognitionCompletionHandler)completion {
+
+    if (!_streaming) {
+        // Attach to the warm call if there's a usable one, otherwise open a new one
+        SpeechRecognitionCall *c = self.warmCall;
+        self.warmCall = nil;
+        BOOL warm = (c && !c.finished && -[c.opened timeIntervalSinceNow] < SPEECH2TEXT_WARM_CALL_LIFETIME);
+        if (!warm) {
+            [c.call cancel];
+            c = [self _openCall];
+        }
+        c.completion = completion;
+        self.activeCall = c;
+        self.attachedToWarmCall = warm;
+        self.firstAudioSent = [NSDate date];
+        self.firstResultReceived = NO;
         _streaming = YES;
-        [_call start];
-        
-        // Send an initial request message to configure the service
-        RecognitionConfig *recognitionConfig = [RecognitionConfig message];
-        recognitionConfig.encoding = RecognitionConfig_AudioEncoding_Linear16;
-        recognitionConfig.sampleRateHertz = self.sampleRate;
-        recognitionConfig.languageCode = SPEECH2TEXT_LANGUAGE;
-        recognitionConfig.maxAlternatives = NUM_SPEECH2TEXT_ALTERNATIVES;
-        
-//        SpeechContext *sc = [SpeechContext new];
-//        [sc setPhrasesArray:[PHRASES_ARRAY mutableCopy]];
-//        recognitionConfig.speechContextsArray = [@[sc] mutableCopy];
-        
-        StreamingRecognitionConfig *streamingRecognitionConfig = [StreamingRecognitionConfig message];
-        streamingRecognitionConfig.config = recognitionConfig;
-        streamingRecognitionConfig.singleUtterance = self.singleUtterance;
-        streamingRecognitionConfig.interimResults = self.interimResults;
-        
-        StreamingRecognizeRequest *streamingRecognizeRequest = [StreamingRecognizeRequest message];
-        streamingRecognizeRequest.streamingConfig = streamingRecognitionConfig;
-        
-        [_writer writeValue:streamingRecognizeRequest];
     }
 
     // Send a request message containing the audio data
     StreamingRecognizeRequest *streamingRecognizeRequest = [StreamingRecognizeRequest message];
     streamingRecognizeRequest.audioContent = audioData;
-    [_writer writeValue:streamingRecognizeRequest];
+    [self.activeCall.call writeMessage:streamingRecognizeRequest];
 }
 
 - (NSArray<NSString *> *)transcriptsFromRecognitionResult:(StreamingRecognitionResult *)result {
@@ -134,8 +381,12 @@
     if (!_streaming) {
         return;
     }
-    [_writer finishWithError:nil];
+    [self.activeCall.call finish];
     _streaming = NO;
+    // A session just ended, so have a call ready for the next one
+    if (self.keepWarm) {
+        [self prewarm];
+    }
 }
 
 - (BOOL)isStreaming {
@@ -0,0 +1,59 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Plays MP3 audio from a URL while it downloads, or from a data: URI
+    or memory while it's decoded. See StreamingAudioPlayer.mm.
+*/
+
+#import <Foundation/Foundation.h>
+
+@class StreamingAudioPlayer;
+
+@protocol StreamingAudioPlayerDelegate <NSObject>
+
+// Called on the main thread once playback is over. Not called if the
+// player is stopped. Flag is NO if the download failed partway through.
+- (void)streamingAudioPlayerDidFinishPlaying:(StreamingAudioPlayer *)player successfully:(BOOL)flag;
+
+// Called on the main thread if the audio couldn't be played at all.
+- (void)streamingAudioPlayer:(StreamingAudioPlayer *)player didFailWithError:(NSError *)error;
+
+@end
+
+@interface StreamingAudioPlayer : NSObject
+
+@property (nonatomic, weak) id<StreamingAudioPlayerDelegate> delegate;
+@property (nonatomic, readonly) NSURL *url;
+// Playback rate, 0.5-2.0. Must be set before calling play.
+@property (nonatomic) float rate;
+// Seconds from play to the start of audio output, or negative until then
+@property (nonatomic, readonly) NSTimeInterval timeToFirstAudio;
+// The whole audio file once it has downloaded successfully, e.g. for
+// caching, or nil
+@property (nonatomic, readonly) NSData *audioData;
+
+- (instancetype)initWithURL:(NSURL *)url;
+// Plays MP3 audio inline in a data: URI, decoding it as playback proceeds
+- (instancetype)initWithDataURI:(NSString *)uri;
+// Plays MP3 audio held in memory, e.g. speech audio from the cache
+- (instancetype)initWithData:(NSData *)data;
+- (void)play;
+- (void)stop;
+
+@end
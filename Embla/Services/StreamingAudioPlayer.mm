@@ -0,0 +1,628 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Streaming playback of synthesized speech.
+ 
+    The answer is fed to an audio queue as it downloads instead of being
+    downloaded in full first, so time to first audio no longer depends
+    on the length of the answer. Incoming bytes go through an incremental
+    MP3 frame parser into a jitter buffer, and the audio queue's buffers
+    are filled from the jitter buffer, both as data arrives and as the
+    queue hands buffers back. Playback starts once a short cushion of
+    audio has been buffered.
+ 
+    All players share one URL session, so connections to the speech
+    audio server are reused from one answer to the next.
+
+    Audio inline in a data: URI takes the same path, decoded a window
+    at a time on a background queue instead of downloaded. Decoding
+    stays only a few seconds ahead of playback, so the decoded audio
+    is never held in full. Audio already in memory, such as cached
+    speech, is fed in the same way.
+ 
+    A processing tap passes the audio on its way to the speaker to the
+    recording service's echo reference, so that its echo can be removed
+    from the microphone and the hotword heard over the answer.
+*/
+
+#import "StreamingAudioPlayer.h"
+#import "Common.h"
+#import "MP3FrameParser.h"
+#import "JitterBuffer.h"
+#import "DataURI.h"
+#import "SessionTrace.h"
+#import "AudioRecordingService.h"
+#import "EchoCanceller.h"
+#import <AVFoundation/AVFoundation.h>
+#import <AudioToolbox/AudioToolbox.h>
+#import <mach/mach_time.h>
+#import <atomic>
+#import <memory>
+#import <mutex>
+#import <vector>
+
+// Audio queue buffers, each holding up to STREAMING_PLAYER_MAX_PACKETS MP3 frames
+#define STREAMING_PLAYER_BUFFER_COUNT       3
+#define STREAMING_PLAYER_BUFFER_SIZE        16384
+#define STREAMING_PLAYER_MAX_PACKETS        64
+// Audio buffered before playback starts, or resumes after running dry (seconds)
+#define STREAMING_PLAYER_PREBUFFER          0.25
+// Number of seconds before a download should time out
+#define STREAMING_PLAYER_REQ_TIMEOUT        25.0f
+// Decoding of data: URIs and audio in memory, in windows of this many bytes
+// and at most this many seconds ahead of playback
+#define STREAMING_PLAYER_DATA_URI_WINDOW    16384
+#define STREAMING_PLAYER_DATA_URI_AHEAD     4.0
+
+@interface StreamingAudioPlayer ()
+{
+    std::unique_ptr<embla::MP3FrameParser> parser;
+    std::unique_ptr<embla::JitterBuffer> jitterBuffer;
+    AudioQueueRef queue;
+    std::mutex freeBuffersMutex;
+    std::vector<AudioQueueBufferRef> freeBuffers;
+    BOOL queueStarted;
+    // Set on the main thread, read on the URL session and decode queues
+    std::atomic<bool> stopped;
+    BOOL downloadFailed;
+    CFAbsoluteTime playTime;
+    // Signalled whenever the audio queue takes audio from the jitter buffer
+    dispatch_semaphore_t bufferConsumed;
+    
+    // Processing tap feeding the echo reference, and its format. The tap
+    // mixes down to mono in tapBuffer, allocated up front.
+    AudioQueueProcessingTapRef tap;
+    AudioStreamBasicDescription tapFormat;
+    std::vector<float> tapBuffer;
+    embla::EchoReference *echoReference;
+    // Seconds from the tap to the speaker
+    double outputDelay;
+    // Seconds per host time unit
+    double hostTimeScale;
+}
+@property (nonatomic, strong, readwrite) NSURL *url;
+@property (nonatomic, strong) NSURLSessionDataTask *task;
+@property (nonatomic, strong) NSString *dataURI;
+@property (nonatomic, strong) NSData *data;
+@property (nonatomic, readwrite) NSTimeInterval timeToFirstAudio;
+@property (nonatomic, strong) NSMutableData *receivedData;
+@property (nonatomic, strong, readwrite) NSData *audioData;
+
+- (void)_didReceiveResponse:(NSURLResponse *)response;
+- (void)_didReceiveData:(NSData *)data;
+- (void)_didCompleteWithError:(NSError *)error;
+
+@end
+
+#pragma mark - Shared session
+
+// Routes URL session delegate calls to the player that owns the task
+@interface StreamingAudioSessionRouter : NSObject <NSURLSessionDataDelegate>
+@property (nonatomic, strong) NSURLSession *session;
+@property (nonatomic, strong) NSMapTable<NSNumber *, StreamingAudioPlayer *> *players;
+@end
+
+@implementation StreamingAudioSessionRouter
+
++ (instancetype)sharedInstance {
+    static StreamingAudioSessionRouter *instance = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        instance = [self new];
+        instance.players = [NSMapTable strongToWeakObjectsMapTable];
+        
+        NSURLSessionConfiguration *configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
+        [configuration setTimeoutIntervalForRequest:STREAMING_PLAYER_REQ_TIMEOUT];
+        NSOperationQueue *delegateQueue = [NSOperationQueue new];
+        delegateQueue.maxConcurrentOperationCount = 1;
+        instance.session = [NSURLSession sessionWithConfiguration:configuration
+                                                         delegate:instance
+                                                    delegateQueue:delegateQueue];
+    });
+    return instance;
+}
+
+- (NSURLSessionDataTask *)taskWithURL:(NSURL *)url forPlayer:(StreamingAudioPlayer *)player {
+    NSURLSessionDataTask *task = [self.session dataTaskWithURL:url];
+    @synchronized (self.players) {
+        [self.players setObject:player forKey:@(task.taskIdentifier)];
+    }
+    return task;
+}
+
+- (StreamingAudioPlayer *)playerForTask:(NSURLSessionTask *)task {
+    @synchronized (self.players) {
+        return [self.players objectForKey:@(task.taskIdentifier)];
+    }
+}
+
+- (void)URLSession:(NSURLSession *)session
+          dataTask:(NSURLSessionDataTask *)dataTask
+didReceiveResponse:(NSURLResponse *)response
+ completionHandler:(void (^)(NSURLSessionResponseDisposition))completionHandler {
+    [[self playerForTask:dataTask] _didReceiveResponse:response];
+    completionHandler(NSURLSessionResponseAllow);
+}
+
+- (void)URLSession:(NSURLSession *)session dataTask:(NSURLSessionDataTask *)dataTask didReceiveData:(NSData *)data {
+    [[self playerForTask:dataTask] _didReceiveData:data];
+}
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didCompleteWithError:(NSError *)error {
+    [[self playerForTask:task] _didCompleteWithError:error];
+    @synchronized (self.players) {
+        [self.players removeObjectForKey:@(task.taskIdentifier)];
+    }
+}
+
+@end
+
+#pragma mark - Audio queue callbacks
+
+static void OutputCallback(void *inUserData, AudioQueueRef inAQ, AudioQueueBufferRef inBuffer);
+static void IsRunningListener(void *inUserData, AudioQueueRef inAQ, AudioQueuePropertyID inID);
+static void TapCallback(void *inClientData, AudioQueueProcessingTapRef inAQTap, UInt32 inNumberFrames,
+                        AudioTimeStamp *ioTimeStamp, AudioQueueProcessingTapFlags *ioFlags,
+                        UInt32 *outNumberFrames, AudioBufferList *ioData);
+
+#pragma mark - Player
+
+@implementation StreamingAudioPlayer
+
+- (instancetype)initWithURL:(NSURL *)url {
+    self = [self _init];
+    if (self) {
+        _url = url;
+        _receivedData = [NSMutableData new];
+    }
+    return self;
+}
+
+- (instancetype)initWithDataURI:(NSString *)uri {
+    self = [self _init];
+    if (self) {
+        _dataURI = uri;
+        bufferConsumed = dispatch_semaphore_create(0);
+    }
+    return self;
+}
+
+- (instancetype)initWithData:(NSData *)data {
+    self = [self _init];
+    if (self) {
+        _data = data;
+        bufferConsumed = dispatch_semaphore_create(0);
+    }
+    return self;
+}
+
+- (instancetype)_init {
+    self = [super init];
+    if (self) {
+        _rate = 1.0f;
+        _timeToFirstAudio = -1;
+        jitterBuffer.reset(new embla::JitterBuffer(STREAMING_PLAYER_PREBUFFER));
+        __weak StreamingAudioPlayer *weakSelf = self;
+        parser.reset(new embla::MP3FrameParser([weakSelf](const uint8_t *frame, const embla::MP3FrameInfo &info) {
+            [weakSelf _didParseFrame:frame info:info];
+        }));
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [self _disposeQueue];
+}
+
+- (void)play {
+    playTime = CFAbsoluteTimeGetCurrent();
+    if (self.dataURI) {
+        [self _decodeDataURI];
+        return;
+    }
+    if (self.data) {
+        [self _decodeData];
+        return;
+    }
+    DLog(@"Streaming audio from %@", [self.url description]);
+    [[SessionTrace sharedInstance] beginSpan:"Speech audio download"];
+    self.task = [[StreamingAudioSessionRouter sharedInstance] taskWithURL:self.url forPlayer:self];
+    [self.task resume];
+}
+
+- (void)stop {
+    stopped = true;
+    [self _bufferConsumed];
+    [self.task cancel];
+    self.task = nil;
+    [self _disposeQueue];
+}
+
+- (void)_disposeQueue {
+    if (queue) {
+        // Disposing of the queue disposes of its processing tap as well
+        AudioQueueDispose(queue, true);
+        queue = NULL;
+        tap = NULL;
+    }
+}
+
+- (void)_failWithMessage:(NSString *)msg {
+    NSError *error = [NSError errorWithDomain:@"Embla" code:0 userInfo:@{ NSLocalizedDescriptionKey:msg }];
+    [self _failWithError:error];
+}
+
+- (void)_failWithError:(NSError *)error {
+    [self.task cancel];
+    dispatch_async(dispatch_get_main_queue(), ^{
+        if (self->stopped) {
+            return;
+        }
+        [self stop];
+        [self.delegate streamingAudioPlayer:self didFailWithError:error];
+    });
+}
+
+#pragma mark - Data URI
+
+- (void)_decodeDataURI {
+    DLog(@"Streaming audio from data URI (%lu characters)", (unsigned long)[self.dataURI length]);
+    dispatch_queue_t queue = dispatch_queue_create("is.mideind.Embla.datauriaudio", DISPATCH_QUEUE_SERIAL);
+    NSString *uri = self.dataURI;
+    dispatch_async(queue, ^{
+        BOOL ok = [DataURI decodeString:uri
+                             windowSize:STREAMING_PLAYER_DATA_URI_WINDOW
+                           chunkHandler:^(NSData *chunk, BOOL *stop) {
+            [self _didReceiveData:chunk];
+            [self _holdOffWhileAhead];
+            *stop = self->stopped;
+        }];
+        if (self->stopped) {
+            return;
+        }
+        NSError *error;
+        if (!ok) {
+            NSString *msg = @"Failed to decode Data URI";
+            error = [NSError errorWithDomain:@"Embla" code:0 userInfo:@{ NSLocalizedDescriptionKey:msg }];
+        }
+        [self _didCompleteWithError:error];
+    });
+}
+
+- (void)_decodeData {
+    DLog(@"Streaming audio from memory (%lu bytes)", (unsigned long)[self.data length]);
+    dispatch_queue_t queue = dispatch_queue_create("is.mideind.Embla.memoryaudio", DISPATCH_QUEUE_SERIAL);
+    NSData *data = self.data;
+    dispatch_async(queue, ^{
+        const uint8_t *bytes = (const uint8_t *)[data bytes];
+        NSUInteger length = [data length];
+        for (NSUInteger offset = 0; offset < length && !self->stopped; offset += STREAMING_PLAYER_DATA_URI_WINDOW) {
+            NSUInteger size = MIN(length - offset, (NSUInteger)STREAMING_PLAYER_DATA_URI_WINDOW);
+            [self _didReceiveData:[NSData dataWithBytesNoCopy:(void *)(bytes + offset) length:size freeWhenDone:NO]];
+            [self _holdOffWhileAhead];
+        }
+        if (self->stopped) {
+            return;
+        }
+        [self _didCompleteWithError:nil];
+    });
+}
+
+// Hold off decoding while well ahead of playback
+- (void)_holdOffWhileAhead {
+    while (!stopped && jitterBuffer->buffered() > STREAMING_PLAYER_DATA_URI_AHEAD) {
+        dispatch_semaphore_wait(bufferConsumed, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC));
+    }
+}
+
+#pragma mark - Download
+
+// The following run on the URL session's serial delegate queue, or the
+// data URI decoding queue
+
+- (void)_didReceiveResponse:(NSURLResponse *)response {
+    DLog(@"Response was: %@", [response description]);
+    NSHTTPURLResponse *httpResponse = (NSHTTPURLResponse *)response;
+    NSString *contentType = [[httpResponse allHeaderFields] objectForKey:@"Content-Type"];
+    if (!contentType || ![contentType hasPrefix:@"audio/mpeg"]) {
+        NSString *msg = [NSString stringWithFormat:@"Wrong content type from speech audio server: %@", contentType];
+        [self _failWithMessage:msg];
+    }
+}
+
+- (void)_didReceiveData:(NSData *)data {
+    if (stopped) {
+        return;
+    }
+    [self.receivedData appendData:data];
+    parser->push((const uint8_t *)[data bytes], [data length]);
+    [self _fillFreeBuffers];
+}
+
+- (void)_didCompleteWithError:(NSError *)error {
+    if (stopped || (error && [error.domain isEqualToString:NSURLErrorDomain] && error.code == NSURLErrorCancelled)) {
+        return;
+    }
+    if (self.url) {
+        [[SessionTrace sharedInstance] endSpan:"Speech audio download"];
+    }
+    parser->finish();
+    embla::MP3FrameParserStats stats = parser->stats();
+    DLog(@"Audio download complete after %.0f ms: %llu frames, %.2f seconds, %llu bytes skipped",
+         (CFAbsoluteTimeGetCurrent() - playTime) * 1000, stats.frames, stats.duration, stats.skippedBytes);
+    
+    if (error || stats.frames == 0) {
+        DLog(@"Error downloading audio: %@", [error localizedDescription]);
+        if (!queueStarted) {
+            error ? [self _failWithError:error] : [self _failWithMessage:@"No audio in speech audio response"];
+            return;
+        }
+        // Play out what did arrive
+        downloadFailed = YES;
+    } else {
+        self.audioData = self.receivedData;
+    }
+    self.receivedData = nil;
+    jitterBuffer->finish();
+    [self _fillFreeBuffers];
+    [self _stopIfDrained];
+}
+
+- (void)_didParseFrame:(const uint8_t *)frame info:(const embla::MP3FrameInfo &)info {
+    if (!queue && ![self _createQueueForFormat:info]) {
+        return;
+    }
+    jitterBuffer->push(frame, info.size, info.duration());
+}
+
+#pragma mark - Audio queue
+
+- (BOOL)_createQueueForFormat:(const embla::MP3FrameInfo &)info {
+    AudioStreamBasicDescription format = {0};
+    format.mSampleRate = info.sampleRate;
+    format.mFormatID = info.layer == 3 ? kAudioFormatMPEGLayer3 :
+                       (info.layer == 2 ? kAudioFormatMPEGLayer2 : kAudioFormatMPEGLayer1);
+    format.mChannelsPerFrame = info.channels;
+    format.mFramesPerPacket = info.samplesPerFrame;
+    
+    OSStatus status = AudioQueueNewOutput(&format, OutputCallback, (__bridge void *)self, NULL, NULL, 0, &queue);
+    if (status != noErr) {
+        queue = NULL;
+        [self _failWithMessage:[NSString stringWithFormat:@"Unable to create audio queue (%d)", (int)status]];
+        return NO;
+    }
+    AudioQueueAddPropertyListener(queue, kAudioQueueProperty_IsRunning, IsRunningListener, (__bridge void *)self);
+    
+    if (self.rate != 1.0f) {
+        UInt32 enable = 1;
+        UInt32 algorithm = kAudioQueueTimePitchAlgorithm_Spectral;
+        AudioQueueSetProperty(queue, kAudioQueueProperty_EnableTimePitch, &enable, sizeof(enable));
+        AudioQueueSetProperty(queue, kAudioQueueProperty_TimePitchAlgorithm, &algorithm, sizeof(algorithm));
+        AudioQueueSetParameter(queue, kAudioQueueParam_PlayRate, self.rate);
+    }
+    AudioQueueSetParameter(queue, kAudioQueueParam_Volume, 1.0);
+    [self _createTap];
+    
+    std::lock_guard<std::mutex> lock(freeBuffersMutex);
+    for (int i = 0; i < STREAMING_PLAYER_BUFFER_COUNT; i++) {
+        AudioQueueBufferRef buffer;
+        if (AudioQueueAllocateBufferWithPacketDescriptions(queue, STREAMING_PLAYER_BUFFER_SIZE,
+                                                           STREAMING_PLAYER_MAX_PACKETS, &buffer) == noErr) {
+            freeBuffers.push_back(buffer);
+        }
+    }
+    return YES;
+}
+
+// Tap the audio after the time pitch effect, as it goes out to the speaker.
+// Echo cancellation is left out if the tap can't be had.
+- (void)_createTap {
+    UInt32 maxFrames = 0;
+    OSStatus status = AudioQueueProcessingTapNew(queue, TapCallback, (__bridge void *)self,
+                                                 kAudioQueueProcessingTap_PostEffects |
+                                                 kAudioQueueProcessingTap_Siphon,
+                                                 &maxFrames, &tapFormat, &tap);
+    if (status != noErr) {
+        DLog(@"Unable to tap audio queue for echo cancellation (%d)", (int)status);
+        tap = NULL;
+        return;
+    }
+    if (!(tapFormat.mFormatFlags & kAudioFormatFlagIsFloat) || tapFormat.mBitsPerChannel != 32) {
+        DLog(@"Audio queue tap format not supported for echo cancellation");
+        AudioQueueProcessingTapDispose(tap);
+        tap = NULL;
+        return;
+    }
+    tapBuffer.assign(maxFrames, 0.0f);
+    AVAudioSession *session = [AVAudioSession sharedInstance];
+    outputDelay = session.IOBufferDuration + session.outputLatency;
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    hostTimeScale = (double)timebase.numer / timebase.denom / NSEC_PER_SEC;
+    echoReference = [[AudioRecordingService sharedInstance] echoReference];
+    echoReference->restartWriter();
+}
+
+// Hands the audio going out to the echo reference. Defined within the class
+// for access to its buffers. Runs on the audio queue's real-time thread, so
+// only touches preallocated state.
+static void TapCallback(void *inClientData, AudioQueueProcessingTapRef inAQTap, UInt32 inNumberFrames,
+                        AudioTimeStamp *ioTimeStamp, AudioQueueProcessingTapFlags *ioFlags,
+                        UInt32 *outNumberFrames, AudioBufferList *ioData) {
+    StreamingAudioPlayer *player = (__bridge StreamingAudioPlayer *)inClientData;
+    *outNumberFrames = inNumberFrames;
+    if (inNumberFrames > player->tapBuffer.size() || ioData->mNumberBuffers == 0) {
+        return;
+    }
+    // Mix down to mono, whether the channels come in separate buffers or interleaved
+    float *mono = player->tapBuffer.data();
+    std::fill(mono, mono + inNumberFrames, 0.0f);
+    UInt32 channels = 0;
+    for (UInt32 b = 0; b < ioData->mNumberBuffers; b++) {
+        const AudioBuffer &buffer = ioData->mBuffers[b];
+        const float *samples = (const float *)buffer.mData;
+        UInt32 stride = std::max<UInt32>(1, buffer.mNumberChannels);
+        if (samples == NULL || buffer.mDataByteSize < inNumberFrames * stride * sizeof(float)) {
+            continue;
+        }
+        for (UInt32 c = 0; c < stride; c++) {
+            for (UInt32 i = 0; i < inNumberFrames; i++) {
+                mono[i] += samples[i * stride + c];
+            }
+        }
+        channels += stride;
+    }
+    if (channels == 0) {
+        return;
+    }
+    if (channels > 1) {
+        float scale = 1.0f / channels;
+        for (UInt32 i = 0; i < inNumberFrames; i++) {
+            mono[i] *= scale;
+        }
+    }
+    // The audio's own time stamp doesn't carry the jitter of when the tap
+    // gets to run. Both are on the host clock, as CACurrentMediaTime is.
+    double time = CACurrentMediaTime();
+    if (ioTimeStamp->mFlags & kAudioTimeStampHostTimeValid) {
+        time = ioTimeStamp->mHostTime * player->hostTimeScale;
+    }
+    player->echoReference->write(time + player->outputDelay, mono, inNumberFrames, player->tapFormat.mSampleRate);
+}
+
+// Fill a buffer from the jitter buffer and enqueue it. If there is
+// nothing to play yet, the buffer is kept for later. Returns NO then.
+- (BOOL)_enqueueBuffer:(AudioQueueBufferRef)buffer {
+    uint32_t sizes[STREAMING_PLAYER_MAX_PACKETS];
+    size_t bytes = 0;
+    size_t count = jitterBuffer->pop((uint8_t *)buffer->mAudioData, buffer->mAudioDataBytesCapacity,
+                                     std::min<size_t>(STREAMING_PLAYER_MAX_PACKETS, buffer->mPacketDescriptionCapacity),
+                                     sizes, bytes);
+    if (count == 0) {
+        std::lock_guard<std::mutex> lock(freeBuffersMutex);
+        freeBuffers.push_back(buffer);
+        return NO;
+    }
+    SInt64 offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        buffer->mPacketDescriptions[i].mStartOffset = offset;
+        buffer->mPacketDescriptions[i].mDataByteSize = sizes[i];
+        buffer->mPacketDescriptions[i].mVariableFramesInPacket = 0;
+        offset += sizes[i];
+    }
+    buffer->mAudioDataByteSize = (UInt32)bytes;
+    buffer->mPacketDescriptionCount = (UInt32)count;
+    return AudioQueueEnqueueBuffer(queue, buffer, 0, NULL) == noErr;
+}
+
+- (void)_fillFreeBuffers {
+    if (!queue) {
+        return;
+    }
+    BOOL enqueued = NO;
+    while (true) {
+        AudioQueueBufferRef buffer;
+        {
+            std::lock_guard<std::mutex> lock(freeBuffersMutex);
+            if (freeBuffers.empty()) {
+                break;
+            }
+            buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+        }
+        if (![self _enqueueBuffer:buffer]) {
+            break;
+        }
+        enqueued = YES;
+    }
+    
+    if (enqueued && !queueStarted) {
+        queueStarted = YES;
+        OSStatus status = AudioQueueStart(queue, NULL);
+        if (status != noErr) {
+            [self _failWithMessage:[NSString stringWithFormat:@"Unable to start audio queue (%d)", (int)status]];
+            return;
+        }
+        [[SessionTrace sharedInstance] mark:"First audio"];
+        NSTimeInterval t = CFAbsoluteTimeGetCurrent() - playTime;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            self.timeToFirstAudio = t;
+        });
+        DLog(@"Audio playback started after %.0f ms, %.2f seconds buffered", t * 1000, jitterBuffer->buffered());
+    }
+}
+
+// Once the stream has ended and every buffer has come back, let the
+// queue play out and stop. The running listener then reports the end.
+- (void)_stopIfDrained {
+    if (!queue || !queueStarted || !jitterBuffer->drained()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(freeBuffersMutex);
+        if (freeBuffers.size() < STREAMING_PLAYER_BUFFER_COUNT) {
+            return;
+        }
+    }
+    dispatch_async(dispatch_get_main_queue(), ^{
+        if (self->queue && !self->stopped) {
+            AudioQueueStop(self->queue, false);
+        }
+    });
+}
+
+- (void)_bufferConsumed {
+    if (bufferConsumed) {
+        dispatch_semaphore_signal(bufferConsumed);
+    }
+}
+
+- (void)_queueDidStop {
+    dispatch_async(dispatch_get_main_queue(), ^{
+        if (self->stopped) {
+            return;
+        }
+        embla::JitterBufferStats stats = self->jitterBuffer->stats();
+        DLog(@"Audio playback finished, %llu underruns, at most %.2f seconds buffered",
+             stats.underruns, stats.maxBuffered);
+        BOOL success = !self->downloadFailed;
+        [self stop];
+        [self.delegate streamingAudioPlayerDidFinishPlaying:self successfully:success];
+    });
+}
+
+@end
+
+// Audio queue has finished with a buffer, so refill it
+static void OutputCallback(void *inUserData, AudioQueueRef inAQ, AudioQueueBufferRef inBuffer) {
+    StreamingAudioPlayer *player = (__bridge StreamingAudioPlayer *)inUserData;
+    if (![player _enqueueBuffer:inBuffer]) {
+        [player _stopIfDrained];
+    }
+    [player _bufferConsumed];
+}
+
+static void IsRunningListener(void *inUserData, AudioQueueRef inAQ, AudioQueuePropertyID inID) {
+    UInt32 running = 0;
+    UInt32 size = sizeof(running);
+    if (AudioQueueGetProperty(inAQ, kAudioQueueProperty_IsRunning, &running, &size) == noErr && !running) {
+        StreamingAudioPlayer *player = (__bridge StreamingAudioPlayer *)inUserData;
+        [player _queueDidStop];
+    }
+}
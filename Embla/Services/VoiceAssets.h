@@ -0,0 +1,60 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#import <Foundation/Foundation.h>
+#ifdef __cplusplus
+#import "VoiceAssetPack.h"
+#endif
+
+// Same order as embla::VoiceClip
+typedef NS_ENUM(NSInteger, VoiceClip) {
+    VoiceClipRecBegin,
+    VoiceClipRecCancel,
+    VoiceClipRecConfirm,
+    VoiceClipConn,
+    VoiceClipErr,
+    VoiceClipDunno01,
+    VoiceClipDunno02,
+    VoiceClipDunno03,
+    VoiceClipDunno04,
+    VoiceClipDunno05,
+    VoiceClipDunno06,
+    VoiceClipDunno07,
+};
+
+@interface VoiceAssets : NSObject
+
++ (instancetype)sharedInstance;
+
+// WAV data for the clip in the current voice, or nil. The data refers to
+// the mapped pack rather than a copy.
+- (NSData *)dataForClip:(VoiceClip)clip;
+
+// Whether the clip is spoken by the voice, i.e. played at speech speed
+- (BOOL)isVoicedClip:(VoiceClip)clip;
+
+// Playing time of the clip at normal speed, zero if there's no such clip
+- (NSTimeInterval)durationOfClip:(VoiceClip)clip;
+
+#ifdef __cplusplus
+// The pack itself, and the clip in the current voice straight from it, or null
+- (const embla::VoiceAssetPack &)pack;
+- (const embla::VoiceClipData *)clipData:(VoiceClip)clip;
+#endif
+
+@end
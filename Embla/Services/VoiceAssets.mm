@@ -0,0 +1,113 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Singleton wrapper around the packed sound clips, VoiceAssets.pack in
+    the app bundle. See VoiceAssetPack.h.
+
+    The pack is mapped once, the first time a clip is needed. The voice
+    is resolved to its index in the pack when the VoiceID default
+    changes, rather than on every lookup.
+*/
+
+#import "VoiceAssets.h"
+#import "Common.h"
+#import "NSString+Additions.h"
+#import "VoiceAssetPack.h"
+#import <memory>
+
+#define VOICE_ASSETS_RESOURCE   @"VoiceAssets"
+#define VOICE_ASSETS_EXTENSION  @"pack"
+
+static_assert(VoiceClipDunno07 + 1 == (NSInteger)embla::VoiceClip::Count, "VoiceClip matches embla::VoiceClip");
+
+@interface VoiceAssets ()
+{
+    std::unique_ptr<embla::VoiceAssetPack> pack;
+    NSString *voiceName;
+    int voice;
+}
+@end
+
+@implementation VoiceAssets
+
++ (instancetype)sharedInstance {
+    static VoiceAssets *instance = nil;
+    if (!instance) {
+        instance = [self new];
+    }
+    return instance;
+}
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        NSString *path = [[NSBundle mainBundle] pathForResource:VOICE_ASSETS_RESOURCE ofType:VOICE_ASSETS_EXTENSION];
+        pack.reset(new embla::VoiceAssetPack(path ? [path fileSystemRepresentation] : ""));
+        if (!pack->isOpen()) {
+            DLog(@"Unable to load voice assets from '%@'", path);
+        }
+        voice = -1;
+    }
+    return self;
+}
+
+- (const embla::VoiceAssetPack &)pack {
+    return *pack;
+}
+
+- (const embla::VoiceClipData *)clipData:(VoiceClip)clip {
+    @synchronized(self) {
+        NSString *name = [DEFAULTS stringForKey:@"VoiceID"];
+        if (name != voiceName && ![name isEqualToString:voiceName]) {
+            voiceName = [name copy];
+            NSString *asciiName = [[name icelandic_asciify] lowercaseString];
+            voice = asciiName ? pack->voiceIndex([asciiName UTF8String]) : -1;
+            if (voice < 0) {
+                DLog(@"No voice assets for voice '%@'", name);
+            }
+        }
+        // UI sounds are the same for every voice
+        const embla::VoiceClipData *data = pack->clip(voice >= 0 ? (size_t)voice : 0, (embla::VoiceClip)clip);
+        if (data && data->voiced && voice < 0) {
+            return nullptr;
+        }
+        return data;
+    }
+}
+
+- (NSData *)dataForClip:(VoiceClip)clip {
+    const embla::VoiceClipData *data = [self clipData:clip];
+    if (data == nullptr) {
+        return nil;
+    }
+    // The pack stays mapped for the lifetime of the app
+    return [NSData dataWithBytesNoCopy:(void *)data->wav length:data->wavSize freeWhenDone:NO];
+}
+
+- (BOOL)isVoicedClip:(VoiceClip)clip {
+    const embla::VoiceClipData *data = [self clipData:clip];
+    return data && data->voiced;
+}
+
+- (NSTimeInterval)durationOfClip:(VoiceClip)clip {
+    const embla::VoiceClipData *data = [self clipData:clip];
+    return data && data->sampleRate ? (NSTimeInterval)data->frames / data->sampleRate : 0.0;
+}
+
+@end
@@ -36,6 +36,11 @@
 - (void)sessionDidRaiseError:(NSError *)err;
 - (void)sessionDidTerminate;
 
+@optional
+// The answer is about to play through a player whose echo is cancelled
+// from the recording, so the hotword can be listened for during playback
+- (void)sessionWillStartInterruptiblePlayback;
+
 @end
 
 
@@ -44,12 +49,20 @@
 @property (nonatomic, weak) id<QuerySessionDelegate> delegate;
 @property (readonly) CGFloat audioLevel;
 @property (readonly) BOOL isRecording;
+@property (readonly) BOOL isPlaying;
 @property (readonly) BOOL terminated;
 @property (nonatomic, strong) NSMutableData *totalAudioData;
 
 - (instancetype)initWithDelegate:(id<QuerySessionDelegate>)del;
 - (void)start;
+// Start by streaming audio recorded since the given position of the recording
+// service, e.g. from where a hotword was heard, then continue with live audio.
+- (void)startFromSamplePosition:(uint64_t)position;
 - (void)terminate;
 - (void)playRemoteURL:(NSString *)urlString;
+// As above, and cache the audio as speech for the given text
+- (void)playRemoteURL:(NSString *)urlString text:(NSString *)text;
+// Returns NO if no speech audio for the text is cached
+- (BOOL)playCachedSpeechForText:(NSString *)text;
 
 @end
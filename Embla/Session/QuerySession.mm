@@ -0,0 +1,641 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+    Session class that handles the process of receiving speech input,
+    communicating with the speech recognition API, sending the ensuing
+    query to the query API and playing the speech-synthesized response.
+
+    The session logic lives in embla::SessionMachine (SessionMachine.h).
+    This class connects it to the app's recording, speech recognition,
+    query and playback services, and to the delegate.
+*/
+
+#import "QuerySession.h"
+#import "AudioRecordingService.h"
+#import "Common.h"
+#import "QueryService.h"
+#import "SpeechRecognitionService.h"
+#import "StreamingAudioPlayer.h"
+#import "SpeechAudioCache.h"
+#import "VoiceAssets.h"
+#import "SessionTrace.h"
+#import "DataURI.h"
+#import "SessionMachine.h"
+#import <AVFoundation/AVFoundation.h>
+#import <memory>
+
+
+#define SESSION_MIN_AUDIO_LEVEL 0.03f
+// How quickly the displayed audio level falls back after a peak
+#define SESSION_LEVEL_RELEASE_MS 150
+
+// Google recommends sending samples in 100 ms chunks
+#define SESSION_STT_CHUNK_MS    100
+// Chunks that can be in flight to the speech recognition service at once
+#define SESSION_STT_CHUNK_SLOTS 16
+
+// Interim results at least this stable are sent to the query server ahead
+// of the final transcript, if the SpeculativeQueries default is set. It is
+// off unless turned on, as it adds load on the query server and sends
+// transcripts the user hasn't finished.
+#define SESSION_SPECULATION_MIN_STABILITY   0.8f
+// Limit on speculative queries per session, to spare the query server
+#define SESSION_MAX_SPECULATIVE_QUERIES     3
+
+
+static inline std::string StdString(NSString *s) {
+    return [s isKindOfClass:[NSString class]] ? std::string([s UTF8String]) : std::string();
+}
+
+static inline NSString *NSStringFromStd(const std::string &s) {
+    return [NSString stringWithUTF8String:s.c_str()];
+}
+
+// Empty strings stand for missing values
+static inline NSString *NSStringOrNil(const std::string &s) {
+    return s.empty() ? nil : NSStringFromStd(s);
+}
+
+static NSArray<NSString *> *NSArrayFromStd(const std::vector<std::string> &strings) {
+    NSMutableArray<NSString *> *res = [NSMutableArray new];
+    for (const std::string &s : strings) {
+        [res addObject:NSStringFromStd(s)];
+    }
+    return [res copy];
+}
+
+
+class QuerySessionBridge;
+
+@interface QuerySession () <AudioRecordingServiceDelegate, AVAudioPlayerDelegate, StreamingAudioPlayerDelegate>
+{
+    std::unique_ptr<embla::SessionMachine> machine;
+    std::unique_ptr<QuerySessionBridge> bridge;
+    
+    // Requests to the query server in flight, by ID
+    NSMutableDictionary<NSNumber *, NSURLSessionDataTask *> *queryTasks;
+    int lastQueryID;
+    // Error being reported to the machine, passed on to the delegate as is
+    NSError *pendingError;
+}
+@property (nonatomic, strong) AVAudioPlayer *audioPlayer;
+@property (nonatomic, strong) StreamingAudioPlayer *streamingPlayer;
+// Text spoken in the audio being streamed, if known, for caching
+@property (nonatomic, strong) NSString *streamingText;
+
+- (void)_startCapture:(uint64_t)position;
+- (void)_stopCapture;
+- (void)_sendAudio:(const embla::SessionAudioChunk &)chunk;
+- (void)_finishAudio;
+- (int)_sendQuery:(NSArray<NSString *> *)alternatives speculative:(BOOL)speculative;
+- (void)_cancelQuery:(int)requestID;
+- (void)_playRemoteURL:(NSString *)urlString text:(NSString *)text;
+- (BOOL)_playCachedSpeechForText:(NSString *)text;
+- (void)_playStreaming:(StreamingAudioPlayer *)player;
+- (void)_stopPlayback;
+- (void)_playbackFailed:(NSError *)error;
+- (NSString *)playDunno;
+- (void)_didStopRecording;
+- (void)_didFail:(NSString *)message;
+- (void)_didResolveSpeculation:(BOOL)hit saved:(double)saved roundTrip:(double)roundTrip;
+
+@end
+
+
+// Hands the machine's calls to the session. Everything happens on the main queue.
+class QuerySessionBridge : public embla::SessionAudioInput, public embla::SessionRecognizer,
+                           public embla::SessionQueryClient, public embla::SessionPlayer,
+                           public embla::SessionListener {
+public:
+    explicit QuerySessionBridge(QuerySession *session) : _session(session) {}
+
+    void startCapture(uint64_t position) override { [_session _startCapture:position]; }
+    void stopCapture() override { [_session _stopCapture]; }
+
+    void sendAudio(const embla::SessionAudioChunk &chunk) override { [_session _sendAudio:chunk]; }
+    void finishAudio() override { [_session _finishAudio]; }
+
+    int sendQuery(const std::vector<std::string> &alternatives, bool speculative) override {
+        return [_session _sendQuery:NSArrayFromStd(alternatives) speculative:speculative];
+    }
+    void cancelQuery(int requestID) override { [_session _cancelQuery:requestID]; }
+
+    void play(const std::string &url, const std::string &text) override {
+        [_session _playRemoteURL:NSStringFromStd(url) text:NSStringOrNil(text)];
+    }
+    bool playCachedSpeech(const std::string &text) override {
+        return [_session _playCachedSpeechForText:NSStringFromStd(text)];
+    }
+    std::string playDunno() override { return StdString([_session playDunno]); }
+    void stop() override { [_session _stopPlayback]; }
+
+    void sessionDidStartRecording() override { [_session.delegate sessionDidStartRecording]; }
+    void sessionDidStopRecording() override { [_session _didStopRecording]; }
+    void sessionDidReceiveInterimResults(const std::vector<std::string> &alternatives) override {
+        [_session.delegate sessionDidReceiveInterimResults:NSArrayFromStd(alternatives)];
+    }
+    void sessionDidReceiveTranscripts(const std::vector<std::string> &alternatives) override {
+        DLog(@"Received final speech recognition response: %@", NSArrayFromStd(alternatives));
+        [_session.delegate sessionDidReceiveTranscripts:alternatives.empty() ? nil : NSArrayFromStd(alternatives)];
+    }
+    void sessionDidReceiveAnswer(const embla::QueryAnswer &a) override {
+        NSString *imgURLStr = NSStringOrNil(a.imageURL);
+        NSString *openURLStr = NSStringOrNil(a.openURL);
+        [_session.delegate sessionDidReceiveAnswer:NSStringOrNil(a.answer)
+                                        toQuestion:NSStringOrNil(a.question)
+                                            source:NSStringOrNil(a.source)
+                                           openURL:openURLStr ? [NSURL URLWithString:openURLStr] : nil
+                                          imageURL:imgURLStr ? [NSURL URLWithString:imgURLStr] : nil
+                                           command:NSStringOrNil(a.command)];
+    }
+    void sessionDidFail(const std::string &message) override { [_session _didFail:NSStringFromStd(message)]; }
+    void sessionDidTerminate() override { [_session.delegate sessionDidTerminate]; }
+    void sessionDidResolveSpeculation(bool hit, double secondsSaved, double roundTrip) override {
+        [_session _didResolveSpeculation:hit saved:secondsSaved roundTrip:roundTrip];
+    }
+
+    void sessionTraceBegin(const char *name) override { [[SessionTrace sharedInstance] beginSpan:name]; }
+    void sessionTraceEnd(const char *name) override { [[SessionTrace sharedInstance] endSpan:name]; }
+    void sessionTraceMark(const char *name) override { [[SessionTrace sharedInstance] mark:name]; }
+
+private:
+    __weak QuerySession *_session;
+};
+
+
+@implementation QuerySession
+
+- (instancetype)initWithDelegate:(id<QuerySessionDelegate>)del {
+    self = [super init];
+    if (self) {
+        _delegate = del;
+        queryTasks = [NSMutableDictionary new];
+        
+        SpeechRecognitionService *service = [SpeechRecognitionService sharedInstance];
+        embla::SessionConfig config;
+        config.sampleRate = (int)REC_SAMPLE_RATE;
+        config.chunkMs = SESSION_STT_CHUNK_MS;
+        config.chunkSlots = SESSION_STT_CHUNK_SLOTS;
+        // Each 100 ms chunk becomes one FLAC frame, roughly halving the upload
+        config.flac = (service.audioEncoding == RecognitionConfig_AudioEncoding_Flac);
+        config.levelReleaseMs = SESSION_LEVEL_RELEASE_MS;
+        config.interimMinStability = MIN_STT_RESULT_STABILITY;
+        config.speculativeQueries = [DEFAULTS boolForKey:@"SpeculativeQueries"];
+        config.speculationMinStability = SESSION_SPECULATION_MIN_STABILITY;
+        config.maxSpeculativeQueries = SESSION_MAX_SPECULATIVE_QUERIES;
+        
+        bridge.reset(new QuerySessionBridge(self));
+        embla::SessionServices services;
+        services.audio = bridge.get();
+        services.recognizer = bridge.get();
+        services.query = bridge.get();
+        services.player = bridge.get();
+        services.listener = bridge.get();
+        machine.reset(new embla::SessionMachine(config, services));
+    }
+    return self;
+}
+
+#pragma mark - Start / stop
+
+- (void)start {
+    [self startFromSamplePosition:[[AudioRecordingService sharedInstance] samplePosition]];
+}
+
+- (void)startFromSamplePosition:(uint64_t)position {
+    NSAssert(self.terminated == FALSE, @"Reusing one-off QuerySession object");
+    DLog(@"Starting session");
+    self.totalAudioData = [NSMutableData new];
+    machine->start(position);
+}
+
+- (void)terminate {
+    if (self.terminated) {
+        return;
+    }
+    DLog(@"Terminating session");
+    machine->terminate();
+}
+
+- (BOOL)isRecording {
+    return machine->isRecording();
+}
+
+- (BOOL)isPlaying {
+    return machine->state() == embla::SessionState::Playing;
+}
+
+- (BOOL)terminated {
+    return machine->terminated();
+}
+
+- (void)_didFail:(NSString *)message {
+    NSError *error = pendingError;
+    if (error == nil) {
+        error = [NSError errorWithDomain:@"Embla" code:0 userInfo:@{ NSLocalizedDescriptionKey: message }];
+    }
+    pendingError = nil;
+    DLog(@"Session error: %@", [error localizedDescription]);
+    [self.delegate sessionDidRaiseError:error];
+}
+
+#pragma mark - Recording
+
+- (void)_startCapture:(uint64_t)position {
+    // If capture is already running (i.e. the hotword detector was listening)
+    // it carries on uninterrupted and we pick up from the given position
+    AudioRecordingService *recorder = [AudioRecordingService sharedInstance];
+    [recorder setDelegate:self replayingFromSample:position];
+    [recorder start];
+}
+
+- (void)_stopCapture {
+    AudioRecordingService *recorder = [AudioRecordingService sharedInstance];
+    if (recorder.delegate == self) {
+        [recorder setDelegate:nil];
+        [recorder stop];
+    }
+}
+
+- (void)_didStopRecording {
+    embla::SessionStats stats = machine->stats();
+    DLog(@"Speech recognition duration: %.2f seconds (%llu bytes)", machine->speechSeconds(), stats.bytes);
+    DLog(@"Speech recognition chunks: %llu sent, %llu copied because all slots were in flight",
+         stats.chunks, stats.transientChunks);
+    if (stats.samples) {
+        DLog(@"Speech audio sent at %.0f%% of its PCM size", 100.0 * stats.bytes / (stats.samples * sizeof(int16_t)));
+    }
+    [self.delegate sessionDidStopRecording];
+}
+
+#pragma mark - AudioRecordingServiceDelegate
+
+- (void)processSampleData:(NSData *)data {
+    if (!self.isRecording) {
+        DLog(@"Received audio data (%d bytes) after recording ended.", (int)[data length]);
+        return;
+    }
+    // Mono 16-bit audio means each frame is 2 bytes
+    machine->audioReceived((const int16_t *)[data bytes], [data length] / 2);
+}
+
+#pragma mark - Speech recognition
+
+// Chunks held in a slot of the machine's chunk assembler are sent without
+// copying. The slot is returned to the pool when the NSData wrapping it is
+// freed.
+- (void)_sendAudio:(const embla::SessionAudioChunk &)chunk {
+    NSData *audioData;
+    if (chunk.holdsSlot()) {
+        embla::SessionAudioChunk held = chunk;
+        audioData = [[NSData alloc] initWithBytesNoCopy:(void *)chunk.data length:chunk.length
+                                            deallocator:^(void *bytes, NSUInteger len) {
+            held.release();
+        }];
+    } else {
+        audioData = [NSData dataWithBytes:chunk.data length:chunk.length];
+    }
+    
+    SpeechRecognitionCompletionHandler handler = ^(StreamingRecognizeResponse *response, NSError *error) {
+        if (self.terminated) {
+            DLog(@"Terminated task received speech recognition response: %@", [response description]);
+            return;
+        }
+        if (error) {
+            DLog(@"Speech recognition error: %@", error);
+            self->pendingError = error;
+            self->machine->recognitionFailed(StdString([error localizedDescription]));
+            self->pendingError = nil;
+        } else if (response == nil) {
+            self->machine->recognitionEnded();
+        } else {
+            DLog(@"Received speech recognition response: %@", response);
+            self->machine->recognitionResponse([self recognitionResponseFrom:response]);
+        }
+    };
+    [[SpeechRecognitionService sharedInstance] streamAudioData:audioData withCompletion:handler];
+}
+
+- (void)_finishAudio {
+    [[SpeechRecognitionService sharedInstance] stopStreaming];
+}
+
+- (embla::RecognitionResponse)recognitionResponseFrom:(StreamingRecognizeResponse *)response {
+    embla::RecognitionResponse r;
+    r.endOfUtterance = (response.speechEventType == StreamingRecognizeResponse_SpeechEventType_EndOfSingleUtterance);
+    for (StreamingRecognitionResult *result in response.resultsArray) {
+        embla::RecognitionResult res;
+        res.isFinal = result.isFinal;
+        res.stability = result.stability;
+        for (SpeechRecognitionAlternative *a in result.alternativesArray) {
+            res.alternatives.push_back(StdString(a.transcript));
+        }
+        r.results.push_back(res);
+    }
+    return r;
+}
+
+#pragma mark - Communication w. query server
+
+- (int)_sendQuery:(NSArray<NSString *> *)alternatives speculative:(BOOL)speculative {
+    DLog(@"Sending %@query to server: %@", speculative ? @"speculative " : @"", [alternatives description]);
+    int requestID = ++lastQueryID;
+    id completionHandler = ^(NSURLResponse *response, id responseObject, NSError *error) {
+        [self->queryTasks removeObjectForKey:@(requestID)];
+        if (self.terminated) {
+            // Ignore response if task has already been terminated
+            DLog(@"Terminated task received query server response: %@", [response description]);
+            return;
+        }
+        if (error) {
+            DLog(@"Error from query server: %@", [error localizedDescription]);
+            self->pendingError = error;
+            self->machine->queryFailed(requestID, StdString([error localizedDescription]));
+            self->pendingError = nil;
+            return;
+        }
+        if (![responseObject isKindOfClass:[NSDictionary class]]) {
+            NSString *msg = [NSString stringWithFormat:@"Malformed response from query server: %@",
+                             [responseObject description]];
+            self->machine->queryFailed(requestID, StdString(msg));
+            return;
+        }
+        DLog(@"Handling query server response: %@", [responseObject description]);
+        self->machine->queryAnswered(requestID, [self queryAnswerFrom:responseObject]);
+    };
+    NSURLSessionDataTask *task = [[QueryService sharedInstance] sendQuery:alternatives
+                                                                 unlogged:speculative
+                                                        completionHandler:completionHandler];
+    if (task) {
+        queryTasks[@(requestID)] = task;
+    }
+    return requestID;
+}
+
+- (void)_cancelQuery:(int)requestID {
+    [queryTasks[@(requestID)] cancel];
+    [queryTasks removeObjectForKey:@(requestID)];
+}
+
+- (embla::QueryAnswer)queryAnswerFrom:(NSDictionary *)r {
+    embla::QueryAnswer a;
+    a.answer = StdString([r objectForKey:@"answer"]);
+    a.question = StdString([r objectForKey:@"q"]);
+    a.source = StdString([r objectForKey:@"source"]);
+    a.command = StdString([r objectForKey:@"command"]);
+    a.imageURL = StdString([r objectForKey:@"image"]);
+    a.audioURL = StdString([r objectForKey:@"audio"]);
+    a.openURL = StdString([r objectForKey:@"open_url"]);
+    a.voice = StdString([r objectForKey:@"voice"]);
+    return a;
+}
+
+#pragma mark - Speculative queries
+
+- (void)_didResolveSpeculation:(BOOL)hit saved:(double)saved roundTrip:(double)roundTrip {
+    embla::SpeculationStats stats = embla::SessionMachine::speculationStats();
+    unsigned long total = (unsigned long)(stats.hits + stats.misses);
+    if (hit) {
+        DLog(@"Speculative query hit, saved %.0f ms of %.0f ms round trip (hit rate %lu/%lu, %.0f ms saved on average)",
+             saved * 1000, roundTrip * 1000, (unsigned long)stats.hits, total,
+             stats.secondsSaved * 1000 / stats.hits);
+    } else {
+        DLog(@"Speculative query missed (hit rate %lu/%lu)", (unsigned long)stats.hits, total);
+    }
+}
+
+#pragma mark - Audio Playback
+
+- (void)playAudio:(id)filenameOrData {
+    [self playAudio:filenameOrData rate:1.0];
+}
+
+// Utility function that creates an AVAudioPlayer to play either a local file or audio data
+- (void)playAudio:(id)filenameOrData rate:(float)rate {
+    NSAssert([filenameOrData isKindOfClass:[NSString class]] || [filenameOrData isKindOfClass:[NSData class]],
+             @"playAudio argument neither filename string nor data.");
+    
+    NSError *err;
+    AVAudioPlayer *player;
+    
+    if ([filenameOrData isKindOfClass:[NSString class]]) {
+        // Local filename specified, init player with local file URL
+        NSString *filename = (NSString *)filenameOrData;
+        NSURL *url = [[NSBundle mainBundle] URLForResource:filename withExtension:@"wav"];
+        if (url) {
+            DLog(@"Playing audio file '%@'", filename);
+            player = [[AVAudioPlayer alloc] initWithContentsOfURL:url error:&err];
+        } else {
+            NSString *errStr = [NSString stringWithFormat:@"Unable to find audio file '%@' in bundle", filename];
+            err = [NSError errorWithDomain:@"Embla" code:0 userInfo:@{ NSLocalizedDescriptionKey: errStr }];
+        }
+    }
+    else {
+        // Init player with audio data
+        NSData *data = (NSData *)filenameOrData;
+        player = [[AVAudioPlayer alloc] initWithData:data error:&err];
+        DLog(@"Playing audio data (%.2f seconds, size %d bytes)", player.duration, (int)[data length]);
+    }
+    
+    if (err) {
+        DLog(@"%@", [err localizedDescription]);
+        [self _playbackFailed:err];
+        return;
+    }
+    
+    // Configure player and set it off
+    self.audioPlayer = player;
+    [self.audioPlayer setVolume:1.0];
+    if (rate != 1.0) {
+        self.audioPlayer.enableRate = YES;
+        [self.audioPlayer setRate:rate];
+    }
+//    [player setMeteringEnabled:YES];
+    [player setDelegate:self];
+    [player play];
+    [[SessionTrace sharedInstance] mark:"First audio"];
+}
+
+- (void)playRemoteURL:(NSString *)urlString {
+    [self playRemoteURL:urlString text:nil];
+}
+
+- (void)playRemoteURL:(NSString *)urlString text:(NSString *)text {
+    machine->play(StdString(urlString), StdString(text));
+}
+
+- (BOOL)playCachedSpeechForText:(NSString *)text {
+    return machine->playCachedSpeech(StdString(text));
+}
+
+- (void)_stopPlayback {
+    if (self.audioPlayer) {
+        [self.audioPlayer stop];
+        self.audioPlayer = nil;
+    }
+    if (self.streamingPlayer) {
+        [self.streamingPlayer stop];
+        self.streamingPlayer = nil;
+    }
+}
+
+- (void)_playbackFailed:(NSError *)error {
+    pendingError = error;
+    machine->playbackFailed(StdString([error localizedDescription]));
+    pendingError = nil;
+}
+
+// Play speech audio for text from the cache, if there
+- (BOOL)_playCachedSpeechForText:(NSString *)text {
+    NSData *data = [[SpeechAudioCache sharedInstance] audioForText:text];
+    if (data == nil) {
+        return NO;
+    }
+    [self _playStreaming:[[StreamingAudioPlayer alloc] initWithData:data]];
+    return YES;
+}
+
+// Play remote MP3 file, from the cache if it has been played before,
+// otherwise starting as soon as enough of it has downloaded
+- (void)_playRemoteURL:(NSString *)urlString text:(NSString *)text {
+    
+    // Special handling of Data URIs. MP3 audio is decoded as it plays.
+    if ([DataURI isDataURI:urlString] && [urlString hasPrefix:@"data:audio/mpeg"]) {
+        [self _playStreaming:[[StreamingAudioPlayer alloc] initWithDataURI:urlString]];
+        return;
+    }
+    if ([DataURI isDataURI:urlString]) {
+        DataURI *uri = [[DataURI alloc] initWithString:urlString];
+        NSData *data = [uri data];
+        if (uri == nil || data == nil) {
+            NSString *msg = [NSString stringWithFormat:@"Failed to decode Data URI %@", urlString];
+            NSError *error = [NSError errorWithDomain:@"Embla" code:0 userInfo:@{ NSLocalizedDescriptionKey:msg }];
+            DLog(@"Error fetching audio: %@", [error localizedDescription]);
+            [self _playbackFailed:error];
+            return;
+        }
+        [self playAudio:data];
+        return;
+    }
+    
+    NSURL *url = [NSURL URLWithString:urlString];
+    NSData *cachedData = [[SpeechAudioCache sharedInstance] audioForText:text url:url];
+    if (cachedData) {
+        [self _playStreaming:[[StreamingAudioPlayer alloc] initWithData:cachedData]];
+        return;
+    }
+    
+    self.streamingText = text;
+    [self _playStreaming:[[StreamingAudioPlayer alloc] initWithURL:url]];
+}
+
+// Speech played this way feeds the echo canceller, so the hotword can
+// interrupt it. The "don't know" clips are too short to bother.
+- (void)_playStreaming:(StreamingAudioPlayer *)player {
+    [player setDelegate:self];
+    self.streamingPlayer = player;
+    if ([self.delegate respondsToSelector:@selector(sessionWillStartInterruptiblePlayback)]) {
+        [self.delegate sessionWillStartInterruptiblePlayback];
+    }
+    [player play];
+}
+
+// Play a "don't know" answer in the current voice
+- (NSString *)playDunno {
+    uint32_t rnd = arc4random_uniform(6) + 1;
+    NSString *dunnoName = [NSString stringWithFormat:@"dunno%02d", rnd];
+    NSData *data = [[VoiceAssets sharedInstance] dataForClip:VoiceClipDunno01 + rnd - 1];
+    if (data) {
+        [self playAudio:data rate:[DEFAULTS floatForKey:@"SpeechSpeed"]];
+    } else {
+        NSString *errStr = [NSString stringWithFormat:@"Unable to find audio clip '%@'", dunnoName];
+        NSError *err = [NSError errorWithDomain:@"Embla" code:0 userInfo:@{ NSLocalizedDescriptionKey: errStr }];
+        DLog(@"%@", [err localizedDescription]);
+        [self _playbackFailed:err];
+    }
+    NSDictionary *dunnoStrings = @{
+        @"dunno01": @"Ég get ekki svarað því.",
+        @"dunno02": @"Ég get því miður ekki svarað því.",
+        @"dunno03": @"Ég kann ekki svar við því.",
+        @"dunno04": @"Ég skil ekki þessa fyrirspurn.",
+        @"dunno05": @"Ég veit það ekki.",
+        @"dunno06": @"Því miður skildi ég þetta ekki.",
+        @"dunno07": @"Því miður veit ég það ekki.",
+    };
+    return [dunnoStrings objectForKey:dunnoName];
+}
+
+#pragma mark - AVAudioPlayerDelegate
+
+// Audio playback of the response is the final task in the pipeline.
+// Once the speech audio file is done playing, the session is over.
+- (void)audioPlayerDidFinishPlaying:(AVAudioPlayer *)player successfully:(BOOL)flag {
+    machine->playbackFinished(flag);
+}
+
+#pragma mark - StreamingAudioPlayerDelegate
+
+- (void)streamingAudioPlayerDidFinishPlaying:(StreamingAudioPlayer *)player successfully:(BOOL)flag {
+    DLog(@"Streamed audio answer finished, time to first audio %.0f ms", player.timeToFirstAudio * 1000);
+    if (flag && player.audioData) {
+        [[SpeechAudioCache sharedInstance] storeAudio:player.audioData forURL:player.url text:self.streamingText];
+    }
+    machine->playbackFinished(flag);
+}
+
+- (void)streamingAudioPlayer:(StreamingAudioPlayer *)player didFailWithError:(NSError *)error {
+    if (self.terminated) {
+        return;
+    }
+    DLog(@"Error fetching audio: %@", [error localizedDescription]);
+    [self _playbackFailed:error];
+}
+
+#pragma mark - Audio level
+
+// The session has an audio level property. If we are recording, this is
+// the volume of the latest microphone input. Otherwise, it is zero.
+- (CGFloat)audioLevel {
+    CGFloat level = 0.f;
+    CGFloat min = SESSION_MIN_AUDIO_LEVEL;
+    if (self.isRecording) {
+        level = [self _normalizedPowerLevelFromDecibels:machine->levelDbfs()];
+//        DLog(@"Audio level: %.2f", level);
+    }
+    return (isnan(level) || level < min) ? min : level;
+}
+
+// Given a decibel range, normalize it to a value between 0.0 and 1.0
+- (CGFloat)_normalizedPowerLevelFromDecibels:(CGFloat)decibels {
+    if (decibels < -60.0f) {
+        return 0.0f;
+    }
+    if (decibels >= 0.0f) {
+        return 1.0f;
+    }
+    CGFloat exp = 0.05f;
+    return powf(
+                    (powf(10.0f, exp * decibels) - powf(10.0f, exp * -60.0f))
+                    * (1.0f / (1.0f - powf(10.0f, exp * -60.0f))),
+                    1.0f / 2.0f
+                );
+}
+
+@end
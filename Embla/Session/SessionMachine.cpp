@@ -0,0 +1,525 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "SessionMachine.h"
+#include "ChunkAssembler.h"
+#include "FlacEncoder.h"
+#include "LevelMeter.h"
+#include <algorithm>
+#include <chrono>
+
+namespace embla {
+
+static SpeculationStats speculationStatsSinceLaunch;
+
+const char *sessionStateName(SessionState state) {
+    switch (state) {
+        case SessionState::Idle: return "idle";
+        case SessionState::Recording: return "recording";
+        case SessionState::Recognizing: return "recognizing";
+        case SessionState::Querying: return "querying";
+        case SessionState::Playing: return "playing";
+        case SessionState::Answered: return "answered";
+        case SessionState::Terminated: return "terminated";
+    }
+    return "unknown";
+}
+
+void SessionAudioChunk::release() const {
+    if (holdsSlot()) {
+        assembler->release(slot);
+    }
+}
+
+static std::string Trimmed(const std::string &s) {
+    const char *ws = " \t\n\r";
+    size_t begin = s.find_first_not_of(ws);
+    if (begin == std::string::npos) {
+        return "";
+    }
+    return s.substr(begin, s.find_last_not_of(ws) + 1 - begin);
+}
+
+// Transcripts are compared ignoring surrounding whitespace and case,
+// which is folded for ASCII and the Latin-1 letters, i.e. all of Icelandic
+static std::string NormalizedTranscript(const std::string &s) {
+    std::string r = Trimmed(s);
+    for (size_t i = 0; i < r.size(); i++) {
+        unsigned char c = (unsigned char)r[i];
+        if (c >= 'A' && c <= 'Z') {
+            r[i] = (char)(c + 32);
+        } else if (c == 0xC3 && i + 1 < r.size()) {
+            // U+00C0-U+00DE, except the multiplication sign
+            unsigned char d = (unsigned char)r[i + 1];
+            if (d >= 0x80 && d <= 0x9E && d != 0x97) {
+                r[i + 1] = (char)(d + 0x20);
+            }
+            i++;
+        }
+    }
+    return r;
+}
+
+static bool TranscriptsMatch(const std::string &a, const std::string &b) {
+    return NormalizedTranscript(a) == NormalizedTranscript(b);
+}
+
+// The query server picks among the alternatives, so a query is only the
+// same if all of them are, in the same order
+static bool AlternativesMatch(const std::vector<std::string> &a, const std::vector<std::string> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (!TranscriptsMatch(a[i], b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+SessionMachine::SessionMachine(const SessionConfig &config, const SessionServices &services)
+    : _config(config), _services(services) {}
+
+SessionMachine::~SessionMachine() = default;
+
+double SessionMachine::now() const {
+    if (_services.clock) {
+        return _services.clock();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SessionMachine::setState(SessionState state) {
+    _state = state;
+}
+
+// Start / stop
+
+void SessionMachine::start(uint64_t position) {
+    if (_state != SessionState::Idle) {
+        return;
+    }
+    size_t chunkSamples = (size_t)_config.sampleRate * _config.chunkMs / 1000;
+    _chunkAssembler = std::make_shared<ChunkAssembler>(chunkSamples, _config.chunkSlots,
+        [this](const int16_t *samples, size_t count, int slot) { sendChunk(samples, count, slot); });
+    if (_config.flac) {
+        // Each chunk becomes one FLAC frame, roughly halving the upload
+        _flacEncoder.reset(new FlacEncoder(_config.sampleRate, chunkSamples));
+    }
+    _levelMeter.reset(new LevelMeter(_config.sampleRate, _config.levelReleaseMs));
+
+    // If capture is already running (i.e. the hotword detector was listening)
+    // it carries on uninterrupted and we pick up from the given position
+    setState(SessionState::Recording);
+    _services.audio->startCapture(position);
+    _services.listener->sessionTraceEnd("Session start");
+    _services.listener->sessionDidStartRecording();
+}
+
+void SessionMachine::terminate() {
+    if (_state == SessionState::Terminated) {
+        return;
+    }
+    if (_state == SessionState::Recording) {
+        stopRecording();
+        if (_state == SessionState::Terminated) {
+            return;
+        }
+    }
+    _services.player->stop();
+    cancelSpeculation();
+    if (_queryID >= 0) {
+        _services.query->cancelQuery(_queryID);
+        _services.listener->sessionTraceEnd("Query");
+        _queryID = -1;
+    }
+    setState(SessionState::Terminated);
+    _services.listener->sessionDidTerminate();
+}
+
+// Recording
+
+// Capture stops, but the recognition stream stays open for the final transcript
+void SessionMachine::stopRecording() {
+    setState(SessionState::Recognizing);
+    _levelMeter->reset();
+    _services.audio->stopCapture();
+    _services.recognizer->finishAudio();
+    _services.listener->sessionDidStopRecording();
+}
+
+void SessionMachine::audioReceived(const int16_t *samples, size_t count) {
+    if (_state != SessionState::Recording) {
+        return;
+    }
+    // Update input level, displayed in the session button's waveform
+    _levelMeter->process(samples, count);
+    // Send exact chunks to speech recognition as they fill up, carrying the
+    // remainder over to the next one
+    _chunkAssembler->push(samples, count);
+}
+
+// Chunks are assembled in preallocated slots and sent without copying,
+// the slot being released once the recognizer is done with it. If the
+// chunks are compressed, the encoded frame is sent instead and the slot
+// released straight away.
+void SessionMachine::sendChunk(const int16_t *samples, size_t count, int slot) {
+    SessionAudioChunk chunk;
+    chunk.samples = count;
+    if (_flacEncoder) {
+        const std::vector<uint8_t> &frame = _flacEncoder->encode(samples, count);
+        chunk.data = frame.data();
+        chunk.length = frame.size();
+        _chunkAssembler->release(slot);
+    } else {
+        chunk.data = (const uint8_t *)samples;
+        chunk.length = count * sizeof(int16_t);
+        if (slot != ChunkAssembler::TransientSlot) {
+            chunk.slot = slot;
+            chunk.assembler = _chunkAssembler;
+        }
+    }
+
+    if (_stats.chunks == 0) {
+        _services.listener->sessionTraceMark("First audio sent");
+        _services.listener->sessionTraceBegin("Speech recognition");
+    }
+    _stats.chunks++;
+    _stats.transientChunks += (slot == ChunkAssembler::TransientSlot);
+    _stats.samples += count;
+    _stats.bytes += chunk.length;
+    _services.recognizer->sendAudio(chunk);
+}
+
+// Speech recognition
+
+void SessionMachine::recognitionResponse(const RecognitionResponse &response) {
+    if (_state != SessionState::Recording && _state != SessionState::Recognizing) {
+        return;
+    }
+
+    if (response.endOfUtterance) {
+        // The speech recognition server has detected the end of a single
+        // utterance, so we stop recording and wait for the final transcript
+        _endOfUtterance = true;
+        if (_state == SessionState::Recording) {
+            stopRecording();
+        }
+        return;
+    }
+
+    // Results are normally just one, with alternatives ordered by probability
+    const RecognitionResult *final = nullptr;
+    // Interim transcript may be split across several results, in which
+    // case only the top alternatives can be put together
+    std::vector<std::string> interim;
+    size_t interimResults = 0;
+    bool interimStable = true;
+    for (const RecognitionResult &result : response.results) {
+        if (result.isFinal) {
+            final = &result;
+            continue;
+        }
+        if (!_receivedInterimResult) {
+            _receivedInterimResult = true;
+            _services.listener->sessionTraceMark("First interim result");
+        }
+        if (result.stability > _config.interimMinStability) {
+            _services.listener->sessionDidReceiveInterimResults(result.alternatives);
+            if (_state == SessionState::Terminated) {
+                return;
+            }
+        }
+        if (interimResults++ == 0) {
+            interim = result.alternatives;
+        } else {
+            interim.resize(1);
+            interim[0] += result.alternatives.empty() ? "" : result.alternatives[0];
+        }
+        interimStable = interimStable && result.stability >= _config.speculationMinStability;
+    }
+
+    if (final) {
+        _services.listener->sessionTraceEnd("Speech recognition");
+        _services.listener->sessionTraceMark("Final transcript");
+        finalTranscript(final->alternatives);
+    } else if (interimStable && !response.results.empty()) {
+        // Get the query server working on a stable interim result while
+        // the speech recognition server finalizes it
+        speculate(interim);
+    }
+}
+
+void SessionMachine::recognitionEnded() {
+    // Timed out after the end of utterance without recognizing anything
+    if (_state == SessionState::Recognizing && _endOfUtterance) {
+        _services.listener->sessionDidReceiveTranscripts({});
+        terminate();
+    }
+}
+
+void SessionMachine::recognitionFailed(const std::string &message) {
+    if (_state != SessionState::Recording && _state != SessionState::Recognizing) {
+        return;
+    }
+    if (_state == SessionState::Recording) {
+        stopRecording();
+        if (_state == SessionState::Terminated) {
+            return;
+        }
+    }
+    fail(message);
+}
+
+void SessionMachine::finalTranscript(const std::vector<std::string> &alternatives) {
+    if (_state == SessionState::Recording) {
+        stopRecording();
+        if (_state == SessionState::Terminated) {
+            return;
+        }
+    }
+    if (alternatives.empty()) {
+        terminate();
+        return;
+    }
+    setState(SessionState::Querying);
+    _finalAlternatives = alternatives;
+    _finalTime = now();
+    // The listener may act on the transcript itself, e.g. a local command
+    _services.listener->sessionDidReceiveTranscripts(alternatives);
+    if (_state != SessionState::Querying) {
+        return;
+    }
+    // Use the speculative query if it asked the same thing, otherwise
+    // send to the query server
+    if (!commitSpeculation()) {
+        sendQuery(_finalAlternatives);
+    }
+}
+
+// Query
+
+void SessionMachine::sendQuery(const std::vector<std::string> &alternatives) {
+    _services.listener->sessionTraceBegin("Query");
+    _queryID = _services.query->sendQuery(alternatives, false);
+}
+
+void SessionMachine::queryAnswered(int requestID, const QueryAnswer &answer) {
+    if (_speculation && requestID == _speculation->requestID) {
+        _services.listener->sessionTraceEnd("Speculative query");
+        _speculation->answered = true;
+        _speculation->answerTime = now();
+        _speculation->answer = answer;
+        if (_speculation->committed) {
+            finishSpeculation();
+        }
+        return;
+    }
+    if (requestID < 0 || requestID != _queryID) {
+        return;
+    }
+    _services.listener->sessionTraceEnd("Query");
+    _queryID = -1;
+    handleAnswer(answer);
+}
+
+void SessionMachine::queryFailed(int requestID, const std::string &message) {
+    if (_speculation && requestID == _speculation->requestID) {
+        _services.listener->sessionTraceEnd("Speculative query");
+        _speculation->answered = true;
+        _speculation->failed = true;
+        _speculation->answerTime = now();
+        if (_speculation->committed) {
+            finishSpeculation();
+        }
+        return;
+    }
+    if (requestID < 0 || requestID != _queryID) {
+        return;
+    }
+    _services.listener->sessionTraceEnd("Query");
+    _queryID = -1;
+    fail(message);
+}
+
+void SessionMachine::handleAnswer(const QueryAnswer &received) {
+    QueryAnswer answer = received;
+    // If the answer opens a URL, there's no audio playback
+    if (!answer.openURL.empty()) {
+        setState(SessionState::Answered);
+    } else if (!answer.audioURL.empty()) {
+        // The voice answer is the text spoken, which may differ from the answer shown
+        setState(SessionState::Playing);
+        _services.player->play(answer.audioURL, answer.voice.empty() ? answer.answer : answer.voice);
+    } else {
+        setState(SessionState::Playing);
+        answer.answer = _services.player->playDunno();
+    }
+    if (_state == SessionState::Terminated) {
+        return;
+    }
+    _services.listener->sessionDidReceiveAnswer(answer);
+}
+
+// Speculative queries
+
+void SessionMachine::speculate(const std::vector<std::string> &interim) {
+    std::vector<std::string> alternatives;
+    for (const std::string &a : interim) {
+        std::string t = Trimmed(a);
+        if (!t.empty()) {
+            alternatives.push_back(t);
+        }
+    }
+    if (!_config.speculativeQueries || alternatives.empty() || _state == SessionState::Terminated) {
+        return;
+    }
+    // Already asked
+    if (_speculation && AlternativesMatch(alternatives, _speculation->alternatives)) {
+        return;
+    }
+    if (_stats.speculativeQueries >= _config.maxSpeculativeQueries) {
+        return;
+    }
+    // Interim result has changed, the previous speculation is moot
+    cancelSpeculation();
+
+    _stats.speculativeQueries++;
+    _speculation.reset(new Speculation());
+    _speculation->alternatives = alternatives;
+    _speculation->sentTime = now();
+    _services.listener->sessionTraceBegin("Speculative query");
+    _speculation->requestID = _services.query->sendQuery(alternatives, true);
+}
+
+void SessionMachine::cancelSpeculation() {
+    if (!_speculation) {
+        return;
+    }
+    if (!_speculation->answered) {
+        _services.query->cancelQuery(_speculation->requestID);
+        _services.listener->sessionTraceEnd("Speculative query");
+    }
+    _speculation.reset();
+}
+
+// Called with the final transcript. Returns true if the speculative query
+// asked the same thing, in which case its answer will be used.
+bool SessionMachine::commitSpeculation() {
+    if (!_speculation) {
+        return false;
+    }
+    if (!AlternativesMatch(_finalAlternatives, _speculation->alternatives)) {
+        speculationStatsSinceLaunch.misses++;
+        _services.listener->sessionTraceMark("Speculation miss");
+        _services.listener->sessionDidResolveSpeculation(false, 0.0, 0.0);
+        cancelSpeculation();
+        return false;
+    }
+    _speculation->committed = true;
+    if (_speculation->answered) {
+        finishSpeculation();
+    }
+    return true;
+}
+
+void SessionMachine::finishSpeculation() {
+    std::unique_ptr<Speculation> speculation = std::move(_speculation);
+
+    if (speculation->failed) {
+        // Failed, so the query gets another chance with all the final alternatives
+        speculationStatsSinceLaunch.misses++;
+        _services.listener->sessionTraceMark("Speculation miss");
+        _services.listener->sessionDidResolveSpeculation(false, 0.0, 0.0);
+        sendQuery(_finalAlternatives);
+        return;
+    }
+
+    // The query round trip is saved, less however long the answer took to
+    // arrive after the final transcript
+    double roundTrip = speculation->answerTime - speculation->sentTime;
+    double saved = roundTrip - std::max(0.0, speculation->answerTime - _finalTime);
+    speculationStatsSinceLaunch.hits++;
+    speculationStatsSinceLaunch.secondsSaved += saved;
+    _services.listener->sessionTraceMark("Speculation hit");
+    _services.listener->sessionDidResolveSpeculation(true, saved, roundTrip);
+    handleAnswer(speculation->answer);
+}
+
+// Playback
+
+void SessionMachine::play(const std::string &url, const std::string &text) {
+    if (_state == SessionState::Terminated) {
+        return;
+    }
+    setState(SessionState::Playing);
+    _services.player->play(url, text);
+}
+
+bool SessionMachine::playCachedSpeech(const std::string &text) {
+    if (_state == SessionState::Terminated || !_services.player->playCachedSpeech(text)) {
+        return false;
+    }
+    setState(SessionState::Playing);
+    return true;
+}
+
+// Playback of the answer is the final task in the pipeline. Once it's
+// done, the session is over.
+void SessionMachine::playbackFinished(bool successfully) {
+    if (_state == SessionState::Playing) {
+        terminate();
+    }
+}
+
+void SessionMachine::playbackFailed(const std::string &message) {
+    if (_state != SessionState::Terminated) {
+        fail(message);
+    }
+}
+
+// Errors end the session, once the listener has been told
+
+void SessionMachine::fail(const std::string &message) {
+    _services.listener->sessionDidFail(message);
+    terminate();
+}
+
+// State
+
+float SessionMachine::levelDbfs() const {
+    if (_state != SessionState::Recording || !_levelMeter) {
+        return LevelMeter::minDbfs;
+    }
+    return _levelMeter->smoothedDbfs();
+}
+
+double SessionMachine::speechSeconds() const {
+    return (double)_stats.samples / _config.sampleRate;
+}
+
+SessionStats SessionMachine::stats() const {
+    return _stats;
+}
+
+SpeculationStats SessionMachine::speculationStats() {
+    return speculationStatsSinceLaunch;
+}
+
+} // namespace embla
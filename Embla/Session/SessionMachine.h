@@ -0,0 +1,291 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    The logic of a query session, from recording speech to playing the
+    answer, as an event-driven state machine:
+
+        Idle -> Recording -> Recognizing -> Querying -> Playing -> Terminated
+                    |             |             |
+                    +-------------+-------------+-> Answered
+
+    Recording streams microphone audio to speech recognition. It ends at
+    the end of utterance event (-> Recognizing, awaiting the final
+    transcript) or the final transcript itself (-> Querying). Querying
+    waits for the answer to the final transcript, or to a speculative
+    query sent ahead on a stable interim result if it asked the same
+    thing. An answer with speech audio, or no answer at all, is played
+    (-> Playing); one that opens a URL is left to the listener
+    (-> Answered). Any state can go to Terminated, which is final.
+
+    The machine does no I/O itself. Capture, speech recognition, the
+    query server and playback are injected as interfaces, which report
+    back by calling the corresponding event methods. The listener is
+    told about progress. Everything, including all calls into the
+    machine, must happen on a single thread or queue, except releasing
+    audio chunks. The listener may call terminate() from any callback.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace embla {
+
+class ChunkAssembler;
+class FlacEncoder;
+class LevelMeter;
+
+enum class SessionState {
+    Idle,
+    Recording,      // Capturing and streaming audio to speech recognition
+    Recognizing,    // Capture stopped at end of utterance, awaiting the final transcript
+    Querying,       // Awaiting the answer to the final transcript
+    Playing,        // Playing the answer
+    Answered,       // Answer received, nothing to play
+    Terminated,
+};
+
+const char *sessionStateName(SessionState state);
+
+struct SessionConfig {
+    int sampleRate = 16000;
+    int chunkMs = 100;                          // Audio is sent in chunks of this length
+    size_t chunkSlots = 16;                     // Chunks that can be in flight at once without copying
+    bool flac = false;                          // Send FLAC frames rather than raw PCM
+    int levelReleaseMs = 150;                   // Release of the level meter
+    float interimMinStability = 0.25f;          // Less stable interim results aren't shown
+    bool speculativeQueries = false;            // Send stable interim results ahead as queries
+    float speculationMinStability = 0.8f;
+    unsigned maxSpeculativeQueries = 3;
+};
+
+// One chunk of audio for the speech recognition service. data is only
+// valid during the call unless the chunk holds a slot, in which case it
+// stays valid until release() is called, from any thread.
+struct SessionAudioChunk {
+    const uint8_t *data = nullptr;
+    size_t length = 0;
+    size_t samples = 0;
+    int slot = -1;                              // Assembler slot holding the data, if any
+    std::shared_ptr<ChunkAssembler> assembler;
+
+    bool holdsSlot() const { return assembler && slot >= 0; }
+    void release() const;
+};
+
+struct RecognitionResult {
+    std::vector<std::string> alternatives;      // Most likely first
+    float stability = 0.0f;
+    bool isFinal = false;
+};
+
+struct RecognitionResponse {
+    bool endOfUtterance = false;
+    std::vector<RecognitionResult> results;
+};
+
+// The parts of a query server answer the session acts on, or passes on
+struct QueryAnswer {
+    std::string answer;
+    std::string question;
+    std::string source;
+    std::string openURL;
+    std::string imageURL;
+    std::string command;
+    std::string audioURL;
+    std::string voice;                          // Text spoken in the audio, if it differs from the answer
+};
+
+// Interfaces to the outside world
+
+class SessionAudioInput {
+public:
+    virtual ~SessionAudioInput() = default;
+    // Deliver audio to audioReceived() from the given sample position,
+    // which may be in the past, onwards
+    virtual void startCapture(uint64_t position) = 0;
+    virtual void stopCapture() = 0;
+};
+
+class SessionRecognizer {
+public:
+    virtual ~SessionRecognizer() = default;
+    // The first chunk opens the stream. Responses go to recognitionResponse().
+    virtual void sendAudio(const SessionAudioChunk &chunk) = 0;
+    // No more audio is coming
+    virtual void finishAudio() = 0;
+};
+
+class SessionQueryClient {
+public:
+    virtual ~SessionQueryClient() = default;
+    // Returns an ID for the request, which is passed to queryAnswered() or queryFailed().
+    // Speculative queries ask on an interim result and shouldn't be logged by the server.
+    virtual int sendQuery(const std::vector<std::string> &alternatives, bool speculative) = 0;
+    virtual void cancelQuery(int requestID) = 0;
+};
+
+class SessionPlayer {
+public:
+    virtual ~SessionPlayer() = default;
+    // Play speech audio, with the text spoken if known. Completion goes to playbackFinished().
+    virtual void play(const std::string &url, const std::string &text) = 0;
+    // Returns false if no speech audio for the text is at hand
+    virtual bool playCachedSpeech(const std::string &text) = 0;
+    // Play a "don't know" answer and return its text
+    virtual std::string playDunno() = 0;
+    virtual void stop() = 0;
+};
+
+class SessionListener {
+public:
+    virtual ~SessionListener() = default;
+    virtual void sessionDidStartRecording() {}
+    virtual void sessionDidStopRecording() {}
+    virtual void sessionDidReceiveInterimResults(const std::vector<std::string> &alternatives) {}
+    // Empty if speech recognition gave up without a result
+    virtual void sessionDidReceiveTranscripts(const std::vector<std::string> &alternatives) {}
+    virtual void sessionDidReceiveAnswer(const QueryAnswer &answer) {}
+    virtual void sessionDidFail(const std::string &message) {}
+    virtual void sessionDidTerminate() {}
+    // Outcome of a speculative query once the final transcript is in.
+    // secondsSaved is zero for misses.
+    virtual void sessionDidResolveSpeculation(bool hit, double secondsSaved, double roundTrip) {}
+    // Latency tracing. Names are string literals. Speculative queries are
+    // marked "Speculation hit" or "Speculation miss" as they resolve.
+    virtual void sessionTraceBegin(const char *name) {}
+    virtual void sessionTraceEnd(const char *name) {}
+    virtual void sessionTraceMark(const char *name) {}
+};
+
+struct SessionServices {
+    SessionAudioInput *audio = nullptr;
+    SessionRecognizer *recognizer = nullptr;
+    SessionQueryClient *query = nullptr;
+    SessionPlayer *player = nullptr;
+    SessionListener *listener = nullptr;
+    // Seconds, monotonic. Defaults to the steady clock.
+    std::function<double()> clock;
+};
+
+struct SessionStats {
+    uint64_t chunks = 0;
+    uint64_t transientChunks = 0;   // Chunks copied because all slots were in flight
+    uint64_t samples = 0;           // Samples sent
+    uint64_t bytes = 0;             // Bytes sent
+    unsigned speculativeQueries = 0;
+};
+
+// Speculative query outcomes since launch
+struct SpeculationStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    double secondsSaved = 0.0;
+};
+
+class SessionMachine {
+public:
+    SessionMachine(const SessionConfig &config, const SessionServices &services);
+    ~SessionMachine();
+
+    SessionMachine(const SessionMachine &) = delete;
+    SessionMachine &operator=(const SessionMachine &) = delete;
+
+    // Commands
+
+    // Start recording from the given sample position of the audio input
+    void start(uint64_t position);
+    void terminate();
+    // Play speech audio outside of the query flow, e.g. for a command's result
+    void play(const std::string &url, const std::string &text);
+    bool playCachedSpeech(const std::string &text);
+
+    // Events
+
+    void audioReceived(const int16_t *samples, size_t count);
+    void recognitionResponse(const RecognitionResponse &response);
+    // The recognition stream closed without a final result
+    void recognitionEnded();
+    void recognitionFailed(const std::string &message);
+    void queryAnswered(int requestID, const QueryAnswer &answer);
+    void queryFailed(int requestID, const std::string &message);
+    void playbackFinished(bool successfully);
+    void playbackFailed(const std::string &message);
+
+    // State
+
+    SessionState state() const { return _state; }
+    bool isRecording() const { return _state == SessionState::Recording; }
+    bool terminated() const { return _state == SessionState::Terminated; }
+    // Smoothed input level in dBFS while recording, otherwise silence
+    float levelDbfs() const;
+    double speechSeconds() const;
+    SessionStats stats() const;
+
+    static SpeculationStats speculationStats();
+
+private:
+    struct Speculation {
+        int requestID = -1;
+        std::vector<std::string> alternatives;
+        double sentTime = 0.0;
+        bool answered = false;
+        bool failed = false;
+        double answerTime = 0.0;
+        QueryAnswer answer;
+        bool committed = false;
+    };
+
+    void setState(SessionState state);
+    void stopRecording();
+    void sendChunk(const int16_t *samples, size_t count, int slot);
+    void finalTranscript(const std::vector<std::string> &alternatives);
+    void sendQuery(const std::vector<std::string> &alternatives);
+    void speculate(const std::vector<std::string> &interim);
+    void cancelSpeculation();
+    bool commitSpeculation();
+    void finishSpeculation();
+    void handleAnswer(const QueryAnswer &answer);
+    void fail(const std::string &message);
+    double now() const;
+
+    const SessionConfig _config;
+    const SessionServices _services;
+    SessionState _state = SessionState::Idle;
+
+    // Shared with chunks in flight, which may outlive the session
+    std::shared_ptr<ChunkAssembler> _chunkAssembler;
+    std::unique_ptr<FlacEncoder> _flacEncoder;
+    std::unique_ptr<LevelMeter> _levelMeter;
+    SessionStats _stats;
+    bool _endOfUtterance = false;
+    bool _receivedInterimResult = false;
+
+    int _queryID = -1;
+    std::vector<std::string> _finalAlternatives;
+    double _finalTime = 0.0;
+    std::unique_ptr<Speculation> _speculation;
+};
+
+} // namespace embla
@@ -26,4 +26,14 @@
 
 + (BOOL)isDataURI:(NSString *)string;
 
+// Decode the payload incrementally, calling the handler with each chunk of
+// up to windowSize decoded bytes as soon as it's ready, so that it can be
+// processed while the rest is decoded. Memory use beyond the string itself
+// is bounded by the window. A chunk's bytes are only valid for the duration
+// of the call. Set *stop to end early. Returns NO if the URI is invalid or
+// decoding was stopped, in which case some chunks may have been handled.
++ (BOOL)decodeString:(NSString *)string
+          windowSize:(NSUInteger)windowSize
+        chunkHandler:(void (^)(NSData *chunk, BOOL *stop))handler;
+
 @end
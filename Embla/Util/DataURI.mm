@@ -0,0 +1,145 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    This is a class to parse data: URIs (RFC2397) since no support
+    is available for them in the Cocoa/CocoaTouch APIs. The parsing
+    and decoding is done by DataURIDecoder.cpp.
+*/
+
+#import "DataURI.h"
+#import "DataURIDecoder.h"
+#import <vector>
+
+
+#define DATA_URI_PREFIX         @"data:"
+
+
+@interface DataURI ()
+{
+    NSString *mimeType;
+    NSData *data;
+}
+@end
+
+
+@implementation DataURI
+
+- (instancetype)initWithString:(NSString *)string {
+    self = [super init];
+    if (self) {
+        if (![self _parse:string]) {
+            NSLog(@"Not a valid Data URI: %@", string);
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (BOOL)_parse:(NSString *)string {
+    // Parse Data URI format
+    // data:[<media type>][;base64],<data>
+    
+    if (![DataURI isDataURI:string]) {
+        return FALSE;
+    }
+    
+    // Work on the string's own ASCII buffer if it has one, otherwise on a copy
+    NSData *ascii;
+    const char *str = CFStringGetCStringPtr((__bridge CFStringRef)string, kCFStringEncodingASCII);
+    size_t length = [string length];
+    if (str == NULL) {
+        ascii = [string dataUsingEncoding:NSASCIIStringEncoding];
+        if (ascii == nil) {
+            return FALSE;
+        }
+        str = (const char *)[ascii bytes];
+        length = [ascii length];
+    }
+    
+    embla::DataURIHeader header;
+    if (!embla::parseDataURIHeader(str, length, header)) {
+        return FALSE;
+    }
+    mimeType = [[NSString alloc] initWithBytes:str + header.mimeTypeOffset
+                                        length:header.mimeTypeLength
+                                      encoding:NSASCIIStringEncoding];
+    
+    // Decode straight into the data's buffer, then trim it to size
+    NSMutableData *decoded = [NSMutableData dataWithLength:embla::dataURIMaxDecodedSize(length, header)];
+    size_t written = 0;
+    if (!embla::decodeDataURI(str, length, header, (uint8_t *)[decoded mutableBytes], written)) {
+        return FALSE;
+    }
+    [decoded setLength:written];
+    data = decoded;
+    return TRUE;
+}
+
+- (NSData *)data {
+    return data;
+}
+
+- (NSString *)mimeType {
+    return mimeType;
+}
+
++ (BOOL)isDataURI:(NSString *)string {
+    // The minimal (empty) data URI is "data:,"
+    return [string hasPrefix:DATA_URI_PREFIX] && [string containsString:@","];
+}
+
++ (BOOL)decodeString:(NSString *)string
+          windowSize:(NSUInteger)windowSize
+        chunkHandler:(void (^)(NSData *chunk, BOOL *stop))handler {
+    embla::DataURIStreamDecoder decoder(windowSize, [handler](const uint8_t *bytes, size_t size) {
+        BOOL stop = NO;
+        NSData *chunk = [[NSData alloc] initWithBytesNoCopy:(void *)bytes length:size freeWhenDone:NO];
+        handler(chunk, &stop);
+        return !stop;
+    });
+    
+    // Feed the string's own ASCII buffer if it has one, otherwise
+    // extract the characters a window at a time
+    const char *str = CFStringGetCStringPtr((__bridge CFStringRef)string, kCFStringEncodingASCII);
+    if (str) {
+        decoder.push(str, [string length]);
+        return decoder.finish();
+    }
+    std::vector<char> buffer(MAX(windowSize, 1));
+    NSRange remaining = NSMakeRange(0, [string length]);
+    while (remaining.length > 0) {
+        NSUInteger used = 0;
+        if (![string getBytes:buffer.data()
+                     maxLength:buffer.size()
+                    usedLength:&used
+                      encoding:NSASCIIStringEncoding
+                       options:0
+                         range:remaining
+                remainingRange:&remaining] || used == 0) {
+            // Not ASCII
+            return NO;
+        }
+        if (!decoder.push(buffer.data(), used)) {
+            return NO;
+        }
+    }
+    return decoder.finish();
+}
+
+@end
@@ -0,0 +1,488 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DataURIDecoder.h"
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define DATA_URI_PREFIX         "data:"
+#define DATA_URI_PREFIX_LENGTH  5
+// Longest header accepted by the stream decoder, up to and including the comma
+#define DATA_URI_MAX_HEADER     1024
+#define DATA_URI_MIN_WINDOW     64
+
+namespace embla {
+
+// Scalar decoding
+
+static const uint8_t Invalid = 0xFF;
+static const uint8_t Padding = 0xFE;
+
+// Character to 6-bit value
+struct Base64Table {
+    uint8_t values[256];
+
+    Base64Table() {
+        const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        memset(values, Invalid, sizeof(values));
+        for (uint8_t i = 0; i < 64; i++) {
+            values[(uint8_t)alphabet[i]] = i;
+        }
+        values['='] = Padding;
+    }
+};
+
+static const Base64Table table;
+
+// Decode until the end of the input or padding, or until past stop and at
+// the end of a group of four characters, so that the vector kernel can
+// carry on from there.
+static uint8_t *DecodeScalar(const char *&src, const char *end, const char *stop, uint8_t *dst, Base64State &s) {
+    while (src < end && !s.done && (src < stop || s.count != 0)) {
+        uint8_t v = table.values[(uint8_t)*src++];
+        if (v < 64) {
+            s.bits = (s.bits << 6) | v;
+            if (++s.count == 4) {
+                dst[0] = (uint8_t)(s.bits >> 16);
+                dst[1] = (uint8_t)(s.bits >> 8);
+                dst[2] = (uint8_t)s.bits;
+                dst += 3;
+                s.bits = 0;
+                s.count = 0;
+            }
+        } else if (v == Padding) {
+            s.done = true;
+        }
+    }
+    return dst;
+}
+
+// Output whatever whole bytes an incomplete final group holds
+static bool FinishScalar(uint8_t *&dst, const Base64State &s) {
+    switch (s.count) {
+    case 2:
+        *dst++ = (uint8_t)(s.bits >> 4);
+        return true;
+    case 3:
+        *dst++ = (uint8_t)(s.bits >> 10);
+        *dst++ = (uint8_t)(s.bits >> 2);
+        return true;
+    default:
+        return s.count == 0;
+    }
+}
+
+bool base64DecodeReference(const char *src, size_t length, uint8_t *dst, size_t &written) {
+    Base64State s;
+    const char *end = src + length;
+    uint8_t *out = DecodeScalar(src, end, end, dst, s);
+    bool ok = FinishScalar(out, s);
+    written = (size_t)(out - dst);
+    return ok;
+}
+
+// Vector kernels
+
+// Each kernel decodes whole blocks for as long as they contain nothing but
+// base64 characters, and leaves src at the first block that doesn't.
+
+#if defined(__AVX2__)
+
+#define BASE64_BLOCK 32
+
+const char *base64KernelName() {
+    return "avx2";
+}
+
+// Validation and translation with nibble lookups, and packing with
+// multiply-adds, after Muła and Lemire, "Faster Base64 Encoding and
+// Decoding using AVX2 Instructions" (2018).
+static uint8_t *DecodeBlocks(const char *&src, const char *end, uint8_t *dst, const uint8_t *dstEnd) {
+    // Bit flags per low and high nibble, whose AND is nonzero for invalid characters
+    const __m256i lutLo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+                                           0x1B, 0x1B, 0x1B, 0x1A, 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lutHi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    // Offset from character to value, by high nibble ('/' gets its own)
+    const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 19, 4,
+                                             -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    // Also clears bit 7, and bit 5 is ignored by the shuffles
+    const __m256i mask2F = _mm256_set1_epi8(0x2F);
+    const __m256i packPairs = _mm256_set1_epi32(0x01400140);
+    const __m256i packQuads = _mm256_set1_epi32(0x00011000);
+    const __m256i packBytes = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5,
+                                               4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i packLanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+    // Each block stores 32 bytes, of which 24 are output
+    while (end - src >= BASE64_BLOCK && dstEnd - dst >= 32) {
+        __m256i in = _mm256_loadu_si256((const __m256i *)src);
+        __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask2F);
+        __m256i loNibbles = _mm256_and_si256(in, mask2F);
+        __m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+        __m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+        if (!_mm256_testz_si256(lo, hi)) {
+            break;
+        }
+        __m256i eq2F = _mm256_cmpeq_epi8(in, mask2F);
+        __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(eq2F, hiNibbles));
+        __m256i values = _mm256_add_epi8(in, roll);
+
+        // 4 x 6 bits to 3 bytes in each 32-bit lane, then squeeze out the gaps
+        __m256i pairs = _mm256_maddubs_epi16(values, packPairs);
+        __m256i out = _mm256_madd_epi16(pairs, packQuads);
+        out = _mm256_shuffle_epi8(out, packBytes);
+        out = _mm256_permutevar8x32_epi32(out, packLanes);
+        _mm256_storeu_si256((__m256i *)dst, out);
+        src += BASE64_BLOCK;
+        dst += 24;
+    }
+    return dst;
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+#define BASE64_BLOCK 64
+
+const char *base64KernelName() {
+    return "neon";
+}
+
+// Character to value for 0-127, with everything else above 63
+struct Base64NeonTable {
+    uint8_t values[128];
+
+    Base64NeonTable() {
+        for (int i = 0; i < 128; i++) {
+            values[i] = table.values[i] < 64 ? table.values[i] : Invalid;
+        }
+    }
+};
+
+static const Base64NeonTable neonTable;
+
+static uint8_t *DecodeBlocks(const char *&src, const char *end, uint8_t *dst, const uint8_t *dstEnd) {
+    const uint8x16x4_t lutLo = vld1q_u8_x4(neonTable.values);
+    const uint8x16x4_t lutHi = vld1q_u8_x4(neonTable.values + 64);
+    const uint8x16_t offset = vdupq_n_u8(64);
+
+    // 64 characters are loaded deinterleaved, one of each group of four
+    // per register, translated with 64-byte table lookups, then packed
+    // and stored interleaved as 48 bytes.
+    while (end - src >= BASE64_BLOCK && dstEnd - dst >= 48) {
+        uint8x16x4_t in = vld4q_u8((const uint8_t *)src);
+        uint8x16_t v[4];
+        uint8x16_t invalid = vdupq_n_u8(0);
+        for (int i = 0; i < 4; i++) {
+            // Characters 128 and up would look up 0, so are flagged separately
+            uint8x16_t x = in.val[i];
+            v[i] = vqtbx4q_u8(vqtbl4q_u8(lutLo, x), lutHi, vsubq_u8(x, offset));
+            invalid = vorrq_u8(invalid, vorrq_u8(v[i], vcgeq_u8(x, vdupq_n_u8(128))));
+        }
+        if (vmaxvq_u8(invalid) > 63) {
+            break;
+        }
+        uint8x16x3_t out;
+        out.val[0] = vorrq_u8(vshlq_n_u8(v[0], 2), vshrq_n_u8(v[1], 4));
+        out.val[1] = vorrq_u8(vshlq_n_u8(v[1], 4), vshrq_n_u8(v[2], 2));
+        out.val[2] = vorrq_u8(vshlq_n_u8(v[2], 6), v[3]);
+        vst3q_u8(dst, out);
+        src += BASE64_BLOCK;
+        dst += 48;
+    }
+    return dst;
+}
+
+#else
+
+#define BASE64_BLOCK 32
+
+const char *base64KernelName() {
+    return "scalar";
+}
+
+static uint8_t *DecodeBlocks(const char *&, const char *, uint8_t *dst, const uint8_t *) {
+    return dst;
+}
+
+#endif
+
+// Decode as much as possible, with the state carried over from any
+// previous piece of input
+static uint8_t *DecodeBase64(const char *&src, const char *end, uint8_t *dst, const uint8_t *dstEnd,
+                             Base64State &s) {
+    while (src < end && !s.done) {
+        // The kernel needs to start at a group of four, which the previous
+        // piece of input may have left incomplete
+        if (s.count == 0) {
+            dst = DecodeBlocks(src, end, dst, dstEnd);
+        }
+        // Step through the block the kernel stopped at
+        dst = DecodeScalar(src, end, src + BASE64_BLOCK, dst, s);
+    }
+    return dst;
+}
+
+bool base64Decode(const char *src, size_t length, uint8_t *dst, size_t &written) {
+    Base64State s;
+    uint8_t *out = DecodeBase64(src, src + length, dst, dst + base64MaxDecodedSize(length), s);
+    bool ok = FinishScalar(out, s);
+    written = (size_t)(out - dst);
+    return ok;
+}
+
+// Data URIs
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+bool parseDataURIHeader(const char *uri, size_t length, DataURIHeader &header) {
+    if (length < DATA_URI_PREFIX_LENGTH || memcmp(uri, DATA_URI_PREFIX, DATA_URI_PREFIX_LENGTH) != 0) {
+        return false;
+    }
+    const char *start = uri + DATA_URI_PREFIX_LENGTH;
+    const char *end = uri + length;
+    const char *comma = (const char *)memchr(start, ',', (size_t)(end - start));
+    if (!comma) {
+        return false;
+    }
+    // A quote before the comma means it may be within a parameter value
+    if (memchr(start, '"', (size_t)(comma - start))) {
+        bool quoted = false;
+        for (comma = start; comma < end && (quoted || *comma != ','); comma++) {
+            quoted = (*comma == '"') ? !quoted : quoted;
+        }
+        if (comma == end) {
+            return false;
+        }
+    }
+
+    const char *semicolon = (const char *)memchr(start, ';', (size_t)(comma - start));
+    header.mimeTypeOffset = DATA_URI_PREFIX_LENGTH;
+    header.mimeTypeLength = (size_t)((semicolon ? semicolon : comma) - start);
+    header.base64 = (comma - start >= 7) && strncasecmp(comma - 7, ";base64", 7) == 0;
+    header.dataOffset = (size_t)(comma + 1 - uri);
+    return true;
+}
+
+size_t dataURIMaxDecodedSize(size_t length, const DataURIHeader &header) {
+    size_t payload = length - header.dataOffset;
+    return header.base64 ? base64MaxDecodedSize(payload) : payload;
+}
+
+bool decodeDataURI(const char *uri, size_t length, const DataURIHeader &header, uint8_t *dst, size_t &written) {
+    const char *src = uri + header.dataOffset;
+    size_t payload = length - header.dataOffset;
+    if (header.base64) {
+        return base64Decode(src, payload, dst, written);
+    }
+    // Percent-encoded, copying runs of plain characters in one go
+    const char *end = src + payload;
+    uint8_t *out = dst;
+    while (src < end) {
+        const char *percent = (const char *)memchr(src, '%', (size_t)(end - src));
+        const char *run = percent ? percent : end;
+        memcpy(out, src, (size_t)(run - src));
+        out += run - src;
+        src = run;
+        if (percent) {
+            int hi = end - percent > 2 ? HexValue(percent[1]) : -1;
+            int lo = hi >= 0 ? HexValue(percent[2]) : -1;
+            if (lo < 0) {
+                return false;
+            }
+            *out++ = (uint8_t)(hi << 4 | lo);
+            src = percent + 3;
+        }
+    }
+    written = (size_t)(out - dst);
+    return true;
+}
+
+// Stream decoding
+
+DataURIStreamDecoder::DataURIStreamDecoder(size_t windowSize, ChunkHandler handler)
+    : _window(std::max<size_t>(DATA_URI_MIN_WINDOW, windowSize)), _handler(std::move(handler)) {}
+
+void DataURIStreamDecoder::reset() {
+    _filled = 0;
+    _headerText.clear();
+    _quoted = false;
+    _inPayload = false;
+    _header = DataURIHeader();
+    _mimeType.clear();
+    _base64 = Base64State();
+    _escape.clear();
+    _failed = false;
+    _stopped = false;
+    _decoded = 0;
+}
+
+bool DataURIStreamDecoder::fail() {
+    _failed = true;
+    return false;
+}
+
+bool DataURIStreamDecoder::emit() {
+    if (_filled > 0 && _handler && !_handler(_window.data(), _filled)) {
+        _stopped = true;
+    }
+    _decoded += _filled;
+    _filled = 0;
+    return !_stopped;
+}
+
+bool DataURIStreamDecoder::append(uint8_t byte) {
+    if (_filled == _window.size() && !emit()) {
+        return false;
+    }
+    _window[_filled++] = byte;
+    return true;
+}
+
+bool DataURIStreamDecoder::push(const char *src, size_t length) {
+    if (_failed || _stopped) {
+        return false;
+    }
+    const char *end = src + length;
+    if (!_inPayload && !pushHeader(src, end)) {
+        return false;
+    }
+    if (!_inPayload || src == end) {
+        return true;
+    }
+    return _header.base64 ? pushBase64(src, end) : pushPercentEncoded(src, end);
+}
+
+// Collect the header up to the comma, which may be split across pieces
+bool DataURIStreamDecoder::pushHeader(const char *&src, const char *end) {
+    while (src < end) {
+        char c = *src++;
+        _headerText += c;
+        if (_headerText.size() > DATA_URI_MAX_HEADER) {
+            return fail();
+        }
+        if (_headerText.size() <= DATA_URI_PREFIX_LENGTH) {
+            if (c != DATA_URI_PREFIX[_headerText.size() - 1]) {
+                return fail();
+            }
+            continue;
+        }
+        _quoted = (c == '"') ? !_quoted : _quoted;
+        if (c == ',' && !_quoted) {
+            if (!parseDataURIHeader(_headerText.data(), _headerText.size(), _header)) {
+                return fail();
+            }
+            _mimeType.assign(_headerText, _header.mimeTypeOffset, _header.mimeTypeLength);
+            _inPayload = true;
+            return true;
+        }
+    }
+    return true;
+}
+
+bool DataURIStreamDecoder::pushBase64(const char *src, const char *end) {
+    while (src < end && !_base64.done) {
+        // Up to three characters may be pending, and every four make three
+        // bytes, so this much input always fits in the rest of the window
+        size_t room = _window.size() - _filled;
+        if (room < DATA_URI_MIN_WINDOW / 2) {
+            if (!emit()) {
+                return false;
+            }
+            room = _window.size();
+        }
+        size_t n = std::min<size_t>((size_t)(end - src), room / 3 * 4 - 3);
+        uint8_t *window = _window.data();
+        uint8_t *out = DecodeBase64(src, src + n, window + _filled, window + _window.size(), _base64);
+        _filled = (size_t)(out - window);
+    }
+    return true;
+}
+
+bool DataURIStreamDecoder::pushPercentEncoded(const char *src, const char *end) {
+    while (src < end) {
+        if (!_escape.empty()) {
+            _escape += *src++;
+            if (_escape.size() == 3) {
+                int hi = HexValue(_escape[1]);
+                int lo = HexValue(_escape[2]);
+                if (hi < 0 || lo < 0) {
+                    return fail();
+                }
+                _escape.clear();
+                if (!append((uint8_t)(hi << 4 | lo))) {
+                    return false;
+                }
+            }
+            continue;
+        }
+        const char *percent = (const char *)memchr(src, '%', (size_t)(end - src));
+        const char *run = percent ? percent : end;
+        while (src < run) {
+            if (_filled == _window.size() && !emit()) {
+                return false;
+            }
+            size_t n = std::min((size_t)(run - src), _window.size() - _filled);
+            memcpy(_window.data() + _filled, src, n);
+            _filled += n;
+            src += n;
+        }
+        if (percent) {
+            _escape = "%";
+            src = percent + 1;
+        }
+    }
+    return true;
+}
+
+bool DataURIStreamDecoder::finish() {
+    if (_failed || _stopped) {
+        return false;
+    }
+    if (!_inPayload || !_escape.empty()) {
+        return fail();
+    }
+    if (_header.base64) {
+        if (_window.size() - _filled < 2 && !emit()) {
+            return false;
+        }
+        uint8_t *out = _window.data() + _filled;
+        if (!FinishScalar(out, _base64)) {
+            return fail();
+        }
+        _filled = (size_t)(out - _window.data());
+    }
+    return emit();
+}
+
+} // namespace embla
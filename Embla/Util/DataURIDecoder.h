@@ -0,0 +1,151 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Decoding of data: URIs (RFC 2397), e.g. inline audio in answers.
+
+    The header is parsed in place, and the payload is decoded in a
+    single pass straight into the destination buffer, without copying
+    the URI or the payload. Base64 payloads go through a vectorized
+    decoder (AVX2 or NEON, with a scalar fallback), which translates
+    and packs a block of characters at a time. Blocks containing
+    anything outside the base64 alphabet, such as line breaks or
+    padding, are handled by the scalar decoder, which skips such
+    characters as NSDataBase64DecodingIgnoreUnknownCharacters does.
+    Other payloads are percent-decoded.
+
+    DataURIStreamDecoder does the same incrementally, for URIs that
+    arrive or are read in pieces. Decoded output is handed over a
+    window at a time, so memory use is bounded by the window size
+    rather than the payload. The output is identical to decoding the
+    URI in one go.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace embla {
+
+// Base64
+
+// Upper bound on the size of length characters of base64 once decoded
+inline size_t base64MaxDecodedSize(size_t length) {
+    return (length + 3) / 4 * 3;
+}
+
+// Decode base64 into dst, which must hold base64MaxDecodedSize(length)
+// bytes. Characters outside the alphabet are skipped and decoding ends at
+// the first '='. Missing padding is tolerated. Returns false if the input
+// ends in a single dangling character, which can't encode a whole byte.
+bool base64Decode(const char *src, size_t length, uint8_t *dst, size_t &written);
+
+// Plain scalar implementation, for verification and benchmarking
+bool base64DecodeReference(const char *src, size_t length, uint8_t *dst, size_t &written);
+
+// Name of the instruction set base64Decode() was compiled for
+const char *base64KernelName();
+
+// Bits of an incomplete group of four characters, carried over between
+// pieces of input
+struct Base64State {
+    uint32_t bits = 0;
+    int count = 0;
+    bool done = false;      // Reached padding
+};
+
+// Data URIs
+
+// data:[<media type>][;base64],<data>
+struct DataURIHeader {
+    size_t mimeTypeOffset = 0;  // Media type without parameters, may be empty
+    size_t mimeTypeLength = 0;
+    bool base64 = false;
+    size_t dataOffset = 0;      // Start of the payload, after the comma
+};
+
+// Commas within quoted parameter values are allowed, e.g.
+// data:video/webm;codecs="vp8, opus";base64,GkXfowEAAAAAA...
+bool parseDataURIHeader(const char *uri, size_t length, DataURIHeader &header);
+
+// Upper bound on the size of the decoded payload
+size_t dataURIMaxDecodedSize(size_t length, const DataURIHeader &header);
+
+// Decode the payload into dst, which must hold dataURIMaxDecodedSize() bytes.
+bool decodeDataURI(const char *uri, size_t length, const DataURIHeader &header, uint8_t *dst, size_t &written);
+
+class DataURIStreamDecoder {
+public:
+    // Called with each window of decoded output. Return false to stop decoding.
+    typedef std::function<bool(const uint8_t *data, size_t size)> ChunkHandler;
+
+    // Windows are at least 64 bytes.
+    DataURIStreamDecoder(size_t windowSize, ChunkHandler handler);
+
+    DataURIStreamDecoder(const DataURIStreamDecoder &) = delete;
+    DataURIStreamDecoder &operator=(const DataURIStreamDecoder &) = delete;
+
+    // Feed the next piece of the URI. Returns false once the URI has turned
+    // out to be invalid or the handler has stopped decoding.
+    bool push(const char *src, size_t length);
+
+    // End of the URI. Hands over the last window and returns whether the
+    // whole URI was valid.
+    bool finish();
+
+    void reset();
+
+    // Available once the header has been pushed
+    bool headerParsed() const { return _inPayload; }
+    const std::string &mimeType() const { return _mimeType; }
+    bool base64() const { return _header.base64; }
+
+    bool failed() const { return _failed; }
+    uint64_t decodedBytes() const { return _decoded; }
+
+private:
+    bool pushHeader(const char *&src, const char *end);
+    bool pushBase64(const char *src, const char *end);
+    bool pushPercentEncoded(const char *src, const char *end);
+    bool append(uint8_t byte);
+    bool emit();
+    bool fail();
+
+    std::vector<uint8_t> _window;
+    size_t _filled = 0;
+    ChunkHandler _handler;
+
+    std::string _headerText;
+    bool _quoted = false;
+    bool _inPayload = false;
+    DataURIHeader _header;
+    std::string _mimeType;
+
+    Base64State _base64;
+    std::string _escape;    // Incomplete percent escape
+
+    bool _failed = false;
+    bool _stopped = false;
+    uint64_t _decoded = 0;
+};
+
+} // namespace embla
@@ -0,0 +1,147 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "IcelandicAsciify.h"
+#include <array>
+#include <cstdint>
+
+namespace embla {
+
+// Table
+
+// Code points below this are looked up, all others become '?'
+#define ASCIIFY_TABLE_SIZE 0x180
+
+// One or two ASCII characters per code point, the first in the low byte
+// and the second, if any, in the high byte. Every code point in the table
+// gives at least one character, '?' if there is no better one. The only
+// code points dropped, combining marks, are past the end of the table.
+typedef std::array<uint16_t, ASCIIFY_TABLE_SIZE> AsciifyTable;
+
+// Letters with diacritics from U+00C0 onwards by their base letter, as
+// canonical decomposition has it. '?' where there is none.
+static constexpr const char *BaseLetters =
+    // Latin-1 Supplement
+    "AAAAAA?CEEEEIIII"
+    "?NOOOOO??UUUUY??"
+    "aaaaaa?ceeeeiiii"
+    "?nooooo??uuuuy?y"
+    // Latin Extended-A
+    "AaAaAaCcCcCcCcDd"
+    "??EeEeEeEeEeGgGg"
+    "GgGgHh??IiIiIiIi"
+    "I???JjKk?LlLlLl?"
+    "???NnNnNn???OoOo"
+    "Oo??RrRrRrSsSsSs"
+    "SsTtTt??UuUuUuUu"
+    "UuUuWwYyYZzZzZz?";
+
+static constexpr uint16_t Pair(char a, char b) {
+    return (uint16_t)((uint8_t)a | (uint8_t)b << 8);
+}
+
+static constexpr AsciifyTable BuildTable() {
+    AsciifyTable table{};
+    for (size_t c = 0; c < 0x80; c++) {
+        table[c] = (uint16_t)c;
+    }
+    for (size_t c = 0x80; c < 0xC0; c++) {
+        table[c] = '?';
+    }
+    for (size_t c = 0xC0; c < ASCIIFY_TABLE_SIZE; c++) {
+        table[c] = (uint8_t)BaseLetters[c - 0xC0];
+    }
+    // Icelandic letters without a base letter
+    table[0xD0] = 'D';          // Ð
+    table[0xF0] = 'd';          // ð
+    table[0xDE] = Pair('T', 'H'); // Þ
+    table[0xFE] = Pair('t', 'h'); // þ
+    table[0xC6] = Pair('A', 'E'); // Æ
+    table[0xE6] = Pair('a', 'e'); // æ
+    return table;
+}
+
+static constexpr AsciifyTable Table = BuildTable();
+
+// Transliteration
+
+size_t icelandicAsciify(const char *utf8, size_t length, char *dst) {
+    const uint8_t *p = (const uint8_t *)utf8;
+    const uint8_t *end = p + length;
+    char *out = dst;
+    while (p < end) {
+        // Runs of ASCII are copied as is
+        if (*p < 0x80) {
+            *out++ = (char)*p++;
+            continue;
+        }
+        uint32_t c;
+        size_t n;
+        if ((*p & 0xE0) == 0xC0) {
+            c = *p & 0x1F;
+            n = 2;
+        } else if ((*p & 0xF0) == 0xE0) {
+            c = *p & 0x0F;
+            n = 3;
+        } else if ((*p & 0xF8) == 0xF0) {
+            c = *p & 0x07;
+            n = 4;
+        } else {
+            // Stray continuation byte or invalid lead byte
+            *out++ = '?';
+            p++;
+            continue;
+        }
+        size_t i = 1;
+        for (; i < n && p + i < end && (p[i] & 0xC0) == 0x80; i++) {
+            c = c << 6 | (p[i] & 0x3F);
+        }
+        if (i < n) {
+            // Truncated sequence
+            *out++ = '?';
+            p += i;
+            continue;
+        }
+        p += n;
+
+        if (c < ASCIIFY_TABLE_SIZE) {
+            uint16_t t = Table[c];
+            *out++ = (char)(t & 0xFF);
+            if (t >> 8) {
+                *out++ = (char)(t >> 8);
+            }
+        } else if (c >= 0x300 && c < 0x370) {
+            // Combining diacritical mark
+        } else {
+            // Characters outside the Basic Multilingual Plane take two UTF-16 code units
+            *out++ = '?';
+            if (c >= 0x10000) {
+                *out++ = '?';
+            }
+        }
+    }
+    return (size_t)(out - dst);
+}
+
+std::string icelandicAsciify(const std::string &utf8) {
+    std::string out(utf8.size(), '\0');
+    out.resize(icelandicAsciify(utf8.data(), utf8.size(), &out[0]));
+    return out;
+}
+
+} // namespace embla
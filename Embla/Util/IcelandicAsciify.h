@@ -0,0 +1,47 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Transliteration of Icelandic text to ASCII, e.g. voice names to
+    file name suffixes.
+
+    Single pass over UTF-8 with a lookup table generated at compile
+    time, covering ASCII, Latin-1 and Latin Extended-A. Icelandic
+    letters are spelled out (ð to d, þ to th, æ to ae), other letters
+    lose their diacritics (é to e, ü to u) and anything else outside
+    ASCII becomes '?', one per UTF-16 code unit. This gives the same
+    result as -[NSString icelandic_asciify] used to, which replaced the
+    Icelandic letters one at a time and then converted to ASCII with
+    NSString's lossy conversion. Combining diacritical marks are
+    dropped, so decomposed input gives the same result as precomposed.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace embla {
+
+// The output is never longer than the input, so dst must hold length bytes.
+// Returns the number of bytes written.
+size_t icelandicAsciify(const char *utf8, size_t length, char *dst);
+
+std::string icelandicAsciify(const std::string &utf8);
+
+} // namespace embla
@@ -0,0 +1,39 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ImageDownsampler.h"
+#include <algorithm>
+
+namespace embla {
+
+ImageSize downsampledSize(uint32_t width, uint32_t height, uint32_t maxWidth) {
+    ImageSize size;
+    if (width == 0 || height == 0) {
+        return size;
+    }
+    if (maxWidth == 0 || width <= maxWidth) {
+        size.width = width;
+        size.height = height;
+        return size;
+    }
+    size.width = maxWidth;
+    size.height = (uint32_t)std::max<uint64_t>(1, ((uint64_t)height * maxWidth + width / 2) / width);
+    return size;
+}
+
+} // namespace embla
@@ -0,0 +1,41 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Sizing of answer images, which are decoded straight to the size they
+    are displayed at, so that they're never held in memory at full
+    resolution (see ImagePipeline.mm). Tools/ImageBench measures the same
+    approach with libjpeg and libpng, with its own row downsampler.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+namespace embla {
+
+struct ImageSize {
+    uint32_t width = 0;
+    uint32_t height = 0;
+};
+
+// Size to display an image of the given size at most maxWidth pixels
+// wide: never larger than the image, same aspect ratio, at least 1x1.
+ImageSize downsampledSize(uint32_t width, uint32_t height, uint32_t maxWidth);
+
+} // namespace embla
@@ -0,0 +1,208 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "LatencyTracer.h"
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+
+namespace embla {
+
+static_assert((LatencyTracer::capacityPerThread & (LatencyTracer::capacityPerThread - 1)) == 0,
+              "Capacity must be a power of two");
+
+// Thread buffers
+
+// Each slot is guarded by a sequence number, odd while it's being
+// written, so that a reader can tell when a slot changed under it. The
+// fields are atomics only so that such reads are well defined; relaxed
+// atomic loads and stores compile to plain ones.
+struct LatencyTracer::ThreadBuffer {
+    struct Slot {
+        std::atomic<uint64_t> sequence{ 0 };
+        std::atomic<uint64_t> time{ 0 };
+        std::atomic<uintptr_t> name{ 0 };
+        std::atomic<uint64_t> id{ 0 };
+        std::atomic<uint8_t> phase{ 0 };
+    };
+
+    explicit ThreadBuffer(uint32_t index) : index(index) {}
+
+    Slot slots[capacityPerThread];
+    std::atomic<uint64_t> head{ 0 };        // Events ever written
+    std::atomic<uint64_t> cleared{ 0 };     // Events before this one are cleared
+    std::atomic<bool> inUse{ true };
+    const uint32_t index;
+};
+
+// Releases the thread's buffer for reuse when the thread exits
+struct ThreadBufferHolder {
+    std::atomic<bool> *inUse = nullptr;
+    void *buffer = nullptr;
+
+    ~ThreadBufferHolder() {
+        if (inUse) {
+            inUse->store(false, std::memory_order_release);
+        }
+    }
+};
+
+static thread_local ThreadBufferHolder threadBuffer;
+
+LatencyTracer &LatencyTracer::shared() {
+    static LatencyTracer *tracer = new LatencyTracer();
+    return *tracer;
+}
+
+uint64_t LatencyTracer::now() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+LatencyTracer::ThreadBuffer *LatencyTracer::acquireBuffer() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &buffer : _buffers) {
+        bool expected = false;
+        if (buffer->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return buffer.get();
+        }
+    }
+    _buffers.emplace_back(new ThreadBuffer((uint32_t)_buffers.size()));
+    return _buffers.back().get();
+}
+
+// Recording
+
+void LatencyTracer::recordEnabled(const char *name, uint64_t id, TracePhase phase) {
+    ThreadBuffer *buffer = (ThreadBuffer *)threadBuffer.buffer;
+    if (!buffer) {
+        buffer = acquireBuffer();
+        threadBuffer.buffer = buffer;
+        threadBuffer.inUse = &buffer->inUse;
+    }
+    uint64_t time = now();
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    ThreadBuffer::Slot &slot = buffer->slots[head & (capacityPerThread - 1)];
+    slot.sequence.store(2 * head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.time.store(time, std::memory_order_relaxed);
+    slot.name.store((uintptr_t)name, std::memory_order_relaxed);
+    slot.id.store(id, std::memory_order_relaxed);
+    slot.phase.store((uint8_t)phase, std::memory_order_relaxed);
+    slot.sequence.store(2 * head + 2, std::memory_order_release);
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+// Reading
+
+std::vector<TraceEvent> LatencyTracer::events() const {
+    std::vector<TraceEvent> events;
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &buffer : _buffers) {
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        uint64_t first = std::max(buffer->cleared.load(std::memory_order_relaxed),
+                                  head - std::min<uint64_t>(head, capacityPerThread));
+        for (uint64_t i = first; i < head; i++) {
+            const ThreadBuffer::Slot &slot = buffer->slots[i & (capacityPerThread - 1)];
+            uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence != 2 * i + 2) {
+                continue;   // Overwritten since head was read
+            }
+            TraceEvent e;
+            e.time = slot.time.load(std::memory_order_relaxed);
+            e.name = (const char *)slot.name.load(std::memory_order_relaxed);
+            e.id = slot.id.load(std::memory_order_relaxed);
+            e.phase = (TracePhase)slot.phase.load(std::memory_order_relaxed);
+            e.thread = buffer->index;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+                events.push_back(e);
+            }
+        }
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const TraceEvent &a, const TraceEvent &b) { return a.time < b.time; });
+    return events;
+}
+
+void LatencyTracer::clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &buffer : _buffers) {
+        buffer->cleared.store(buffer->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+}
+
+LatencyTracerStats LatencyTracer::stats() const {
+    LatencyTracerStats s;
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &buffer : _buffers) {
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        s.events += head;
+        s.overwritten += head - std::min<uint64_t>(head, capacityPerThread);
+    }
+    s.threads = _buffers.size();
+    return s;
+}
+
+// Export
+
+static void AppendEscaped(std::string &out, const char *s) {
+    for (; s && *s; s++) {
+        char c = *s;
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += c;
+        }
+    }
+}
+
+// Spans are async events, as they may begin and end on different
+// threads, grouped by query id. Times are in microseconds from the
+// first event.
+std::string LatencyTracer::chromeTraceJSON(const std::vector<TraceEvent> &events) {
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    uint64_t start = events.empty() ? 0 : events.front().time;
+    for (const TraceEvent &e : events) {
+        start = std::min(start, e.time);
+    }
+    char buffer[160];
+    bool first = true;
+    for (const TraceEvent &e : events) {
+        const char *phase = e.phase == TracePhase::Begin ? "b" : e.phase == TracePhase::End ? "e" : "n";
+        out += first ? "" : ",\n";
+        out += "{\"name\":\"";
+        AppendEscaped(out, e.name);
+        snprintf(buffer, sizeof(buffer),
+                 "\",\"cat\":\"query\",\"ph\":\"%s\",\"id\":\"0x%" PRIx64 "\",\"ts\":%" PRIu64 ".%03u,"
+                 "\"pid\":1,\"tid\":%u}",
+                 phase, e.id, (e.time - start) / 1000, (unsigned)((e.time - start) % 1000), e.thread);
+        out += buffer;
+        first = false;
+    }
+    out += "\n]}\n";
+    return out;
+}
+
+} // namespace embla
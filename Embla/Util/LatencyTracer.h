@@ -0,0 +1,121 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Low-overhead tracing of where the time goes in a query, from the
+    hotword being heard to the answer starting to play.
+
+    Each thread records events into a fixed ring buffer of its own, so
+    recording takes no locks and allocates nothing once a thread has its
+    buffer. Events are timestamped with the monotonic clock and refer to
+    their name by pointer, so names must be string literals. A span is a
+    begin and end event with the same name and id, and may begin and end
+    on different threads, as most stages of a query do. The id ties the
+    events of one query together.
+
+    Events can be read back at any time without stopping the threads
+    recording them, and exported in the Chrome trace event format, for
+    chrome://tracing or Perfetto. When a ring fills up the oldest events
+    are overwritten. Recording is off until enabled, and then costs a
+    single relaxed load per event.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace embla {
+
+enum class TracePhase : uint8_t {
+    Begin,
+    End,
+    Instant,
+};
+
+struct TraceEvent {
+    uint64_t time = 0;              // Nanoseconds, monotonic
+    const char *name = nullptr;
+    uint64_t id = 0;                // Query the event belongs to
+    TracePhase phase = TracePhase::Instant;
+    uint32_t thread = 0;            // Buffer the event was recorded in, one per live thread
+};
+
+struct LatencyTracerStats {
+    uint64_t events = 0;            // Recorded since the tracer was created
+    uint64_t overwritten = 0;       // Lost because a ring filled up
+    size_t threads = 0;             // Buffers allocated
+};
+
+class LatencyTracer {
+public:
+    // Events held per thread
+    static const size_t capacityPerThread = 1024;
+
+    static LatencyTracer &shared();
+
+    // Monotonic clock the events are timestamped with, in nanoseconds
+    static uint64_t now();
+
+    LatencyTracer(const LatencyTracer &) = delete;
+    LatencyTracer &operator=(const LatencyTracer &) = delete;
+
+    void setEnabled(bool enabled) { _enabled.store(enabled, std::memory_order_relaxed); }
+    bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+    void begin(const char *name, uint64_t id) { record(name, id, TracePhase::Begin); }
+    void end(const char *name, uint64_t id) { record(name, id, TracePhase::End); }
+    void instant(const char *name, uint64_t id) { record(name, id, TracePhase::Instant); }
+
+    // Events currently held, by time. May be called from any thread.
+    std::vector<TraceEvent> events() const;
+
+    // Forget the events recorded so far.
+    void clear();
+
+    LatencyTracerStats stats() const;
+
+    // Chrome trace event JSON, one event per line
+    static std::string chromeTraceJSON(const std::vector<TraceEvent> &events);
+
+private:
+    struct ThreadBuffer;
+
+    LatencyTracer() = default;
+
+    void record(const char *name, uint64_t id, TracePhase phase) {
+        if (enabled()) {
+            recordEnabled(name, id, phase);
+        }
+    }
+    void recordEnabled(const char *name, uint64_t id, TracePhase phase);
+    ThreadBuffer *acquireBuffer();
+
+    std::atomic<bool> _enabled{ false };
+
+    // Buffers are never freed, but reused once their thread exits
+    mutable std::mutex _mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> _buffers;
+};
+
+} // namespace embla
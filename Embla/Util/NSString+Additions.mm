@@ -17,6 +17,8 @@
  */
 
 #import "NSString+Additions.h"
+#import "IcelandicAsciify.h"
+#import <vector>
 
 @implementation NSString (Additions)
 
@@ -52,43 +54,22 @@
 }
 
 - (NSString *)icelandic_asciify {
-    //Convert Icelandic characters to their ASCII equivalent
-    // and then remove all non-ASCII characters.
-
-    NSDictionary *ICECHARS_TO_ASCII = @{
-        @"ð": @"d",
-        @"Ð": @"D",
-        @"á": @"a",
-        @"Á": @"A",
-        @"ú": @"u",
-        @"Ú": @"U",
-        @"í": @"i",
-        @"Í": @"I",
-        @"é": @"e",
-        @"É": @"E",
-        @"þ": @"th",
-        @"Þ": @"TH",
-        @"ó": @"o",
-        @"Ó": @"O",
-        @"ý": @"y",
-        @"Ý": @"Y",
-        @"ö": @"o",
-        @"Ö": @"O",
-        @"æ": @"ae",
-        @"Æ": @"AE",
-    };
-    
-    NSString *s = [self copy];
-    for (NSString *key in ICECHARS_TO_ASCII) {
-        s = [s stringByReplacingOccurrencesOfString:key
-                                         withString:ICECHARS_TO_ASCII[key]];
+    // Convert Icelandic characters to their ASCII equivalent
+    // and everything else to plain ASCII, in a single pass.
+    // See IcelandicAsciify.cpp for the transliteration table.
+    const char *utf8 = CFStringGetCStringPtr((__bridge CFStringRef)self, kCFStringEncodingUTF8);
+    if (utf8 == NULL) {
+        utf8 = [self UTF8String];
     }
+    size_t length = strlen(utf8);
     
-    NSData *d = [s dataUsingEncoding:NSASCIIStringEncoding
-                allowLossyConversion:YES];
+    // The result is never longer than the UTF-8 input
+    std::vector<char> buf(length);
+    length = embla::icelandicAsciify(utf8, length, buf.data());
     
-    return [[NSString alloc] initWithData:d
-                                 encoding:NSASCIIStringEncoding];
+    return [[NSString alloc] initWithBytes:buf.data()
+                                    length:length
+                                  encoding:NSASCIIStringEncoding];
 }
 
 @end
@@ -0,0 +1,173 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "VoiceAssetPack.h"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PACK_MAGIC          "EMVA"
+#define PACK_VERSION        1
+#define PACK_NAME_SIZE      16
+#define PACK_HEADER_SIZE    16
+#define PACK_ENTRY_SIZE     32
+
+#define FLAG_PRESENT        1
+#define FLAG_VOICED         2
+
+namespace embla {
+
+static const char *ClipNames[] = {
+    "rec_begin", "rec_cancel", "rec_confirm", "conn", "err",
+    "dunno01", "dunno02", "dunno03", "dunno04", "dunno05", "dunno06", "dunno07",
+};
+
+static_assert(sizeof(ClipNames) / sizeof(ClipNames[0]) == (size_t)VoiceClip::Count, "A name for every clip");
+
+const char *voiceClipName(VoiceClip clip) {
+    return clip < VoiceClip::Count ? ClipNames[(size_t)clip] : "";
+}
+
+// Reading
+
+template <typename T>
+static T Read(const uint8_t *p) {
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+static std::string ReadName(const uint8_t *p) {
+    return std::string((const char *)p, strnlen((const char *)p, PACK_NAME_SIZE));
+}
+
+// Pack
+
+VoiceAssetPack::VoiceAssetPack(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= PACK_HEADER_SIZE) {
+        void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            _map = p;
+            _size = (size_t)st.st_size;
+        }
+    }
+    close(fd);
+    if (_map && !load()) {
+        unmap();
+    }
+}
+
+VoiceAssetPack::~VoiceAssetPack() {
+    unmap();
+}
+
+void VoiceAssetPack::unmap() {
+    if (_map) {
+        munmap(_map, _size);
+        _map = nullptr;
+        _size = 0;
+    }
+    _voices.clear();
+    _clips.clear();
+}
+
+// Validate the index and resolve it into the clip table
+bool VoiceAssetPack::load() {
+    const uint8_t *base = (const uint8_t *)_map;
+    if (memcmp(base, PACK_MAGIC, 4) != 0 || Read<uint32_t>(base + 4) != PACK_VERSION) {
+        return false;
+    }
+    uint64_t voiceCount = Read<uint32_t>(base + 8);
+    uint64_t clipCount = Read<uint32_t>(base + 12);
+    uint64_t entriesOffset = PACK_HEADER_SIZE + PACK_NAME_SIZE * (voiceCount + clipCount);
+    if (entriesOffset + PACK_ENTRY_SIZE * voiceCount * clipCount > _size) {
+        return false;
+    }
+
+    const uint8_t *names = base + PACK_HEADER_SIZE;
+    for (uint64_t v = 0; v < voiceCount; v++) {
+        _voices.push_back(ReadName(names + PACK_NAME_SIZE * v));
+    }
+    // Clip IDs by position in the pack, Count for clips the app doesn't know
+    std::vector<VoiceClip> ids;
+    for (uint64_t c = 0; c < clipCount; c++) {
+        std::string name = ReadName(names + PACK_NAME_SIZE * (voiceCount + c));
+        size_t id = 0;
+        while (id < (size_t)VoiceClip::Count && name != ClipNames[id]) {
+            id++;
+        }
+        ids.push_back((VoiceClip)id);
+    }
+
+    _clips.assign(voiceCount * (size_t)VoiceClip::Count, VoiceClipData());
+    const uint8_t *entry = base + entriesOffset;
+    for (uint64_t v = 0; v < voiceCount; v++) {
+        for (uint64_t c = 0; c < clipCount; c++, entry += PACK_ENTRY_SIZE) {
+            uint32_t flags = Read<uint32_t>(entry + 28);
+            if (!(flags & FLAG_PRESENT) || ids[c] == VoiceClip::Count) {
+                continue;
+            }
+            uint64_t offset = Read<uint64_t>(entry);
+            uint64_t size = Read<uint32_t>(entry + 8);
+            uint64_t dataOffset = Read<uint32_t>(entry + 12);
+            uint64_t frames = Read<uint32_t>(entry + 16);
+            uint16_t channels = Read<uint16_t>(entry + 24);
+            uint16_t bits = Read<uint16_t>(entry + 26);
+            // Samples are read in place, so must be aligned
+            if (offset + size > _size || bits != 16 || channels == 0 || dataOffset + frames * channels * 2 > size ||
+                (offset + dataOffset) % sizeof(int16_t) != 0) {
+                return false;
+            }
+            VoiceClipData &clip = _clips[v * (size_t)VoiceClip::Count + (size_t)ids[c]];
+            clip.wav = base + offset;
+            clip.wavSize = (size_t)size;
+            clip.samples = (const int16_t *)(base + offset + dataOffset);
+            clip.frames = (size_t)frames;
+            clip.sampleRate = Read<uint32_t>(entry + 20);
+            clip.channels = channels;
+            clip.voiced = flags & FLAG_VOICED;
+        }
+    }
+    return true;
+}
+
+int VoiceAssetPack::voiceIndex(const std::string &name) const {
+    for (size_t v = 0; v < _voices.size(); v++) {
+        if (_voices[v] == name) {
+            return (int)v;
+        }
+    }
+    return -1;
+}
+
+const VoiceClipData *VoiceAssetPack::clip(size_t voice, VoiceClip clip) const {
+    if (voice >= _voices.size() || clip >= VoiceClip::Count) {
+        return nullptr;
+    }
+    const VoiceClipData &data = _clips[voice * (size_t)VoiceClip::Count + (size_t)clip];
+    return data.wav ? &data : nullptr;
+}
+
+} // namespace embla
@@ -0,0 +1,101 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    The app's sound clips (UI sounds, and the connection error, error
+    and "don't know" answers spoken by each voice), packed into a single
+    file at build time by Embla/Audio/pack_voices.py, which documents
+    the format.
+
+    The pack is memory-mapped once and its index resolved into a table
+    by voice and clip ID, so looking up a clip is an array access. Each
+    clip is 16-bit PCM, available both as a complete WAV file (e.g. for
+    AVAudioPlayer) and as raw samples, straight from the mapping. The
+    pack is read-only and can be used from any thread.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace embla {
+
+enum class VoiceClip : uint16_t {
+    RecBegin,
+    RecCancel,
+    RecConfirm,
+    Conn,
+    Err,
+    Dunno01,
+    Dunno02,
+    Dunno03,
+    Dunno04,
+    Dunno05,
+    Dunno06,
+    Dunno07,
+    Count
+};
+
+// Name of the clip in the pack, e.g. "dunno01"
+const char *voiceClipName(VoiceClip clip);
+
+struct VoiceClipData {
+    const uint8_t *wav = nullptr;       // Complete WAV file
+    size_t wavSize = 0;
+    const int16_t *samples = nullptr;   // Interleaved PCM
+    size_t frames = 0;
+    uint32_t sampleRate = 0;
+    uint16_t channels = 0;
+    bool voiced = false;                // Spoken by the voice, as opposed to a UI sound
+};
+
+class VoiceAssetPack {
+public:
+    // Maps the pack at path. Check isOpen() for success.
+    explicit VoiceAssetPack(const std::string &path);
+    ~VoiceAssetPack();
+
+    VoiceAssetPack(const VoiceAssetPack &) = delete;
+    VoiceAssetPack &operator=(const VoiceAssetPack &) = delete;
+
+    bool isOpen() const { return _map != nullptr; }
+
+    size_t voiceCount() const { return _voices.size(); }
+    const std::string &voiceName(size_t voice) const { return _voices[voice]; }
+
+    // Index of the voice with the given name, e.g. "gudrun", or -1.
+    int voiceIndex(const std::string &name) const;
+
+    // The clip, or null if the voice or clip doesn't exist.
+    const VoiceClipData *clip(size_t voice, VoiceClip clip) const;
+
+private:
+    bool load();
+    void unmap();
+
+    void *_map = nullptr;
+    size_t _size = 0;
+    std::vector<std::string> _voices;
+    // voiceCount() x VoiceClip::Count, by voice then clip
+    std::vector<VoiceClipData> _clips;
+};
+
+} // namespace embla
@@ -0,0 +1,300 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Checks and benchmarks the Icelandic to ASCII transliteration behind
+    -[NSString icelandic_asciify] (IcelandicAsciify.cpp).
+
+    The check compares the transliteration with a model of the way
+    NSString+Additions.m used to do it: replace each of the 20 Icelandic
+    letters in turn, matching decomposed forms too as NSString does, and
+    then convert to ASCII the way NSString's lossy conversion does,
+    i.e. strip diacritics from letters that have them and turn anything
+    else into '?', one per UTF-16 code unit. The model is written from
+    the letters themselves rather than code points, so it doesn't share
+    the transliteration's table. Voice names, pangrams, every code point
+    up to U+024F, and random strings of Icelandic, Latin-1, combining
+    marks, other scripts and emoji must all give the same result. Any
+    failure is reported and the exit status is nonzero.
+
+    The benchmark transliterates long Icelandic text both ways.
+
+    $ build/asciifybench [--kb N] [--seed N]
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "BenchCheck.h"
+#include "IcelandicAsciify.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#define DEFAULT_TEXT_KB     256
+#define FUZZ_ROUNDS         20000
+#define MIN_BENCH_SECONDS   0.5
+
+typedef std::chrono::steady_clock Clock;
+
+// UTF-8
+
+static std::string Utf8(uint32_t c) {
+    std::string s;
+    if (c < 0x80) {
+        s += (char)c;
+    } else if (c < 0x800) {
+        s += (char)(0xC0 | c >> 6);
+        s += (char)(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        s += (char)(0xE0 | c >> 12);
+        s += (char)(0x80 | ((c >> 6) & 0x3F));
+        s += (char)(0x80 | (c & 0x3F));
+    } else {
+        s += (char)(0xF0 | c >> 18);
+        s += (char)(0x80 | ((c >> 12) & 0x3F));
+        s += (char)(0x80 | ((c >> 6) & 0x3F));
+        s += (char)(0x80 | (c & 0x3F));
+    }
+    return s;
+}
+
+static std::vector<uint32_t> CodePoints(const std::string &s) {
+    std::vector<uint32_t> out;
+    for (size_t i = 0; i < s.size();) {
+        uint8_t b = (uint8_t)s[i];
+        size_t n = b < 0x80 ? 1 : b < 0xE0 ? 2 : b < 0xF0 ? 3 : 4;
+        uint32_t c = n == 1 ? b : n == 2 ? (b & 0x1F) : n == 3 ? (b & 0x0F) : (b & 0x07);
+        for (size_t j = 1; j < n; j++) {
+            c = c << 6 | ((uint8_t)s[i + j] & 0x3F);
+        }
+        out.push_back(c);
+        i += n;
+    }
+    return out;
+}
+
+// Model of the old implementation
+
+static const char *IceChars[][2] = {
+    { "ð", "d" }, { "Ð", "D" }, { "á", "a" }, { "Á", "A" }, { "ú", "u" }, { "Ú", "U" }, { "í", "i" },
+    { "Í", "I" }, { "é", "e" }, { "É", "E" }, { "þ", "th" }, { "Þ", "TH" }, { "ó", "o" }, { "Ó", "O" },
+    { "ý", "y" }, { "Ý", "Y" }, { "ö", "o" }, { "Ö", "O" }, { "æ", "ae" }, { "Æ", "AE" },
+};
+
+// Canonically equivalent decomposed forms, which NSString's search matches as well
+static const char *IceCharsDecomposed[][2] = {
+    { "á", "a" }, { "Á", "A" }, { "ú", "u" }, { "Ú", "U" }, { "í", "i" },
+    { "Í", "I" }, { "é", "e" }, { "É", "E" }, { "ó", "o" }, { "Ó", "O" },
+    { "ý", "y" }, { "Ý", "Y" }, { "ö", "o" }, { "Ö", "O" },
+};
+
+// Letters that decompose into a base letter and diacritics
+static const char *Diacritics[][2] = {
+    { "A", "ÀÁÂÃÄÅĀĂĄ" }, { "a", "àáâãäåāăą" }, { "C", "ÇĆĈĊČ" }, { "c", "çćĉċč" }, { "D", "Ď" },
+    { "d", "ď" }, { "E", "ÈÉÊËĒĔĖĘĚ" }, { "e", "èéêëēĕėęě" }, { "G", "ĜĞĠĢ" }, { "g", "ĝğġģ" },
+    { "H", "Ĥ" }, { "h", "ĥ" }, { "I", "ÌÍÎÏĨĪĬĮİ" }, { "i", "ìíîïĩīĭį" }, { "J", "Ĵ" }, { "j", "ĵ" },
+    { "K", "Ķ" }, { "k", "ķ" }, { "L", "ĹĻĽ" }, { "l", "ĺļľ" }, { "N", "ÑŃŅŇ" }, { "n", "ñńņň" },
+    { "O", "ÒÓÔÕÖŌŎŐ" }, { "o", "òóôõöōŏő" }, { "R", "ŔŖŘ" }, { "r", "ŕŗř" }, { "S", "ŚŜŞŠ" },
+    { "s", "śŝşš" }, { "T", "ŢŤ" }, { "t", "ţť" }, { "U", "ÙÚÛÜŨŪŬŮŰŲ" }, { "u", "ùúûüũūŭůűų" },
+    { "W", "Ŵ" }, { "w", "ŵ" }, { "Y", "ÝŶŸ" }, { "y", "ýÿŷ" }, { "Z", "ŹŻŽ" }, { "z", "źżž" },
+};
+
+static void ReplaceAll(std::string &s, const std::string &from, const std::string &to) {
+    std::string out;
+    size_t pos = 0;
+    for (size_t hit; (hit = s.find(from, pos)) != std::string::npos; pos = hit + from.size()) {
+        out.append(s, pos, hit - pos);
+        out += to;
+    }
+    if (pos == 0) {
+        return;
+    }
+    out.append(s, pos, std::string::npos);
+    s.swap(out);
+}
+
+static std::string AsciifyOldWay(const std::string &input) {
+    static std::vector<std::string> lossy;
+    if (lossy.empty()) {
+        lossy.resize(0x10000);
+        for (auto &d : Diacritics) {
+            for (uint32_t c : CodePoints(d[1])) {
+                lossy[c] = d[0];
+            }
+        }
+    }
+
+    std::string s = input;
+    for (auto &r : IceChars) {
+        ReplaceAll(s, r[0], r[1]);
+    }
+    for (auto &r : IceCharsDecomposed) {
+        ReplaceAll(s, r[0], r[1]);
+    }
+
+    std::string out;
+    for (uint32_t c : CodePoints(s)) {
+        if (c < 0x80) {
+            out += (char)c;
+        } else if (c >= 0x300 && c < 0x370) {
+            // Combining diacritical marks are dropped
+        } else if (c < 0x10000 && !lossy[c].empty()) {
+            out += lossy[c];
+        } else {
+            out += c < 0x10000 ? "?" : "??";
+        }
+    }
+    return out;
+}
+
+// Checks
+
+static void Check(const std::string &input, const char *expected = nullptr) {
+    // Canaries beyond the input length catch overruns
+    std::vector<char> buf(input.size() + 16, (char)0xA5);
+    size_t length = embla::icelandicAsciify(input.data(), input.size(), buf.data());
+    std::string got(buf.data(), length);
+    std::string want = expected ? expected : AsciifyOldWay(input);
+    bool overrun = false;
+    for (size_t i = input.size(); i < buf.size(); i++) {
+        overrun |= buf[i] != (char)0xA5;
+    }
+    if (got != want || overrun) {
+        FailFormat("'%.60s': got '%.60s', expected '%.60s'%s", input.c_str(), got.c_str(), want.c_str(),
+                   overrun ? ", wrote past the end of the buffer" : "");
+    }
+}
+
+static void CheckKnown() {
+    Check("Dóra", "Dora");
+    Check("Guðrún", "Gudrun");
+    Check("Gunnar", "Gunnar");
+    Check("Þórunn Ýr Ævarsdóttir", "THorunn Yr AEvarsdottir");
+    Check("Kæmi ný öxi hér, ykist þjófum nú bæði víl og ádrepa", "Kaemi ny oxi her, ykist thjofum nu baedi vil og adrepa");
+    Check("Crème brûlée à la française", "Creme brulee a la francaise");
+    Check("Straße, Øresund, Łódź", "Stra?e, ?resund, ?odz");
+    Check("Guðrún", "Gudrun");
+    Check("€10 — \U0001F600", "?10 ? ??");
+    Check("", "");
+}
+
+static void CheckAllCodePoints() {
+    for (uint32_t c = 0; c < 0x250; c++) {
+        Check("x" + Utf8(c) + "y");
+    }
+    for (auto &r : IceChars) {
+        Check(r[0]);
+    }
+}
+
+static void Fuzz(uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<std::string> pool;
+    for (auto &r : IceChars) {
+        pool.push_back(r[0]);
+    }
+    for (auto &r : IceCharsDecomposed) {
+        pool.push_back(r[0]);
+    }
+    for (uint32_t c : { 0x20, 0x2E, 0x3F, 0x61, 0x41, 0x7A, 0xA0, 0xAB, 0xC5, 0xDF, 0xE7, 0xF8, 0xFF, 0x152, 0x301,
+                        0x308, 0x3A9, 0x416, 0x2014, 0x201E, 0x20AC, 0x4E2D, 0x1F600 }) {
+        pool.push_back(Utf8(c));
+    }
+    for (int round = 0; round < FUZZ_ROUNDS; round++) {
+        std::string s;
+        size_t n = rng() % 40;
+        for (size_t i = 0; i < n; i++) {
+            s += pool[rng() % pool.size()];
+        }
+        Check(s);
+    }
+}
+
+// Benchmark
+
+static std::string IcelandicText(size_t bytes) {
+    static const char *sentences[] = {
+        "Veðrið í Reykjavík er skýjað og hiti um fimm stig. ",
+        "Á morgun er spáð norðaustanátt og éljum fyrir norðan. ",
+        "Þjóðminjasafn Íslands er opið alla daga frá klukkan tíu. ",
+        "Kæmi ný öxi hér, ykist þjófum nú bæði víl og ádrepa. ",
+        "Strætó númer fjórtán fer frá Hlemmi eftir sjö mínútur. ",
+    };
+    std::string s;
+    for (size_t i = 0; s.size() < bytes; i++) {
+        s += sentences[i % 5];
+    }
+    return s;
+}
+
+template <typename F>
+static double Throughput(const std::string &text, F asciify) {
+    size_t runs = 0;
+    size_t total = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0.0;
+    while (elapsed < MIN_BENCH_SECONDS) {
+        total += asciify(text).size();
+        runs++;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return total ? text.size() * runs / elapsed / 1e6 : 0.0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t kb = DEFAULT_TEXT_KB;
+    uint32_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--kb" && i + 1 < argc) {
+            kb = (size_t)atoi(argv[++i]);
+        } else if (a == "--seed" && i + 1 < argc) {
+            seed = (uint32_t)atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--kb N] [--seed N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    CheckKnown();
+    CheckAllCodePoints();
+    Fuzz(seed);
+    if (!ChecksPassed()) {
+        return 1;
+    }
+
+    std::string text = IcelandicText(kb * 1024);
+    if (embla::icelandicAsciify(text) != AsciifyOldWay(text)) {
+        fprintf(stderr, "Benchmark text transliterated incorrectly\n");
+        return 1;
+    }
+    double oldRate = Throughput(text, AsciifyOldWay);
+    double newRate = Throughput(text, [](const std::string &s) { return embla::icelandicAsciify(s); });
+    printf("{\n");
+    printf("  \"fuzz_rounds\": %d,\n", FUZZ_ROUNDS);
+    printf("  \"text_bytes\": %zu,\n", text.size());
+    printf("  \"old_mb_per_s\": %.0f,\n", oldRate);
+    printf("  \"new_mb_per_s\": %.0f,\n", newRate);
+    printf("  \"speedup\": %.1f\n", newRate / oldRate);
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,258 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Checks and stress tests the lock-free ring buffer between the
+    recording callback and the consumer queue (AudioRingBuffer.h).
+
+    The checks number every sample written so that the reader can tell
+    exactly what it got. Writes and reads of random sizes must come out
+    in order across many wraps of the buffer. Writing past a full buffer
+    must drop the newest samples and count them, and leave the oldest
+    intact. discard() must leave nothing to read and writing must carry
+    on from there.
+
+    The stress test runs a producer thread that writes 16 kHz audio in
+    the recording callback's slice sizes, in real time, against a
+    consumer that drains every 10 ms as AudioRecordingService does. Once
+    the producer stops, a last drain must hand over every sample left,
+    with none dropped and none out of order. A second run with an
+    unpaced producer and a consumer that stalls now and then forces
+    overruns: what arrives must still be in order, and what arrived and
+    what was dropped must add up to what was written.
+
+    The report gives the most the real-time run had buffered and the
+    throughput of the unpaced run. Any failure is reported and the exit
+    status is nonzero.
+
+    $ build/ringbench [--seconds N] [--seed N]
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "BenchCheck.h"
+#include "AudioRingBuffer.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// As in AudioRecordingService.mm
+#define SAMPLE_RATE             16000
+#define RING_BUFFER_SECONDS     2
+#define DRAIN_INTERVAL_MS       10
+// RemoteIO slice sizes the producer picks from
+static const size_t kSliceSizes[] = { 128, 160, 256, 341, 512, 1024 };
+
+typedef std::chrono::steady_clock Clock;
+
+// Checks
+
+static void CheckWraparound(std::mt19937 &rng) {
+    embla::AudioRingBuffer<uint32_t> ring(1000);
+    CHECK(ring.capacity() == 1024);
+    std::vector<uint32_t> in(ring.capacity()), out(ring.capacity());
+    uint32_t written = 0, read = 0;
+    for (int round = 0; round < 20000; round++) {
+        size_t n = rng() % (ring.availableToWrite() + 1);
+        for (size_t i = 0; i < n; i++) {
+            in[i] = written + (uint32_t)i;
+        }
+        if (ring.write(in.data(), n) != n) {
+            FailFormat("Write of %zu samples with room for them fell short", n);
+            return;
+        }
+        written += (uint32_t)n;
+        n = ring.read(out.data(), rng() % (ring.capacity() + 1));
+        for (size_t i = 0; i < n; i++) {
+            if (out[i] != read + i) {
+                FailFormat("Round %d: read sample %u, expected %zu", round, out[i], read + i);
+                return;
+            }
+        }
+        read += (uint32_t)n;
+        CHECK(ring.availableToRead() == written - read);
+    }
+    CHECK(written > 100 * ring.capacity());
+    CHECK(ring.droppedCount() == 0);
+}
+
+static void CheckOverrun() {
+    embla::AudioRingBuffer<uint32_t> ring(256);
+    std::vector<uint32_t> in(400), out(400);
+    for (uint32_t i = 0; i < in.size(); i++) {
+        in[i] = i;
+    }
+    // Partly read, so the overrun also wraps
+    CHECK(ring.write(in.data(), 100) == 100);
+    CHECK(ring.read(out.data(), 60) == 60);
+    CHECK(ring.write(in.data() + 100, 300) == 216);
+    CHECK(ring.droppedCount() == 84);
+    CHECK(ring.availableToWrite() == 0);
+    CHECK(ring.write(in.data(), 10) == 0);
+    CHECK(ring.droppedCount() == 94);
+    // The oldest samples are kept, the newest dropped
+    CHECK(ring.read(out.data(), 400) == 256);
+    bool ordered = true;
+    for (uint32_t i = 0; i < 256; i++) {
+        ordered = ordered && out[i] == 60 + i;
+    }
+    CHECK(ordered);
+
+    CHECK(ring.write(in.data(), 50) == 50);
+    ring.discard();
+    CHECK(ring.availableToRead() == 0);
+    CHECK(ring.write(in.data() + 50, 10) == 10);
+    CHECK(ring.read(out.data(), 400) == 10 && out[0] == 50 && out[9] == 59);
+}
+
+// Stress
+
+struct StressResult {
+    uint64_t written = 0;
+    uint64_t received = 0;
+    uint64_t dropped = 0;
+    uint64_t outOfOrder = 0;
+    size_t maxBuffered = 0;
+    double seconds = 0.0;
+};
+
+// Producer writes numbered samples in random slice sizes, paced to real
+// time at SAMPLE_RATE or as fast as it can. The consumer drains every
+// DRAIN_INTERVAL_MS, stalling for stallMs every so often if asked to, and
+// drains once more after the producer has stopped.
+template <typename T>
+static StressResult Stress(double seconds, bool paced, int stallMs, uint32_t seed) {
+    embla::AudioRingBuffer<T> ring(SAMPLE_RATE * RING_BUFFER_SECONDS);
+    std::atomic<bool> running{true};
+    std::atomic<uint64_t> written{0};
+    StressResult result;
+
+    std::thread producer([&]() {
+        std::mt19937 rng(seed);
+        std::vector<T> slice(1024);
+        uint64_t next = 0;
+        Clock::time_point start = Clock::now();
+        while (std::chrono::duration<double>(Clock::now() - start).count() < seconds) {
+            size_t n = kSliceSizes[rng() % (sizeof(kSliceSizes) / sizeof(kSliceSizes[0]))];
+            for (size_t i = 0; i < n; i++) {
+                slice[i] = (T)(next + i);
+            }
+            // Numbering carries on past dropped samples, like time does
+            ring.write(slice.data(), n);
+            next += n;
+            written.store(next, std::memory_order_relaxed);
+            if (paced) {
+                std::this_thread::sleep_until(start + std::chrono::microseconds(next * 1000000 / SAMPLE_RATE));
+            }
+        }
+        running = false;
+    });
+
+    std::mt19937 rng(seed + 1);
+    std::vector<T> drain(ring.capacity());
+    uint64_t expected = 0;
+    bool first = true;
+    Clock::time_point start = Clock::now();
+    auto drainOnce = [&]() {
+        result.maxBuffered = std::max(result.maxBuffered, ring.availableToRead());
+        size_t n = ring.read(drain.data(), drain.size());
+        for (size_t i = 0; i < n; i++) {
+            // Samples may be missing after an overrun, but never go backwards
+            if (!first && (paced ? drain[i] != (T)expected : (uint64_t)drain[i] < expected)) {
+                result.outOfOrder++;
+            }
+            expected = (uint64_t)drain[i] + 1;
+            first = false;
+        }
+        result.received += n;
+    };
+    while (running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_INTERVAL_MS));
+        if (stallMs && rng() % 20 == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(stallMs));
+        }
+        drainOnce();
+    }
+    producer.join();
+    // Clean stop: the producer is done, so this gets the rest
+    drainOnce();
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.written = written;
+    result.dropped = ring.droppedCount();
+    if (ring.availableToRead() != 0) {
+        Fail("Samples left in the ring buffer after the last drain");
+    }
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = 3.0;
+    uint32_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--seconds" && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (a == "--seed" && i + 1 < argc) {
+            seed = (uint32_t)atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--seconds N] [--seed N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::mt19937 rng(seed);
+    CheckWraparound(rng);
+    CheckOverrun();
+
+    // 16-bit samples, as recorded, in real time
+    StressResult paced = Stress<int16_t>(seconds, true, 0, seed);
+    if (paced.dropped || paced.outOfOrder || paced.received != paced.written) {
+        FailFormat("Real time: %llu written, %llu received, %llu dropped, %llu out of order",
+                   (unsigned long long)paced.written, (unsigned long long)paced.received,
+                   (unsigned long long)paced.dropped, (unsigned long long)paced.outOfOrder);
+    }
+    CHECK(paced.written >= (uint64_t)(seconds * SAMPLE_RATE * 0.9));
+
+    // Flat out against a stalling consumer
+    StressResult unpaced = Stress<uint64_t>(std::min(seconds, 1.0), false, 50, seed);
+    if (unpaced.outOfOrder || unpaced.received + unpaced.dropped != unpaced.written) {
+        FailFormat("Unpaced: %llu written, %llu received, %llu dropped, %llu out of order",
+                   (unsigned long long)unpaced.written, (unsigned long long)unpaced.received,
+                   (unsigned long long)unpaced.dropped, (unsigned long long)unpaced.outOfOrder);
+    }
+    CHECK(unpaced.dropped > 0);
+    if (!ChecksPassed()) {
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"realtime\": { \"samples\": %llu, \"max_buffered_ms\": %.1f },\n",
+           (unsigned long long)paced.written, paced.maxBuffered * 1000.0 / SAMPLE_RATE);
+    printf("  \"unpaced\": { \"samples\": %llu, \"dropped\": %llu, \"msamples_per_second\": %.0f }\n",
+           (unsigned long long)unpaced.written, (unsigned long long)unpaced.dropped,
+           unpaced.written / unpaced.seconds / 1e6);
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,320 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Checks embla::DiskCache, the on-disk cache for synthesized speech
+    audio, and measures it on a simulated workload.
+
+    The checks cover lookups, sharing of blobs between keys, LRU
+    eviction, persistence of the index across reopening, recovery from
+    a damaged index, deleted blob files or a crash before the index was
+    saved, and mappings that outlive eviction. Any failure is reported and the exit status is nonzero.
+
+    The workload draws answers from a Zipf distribution, as a few
+    answers (the time, common weather phrases) make up much of the
+    traffic, and reports the hit rate along with the time to look up a
+    cached blob through the memory mapping versus reading the file.
+
+    $ build/cachebench [--answers N] [--lookups N] [--cache-mb N]
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "BenchCheck.h"
+#include "DiskCache.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#define DEFAULT_ANSWERS     2000
+#define DEFAULT_LOOKUPS     20000
+#define DEFAULT_CACHE_MB    20
+#define ZIPF_EXPONENT       1.1
+
+namespace fs = std::filesystem;
+
+typedef std::chrono::steady_clock Clock;
+
+static std::vector<uint8_t> Blob(size_t size, uint32_t seed) {
+    std::vector<uint8_t> data(size);
+    std::mt19937 rng(seed);
+    for (uint8_t &b : data) {
+        b = (uint8_t)rng();
+    }
+    return data;
+}
+
+static bool Equals(const std::shared_ptr<embla::MappedBlob> &mapped, const std::vector<uint8_t> &data) {
+    return mapped && mapped->size() == data.size() && memcmp(mapped->data(), data.data(), data.size()) == 0;
+}
+
+// Checks
+
+static void Check(const std::string &dir) {
+    fs::remove_all(dir);
+    std::vector<uint8_t> a = Blob(1000, 1), b = Blob(2000, 2), c = Blob(3000, 3), d = Blob(1500, 4);
+    {
+        embla::DiskCache cache(dir, 5000);
+        CHECK(!cache.get("url:a"));
+        CHECK(cache.put({"url:a", "text:a"}, a.data(), a.size()));
+        CHECK(Equals(cache.get("url:a"), a));
+        CHECK(Equals(cache.get("text:a"), a));
+
+        // Same contents under another key share the blob
+        CHECK(cache.put({"url:a2"}, a.data(), a.size()));
+        CHECK(cache.alias("url:a", "text:a2"));
+        CHECK(!cache.alias("missing", "text:x"));
+        embla::DiskCacheStats s = cache.stats();
+        CHECK(s.blobs == 1 && s.keys == 4 && s.bytes == 1000);
+        CHECK(s.hits == 2 && s.misses == 1);
+
+        // The first key found is used, counting once
+        CHECK(Equals(cache.get(std::vector<std::string>{ "text:x", "url:a2" }), a));
+        CHECK(!cache.get(std::vector<std::string>{ "text:x", "text:y" }));
+        s = cache.stats();
+        CHECK(s.hits == 3 && s.misses == 2);
+
+        // Too large for the cache
+        std::vector<uint8_t> huge = Blob(6000, 9);
+        CHECK(!cache.put({"huge"}, huge.data(), huge.size()));
+
+        // a and b are held, b most recently used, so c evicts a with all its keys
+        CHECK(cache.put({"b"}, b.data(), b.size()));
+        CHECK(cache.get("b"));
+        CHECK(cache.put({"c"}, c.data(), c.size()));
+        CHECK(!cache.contains("url:a") && !cache.contains("text:a2"));
+        s = cache.stats();
+        CHECK(s.blobs == 2 && s.keys == 2 && s.bytes == 5000 && s.evictions == 1);
+    }
+    fs::remove_all(dir);
+    {
+        embla::DiskCache cache(dir, 6000);
+        CHECK(cache.put({"a"}, a.data(), a.size()));
+        CHECK(cache.put({"b"}, b.data(), b.size()));
+        CHECK(cache.put({"c"}, c.data(), c.size()));
+        std::shared_ptr<embla::MappedBlob> mappedB = cache.get("b");
+        CHECK(cache.get("a"));
+        // 6000 bytes held, d needs 1500: c is least recently used
+        CHECK(cache.put({"d"}, d.data(), d.size()));
+        CHECK(!cache.contains("c"));
+        CHECK(cache.contains("a") && cache.contains("b") && cache.contains("d"));
+        CHECK(cache.stats().evictions == 1 && cache.stats().bytes == 4500);
+
+        // Storing new contents under d evicts b, the oldest, and moving d's
+        // only key off its old blob drops that blob too
+        CHECK(cache.put({"d"}, c.data(), c.size()));
+        CHECK(Equals(cache.get("d"), c));
+        CHECK(!cache.contains("b"));
+        CHECK(cache.stats().blobs == 2 && cache.stats().bytes == 4000);
+
+        // Evicted blobs stay readable through existing mappings
+        CHECK(Equals(mappedB, b));
+
+        cache.remove("a");
+        CHECK(!cache.contains("a") && cache.stats().blobs == 1);
+    }
+    {
+        // The index survives reopening, including LRU order and counts
+        embla::DiskCache cache(dir, 6000);
+        embla::DiskCacheStats s = cache.stats();
+        CHECK(s.blobs == 1 && s.bytes == 3000);
+        CHECK(s.hits == 3 && s.misses == 0);
+        CHECK(Equals(cache.get("d"), c));
+        CHECK(cache.put({"a"}, a.data(), a.size()));
+        CHECK(cache.put({"b"}, b.data(), b.size()));
+    }
+    {
+        // A lowered limit is enforced on opening
+        embla::DiskCache cache(dir, 2500);
+        CHECK(cache.stats().bytes == 2000);
+        CHECK(cache.contains("b") && !cache.contains("a") && !cache.contains("d"));
+    }
+    {
+        // Blob files deleted behind the cache's back are misses, and stray
+        // files are removed when opening
+        for (const fs::directory_entry &e : fs::directory_iterator(dir)) {
+            if (e.path().filename() != "index") {
+                fs::remove(e.path());
+            }
+        }
+        std::ofstream(dir + "/stray.tmp") << "x";
+        embla::DiskCache cache(dir, 6000);
+        CHECK(!cache.get("b"));
+        CHECK(cache.stats().blobs == 0);
+        CHECK(!fs::exists(dir + "/stray.tmp"));
+    }
+    {
+        // A crash before the index is saved, as seen by copying the
+        // directory meanwhile, loses the blobs stored since, while those
+        // removed since stay removed
+        std::string crashed = dir + "-crashed";
+        fs::remove_all(crashed);
+        {
+            embla::DiskCache cache(dir, 6000);
+            CHECK(cache.put({"a"}, a.data(), a.size()));
+            cache.sync();
+            CHECK(cache.put({"b"}, b.data(), b.size()));
+            cache.remove("a");
+            fs::copy(dir, crashed);
+        }
+        {
+            embla::DiskCache cache(crashed, 6000);
+            CHECK(!cache.get("a") && !cache.get("b"));
+            CHECK(cache.stats().blobs == 0);
+            size_t files = 0;
+            for (auto it = fs::directory_iterator(crashed); it != fs::directory_iterator(); ++it) {
+                files++;
+            }
+            CHECK(files == 1);
+        }
+        fs::remove_all(crashed);
+        {
+            // Closed properly, the changes are kept
+            embla::DiskCache cache(dir, 6000);
+            CHECK(!cache.contains("a") && cache.contains("b"));
+            cache.clear();
+        }
+    }
+    {
+        // A damaged index means an empty cache, not a crash
+        {
+            embla::DiskCache cache(dir, 6000);
+            CHECK(cache.put({"a"}, a.data(), a.size()));
+        }
+        std::string index = dir + "/index";
+        fs::resize_file(index, fs::file_size(index) - 3);
+        embla::DiskCache cache(dir, 6000);
+        CHECK(cache.stats().blobs == 0 && cache.stats().keys == 0);
+        CHECK(cache.put({"a"}, a.data(), a.size()));
+        size_t files = 0;
+        for (auto it = fs::directory_iterator(dir); it != fs::directory_iterator(); ++it) {
+            files++;
+        }
+        CHECK(files == 2);
+    }
+    fs::remove_all(dir);
+}
+
+// Workload
+
+static int Workload(const std::string &dir, int answers, int lookups, int cacheMB) {
+    fs::remove_all(dir);
+    std::string plainDir = dir + "-plain";
+    fs::create_directories(plainDir);
+    embla::DiskCache cache(dir, (uint64_t)cacheMB << 20);
+
+    // Answer sizes of 1-8 seconds of 32 kbit/s MP3
+    std::mt19937 rng(7);
+    std::vector<size_t> sizes(answers);
+    for (size_t &size : sizes) {
+        size = 4000 + rng() % 28000;
+    }
+    std::vector<double> weights(answers);
+    for (int i = 0; i < answers; i++) {
+        weights[i] = 1.0 / pow(i + 1, ZIPF_EXPONENT);
+    }
+    std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+
+    double getTime = 0.0, readTime = 0.0, putTime = 0.0;
+    uint64_t hits = 0, puts = 0, checksum = 0;
+    std::vector<uint8_t> readBuffer;
+    for (int n = 0; n < lookups; n++) {
+        int answer = zipf(rng);
+        std::string key = "text:" + std::to_string(answer) + "|Dora|1.00";
+
+        Clock::time_point t0 = Clock::now();
+        std::shared_ptr<embla::MappedBlob> blob = cache.get(key);
+        if (blob) {
+            // Touch every page, as playback would
+            for (size_t i = 0; i < blob->size(); i += 4096) {
+                checksum += blob->data()[i];
+            }
+        }
+        if (blob) {
+            getTime += std::chrono::duration<double>(Clock::now() - t0).count();
+            hits++;
+            // The same bytes read into memory from a plain file, for comparison
+            t0 = Clock::now();
+            std::ifstream f(plainDir + "/" + std::to_string(answer), std::ios::binary);
+            readBuffer.resize(blob->size());
+            f.read((char *)readBuffer.data(), readBuffer.size());
+            checksum += readBuffer[0];
+            readTime += std::chrono::duration<double>(Clock::now() - t0).count();
+            continue;
+        }
+        std::vector<uint8_t> data = Blob(sizes[answer], answer);
+        t0 = Clock::now();
+        cache.put({key, "url:https://example.com/" + std::to_string(answer) + ".mp3"}, data.data(), data.size());
+        putTime += std::chrono::duration<double>(Clock::now() - t0).count();
+        puts++;
+        std::ofstream(plainDir + "/" + std::to_string(answer), std::ios::binary)
+            .write((const char *)data.data(), data.size());
+    }
+    cache.sync();
+
+    embla::DiskCacheStats s = cache.stats();
+    printf("{\n");
+    printf("  \"answers\": %d,\n", answers);
+    printf("  \"lookups\": %d,\n", lookups);
+    printf("  \"cache_mb\": %d,\n", cacheMB);
+    printf("  \"hit_rate\": %.3f,\n", s.hitRate());
+    printf("  \"evictions\": %llu,\n", (unsigned long long)s.evictions);
+    printf("  \"blobs\": %zu,\n", s.blobs);
+    printf("  \"bytes\": %llu,\n", (unsigned long long)s.bytes);
+    printf("  \"mapped_lookup_us\": %.1f,\n", hits ? getTime / hits * 1e6 : 0.0);
+    printf("  \"read_file_us\": %.1f,\n", hits ? readTime / hits * 1e6 : 0.0);
+    printf("  \"put_us\": %.1f,\n", puts ? putTime / puts * 1e6 : 0.0);
+    printf("  \"checksum\": %llu\n", (unsigned long long)checksum);
+    printf("}\n");
+    fs::remove_all(dir);
+    fs::remove_all(plainDir);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int answers = DEFAULT_ANSWERS;
+    int lookups = DEFAULT_LOOKUPS;
+    int cacheMB = DEFAULT_CACHE_MB;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--answers" && i + 1 < argc) {
+            answers = atoi(argv[++i]);
+        } else if (a == "--lookups" && i + 1 < argc) {
+            lookups = atoi(argv[++i]);
+        } else if (a == "--cache-mb" && i + 1 < argc) {
+            cacheMB = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--answers N] [--lookups N] [--cache-mb N]\n", argv[0]);
+            return 1;
+        }
+    }
+    std::string dir = (fs::temp_directory_path() / ("cachebench-" + std::to_string(getpid()))).string();
+    Check(dir);
+    if (!ChecksPassed()) {
+        return 1;
+    }
+    return Workload(dir, answers, lookups, cacheMB);
+}
@@ -0,0 +1,165 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Compares heap allocations and time per second of audio for two ways
+    of chunking microphone audio for streaming speech recognition:
+
+    - "legacy": what QuerySession used to do. Blocks are appended to a
+      growable buffer, which is sent whole (remainder and all) and
+      replaced with a new one once it holds at least 100 ms of audio.
+    - "assembler": embla::ChunkAssembler, which assembles exact chunks
+      in preallocated slots that the consumer releases after sending.
+
+    Allocations are counted by replacing the global operator new, so
+    NSMutableData is approximated by std::vector. Chunks are held by a
+    simulated in-flight queue before being released, like the gRPC pipe
+    holds the NSData objects the assembler hands out.
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "ChunkAssembler.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <new>
+#include <vector>
+
+#define SAMPLE_RATE     16000
+#define CHUNK_MS        100
+#define SLOTS           16
+#define IN_FLIGHT       4       // Chunks held by the simulated consumer
+#define AUDIO_SECONDS   3600
+
+static size_t gAllocations = 0;
+
+void *operator new(size_t size) {
+    gAllocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+struct Result {
+    size_t allocations;
+    double seconds;
+    uint64_t chunks;
+    uint64_t bytes;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+// Blocks vary in size like RemoteIO buffers drained every ~10 ms
+static size_t BlockSize(size_t i) {
+    static const size_t sizes[] = { 160, 171, 149, 160, 256, 64 };
+    return sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+}
+
+static Result RunLegacy(const std::vector<int16_t> &input) {
+    const size_t chunkBytes = SAMPLE_RATE * CHUNK_MS / 1000 * sizeof(int16_t);
+    std::deque<std::unique_ptr<std::vector<uint8_t>>> inFlight;
+    std::unique_ptr<std::vector<uint8_t>> buffer(new std::vector<uint8_t>());
+    Result r = {};
+
+    size_t before = gAllocations;
+    Clock::time_point start = Clock::now();
+    size_t pos = 0;
+    for (size_t i = 0; pos < input.size(); i++) {
+        size_t n = std::min(BlockSize(i), input.size() - pos);
+        const uint8_t *bytes = (const uint8_t *)(input.data() + pos);
+        buffer->insert(buffer->end(), bytes, bytes + n * sizeof(int16_t));
+        pos += n;
+        if (buffer->size() < chunkBytes) {
+            continue;
+        }
+        r.chunks++;
+        r.bytes += buffer->size();
+        inFlight.push_back(std::move(buffer));
+        if (inFlight.size() > IN_FLIGHT) {
+            inFlight.pop_front();
+        }
+        buffer.reset(new std::vector<uint8_t>());
+    }
+    r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    r.allocations = gAllocations - before;
+    return r;
+}
+
+static Result RunAssembler(const std::vector<int16_t> &input) {
+    const size_t chunkSamples = SAMPLE_RATE * CHUNK_MS / 1000;
+    std::vector<int> inFlight; // Reserved up front, used as a FIFO
+    inFlight.reserve(IN_FLIGHT + 1);
+    Result r = {};
+    embla::ChunkAssembler *assemblerPtr = nullptr;
+
+    embla::ChunkAssembler assembler(chunkSamples, SLOTS, [&](const int16_t *samples, size_t count, int slot) {
+        r.chunks++;
+        r.bytes += count * sizeof(int16_t);
+        if (slot == embla::ChunkAssembler::TransientSlot) {
+            return;
+        }
+        inFlight.push_back(slot);
+        if (inFlight.size() > IN_FLIGHT) {
+            assemblerPtr->release(inFlight.front());
+            inFlight.erase(inFlight.begin());
+        }
+    });
+    assemblerPtr = &assembler;
+
+    size_t before = gAllocations;
+    Clock::time_point start = Clock::now();
+    size_t pos = 0;
+    for (size_t i = 0; pos < input.size(); i++) {
+        size_t n = std::min(BlockSize(i), input.size() - pos);
+        assembler.push(input.data() + pos, n);
+        pos += n;
+    }
+    r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    r.allocations = gAllocations - before;
+    return r;
+}
+
+static void Print(const char *name, const Result &r) {
+    printf("%-10s %10.2f allocs/s of audio %10.3f ms/s of audio %8llu chunks %12llu bytes\n", name,
+           (double)r.allocations / AUDIO_SECONDS, r.seconds * 1000.0 / AUDIO_SECONDS, (unsigned long long)r.chunks,
+           (unsigned long long)r.bytes);
+}
+
+int main() {
+    std::vector<int16_t> input((size_t)SAMPLE_RATE * AUDIO_SECONDS);
+    for (size_t i = 0; i < input.size(); i++) {
+        input[i] = (int16_t)(rand() - RAND_MAX / 2);
+    }
+    printf("%d s of audio, %d ms chunks\n", AUDIO_SECONDS, CHUNK_MS);
+    Print("legacy", RunLegacy(input));
+    Print("assembler", RunAssembler(input));
+    return 0;
+}
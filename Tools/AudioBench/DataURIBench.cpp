@@ -0,0 +1,397 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Checks and benchmarks the data: URI decoder used for inline audio in
+    answers (DataURIDecoder.cpp).
+
+    The fuzz check encodes random payloads, mangles the base64 with line
+    breaks, stray characters, missing padding and trailing garbage, and
+    verifies that the vectorized decoder agrees with both the original
+    payload and the scalar reference. Random strings that aren't base64
+    at all must get the same result from both decoders, and a set of
+    data: URI headers is checked as well. Each input is also wrapped in
+    a data: URI and fed to the stream decoder in random-sized pieces
+    with a random window size, which must give exactly the same result
+    as decoding in one go, in chunks no larger than the window. Any failure is reported and
+    the exit status is nonzero.
+
+    The benchmark decodes a data: URI holding an MP3 answer, the new way
+    and the way DataURI.m used to: copy the URI to a C string, scan for
+    the comma byte by byte, copy the payload into another string and
+    decode that with a table-driven decoder into a growing buffer.
+
+    $ build/datauribench [--kb N] [--seed N]
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "BenchCheck.h"
+#include "DataURIDecoder.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#define DEFAULT_PAYLOAD_KB  300
+#define FUZZ_ROUNDS         20000
+#define MIN_BENCH_SECONDS   0.5
+
+typedef std::chrono::steady_clock Clock;
+
+static const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static std::string Encode(const std::vector<uint8_t> &data, bool pad) {
+    std::string out;
+    size_t i = 0;
+    for (; i + 3 <= data.size(); i += 3) {
+        uint32_t v = (uint32_t)data[i] << 16 | (uint32_t)data[i + 1] << 8 | data[i + 2];
+        for (int shift = 18; shift >= 0; shift -= 6) {
+            out += alphabet[(v >> shift) & 63];
+        }
+    }
+    size_t rest = data.size() - i;
+    if (rest) {
+        uint32_t v = (uint32_t)data[i] << 16 | (rest == 2 ? (uint32_t)data[i + 1] << 8 : 0);
+        out += alphabet[(v >> 18) & 63];
+        out += alphabet[(v >> 12) & 63];
+        if (rest == 2) {
+            out += alphabet[(v >> 6) & 63];
+        }
+        if (pad) {
+            out += rest == 1 ? "==" : "=";
+        }
+    }
+    return out;
+}
+
+// Fuzzing
+
+static void Fail(const char *what, size_t round, const std::string &input) {
+    FailFormat("Round %zu: %s (input length %zu: %.60s%s)", round, what, input.size(), input.c_str(),
+               input.size() > 60 ? "..." : "");
+}
+
+static bool Decode(bool reference, const std::string &s, std::vector<uint8_t> &out) {
+    // Canaries beyond the maximum size catch overruns
+    out.assign(embla::base64MaxDecodedSize(s.size()) + 16, 0xA5);
+    size_t written = 0;
+    bool ok = reference ? embla::base64DecodeReference(s.data(), s.size(), out.data(), written)
+                        : embla::base64Decode(s.data(), s.size(), out.data(), written);
+    for (size_t i = out.size() - 16; i < out.size(); i++) {
+        if (out[i] != 0xA5) {
+            Fail("Decoder wrote past the end of the buffer");
+            break;
+        }
+    }
+    out.resize(written);
+    return ok;
+}
+
+static bool DecodeURI(const std::string &uri, std::vector<uint8_t> &out) {
+    embla::DataURIHeader header;
+    if (!embla::parseDataURIHeader(uri.data(), uri.size(), header)) {
+        out.clear();
+        return false;
+    }
+    out.resize(embla::dataURIMaxDecodedSize(uri.size(), header));
+    size_t written = 0;
+    bool ok = embla::decodeDataURI(uri.data(), uri.size(), header, out.data(), written);
+    out.resize(written);
+    return ok;
+}
+
+static bool DecodeURIStream(const std::string &uri, std::mt19937 &rng, std::vector<uint8_t> &out) {
+    size_t window = 1 + rng() % 4096;
+    out.clear();
+    bool oversized = false;
+    embla::DataURIStreamDecoder decoder(window, [&](const uint8_t *data, size_t size) {
+        oversized = oversized || size > std::max<size_t>(64, window);
+        out.insert(out.end(), data, data + size);
+        return true;
+    });
+    size_t maxPiece = 1 + rng() % 5000;
+    for (size_t pos = 0; pos < uri.size();) {
+        size_t n = std::min(uri.size() - pos, 1 + rng() % maxPiece);
+        decoder.push(uri.data() + pos, n);
+        pos += n;
+    }
+    bool ok = decoder.finish();
+    if (oversized) {
+        Fail("Stream decoder handed over more than a window");
+    }
+    return ok;
+}
+
+// The stream decoder must agree with the one-shot decoder, byte for byte when valid
+static void CompareStream(size_t round, const std::string &uri, std::mt19937 &rng) {
+    std::vector<uint8_t> whole, streamed;
+    bool wholeOk = DecodeURI(uri, whole);
+    bool streamOk = DecodeURIStream(uri, rng, streamed);
+    if (wholeOk != streamOk || (wholeOk && whole != streamed)) {
+        Fail("stream decoder disagrees", round, uri);
+    }
+}
+
+static void Fuzz(uint32_t seed) {
+    std::mt19937 rng(seed);
+    for (size_t round = 0; round < FUZZ_ROUNDS; round++) {
+        // Mostly short payloads, where block boundaries matter most
+        size_t size = (round % 10 == 0) ? rng() % 20000 : rng() % 300;
+        std::vector<uint8_t> payload(size);
+        for (uint8_t &b : payload) {
+            b = (uint8_t)rng();
+        }
+        bool pad = rng() % 2;
+        std::string enc = Encode(payload, pad);
+
+        // Characters the decoder must skip
+        int mangle = rng() % 4;
+        if (mangle == 1) {
+            size_t lineLength = 1 + rng() % 100;
+            std::string wrapped;
+            for (size_t i = 0; i < enc.size(); i += lineLength) {
+                wrapped += enc.substr(i, lineLength) + (rng() % 2 ? "\r\n" : "\n");
+            }
+            enc = wrapped;
+        } else if (mangle == 2) {
+            int count = 1 + rng() % 8;
+            for (int i = 0; i < count; i++) {
+                static const char stray[] = " \t\n-_.!*\x80\xff";
+                enc.insert(enc.begin() + rng() % (enc.size() + 1), stray[rng() % (sizeof(stray) - 1)]);
+            }
+        } else if (mangle == 3 && pad) {
+            enc += "=garbage after padding";
+        }
+
+        std::vector<uint8_t> vec, ref;
+        bool vecOk = Decode(false, enc, vec);
+        bool refOk = Decode(true, enc, ref);
+        if (!vecOk || !refOk) {
+            Fail("valid input rejected", round, enc);
+        } else if (vec != payload || ref != payload) {
+            Fail("decoded payload differs", round, enc);
+        }
+        CompareStream(round, "data:audio/mpeg;base64," + enc, rng);
+
+        // Percent-encoded, with the occasional broken escape
+        std::string plain = "data:text/plain,";
+        for (size_t i = 0; i < std::min<size_t>(payload.size(), 500); i++) {
+            char hex[4];
+            snprintf(hex, sizeof(hex), "%%%02X", payload[i]);
+            plain += (payload[i] >= 'a' && payload[i] <= 'z') ? std::string(1, (char)payload[i]) : hex;
+        }
+        if (rng() % 10 == 0) {
+            plain.insert(plain.size() - rng() % std::min<size_t>(plain.size() - 15, 3), "%");
+        }
+        CompareStream(round, plain, rng);
+
+        // Random characters, mostly from the alphabet
+        std::string junk(rng() % 200, 'A');
+        for (char &c : junk) {
+            c = rng() % 16 ? alphabet[rng() % 64] : (char)rng();
+        }
+        vecOk = Decode(false, junk, vec);
+        refOk = Decode(true, junk, ref);
+        if (vecOk != refOk || vec != ref) {
+            Fail("decoders disagree", round, junk);
+        }
+        CompareStream(round, "data:;base64," + junk, rng);
+    }
+}
+
+struct HeaderCase {
+    const char *uri;
+    bool valid;
+    const char *mimeType;
+    bool base64;
+    const char *payload;
+};
+
+static void CheckHeaders() {
+    static const HeaderCase cases[] = {
+        {"data:,", true, "", false, ""},
+        {"data:audio/mpeg;base64,SUQz", true, "audio/mpeg", true, "ID3"},
+        {"data:text/plain;charset=utf-8,%C3%BEetta%20er", true, "text/plain", false, "\xC3\xBE" "etta er"},
+        {"data:;BASE64,QQ", true, "", true, "A"},
+        {"data:video/webm;codecs=\"vp8, opus\";base64,QUJD", true, "video/webm", true, "ABC"},
+        {"data:text/plain,100%", false, "", false, ""},
+        {"data:text/plain;base64", false, "", false, ""},
+        {"data:a;codecs=\"x,y,QUJD", false, "", false, ""},
+        {"https://example.com/a,b", false, "", false, ""},
+    };
+    for (const HeaderCase &c : cases) {
+        size_t length = strlen(c.uri);
+        embla::DataURIHeader header;
+        bool ok = embla::parseDataURIHeader(c.uri, length, header);
+        std::vector<uint8_t> out(ok ? embla::dataURIMaxDecodedSize(length, header) : 0);
+        size_t written = 0;
+        ok = ok && embla::decodeDataURI(c.uri, length, header, out.data(), written);
+        if (ok != c.valid) {
+            FailFormat("%s: expected %s", c.uri, c.valid ? "valid" : "invalid");
+            continue;
+        }
+        if (!ok) {
+            continue;
+        }
+        std::string mimeType(c.uri + header.mimeTypeOffset, header.mimeTypeLength);
+        std::string payload((const char *)out.data(), written);
+        if (mimeType != c.mimeType || header.base64 != c.base64 || payload != c.payload) {
+            FailFormat("%s: got %s, %s, '%s'", c.uri, mimeType.c_str(), header.base64 ? "base64" : "plain",
+                       payload.c_str());
+        }
+    }
+}
+
+// Benchmark
+
+// Approximates what DataURI.m used to do
+static size_t DecodeOldWay(const std::string &uri, std::vector<uint8_t> &out) {
+    std::string copy(uri.c_str());
+    size_t split = 5;
+    for (size_t i = 5; i < copy.size(); i++) {
+        if (copy[i] == ',') {
+            split = i;
+            break;
+        }
+    }
+    std::string base64(copy.c_str() + split + 1, copy.size() - split - 1);
+    static int8_t values[256];
+    if (!values['B']) {
+        memset(values, -1, sizeof(values));
+        for (int i = 0; i < 64; i++) {
+            values[(uint8_t)alphabet[i]] = (int8_t)i;
+        }
+    }
+    out.clear();
+    uint32_t bits = 0;
+    int count = 0;
+    for (char c : base64) {
+        int8_t v = values[(uint8_t)c];
+        if (v < 0) {
+            continue;
+        }
+        bits = bits << 6 | (uint32_t)v;
+        if (++count == 4) {
+            out.push_back((uint8_t)(bits >> 16));
+            out.push_back((uint8_t)(bits >> 8));
+            out.push_back((uint8_t)bits);
+            count = 0;
+        }
+    }
+    if (count == 2) {
+        out.push_back((uint8_t)(bits >> 4));
+    } else if (count == 3) {
+        out.push_back((uint8_t)(bits >> 10));
+        out.push_back((uint8_t)(bits >> 2));
+    }
+    return out.size();
+}
+
+// In 16 KB windows, as StreamingAudioPlayer does, reading the URI 16 KB at a time
+static size_t DecodeStreaming(const std::string &uri, std::vector<uint8_t> &out) {
+    size_t total = 0;
+    embla::DataURIStreamDecoder decoder(16384, [&](const uint8_t *data, size_t size) {
+        total += size;
+        out.assign(data, data + size);
+        return true;
+    });
+    for (size_t pos = 0; pos < uri.size(); pos += 16384) {
+        decoder.push(uri.data() + pos, std::min<size_t>(16384, uri.size() - pos));
+    }
+    decoder.finish();
+    return total;
+}
+
+static size_t DecodeNewWay(const std::string &uri, std::vector<uint8_t> &out) {
+    embla::DataURIHeader header;
+    embla::parseDataURIHeader(uri.data(), uri.size(), header);
+    out.resize(embla::dataURIMaxDecodedSize(uri.size(), header));
+    size_t written = 0;
+    embla::decodeDataURI(uri.data(), uri.size(), header, out.data(), written);
+    out.resize(written);
+    return written;
+}
+
+template <typename F>
+static double Throughput(const std::string &uri, F decode) {
+    std::vector<uint8_t> out;
+    size_t runs = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0.0;
+    while (elapsed < MIN_BENCH_SECONDS) {
+        decode(uri, out);
+        runs++;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return uri.size() * runs / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    size_t kb = DEFAULT_PAYLOAD_KB;
+    uint32_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--kb" && i + 1 < argc) {
+            kb = (size_t)atoi(argv[++i]);
+        } else if (a == "--seed" && i + 1 < argc) {
+            seed = (uint32_t)atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--kb N] [--seed N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Fuzz(seed);
+    CheckHeaders();
+    if (!ChecksPassed()) {
+        return 1;
+    }
+
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> payload(kb * 1024);
+    for (uint8_t &b : payload) {
+        b = (uint8_t)rng();
+    }
+    std::string uri = "data:audio/mpeg;base64," + Encode(payload, true);
+    std::vector<uint8_t> oldOut, newOut;
+    DecodeOldWay(uri, oldOut);
+    DecodeNewWay(uri, newOut);
+    if (oldOut != payload || newOut != payload) {
+        fprintf(stderr, "Benchmark payload decoded incorrectly\n");
+        return 1;
+    }
+
+    double oldRate = Throughput(uri, DecodeOldWay);
+    double newRate = Throughput(uri, DecodeNewWay);
+    double streamRate = Throughput(uri, DecodeStreaming);
+    printf("{\n");
+    printf("  \"kernel\": \"%s\",\n", embla::base64KernelName());
+    printf("  \"fuzz_rounds\": %d,\n", FUZZ_ROUNDS);
+    printf("  \"uri_bytes\": %zu,\n", uri.size());
+    printf("  \"old_mb_per_s\": %.0f,\n", oldRate);
+    printf("  \"new_mb_per_s\": %.0f,\n", newRate);
+    printf("  \"stream_mb_per_s\": %.0f,\n", streamRate);
+    printf("  \"speedup\": %.1f\n", newRate / oldRate);
+    printf("}\n");
+    return 0;
+}
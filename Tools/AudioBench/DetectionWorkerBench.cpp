@@ -0,0 +1,355 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Checks and benchmarks the hotword detection worker thread
+    (DetectionWorker.cpp) with a mock engine in place of Snowboy.
+
+    The mock engine records every block it is given, can be held inside
+    a call to stand for a slow detector, and reports a hotword for
+    blocks that start with a marker sample. The checks submit numbered
+    samples and compare what the engine saw: blocks in order and whole,
+    larger blocks split, engine resets before the block that follows
+    the request, and the hotword callback run on the worker thread with
+    the position just past the block the hotword was in. With
+    the engine held, the queue must take exactly its capacity and turn
+    the rest away as dropped, flush() must empty it, and the worker must
+    stop cleanly with blocks still queued. Any failure is reported and
+    the exit status is nonzero.
+
+    The benchmark feeds 30 ms windows of 16 kHz audio in real time to an
+    engine taking a given share of real time per call, and reports the
+    engine latency, the longest wait in the queue and any drops.
+
+    $ build/workerbench [--seconds N] [--load X]
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "BenchCheck.h"
+#include "DetectionWorker.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SAMPLE_RATE         16000
+#define WINDOW_SAMPLES      480     // 30 ms, SNOWBOY_WINDOW_NORMAL_MS
+#define QUEUE_CAPACITY      32      // SNOWBOY_QUEUE_CAPACITY
+// Blocks starting with this sample are reported as hotword 1
+#define HOTWORD_MARKER      -32768
+
+typedef std::chrono::steady_clock Clock;
+
+// Mock engine
+
+class MockEngine : public embla::HotwordEngine {
+public:
+    struct Call {
+        int16_t first;
+        int count;
+        int resetsBefore;
+    };
+
+    int runDetection(const int16_t *samples, int count) override {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _inside = true;
+        _cond.notify_all();
+        _cond.wait(lock, [this] { return !_held; });
+        _inside = false;
+        _calls.push_back({ samples[0], count, _resets });
+        lock.unlock();
+        if (_costMicroseconds > 0.0) {
+            // Busy, like a detector would be
+            Clock::time_point until = Clock::now() + std::chrono::microseconds((int64_t)_costMicroseconds);
+            while (Clock::now() < until) {
+            }
+        }
+        return samples[0] == HOTWORD_MARKER ? 1 : 0;
+    }
+
+    void reset() override {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _resets++;
+    }
+
+    // Hold the next call inside the engine until released
+    void hold() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _held = true;
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _held = false;
+        _cond.notify_all();
+    }
+
+    // Wait until a held call has entered the engine
+    bool waitInside() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _cond.wait_for(lock, std::chrono::seconds(2), [this] { return _inside; });
+    }
+
+    // Wait until count calls have finished
+    bool waitCalls(size_t count) {
+        Clock::time_point deadline = Clock::now() + std::chrono::seconds(2);
+        while (Clock::now() < deadline) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_calls.size() >= count) {
+                    return true;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return false;
+    }
+
+    std::vector<Call> calls() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _calls;
+    }
+
+    void setCost(double microseconds) { _costMicroseconds = microseconds; }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    bool _held = false;
+    bool _inside = false;
+    int _resets = 0;
+    std::vector<Call> _calls;
+    double _costMicroseconds = 0.0;
+};
+
+// Blocks of count samples numbered from first
+static std::vector<int16_t> Numbered(int16_t first, size_t count) {
+    std::vector<int16_t> samples(count);
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = (int16_t)(first + i);
+    }
+    return samples;
+}
+
+// Checks
+
+static void CheckOrder() {
+    MockEngine engine;
+    embla::DetectionWorker worker(&engine, nullptr, QUEUE_CAPACITY, 1024);
+    for (int i = 0; i < 200; i++) {
+        std::vector<int16_t> block = Numbered((int16_t)(i * 10), 100 + i % 7);
+        CHECK(worker.submit(block.data(), block.size(), (uint64_t)i * 1000));
+        if (i % 16 == 15) {
+            engine.waitCalls(i + 1);
+        }
+    }
+    CHECK(engine.waitCalls(200));
+    std::vector<MockEngine::Call> calls = engine.calls();
+    bool ordered = calls.size() == 200;
+    for (size_t i = 0; ordered && i < calls.size(); i++) {
+        ordered = calls[i].first == (int16_t)(i * 10) && calls[i].count == (int)(100 + i % 7);
+    }
+    CHECK(ordered);
+    embla::DetectionWorkerStats stats = worker.stats();
+    CHECK(stats.submittedBlocks == 200 && stats.processedBlocks == 200 && stats.droppedBlocks == 0);
+}
+
+static void CheckSplitting() {
+    MockEngine engine;
+    std::atomic<uint64_t> detectedEnd{0};
+    embla::DetectionWorker worker(&engine, [&](int, uint64_t end) {
+        detectedEnd = end;
+    }, QUEUE_CAPACITY, 1000);
+    // The hotword in the middle block is reported at that block's end
+    std::vector<int16_t> big = Numbered(0, 2500);
+    big[1000] = HOTWORD_MARKER;
+    CHECK(worker.submit(big.data(), big.size(), 10000));
+    CHECK(engine.waitCalls(3));
+    std::vector<MockEngine::Call> calls = engine.calls();
+    CHECK(calls.size() == 3);
+    if (calls.size() == 3) {
+        CHECK(calls[0].first == 0 && calls[0].count == 1000);
+        CHECK(calls[1].first == HOTWORD_MARKER && calls[1].count == 1000);
+        CHECK(calls[2].first == 2000 && calls[2].count == 500);
+    }
+    for (int i = 0; i < 2000 && detectedEnd == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK(detectedEnd == 9500);
+}
+
+static void CheckBackpressure() {
+    MockEngine engine;
+    embla::DetectionWorker worker(&engine, nullptr, QUEUE_CAPACITY, WINDOW_SAMPLES);
+    std::vector<int16_t> block = Numbered(0, WINDOW_SAMPLES);
+
+    // The first block is taken off the queue and held in the engine, then
+    // the queue fills up and turns the rest away
+    engine.hold();
+    block[0] = 0;
+    CHECK(worker.submit(block.data(), block.size(), WINDOW_SAMPLES));
+    CHECK(engine.waitInside());
+    int accepted = 0;
+    for (int i = 1; i <= QUEUE_CAPACITY + 10; i++) {
+        block[0] = (int16_t)i;
+        accepted += worker.submit(block.data(), block.size(), (uint64_t)(i + 1) * WINDOW_SAMPLES) ? 1 : 0;
+    }
+    CHECK(accepted == QUEUE_CAPACITY);
+    embla::DetectionWorkerStats stats = worker.stats();
+    CHECK(stats.droppedBlocks == 10);
+    CHECK(stats.queueDepth == QUEUE_CAPACITY && stats.maxQueueDepth == QUEUE_CAPACITY);
+
+    // What was accepted is processed in order once the engine catches up
+    engine.release();
+    CHECK(engine.waitCalls(QUEUE_CAPACITY + 1));
+    std::vector<MockEngine::Call> calls = engine.calls();
+    bool ordered = calls.size() == QUEUE_CAPACITY + 1;
+    for (size_t i = 0; ordered && i < calls.size(); i++) {
+        ordered = calls[i].first == (int16_t)i;
+    }
+    CHECK(ordered);
+    stats = worker.stats();
+    CHECK(stats.submittedBlocks == stats.processedBlocks + stats.droppedBlocks);
+    CHECK(stats.maxQueueWaitMs > 0.0);
+}
+
+static void CheckFlushAndReset() {
+    MockEngine engine;
+    std::atomic<int> detected{0};
+    std::atomic<uint64_t> detectedEnd{0};
+    std::atomic<bool> onWorker{false};
+    const std::thread::id mainThread = std::this_thread::get_id();
+    embla::DetectionWorker worker(&engine, [&](int index, uint64_t end) {
+        onWorker = std::this_thread::get_id() != mainThread;
+        detectedEnd = end;
+        detected = index;
+    }, QUEUE_CAPACITY, WINDOW_SAMPLES);
+    std::vector<int16_t> block = Numbered(0, WINDOW_SAMPLES);
+
+    engine.hold();
+    block[0] = 0;
+    worker.submit(block.data(), block.size(), WINDOW_SAMPLES);
+    CHECK(engine.waitInside());
+    for (int i = 1; i <= 5; i++) {
+        block[0] = (int16_t)i;
+        worker.submit(block.data(), block.size(), (uint64_t)(i + 1) * WINDOW_SAMPLES);
+    }
+    // Queued blocks are dropped, the one in the engine finishes
+    worker.flush();
+    CHECK(worker.stats().queueDepth == 0);
+    worker.resetEngine();
+    engine.release();
+    block[0] = HOTWORD_MARKER;
+    worker.submit(block.data(), block.size(), 7 * WINDOW_SAMPLES);
+    CHECK(engine.waitCalls(2));
+    for (int i = 0; i < 2000 && detected == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::vector<MockEngine::Call> calls = engine.calls();
+    CHECK(calls.size() == 2);
+    if (calls.size() == 2) {
+        CHECK(calls[0].first == 0 && calls[0].resetsBefore == 0);
+        CHECK(calls[1].first == HOTWORD_MARKER && calls[1].resetsBefore == 1);
+    }
+    CHECK(detected == 1 && detectedEnd == 7 * WINDOW_SAMPLES && worker.stats().detections == 1);
+    CHECK(onWorker);
+}
+
+static void CheckStop() {
+    MockEngine engine;
+    engine.setCost(2000.0);
+    Clock::time_point start;
+    {
+        embla::DetectionWorker worker(&engine, nullptr, QUEUE_CAPACITY, WINDOW_SAMPLES);
+        std::vector<int16_t> block = Numbered(0, WINDOW_SAMPLES);
+        for (int i = 0; i < QUEUE_CAPACITY; i++) {
+            worker.submit(block.data(), block.size(), (uint64_t)(i + 1) * WINDOW_SAMPLES);
+        }
+        start = Clock::now();
+    }
+    // The worker stops after the block in hand, not after the whole queue
+    double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    CHECK(engine.calls().size() < QUEUE_CAPACITY);
+    CHECK(ms < 20.0);
+}
+
+// Benchmark
+
+// Real-time windows against an engine taking load of real time per call
+static embla::DetectionWorkerStats RealTime(double seconds, double load) {
+    MockEngine engine;
+    engine.setCost(load * WINDOW_SAMPLES * 1e6 / SAMPLE_RATE);
+    embla::DetectionWorker worker(&engine, nullptr, QUEUE_CAPACITY, WINDOW_SAMPLES);
+    std::vector<int16_t> block = Numbered(1, WINDOW_SAMPLES);
+    size_t windows = (size_t)(seconds * SAMPLE_RATE / WINDOW_SAMPLES);
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < windows; i++) {
+        std::this_thread::sleep_until(start + std::chrono::microseconds((int64_t)(i * WINDOW_SAMPLES * 1e6 / SAMPLE_RATE)));
+        worker.submit(block.data(), block.size(), (i + 1) * WINDOW_SAMPLES);
+    }
+    engine.waitCalls(windows - worker.stats().droppedBlocks);
+    return worker.stats();
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = 2.0;
+    double load = 0.3;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--seconds" && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (a == "--load" && i + 1 < argc) {
+            load = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--seconds N] [--load X]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    CheckOrder();
+    CheckSplitting();
+    CheckBackpressure();
+    CheckFlushAndReset();
+    CheckStop();
+    embla::DetectionWorkerStats stats = RealTime(seconds, load);
+    if (load < 1.0) {
+        CHECK(stats.droppedBlocks == 0);
+    }
+    if (!ChecksPassed()) {
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"load\": %.2f,\n", load);
+    printf("  \"blocks\": %llu,\n", (unsigned long long)stats.submittedBlocks);
+    printf("  \"dropped\": %llu,\n", (unsigned long long)stats.droppedBlocks);
+    printf("  \"mean_latency_ms\": %.2f,\n", stats.meanLatencyMs);
+    printf("  \"max_latency_ms\": %.2f,\n", stats.maxLatencyMs);
+    printf("  \"max_queue_wait_ms\": %.2f,\n", stats.maxQueueWaitMs);
+    printf("  \"max_queue_depth\": %zu\n", stats.maxQueueDepth);
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,343 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Checks and benchmarks the earcon mixer (EarconMixer.cpp).
+
+    The checks render in random buffer sizes and compare the mixed
+    output with what it should be: clips at the output rate must appear
+    sample for sample at exactly the frame they were triggered for, mono
+    on every channel and stereo downmixed for mono output, overlapping
+    clips must add up, and a clip triggered for a frame already past
+    must start right away and be counted as late. Resampled sines (from
+    16, 22.05 and 44.1 kHz) must match the expected sine at the output
+    rate, at the expected pitch and length. Voice stealing, stopAll(),
+    idle() and the limits of the command queue are checked as well. Any
+    failure is reported and the exit status is nonzero.
+
+    The benchmark renders 256-frame stereo buffers with four clips
+    playing, resampled and not, and reports how many times faster than
+    real time that is.
+
+    $ build/earconbench [--seed N]
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "BenchCheck.h"
+#include "EarconMixer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#define OUTPUT_RATE         48000
+#define MIN_BENCH_SECONDS   0.5
+
+typedef std::chrono::steady_clock Clock;
+
+// Render frames in random buffer sizes, returning the output by channel.
+// before is called before each buffer with the frame it starts at.
+template <typename F>
+static std::vector<std::vector<float>> Render(embla::EarconMixer &mixer, size_t channels, size_t frames,
+                                              std::mt19937 &rng, F before) {
+    std::vector<std::vector<float>> out(channels, std::vector<float>(frames));
+    size_t done = 0;
+    while (done < frames) {
+        size_t n = std::min<size_t>(frames - done, 1 + rng() % 1024);
+        before(mixer.framePosition());
+        std::vector<float *> ptrs;
+        for (auto &ch : out) {
+            ptrs.push_back(ch.data() + done);
+        }
+        mixer.render(ptrs.data(), channels, n);
+        done += n;
+    }
+    return out;
+}
+
+static std::vector<std::vector<float>> Render(embla::EarconMixer &mixer, size_t channels, size_t frames,
+                                              std::mt19937 &rng) {
+    return Render(mixer, channels, frames, rng, [](uint64_t) {});
+}
+
+static std::vector<int16_t> Noise(size_t samples, std::mt19937 &rng, int amplitude = 8000) {
+    std::vector<int16_t> s(samples);
+    for (int16_t &x : s) {
+        x = (int16_t)((int)(rng() % (2 * amplitude + 1)) - amplitude);
+    }
+    return s;
+}
+
+// Checks
+
+static void CheckPlacement(std::mt19937 &rng) {
+    for (int round = 0; round < 50; round++) {
+        embla::EarconMixer mixer(OUTPUT_RATE);
+        size_t frames = 100 + rng() % 5000;
+        bool stereoClip = round % 2;
+        std::vector<int16_t> clip = Noise(frames * (stereoClip ? 2 : 1), rng);
+        int id = mixer.addClip(clip.data(), frames, stereoClip ? 2 : 1, OUTPUT_RATE);
+        size_t channels = 1 + rng() % 2;
+        uint64_t at = 1 + rng() % 3000;
+        bool triggered = false;
+        auto out = Render(mixer, channels, at + frames + 500, rng, [&](uint64_t) {
+            if (!triggered) {
+                mixer.trigger(id, 1.0f, at);
+                triggered = true;
+            }
+        });
+        for (size_t c = 0; c < channels; c++) {
+            for (size_t i = 0; i < out[c].size(); i++) {
+                float expected = 0.0f;
+                if (i >= at && i < at + frames) {
+                    size_t f = i - at;
+                    if (!stereoClip) {
+                        expected = clip[f] / 32768.0f;
+                    } else if (channels == 1) {
+                        expected = 0.5f * (clip[2 * f] + clip[2 * f + 1]) / 32768.0f;
+                    } else {
+                        expected = clip[2 * f + c] / 32768.0f;
+                    }
+                }
+                if (std::fabs(out[c][i] - expected) > 1e-6f) {
+                    Fail("Placement round " + std::to_string(round) + ": frame " + std::to_string(i) + " channel " +
+                         std::to_string(c) + " is " + std::to_string(out[c][i]) + ", expected " +
+                         std::to_string(expected));
+                    return;
+                }
+            }
+        }
+        if (mixer.stats().late || mixer.stats().triggers != 1) {
+            Fail("Placement round " + std::to_string(round) + ": wrong stats");
+        }
+    }
+}
+
+static void CheckOverlap(std::mt19937 &rng) {
+    embla::EarconMixer mixer(OUTPUT_RATE);
+    std::vector<int16_t> a = Noise(3000, rng), b = Noise(2000, rng);
+    int ia = mixer.addClip(a.data(), a.size(), 1, OUTPUT_RATE);
+    int ib = mixer.addClip(b.data(), b.size(), 1, OUTPUT_RATE);
+    mixer.trigger(ia, 1.0f, 100);
+    mixer.trigger(ib, 0.5f, 1700);
+    auto out = Render(mixer, 2, 5000, rng);
+    for (size_t i = 0; i < 5000; i++) {
+        float expected = 0.0f;
+        if (i >= 100 && i < 3100) {
+            expected += a[i - 100] / 32768.0f;
+        }
+        if (i >= 1700 && i < 3700) {
+            expected += 0.5f * b[i - 1700] / 32768.0f;
+        }
+        if (std::fabs(out[0][i] - expected) > 1e-6f || out[1][i] != out[0][i]) {
+            Fail("Overlap: frame " + std::to_string(i) + " differs");
+            return;
+        }
+    }
+}
+
+static void CheckNowAndLate(std::mt19937 &rng) {
+    embla::EarconMixer mixer(OUTPUT_RATE);
+    std::vector<int16_t> a = Noise(500, rng);
+    int id = mixer.addClip(a.data(), a.size(), 1, OUTPUT_RATE);
+    Render(mixer, 1, 777, rng);
+    mixer.trigger(id);
+    mixer.trigger(id, 1.0f, 10);
+    auto out = Render(mixer, 1, 600, rng);
+    for (size_t i = 0; i < 500; i++) {
+        if (std::fabs(out[0][i] - 2 * a[i] / 32768.0f) > 1e-6f) {
+            Fail("Now and late: frame " + std::to_string(i) + " differs");
+            return;
+        }
+    }
+    if (mixer.stats().late != 1) {
+        Fail("Late trigger not counted");
+    }
+}
+
+// Sine of frequency hz at the given rate, amplitude 0.5
+static std::vector<int16_t> Sine(double hz, uint32_t rate, size_t frames) {
+    std::vector<int16_t> s(frames);
+    for (size_t i = 0; i < frames; i++) {
+        s[i] = (int16_t)std::lround(16384.0 * std::sin(2 * M_PI * hz * i / rate));
+    }
+    return s;
+}
+
+static void CheckResampling(std::mt19937 &rng) {
+    const double hz = 440.0;
+    for (uint32_t clipRate : { 16000, 22050, 44100 }) {
+        const size_t frames = clipRate / 2;
+        std::vector<int16_t> sine = Sine(hz, clipRate, frames);
+        embla::EarconMixer mixer(OUTPUT_RATE);
+        int id = mixer.addClip(sine.data(), frames, 1, clipRate);
+        mixer.trigger(id);
+        auto out = Render(mixer, 1, OUTPUT_RATE, rng);
+
+        double step = (double)clipRate / OUTPUT_RATE;
+        size_t expectedLength = (size_t)std::ceil(frames / step);
+        size_t length = 0;
+        double maxError = 0.0;
+        for (size_t i = 0; i < out[0].size(); i++) {
+            if (out[0][i] != 0.0f) {
+                length = i + 1;
+            }
+            // Away from the ends, where the interpolation sees silence
+            if (i > 4 && i + 4 < expectedLength) {
+                double expected = 0.5 * std::sin(2 * M_PI * hz * i / OUTPUT_RATE);
+                maxError = std::max(maxError, std::fabs(out[0][i] - expected));
+            }
+        }
+        if (maxError > 2e-3) {
+            Fail("Resampling from " + std::to_string(clipRate) + " Hz: error " + std::to_string(maxError));
+        }
+        if (length + 1 < expectedLength || length > expectedLength) {
+            Fail("Resampling from " + std::to_string(clipRate) + " Hz: " + std::to_string(length) + " frames, expected " +
+                 std::to_string(expectedLength));
+        }
+    }
+}
+
+static void CheckStealing(std::mt19937 &rng) {
+    embla::EarconMixer mixer(OUTPUT_RATE, 2);
+    std::vector<std::vector<int16_t>> clips = { Noise(4000, rng), Noise(4000, rng), Noise(4000, rng) };
+    for (auto &c : clips) {
+        mixer.addClip(c.data(), c.size(), 1, OUTPUT_RATE);
+    }
+    mixer.trigger(0);
+    mixer.trigger(1);
+    mixer.trigger(2);
+    auto out = Render(mixer, 1, 4000, rng);
+    for (size_t i = 0; i < 4000; i++) {
+        if (std::fabs(out[0][i] - (clips[1][i] + clips[2][i]) / 32768.0f) > 1e-6f) {
+            Fail("Stealing: frame " + std::to_string(i) + " differs");
+            break;
+        }
+    }
+    if (mixer.stats().stolen != 1) {
+        Fail("Stolen voice not counted");
+    }
+    if (!mixer.idle()) {
+        Fail("Mixer not idle after its clips ended");
+    }
+
+    // Everything stops from the next buffer
+    mixer.trigger(0);
+    float buf[256];
+    float *ptr = buf;
+    bool triggered = !mixer.idle();
+    mixer.render(&ptr, 1, 256);
+    bool playing = !mixer.idle();
+    mixer.stopAll();
+    if (mixer.render(&ptr, 1, 256) || *std::max_element(buf, buf + 256) != 0.0f) {
+        Fail("stopAll() didn't silence the mixer");
+    }
+    if (!triggered || !playing || !mixer.idle()) {
+        Fail("idle() doesn't follow the clip");
+    }
+}
+
+static void CheckLimits(std::mt19937 &rng) {
+    embla::EarconMixer mixer(OUTPUT_RATE);
+    std::vector<int16_t> a = Noise(100, rng);
+    int id = mixer.addClip(a.data(), a.size(), 1, OUTPUT_RATE);
+    if (mixer.addClip(a.data(), 0, 1, OUTPUT_RATE) != -1 || mixer.addClip(a.data(), 10, 3, OUTPUT_RATE) != -1) {
+        Fail("Invalid clip accepted");
+    }
+    if (mixer.trigger(id + 1) || mixer.trigger(-1)) {
+        Fail("Invalid trigger accepted");
+    }
+    int accepted = 0;
+    for (int i = 0; i < 100; i++) {
+        accepted += mixer.trigger(id);
+    }
+    if (accepted != 64 || mixer.stats().dropped != 36) {
+        Fail("Queue accepted " + std::to_string(accepted) + " triggers, expected 64");
+    }
+    float buf[128];
+    float *ptr = buf;
+    mixer.render(&ptr, 1, 128);
+    if (!mixer.trigger(id)) {
+        Fail("Queue not emptied by render()");
+    }
+}
+
+// Benchmark
+
+static double RealTimeFactor(uint32_t clipRate) {
+    embla::EarconMixer mixer(OUTPUT_RATE);
+    std::mt19937 rng(1);
+    std::vector<int16_t> clip = Noise(clipRate * 2, rng);
+    for (int i = 0; i < 4; i++) {
+        mixer.addClip(clip.data(), clip.size(), 1, clipRate);
+    }
+    std::vector<float> left(256), right(256);
+    float *outputs[2] = { left.data(), right.data() };
+    size_t buffers = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0.0;
+    while (elapsed < MIN_BENCH_SECONDS) {
+        // Keep four clips playing
+        if (buffers % 100 == 0) {
+            mixer.stopAll();
+            for (int i = 0; i < 4; i++) {
+                mixer.trigger(i, 0.25f);
+            }
+        }
+        mixer.render(outputs, 2, 256);
+        buffers++;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return buffers * 256.0 / OUTPUT_RATE / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--seed" && i + 1 < argc) {
+            seed = (uint32_t)atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--seed N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::mt19937 rng(seed);
+    CheckPlacement(rng);
+    CheckOverlap(rng);
+    CheckNowAndLate(rng);
+    CheckResampling(rng);
+    CheckStealing(rng);
+    CheckLimits(rng);
+    if (!ChecksPassed()) {
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"output_rate\": %d,\n", OUTPUT_RATE);
+    printf("  \"realtime_factor_direct\": %.0f,\n", RealTimeFactor(OUTPUT_RATE));
+    printf("  \"realtime_factor_resampled\": %.0f\n", RealTimeFactor(22050));
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,527 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Checks and benchmarks the echo canceller (EchoCanceller.cpp).
+
+    The checks run on synthetic echo: a speech-like far end signal (a
+    harmonic series on a wandering pitch with syllable-rate envelope and
+    some breath noise) goes through a random room impulse response,
+    decaying exponentially after a bulk delay, and is added to the
+    microphone signal together with a little noise and, for double talk,
+    a different speech-like near end signal. Echo return loss enhancement
+    (ERLE, echo energy over the energy of what is left of it) is measured
+    after the filter has converged, as well as how quickly it converges,
+    how well the near end survives double talk and the filter with it,
+    and how it recovers from a change of echo path. With no far end the
+    audio must pass through untouched.
+
+    EchoReference is checked for placing played audio resampled from
+    24 kHz at the right recording positions despite jittery times,
+    jumping when playback stalls, and dropping audio while the recording
+    clock is unknown. Finally the two are run together with jittery
+    times and different echo delays, as in the app.
+
+    Any failure is reported and the exit status is nonzero. The benchmark
+    then reports the processing time per block and the share of one CPU
+    core taken at 16 kHz for different filter lengths, and fails if the
+    default configuration exceeds its budget.
+
+    $ build/echobench [--seed N]
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "BenchCheck.h"
+#include "EchoCanceller.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#define SAMPLE_RATE         16000
+#define MIN_BENCH_SECONDS   0.5
+// Share of one core the default configuration may take
+#define CPU_BUDGET_PERCENT  5.0
+
+typedef std::chrono::steady_clock Clock;
+
+static std::string Format(const char *fmt, double value) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), fmt, value);
+    return buf;
+}
+
+// Signals
+
+// Speech-like signal at full scale 1.0 with the given RMS level in dBFS
+static std::vector<float> Speech(size_t samples, std::mt19937 &rng, float levelDbfs = -20.0f) {
+    std::vector<float> s(samples);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    double phase = 0.0;
+    double base = 100.0 + 80.0 * uniform(rng);
+    double drift = 0.0;
+    double syllablePhase = uniform(rng) * 2 * M_PI;
+    double syllableRate = 3.0 + 2.0 * uniform(rng);
+    double intonationPhase = uniform(rng) * 2 * M_PI;
+    for (size_t i = 0; i < samples; i++) {
+        // Pitch glides with the intonation and wanders within the range
+        // of a speaking voice
+        double t = (double)i / SAMPLE_RATE;
+        drift = std::min(0.2, std::max(-0.2, drift + 2e-4 * noise(rng)));
+        double pitch = base * (1.0 + 0.2 * std::sin(2 * M_PI * 0.8 * t + intonationPhase) + drift);
+        phase += 2 * M_PI * pitch / SAMPLE_RATE;
+        float voiced = 0.0f;
+        for (int h = 1; h <= 20 && h * pitch < SAMPLE_RATE / 2; h++) {
+            voiced += (float)(std::sin(h * phase) / h);
+        }
+        double envelope = std::max(0.0, std::sin(2 * M_PI * syllableRate * t + syllablePhase));
+        s[i] = (float)(std::sqrt(envelope) * (0.5f * voiced + 0.1f * noise(rng)));
+    }
+    double sum = 0.0;
+    for (float x : s) {
+        sum += x * x;
+    }
+    float gain = (float)(std::pow(10.0, levelDbfs / 20.0) / std::sqrt(sum / samples + 1e-20));
+    for (float &x : s) {
+        x *= gain;
+    }
+    return s;
+}
+
+// Bulk delay followed by an exponentially decaying random response, with
+// the given gain in energy
+static std::vector<float> RoomResponse(size_t delay, size_t length, std::mt19937 &rng, float gainDb = -3.0f) {
+    std::vector<float> h(delay + length);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+    double energy = 0.0;
+    for (size_t i = 0; i < length; i++) {
+        h[delay + i] = noise(rng) * std::exp(-(float)i / (length / 5.0f));
+        energy += h[delay + i] * h[delay + i];
+    }
+    float gain = (float)(std::pow(10.0, gainDb / 20.0) / std::sqrt(energy));
+    for (float &x : h) {
+        x *= gain;
+    }
+    return h;
+}
+
+static std::vector<float> Convolve(const std::vector<float> &x, const std::vector<float> &h) {
+    std::vector<float> y(x.size());
+    for (size_t i = 0; i < x.size(); i++) {
+        double sum = 0.0;
+        size_t n = std::min(h.size(), i + 1);
+        for (size_t j = 0; j < n; j++) {
+            sum += h[j] * x[i - j];
+        }
+        y[i] = (float)sum;
+    }
+    return y;
+}
+
+static std::vector<int16_t> ToPCM(const std::vector<float> &x) {
+    std::vector<int16_t> pcm(x.size());
+    for (size_t i = 0; i < x.size(); i++) {
+        pcm[i] = (int16_t)std::lround(std::min(32767.0f, std::max(-32768.0f, x[i] * 32768.0f)));
+    }
+    return pcm;
+}
+
+// Echo scenario: mic = echo of far + near + noise
+struct Scenario {
+    std::vector<float> far;
+    std::vector<float> echo;
+    std::vector<float> near;
+    std::vector<int16_t> farPCM;
+    std::vector<int16_t> micPCM;
+};
+
+static Scenario MakeScenario(const std::vector<float> &far, const std::vector<float> &echo,
+                             const std::vector<float> &near, std::mt19937 &rng) {
+    Scenario s;
+    s.far = far;
+    s.echo = echo;
+    s.near = near;
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+    std::vector<float> mic(far.size());
+    for (size_t i = 0; i < mic.size(); i++) {
+        // Noise floor at -70 dBFS
+        mic[i] = echo[i] + near[i] + 3.2e-4f * noise(rng);
+    }
+    s.farPCM = ToPCM(far);
+    s.micPCM = ToPCM(mic);
+    return s;
+}
+
+// Run the canceller in 10 ms drains of whole blocks, as the recording
+// service does, returning the output at full scale 1.0
+static std::vector<float> Cancel(embla::EchoCanceller &aec, const std::vector<int16_t> &mic,
+                                 const std::vector<int16_t> &far) {
+    std::vector<int16_t> out = mic;
+    const size_t drain = SAMPLE_RATE / 100;
+    size_t done = 0;
+    for (size_t pos = drain; pos <= out.size(); pos += drain) {
+        size_t count = (pos - done) / aec.blockSize() * aec.blockSize();
+        aec.process(out.data() + done, far.data() + done, count);
+        done += count;
+    }
+    std::vector<float> res(out.size());
+    for (size_t i = 0; i < out.size(); i++) {
+        res[i] = out[i] / 32768.0f;
+    }
+    return res;
+}
+
+// Energy ratio of a over b between the given seconds, in dB
+static double RatioDb(const std::vector<float> &a, const std::vector<float> &b, double from, double to) {
+    size_t begin = (size_t)(from * SAMPLE_RATE), end = std::min(a.size(), (size_t)(to * SAMPLE_RATE));
+    double ea = 1e-12, eb = 1e-12;
+    for (size_t i = begin; i < end; i++) {
+        ea += a[i] * a[i];
+        eb += b[i] * b[i];
+    }
+    return 10.0 * std::log10(ea / eb);
+}
+
+static std::vector<float> Difference(const std::vector<float> &a, const std::vector<float> &b) {
+    std::vector<float> d(a.size());
+    for (size_t i = 0; i < a.size(); i++) {
+        d[i] = a[i] - b[i];
+    }
+    return d;
+}
+
+// Seconds until ERLE over 250 ms windows first reaches the given level
+static double ConvergenceTime(const std::vector<float> &echo, const std::vector<float> &residual, double erleDb) {
+    double duration = (double)echo.size() / SAMPLE_RATE;
+    for (double t = 0.0; t + 0.25 <= duration; t += 0.05) {
+        if (RatioDb(echo, residual, t, t + 0.25) >= erleDb) {
+            return t + 0.25;
+        }
+    }
+    return INFINITY;
+}
+
+// Checks
+
+static void CheckPassthrough(std::mt19937 &rng) {
+    embla::EchoCanceller aec;
+    std::vector<float> near = Speech(SAMPLE_RATE, rng);
+    std::vector<int16_t> mic = ToPCM(near), far(mic.size(), 0), out = mic;
+    aec.process(out.data(), far.data(), out.size());
+    if (out != mic) {
+        Fail("Passthrough: audio changed without far end");
+    }
+    if (aec.stats().activeBlocks != 0) {
+        Fail("Passthrough: blocks without far end counted as active");
+    }
+}
+
+static double CheckConvergence(std::mt19937 &rng, double *convergence) {
+    const size_t samples = 5 * SAMPLE_RATE;
+    std::vector<float> far = Speech(samples, rng);
+    std::vector<float> echo = Convolve(far, RoomResponse(160, 800, rng));
+    Scenario s = MakeScenario(far, echo, std::vector<float>(samples), rng);
+    embla::EchoCanceller aec;
+    std::vector<float> out = Cancel(aec, s.micPCM, s.farPCM);
+    double erle = RatioDb(s.echo, out, 4.0, 5.0);
+    *convergence = ConvergenceTime(s.echo, out, 15.0);
+    if (erle < 20.0) {
+        Fail("Convergence: ERLE " + Format("%.1f", erle) + " dB after 4 s, expected at least 20 dB");
+    }
+    if (*convergence > 1.5) {
+        Fail("Convergence: 15 dB ERLE took " + Format("%.2f", *convergence) + " s, expected at most 1.5 s");
+    }
+    if (aec.stats().foregroundUpdates == 0 || aec.stats().erleDb < 15.0f) {
+        Fail("Convergence: stats don't show the foreground filter converging");
+    }
+    return erle;
+}
+
+// The user talks over the answer from 3 to 6 s, with the far end going on
+static void CheckDoubleTalk(std::mt19937 &rng, double *nearQuality, double *erleDuring, double *erleAfter) {
+    const size_t samples = 7 * SAMPLE_RATE;
+    std::vector<float> far = Speech(samples, rng);
+    std::vector<float> echo = Convolve(far, RoomResponse(160, 800, rng));
+    std::vector<float> talk = Speech(3 * SAMPLE_RATE, rng, -20.0f);
+    std::vector<float> near(samples);
+    std::copy(talk.begin(), talk.end(), near.begin() + 3 * SAMPLE_RATE);
+    Scenario s = MakeScenario(far, echo, near, rng);
+    embla::EchoCanceller aec;
+    std::vector<float> out = Cancel(aec, s.micPCM, s.farPCM);
+    std::vector<float> residual = Difference(out, s.near);
+    *nearQuality = RatioDb(s.near, residual, 3.0, 6.0);
+    *erleDuring = RatioDb(s.echo, residual, 3.0, 6.0);
+    *erleAfter = RatioDb(s.echo, residual, 6.0, 7.0);
+    if (*nearQuality < 15.0) {
+        Fail("Double talk: near end " + Format("%.1f", *nearQuality) + " dB above what's left of the echo, "
+             "expected at least 15 dB");
+    }
+    if (*erleDuring < 12.0) {
+        Fail("Double talk: ERLE " + Format("%.1f", *erleDuring) + " dB, expected at least 12 dB");
+    }
+    if (*erleAfter < 15.0) {
+        Fail("Double talk: ERLE " + Format("%.1f", *erleAfter) + " dB afterwards, expected at least 15 dB");
+    }
+}
+
+// The phone is moved after 3 s, with a different response and delay
+static double CheckPathChange(std::mt19937 &rng) {
+    const size_t samples = 7 * SAMPLE_RATE, change = 3 * SAMPLE_RATE;
+    std::vector<float> far = Speech(samples, rng);
+    std::vector<float> before = Convolve(far, RoomResponse(160, 800, rng));
+    std::vector<float> after = Convolve(far, RoomResponse(400, 800, rng, 0.0f));
+    std::vector<float> echo(samples);
+    for (size_t i = 0; i < samples; i++) {
+        echo[i] = i < change ? before[i] : after[i];
+    }
+    Scenario s = MakeScenario(far, echo, std::vector<float>(samples), rng);
+    embla::EchoCanceller aec;
+    std::vector<float> out = Cancel(aec, s.micPCM, s.farPCM);
+    double erle = RatioDb(s.echo, out, 6.0, 7.0);
+    if (erle < 15.0) {
+        Fail("Path change: ERLE " + Format("%.1f", erle) + " dB 3 s after the change, expected at least 15 dB");
+    }
+    return erle;
+}
+
+// 24 kHz sine, as a player would write it
+static std::vector<float> Sine(double hz, double rate, size_t frames, double amplitude = 0.5) {
+    std::vector<float> s(frames);
+    for (size_t i = 0; i < frames; i++) {
+        s[i] = (float)(amplitude * std::sin(2 * M_PI * hz * i / rate));
+    }
+    return s;
+}
+
+static void CheckReference(std::mt19937 &rng) {
+    const double lead = 0.03, playRate = 24000.0, hz = 440.0;
+    std::uniform_real_distribution<double> jitter(-0.002, 0.002);
+
+    // Nothing is placed while the recording clock is unknown
+    embla::EchoReference reference(SAMPLE_RATE, 2.0, lead);
+    std::vector<float> sine = Sine(hz, playRate, 24000);
+    reference.write(1.0, sine.data(), 512, playRate);
+    if (reference.stats().written != 0 || reference.stats().dropped == 0 || reference.activeAt(0, 2048)) {
+        Fail("Reference: audio placed without a recording clock");
+    }
+
+    // Played from 10.5 s, in 512 frame blocks with jittery times after the
+    // first, which sets where the audio goes
+    const size_t frames = sine.size() / 512 * 512;
+    reference.setRecordingTime(1000, 10.0);
+    for (size_t i = 0; i < frames; i += 512) {
+        reference.setRecordingTime(1000 + (uint64_t)(i / playRate * SAMPLE_RATE), 10.0 + i / playRate);
+        reference.write(10.5 + i / playRate + (i ? jitter(rng) : 0.0), sine.data() + i, 512, playRate);
+    }
+    const uint64_t start = 1000 + (uint64_t)std::llround((0.5 - lead) * SAMPLE_RATE);
+    const size_t length = (size_t)((frames - 1) / playRate * SAMPLE_RATE) + 1;
+    std::vector<int16_t> out(length + 200);
+    size_t played = reference.read(start - 100, out.data(), out.size());
+    if (played != length) {
+        Fail("Reference: " + std::to_string(played) + " samples played, expected " + std::to_string(length));
+    }
+    for (size_t i = 0; i < 100; i++) {
+        if (out[i] != 0) {
+            Fail("Reference: audio placed before its time");
+            break;
+        }
+    }
+    double maxError = 0.0;
+    for (size_t i = 0; i < length; i++) {
+        double expected = 0.5 * std::sin(2 * M_PI * hz * i / SAMPLE_RATE);
+        maxError = std::max(maxError, std::fabs(out[100 + i] / 32768.0 - expected));
+    }
+    if (maxError > 0.01) {
+        Fail("Reference: placed sine off by " + Format("%.3f", maxError) + ", jitter shifted the audio?");
+    }
+    if (reference.stats().resyncs != 0) {
+        Fail("Reference: writer jumped on jitter");
+    }
+    if (!reference.activeAt(start + length, 2048) || reference.activeAt(start + length + 2200, 2048)) {
+        Fail("Reference: wrong activity after playback");
+    }
+
+    // Playback stalls for 100 ms, then goes on
+    double t = 10.5 + frames / playRate + 0.1;
+    reference.write(t, sine.data(), 512, playRate);
+    if (reference.stats().resyncs != 1) {
+        Fail("Reference: writer didn't jump after a stall");
+    }
+    std::vector<int16_t> gap(800);
+    reference.read(start + length + 100, gap.data(), gap.size());
+    if (*std::max_element(gap.begin(), gap.end()) != 0) {
+        Fail("Reference: stall not filled with silence");
+    }
+    uint64_t resumed = 1000 + (uint64_t)std::llround((t - 10.0 - lead) * SAMPLE_RATE);
+    std::vector<int16_t> after(100);
+    reference.read(resumed, after.data(), after.size());
+    if (*std::max_element(after.begin(), after.end()) < 8000) {
+        Fail("Reference: audio after the stall not at its time");
+    }
+
+    // Playback goes on after a gap of more than half the buffer. Where the
+    // gap lies in what the reader sees, audio played a buffer earlier must
+    // not show through.
+    double later = 13.0;
+    reference.write(later, sine.data(), 512, playRate);
+    uint64_t resumedLater = 1000 + (uint64_t)std::llround((later - 10.0 - lead) * SAMPLE_RATE);
+    std::vector<int16_t> longGap(SAMPLE_RATE);
+    reference.read(resumedLater - longGap.size(), longGap.data(), longGap.size());
+    reference.read(resumedLater, after.data(), after.size());
+    if (*std::max_element(longGap.begin(), longGap.end()) != 0 ||
+        *std::max_element(after.begin(), after.end()) < 8000) {
+        Fail("Reference: long gap not filled with silence");
+    }
+
+    // A new player starts where its own time puts it
+    reference.restartWriter();
+    reference.clearRecordingTime();
+    reference.write(t + 1.0, sine.data(), 512, playRate);
+    if (reference.stats().resyncs != 2 || reference.stats().dropped == 0) {
+        Fail("Reference: audio placed after the recording stopped");
+    }
+}
+
+// Player and recorder with jittery clocks, for different echo delays
+static void CheckEndToEnd(std::mt19937 &rng, std::vector<double> &erles) {
+    const double lead = 0.03;
+    for (int delayMs : { 0, 30, 70 }) {
+        const size_t samples = 5 * SAMPLE_RATE;
+        std::vector<float> far = Speech(samples, rng);
+        // The speaker starts 0.2 s into the recording. Echo reaches the
+        // microphone delayMs after its nominal time.
+        const size_t offset = SAMPLE_RATE / 5;
+        std::vector<float> played(samples + offset);
+        std::copy(far.begin(), far.end(), played.begin() + offset);
+        std::vector<float> echo = Convolve(played, RoomResponse(delayMs * SAMPLE_RATE / 1000, 400, rng));
+        Scenario s = MakeScenario(played, echo, std::vector<float>(played.size()), rng);
+
+        embla::EchoReference reference(SAMPLE_RATE, 2.0, lead);
+        embla::EchoCanceller aec;
+        std::uniform_real_distribution<double> jitter(-0.003, 0.003);
+        std::vector<int16_t> out = s.micPCM, farBlock(SAMPLE_RATE);
+        const size_t drain = SAMPLE_RATE / 100, player = 1024;
+        size_t written = 0, done = 0;
+        for (size_t pos = 0; pos + drain <= out.size(); pos += drain) {
+            double now = (double)pos / SAMPLE_RATE;
+            reference.setRecordingTime(pos, now + jitter(rng));
+            // The player renders ahead of the speaker
+            while (written < far.size() && (double)(offset + written) / SAMPLE_RATE < now + 0.1) {
+                size_t n = std::min(player, far.size() - written);
+                reference.write((double)(offset + written) / SAMPLE_RATE + jitter(rng), far.data() + written, n,
+                                SAMPLE_RATE);
+                written += n;
+            }
+            size_t count = (pos + drain - done) / aec.blockSize() * aec.blockSize();
+            if (reference.activeAt(done, aec.filterLength())) {
+                reference.read(done, farBlock.data(), count);
+                aec.process(out.data() + done, farBlock.data(), count);
+            }
+            done += count;
+        }
+        std::vector<float> res(out.size());
+        for (size_t i = 0; i < out.size(); i++) {
+            res[i] = out[i] / 32768.0f;
+        }
+        double erle = RatioDb(s.echo, res, 4.0, 5.0);
+        erles.push_back(erle);
+        if (erle < 18.0) {
+            Fail("End to end with " + std::to_string(delayMs) + " ms delay: ERLE " + Format("%.1f", erle) +
+                 " dB, expected at least 18 dB");
+        }
+    }
+}
+
+// Benchmark
+
+// Share of one core taken by the canceller, in percent
+static double CpuPercent(size_t filterLength, double *blockMicroseconds) {
+    std::mt19937 rng(1);
+    std::vector<int16_t> far = ToPCM(Speech(SAMPLE_RATE, rng));
+    std::vector<int16_t> mic = ToPCM(Speech(SAMPLE_RATE, rng));
+    embla::EchoCancellerConfig config;
+    config.filterLength = filterLength;
+    embla::EchoCanceller aec(config);
+    std::vector<int16_t> out(mic.size());
+    size_t blocks = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0.0;
+    while (elapsed < MIN_BENCH_SECONDS) {
+        out = mic;
+        aec.process(out.data(), far.data(), out.size());
+        blocks += out.size() / aec.blockSize();
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    *blockMicroseconds = elapsed * 1e6 / blocks;
+    double audioSeconds = (double)blocks * aec.blockSize() / SAMPLE_RATE;
+    return 100.0 * elapsed / audioSeconds;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--seed" && i + 1 < argc) {
+            seed = (uint32_t)atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--seed N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::mt19937 rng(seed);
+    double convergence, nearQuality, erleDuring, erleAfter;
+    std::vector<double> endToEnd;
+    CheckPassthrough(rng);
+    double erle = CheckConvergence(rng, &convergence);
+    CheckDoubleTalk(rng, &nearQuality, &erleDuring, &erleAfter);
+    double erlePathChange = CheckPathChange(rng);
+    CheckReference(rng);
+    CheckEndToEnd(rng, endToEnd);
+
+    double us1024, us2048, us4096;
+    double cpu1024 = CpuPercent(1024, &us1024);
+    double cpu2048 = CpuPercent(2048, &us2048);
+    double cpu4096 = CpuPercent(4096, &us4096);
+    if (cpu2048 > CPU_BUDGET_PERCENT) {
+        Fail("CPU: " + Format("%.2f", cpu2048) + "% of one core, budget is " + Format("%.1f", CPU_BUDGET_PERCENT) +
+             "%");
+    }
+    if (!ChecksPassed()) {
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"erle_db\": %.1f,\n", erle);
+    printf("  \"convergence_15db_s\": %.2f,\n", convergence);
+    printf("  \"double_talk_near_db\": %.1f,\n", nearQuality);
+    printf("  \"double_talk_erle_db\": %.1f,\n", erleDuring);
+    printf("  \"after_double_talk_erle_db\": %.1f,\n", erleAfter);
+    printf("  \"path_change_erle_db\": %.1f,\n", erlePathChange);
+    printf("  \"end_to_end_erle_db\": [%.1f, %.1f, %.1f],\n", endToEnd[0], endToEnd[1], endToEnd[2]);
+    printf("  \"block_us\": { \"1024\": %.1f, \"2048\": %.1f, \"4096\": %.1f },\n", us1024, us2048, us4096);
+    printf("  \"cpu_percent\": { \"1024\": %.2f, \"2048\": %.2f, \"4096\": %.2f }\n", cpu1024, cpu2048, cpu4096);
+    printf("}\n");
+    return 0;
+}
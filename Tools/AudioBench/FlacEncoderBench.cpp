@@ -0,0 +1,388 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Measures what embla::FlacEncoder saves when uploading speech to the
+    recognition server, and what it costs.
+
+    Recordings (16-bit mono PCM WAV, any sample rate, or directories of
+    them) are encoded in 100 ms blocks, like QuerySession does. The
+    report gives bytes and bitrate before and after, and the encoding
+    time per second of audio. The output is also decoded with a minimal
+    FLAC decoder included here and compared to the input, so each run
+    checks that encoding is lossless and that frame checksums are right.
+
+    Embla/Audio contains Icelandic speech to try it on:
+
+    $ build/flacbench Embla/Audio/Dora
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "FlacEncoder.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define CHUNK_MS        100
+#define DEFAULT_REPEAT  20
+
+namespace fs = std::filesystem;
+
+// Input
+
+static bool ReadWAV(const std::string &path, std::vector<int16_t> &samples, int &rate, std::string &err) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) {
+        err = "unable to open file";
+        return false;
+    }
+    char riff[12];
+    if (!f.read(riff, 12) || memcmp(riff, "RIFF", 4) || memcmp(riff + 8, "WAVE", 4)) {
+        err = "not a RIFF/WAVE file";
+        return false;
+    }
+    bool haveFormat = false;
+    char hdr[8];
+    while (f.read(hdr, 8)) {
+        uint32_t size;
+        memcpy(&size, hdr + 4, 4);
+        if (!memcmp(hdr, "fmt ", 4)) {
+            std::vector<char> fmt(size);
+            f.read(fmt.data(), size);
+            uint16_t format, channels, bits;
+            uint32_t r;
+            memcpy(&format, fmt.data(), 2);
+            memcpy(&channels, fmt.data() + 2, 2);
+            memcpy(&r, fmt.data() + 4, 4);
+            memcpy(&bits, fmt.data() + 14, 2);
+            if (format != 1 || channels != 1 || bits != 16) {
+                err = "unsupported format, need 16-bit mono PCM";
+                return false;
+            }
+            rate = (int)r;
+            haveFormat = true;
+        } else if (!memcmp(hdr, "data", 4)) {
+            if (!haveFormat) {
+                err = "data chunk before fmt chunk";
+                return false;
+            }
+            samples.resize(size / 2);
+            f.read((char *)samples.data(), samples.size() * 2);
+            samples.resize(f.gcount() / 2);
+            return true;
+        } else {
+            f.seekg(size + (size & 1), std::ios::cur);
+        }
+    }
+    err = "no data chunk";
+    return false;
+}
+
+static std::vector<std::string> CollectInputs(int argc, char *argv[]) {
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            continue;
+        }
+        if (fs::is_directory(argv[i])) {
+            for (const auto &e : fs::recursive_directory_iterator(argv[i])) {
+                if (e.is_regular_file() && e.path().extension() == ".wav") {
+                    files.push_back(e.path().string());
+                }
+            }
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// Verification
+
+class BitReader {
+public:
+    BitReader(const uint8_t *data, size_t length) : _data(data), _length(length) {}
+
+    uint32_t bits(int n) {
+        uint32_t v = 0;
+        for (int i = 0; i < n; i++) {
+            if (_pos >= _length * 8) {
+                _overrun = true;
+                return 0;
+            }
+            v = (v << 1) | ((_data[_pos >> 3] >> (7 - (_pos & 7))) & 1);
+            _pos++;
+        }
+        return v;
+    }
+    int32_t signedBits(int n) {
+        uint32_t v = bits(n);
+        return (int32_t)(v << (32 - n)) >> (32 - n);
+    }
+    uint32_t unary() {
+        uint32_t q = 0;
+        while (!_overrun && bits(1) == 0) {
+            q++;
+        }
+        return q;
+    }
+    void align() { _pos = (_pos + 7) & ~(size_t)7; }
+    size_t bytePosition() const { return _pos >> 3; }
+    bool overrun() const { return _overrun; }
+    bool atEnd() const { return _pos >= _length * 8; }
+
+private:
+    const uint8_t *_data;
+    size_t _length;
+    size_t _pos = 0;
+    bool _overrun = false;
+};
+
+static uint16_t Crc16(const uint8_t *data, size_t length) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint16_t)(data[i] << 8);
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static uint8_t Crc8(const uint8_t *data, size_t length) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+// Decodes the subset of FLAC the encoder produces: mono, 16 bits, fixed
+// block size, constant, verbatim and fixed predictor subframes.
+static bool DecodeFLAC(const std::vector<uint8_t> &stream, int rate, std::vector<int16_t> &out, std::string &err) {
+    if (stream.size() < 42 || memcmp(stream.data(), "fLaC", 4)) {
+        err = "missing stream header";
+        return false;
+    }
+    BitReader info(stream.data() + 8, 34);
+    info.bits(16 + 16 + 24 + 24);
+    if ((int)info.bits(20) != rate || info.bits(3) != 0 || info.bits(5) != 15) {
+        err = "wrong STREAMINFO";
+        return false;
+    }
+
+    size_t offset = 42;
+    uint64_t expectedFrame = 0;
+    while (offset < stream.size()) {
+        BitReader r(stream.data() + offset, stream.size() - offset);
+        if (r.bits(14) != 0x3FFE || r.bits(1) != 0 || r.bits(1) != 0) {
+            err = "bad frame sync";
+            return false;
+        }
+        uint32_t bsCode = r.bits(4);
+        r.bits(4 + 4 + 3 + 1);
+        uint32_t lead = r.bits(8);
+        uint64_t frame = lead;
+        int extra = 0;
+        while (extra < 7 && (lead & (0x80 >> extra))) {
+            extra++;
+        }
+        if (extra > 0) {
+            frame = lead & (0x7F >> extra);
+            for (int i = 1; i < extra; i++) {
+                frame = (frame << 6) | (r.bits(8) & 0x3F);
+            }
+        }
+        if (frame != expectedFrame++) {
+            err = "wrong frame number";
+            return false;
+        }
+        size_t count = (bsCode == 6 ? r.bits(8) : r.bits(16)) + 1;
+        size_t headerLength = r.bytePosition();
+        if (r.bits(8) != Crc8(stream.data() + offset, headerLength)) {
+            err = "bad header CRC";
+            return false;
+        }
+
+        r.bits(1);
+        uint32_t type = r.bits(6);
+        r.bits(1);
+        size_t base = out.size();
+        out.resize(base + count);
+        int16_t *x = out.data() + base;
+        if (type == 0) {
+            int16_t v = (int16_t)r.signedBits(16);
+            std::fill(x, x + count, v);
+        } else if (type == 1) {
+            for (size_t i = 0; i < count; i++) {
+                x[i] = (int16_t)r.signedBits(16);
+            }
+        } else if ((type & 0x38) == 8 && (type & 7) <= 4) {
+            int order = type & 7;
+            std::vector<int32_t> y(count);
+            for (int i = 0; i < order; i++) {
+                y[i] = r.signedBits(16);
+            }
+            uint32_t method = r.bits(2);
+            int paramBits = method ? 5 : 4;
+            int po = r.bits(4);
+            size_t parts = (size_t)1 << po;
+            size_t n = order;
+            for (size_t p = 0; p < parts; p++) {
+                int k = (int)r.bits(paramBits);
+                size_t end = (p + 1) * (count >> po);
+                for (; n < end; n++) {
+                    uint32_t q = r.unary();
+                    uint32_t u = (q << k) | r.bits(k);
+                    y[n] = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+                }
+            }
+            for (size_t i = order; i < count; i++) {
+                int32_t pred = 0;
+                switch (order) {
+                    case 1: pred = y[i - 1]; break;
+                    case 2: pred = 2 * y[i - 1] - y[i - 2]; break;
+                    case 3: pred = 3 * y[i - 1] - 3 * y[i - 2] + y[i - 3]; break;
+                    case 4: pred = 4 * y[i - 1] - 6 * y[i - 2] + 4 * y[i - 3] - y[i - 4]; break;
+                }
+                y[i] += pred;
+            }
+            for (size_t i = 0; i < count; i++) {
+                x[i] = (int16_t)y[i];
+            }
+        } else {
+            err = "unexpected subframe type";
+            return false;
+        }
+
+        r.align();
+        size_t frameLength = r.bytePosition();
+        uint16_t crc = (uint16_t)r.bits(16);
+        if (r.overrun() || crc != Crc16(stream.data() + offset, frameLength)) {
+            err = "bad frame CRC";
+            return false;
+        }
+        offset += frameLength + 2;
+    }
+    return true;
+}
+
+// Benchmark
+
+struct Totals {
+    size_t files = 0;
+    double seconds = 0.0;
+    uint64_t pcmBytes = 0;
+    uint64_t flacBytes = 0;
+    uint64_t frames = 0;
+    uint64_t verbatimFrames = 0;
+    double encodeSeconds = 0.0;
+    size_t verified = 0;
+};
+
+int main(int argc, char *argv[]) {
+    int repeat = DEFAULT_REPEAT;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (!strcmp(argv[i], "--repeat")) {
+            repeat = std::max(1, atoi(argv[i + 1]));
+            argv[i + 1][0] = '-'; // Skip the value when collecting inputs
+        }
+    }
+    std::vector<std::string> files = CollectInputs(argc, argv);
+    if (files.empty()) {
+        fprintf(stderr, "usage: %s [--repeat N] <file.wav|directory>...\n", argv[0]);
+        return 1;
+    }
+
+    Totals t;
+    for (const std::string &path : files) {
+        std::vector<int16_t> samples;
+        int rate = 0;
+        std::string err;
+        if (!ReadWAV(path, samples, rate, err)) {
+            fprintf(stderr, "%s: %s, skipping\n", path.c_str(), err.c_str());
+            continue;
+        }
+        size_t chunk = (size_t)rate * CHUNK_MS / 1000;
+
+        // One pass to collect and verify the stream
+        embla::FlacEncoder encoder(rate, chunk);
+        std::vector<uint8_t> stream;
+        for (size_t i = 0; i < samples.size(); i += chunk) {
+            const std::vector<uint8_t> &out = encoder.encode(samples.data() + i, std::min(chunk, samples.size() - i));
+            stream.insert(stream.end(), out.begin(), out.end());
+        }
+        std::vector<int16_t> decoded;
+        if (!DecodeFLAC(stream, rate, decoded, err)) {
+            fprintf(stderr, "%s: decoding failed: %s\n", path.c_str(), err.c_str());
+            return 1;
+        }
+        if (decoded != samples) {
+            fprintf(stderr, "%s: decoded audio differs from input\n", path.c_str());
+            return 1;
+        }
+        t.verified++;
+
+        // Timed passes
+        auto start = std::chrono::steady_clock::now();
+        for (int n = 0; n < repeat; n++) {
+            encoder.reset();
+            for (size_t i = 0; i < samples.size(); i += chunk) {
+                encoder.encode(samples.data() + i, std::min(chunk, samples.size() - i));
+            }
+        }
+        t.encodeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / repeat;
+
+        embla::FlacEncoderStats stats = encoder.stats();
+        t.files++;
+        t.seconds += (double)samples.size() / rate;
+        t.pcmBytes += samples.size() * sizeof(int16_t);
+        t.flacBytes += stream.size();
+        t.frames += stats.frames / (repeat + 1);
+        t.verbatimFrames += stats.verbatimFrames / (repeat + 1);
+    }
+    if (t.files == 0) {
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"files\": %zu,\n", t.files);
+    printf("  \"verified\": %zu,\n", t.verified);
+    printf("  \"audio_s\": %.2f,\n", t.seconds);
+    printf("  \"frames\": %llu,\n", (unsigned long long)t.frames);
+    printf("  \"verbatim_frames\": %llu,\n", (unsigned long long)t.verbatimFrames);
+    printf("  \"pcm_bytes\": %llu,\n", (unsigned long long)t.pcmBytes);
+    printf("  \"flac_bytes\": %llu,\n", (unsigned long long)t.flacBytes);
+    printf("  \"bytes_saved_pct\": %.1f,\n", 100.0 * (1.0 - (double)t.flacBytes / t.pcmBytes));
+    printf("  \"pcm_kbps\": %.1f,\n", t.pcmBytes * 8 / t.seconds / 1000);
+    printf("  \"flac_kbps\": %.1f,\n", t.flacBytes * 8 / t.seconds / 1000);
+    printf("  \"encode_us_per_audio_s\": %.1f,\n", t.encodeSeconds / t.seconds * 1e6);
+    printf("  \"rtf\": %.6f\n", t.encodeSeconds / t.seconds);
+    printf("}\n");
+    return 0;
+}
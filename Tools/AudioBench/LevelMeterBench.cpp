@@ -0,0 +1,110 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Throughput benchmark for the level metering kernel in LevelMeter.cpp,
+    compared against the plain scalar reference. Before timing anything,
+    the kernel's output is checked against the reference on random
+    audio and edge cases (full scale negative samples, odd lengths and
+    unaligned input), and the benchmark fails if they differ.
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "LevelMeter.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#define BLOCK_SAMPLES   160     // 10 ms at 16 kHz, a typical RemoteIO drain
+#define TOTAL_SAMPLES   (1 << 28)
+
+typedef embla::LevelMeasurement (*Kernel)(const int16_t *, size_t);
+
+static bool Same(const embla::LevelMeasurement &a, const embla::LevelMeasurement &b) {
+    return a.peak == b.peak && a.sumSquares == b.sumSquares && a.count == b.count;
+}
+
+static bool Verify() {
+    std::vector<int16_t> buf(4096 + 1);
+    // Random audio, all lengths up to 300 and all offsets
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = (int16_t)(rand() & 0xFFFF);
+    }
+    for (size_t offset = 0; offset < 2; offset++) {
+        for (size_t n = 0; n <= 300; n++) {
+            if (!Same(embla::measureLevel(buf.data() + offset, n),
+                      embla::measureLevelReference(buf.data() + offset, n))) {
+                fprintf(stderr, "Mismatch on random audio, offset %zu, length %zu\n", offset, n);
+                return false;
+            }
+        }
+    }
+    // Negative full scale must register as a peak of 32768 and not overflow the sum
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = -32768;
+    }
+    embla::LevelMeasurement m = embla::measureLevel(buf.data(), 4096);
+    if (!Same(m, embla::measureLevelReference(buf.data(), 4096)) || m.peak != 32768) {
+        fprintf(stderr, "Mismatch on negative full scale\n");
+        return false;
+    }
+    // Negative peaks must not be ignored
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = (i == 1000) ? -20000 : 100;
+    }
+    m = embla::measureLevel(buf.data(), 4096);
+    if (!Same(m, embla::measureLevelReference(buf.data(), 4096)) || m.peak != 20000) {
+        fprintf(stderr, "Mismatch on isolated negative peak\n");
+        return false;
+    }
+    return true;
+}
+
+static double Run(Kernel kernel, const std::vector<int16_t> &input, uint64_t &checksum) {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    for (size_t done = 0; done < TOTAL_SAMPLES; done += BLOCK_SAMPLES) {
+        size_t offset = done % (input.size() - BLOCK_SAMPLES);
+        embla::LevelMeasurement m = kernel(input.data() + offset, BLOCK_SAMPLES);
+        checksum += m.peak + m.sumSquares;
+    }
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int main() {
+    if (!Verify()) {
+        return 1;
+    }
+    printf("Kernel %s matches reference\n", embla::levelKernelName());
+
+    std::vector<int16_t> input(1 << 16);
+    for (size_t i = 0; i < input.size(); i++) {
+        input[i] = (int16_t)(rand() & 0xFFFF);
+    }
+    uint64_t checksum = 0;
+    double ref = Run(embla::measureLevelReference, input, checksum);
+    double vec = Run(embla::measureLevel, input, checksum);
+    double seconds = TOTAL_SAMPLES / 16000.0;
+    printf("%-10s %8.0f Msamples/s  %10.0fx real time\n", "reference", TOTAL_SAMPLES / ref / 1e6, seconds / ref);
+    printf("%-10s %8.0f Msamples/s  %10.0fx real time\n", embla::levelKernelName(), TOTAL_SAMPLES / vec / 1e6,
+           seconds / vec);
+    printf("Speedup %.1fx (checksum %llu)\n", ref / vec, (unsigned long long)checksum);
+    return 0;
+}
@@ -0,0 +1,381 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Checks and benchmarks the streaming playback pipeline for synthesized
+    speech: embla::MP3FrameParser feeding embla::JitterBuffer, as in
+    StreamingAudioPlayer.mm.
+
+    --synth writes a synthetic MP3 stream (ID3v2 tag and valid frame
+    headers with random payload, which also contains false sync
+    patterns) of the given length.
+
+    --check parses a file in one go and again in random-sized pieces
+    and verifies that both yield the same frames and the expected
+    duration.
+
+    --url downloads from a local HTTP server, e.g. query_standin.py with
+    --audio-chunk-delay-ms, and plays the stream on a simulated real
+    time clock. It reports time to first audio alongside the time the
+    download took, which is when the old download-then-play approach
+    would have started, and any underruns.
+
+    $ build/mp3bench --synth /tmp/long.mp3 --seconds 30
+    $ python3 Tools/StandIn/query_standin.py --audio /tmp/long.mp3 \
+        --audio-chunk-bytes 2048 --audio-chunk-delay-ms 40 &
+    $ build/mp3bench --url http://localhost:8000/audio/long.mp3
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "JitterBuffer.h"
+#include "MP3FrameParser.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <netdb.h>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define DEFAULT_PREBUFFER_MS    250
+#define DEFAULT_BITRATE         32
+#define DEFAULT_SAMPLE_RATE     22050
+#define PLAYBACK_BUFFER_SIZE    16384
+#define PLAYBACK_MAX_PACKETS    64
+
+typedef std::chrono::steady_clock Clock;
+
+static double Since(Clock::time_point t) {
+    return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+// Synthetic stream
+
+// MPEG-2 layer III, mono, as the speech synthesis server produces
+static bool Synthesize(const char *path, double seconds, int bitrate, int sampleRate) {
+    static const int rates[] = {22050, 24000, 16000};
+    static const int bitrates[] = {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160};
+    int rateIndex = -1, bitrateIndex = -1;
+    for (int i = 0; i < 3; i++) {
+        rateIndex = rates[i] == sampleRate ? i : rateIndex;
+    }
+    for (int i = 1; i < 15; i++) {
+        bitrateIndex = bitrates[i] == bitrate ? i : bitrateIndex;
+    }
+    if (rateIndex < 0 || bitrateIndex < 0) {
+        fprintf(stderr, "Unsupported MPEG-2 sample rate or bitrate\n");
+        return false;
+    }
+
+    std::ofstream f(path, std::ios::binary);
+    std::mt19937 rng(42);
+    // ID3v2 tag with 100 bytes of padding
+    const uint8_t id3[10] = {'I', 'D', '3', 3, 0, 0, 0, 0, 0, 100};
+    f.write((const char *)id3, 10);
+    f.write(std::string(100, '\0').data(), 100);
+
+    const int samplesPerFrame = 576;
+    size_t frames = (size_t)(seconds * sampleRate / samplesPerFrame);
+    double exact = (double)samplesPerFrame / 8 * bitrate * 1000 / sampleRate;
+    double written = 0.0;
+    for (size_t n = 0; n < frames; n++) {
+        // Pad frames as needed to keep the average at the nominal bitrate
+        size_t size = (size_t)exact;
+        int padding = (written + size + 0.5 <= exact * (n + 1)) ? 1 : 0;
+        size += padding;
+        written += size;
+        std::vector<uint8_t> frame(size);
+        frame[0] = 0xFF;
+        frame[1] = 0xF3; // MPEG-2, layer III, no CRC
+        frame[2] = (uint8_t)((bitrateIndex << 4) | (rateIndex << 2) | (padding << 1));
+        frame[3] = 0xC4; // Mono
+        for (size_t i = 4; i < size; i++) {
+            frame[i] = (uint8_t)rng();
+        }
+        f.write((const char *)frame.data(), size);
+    }
+    // ID3v1 tag at the end, which the parser should skip
+    char tag[128] = "TAG";
+    f.write(tag, sizeof(tag));
+    printf("Wrote %zu frames, %.2f seconds to %s\n", frames, (double)frames * samplesPerFrame / sampleRate, path);
+    return (bool)f;
+}
+
+// Consistency check
+
+static bool ReadFile(const char *path, std::vector<uint8_t> &data) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    return true;
+}
+
+struct ParsedFrame {
+    size_t size;
+    uint32_t hash;
+};
+
+static std::vector<ParsedFrame> ParseInPieces(const std::vector<uint8_t> &data, size_t maxPiece, uint32_t seed) {
+    std::vector<ParsedFrame> frames;
+    embla::MP3FrameParser parser([&frames](const uint8_t *frame, const embla::MP3FrameInfo &info) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < info.size; i++) {
+            h = (h ^ frame[i]) * 16777619u;
+        }
+        frames.push_back({info.size, h});
+    });
+    std::mt19937 rng(seed);
+    for (size_t pos = 0; pos < data.size();) {
+        size_t n = std::min(data.size() - pos, maxPiece == 0 ? data.size() : 1 + rng() % maxPiece);
+        parser.push(data.data() + pos, n);
+        pos += n;
+    }
+    parser.finish();
+    return frames;
+}
+
+static int Check(const char *path) {
+    std::vector<uint8_t> data;
+    if (!ReadFile(path, data)) {
+        fprintf(stderr, "Unable to read %s\n", path);
+        return 1;
+    }
+    std::vector<ParsedFrame> whole = ParseInPieces(data, 0, 0);
+    for (size_t piece : {1, 7, 100, 1500, 8192}) {
+        for (uint32_t seed = 1; seed <= 5; seed++) {
+            std::vector<ParsedFrame> pieces = ParseInPieces(data, piece, seed);
+            bool same = pieces.size() == whole.size();
+            for (size_t i = 0; same && i < whole.size(); i++) {
+                same = pieces[i].size == whole[i].size && pieces[i].hash == whole[i].hash;
+            }
+            if (!same) {
+                fprintf(stderr, "Parsing in pieces of up to %zu bytes gave %zu frames instead of %zu\n", piece,
+                        pieces.size(), whole.size());
+                return 1;
+            }
+        }
+    }
+
+    embla::MP3FrameParser parser(nullptr);
+    parser.push(data.data(), data.size());
+    parser.finish();
+    embla::MP3FrameParserStats stats = parser.stats();
+    printf("{\n");
+    printf("  \"file\": \"%s\",\n", path);
+    printf("  \"bytes\": %zu,\n", data.size());
+    printf("  \"frames\": %llu,\n", (unsigned long long)stats.frames);
+    printf("  \"skipped_bytes\": %llu,\n", (unsigned long long)stats.skippedBytes);
+    printf("  \"duration_s\": %.3f,\n", stats.duration);
+    printf("  \"consistent\": true\n");
+    printf("}\n");
+    return 0;
+}
+
+// Streaming
+
+// Minimal blocking HTTP/1.0 GET, calling back with body data as it arrives
+static bool HTTPGet(const std::string &url, std::function<void(const uint8_t *, size_t)> onData, std::string &err) {
+    if (url.compare(0, 7, "http://") != 0) {
+        err = "only http:// URLs are supported";
+        return false;
+    }
+    std::string rest = url.substr(7);
+    size_t slash = rest.find('/');
+    std::string hostPort = rest.substr(0, slash);
+    std::string path = slash == std::string::npos ? "/" : rest.substr(slash);
+    size_t colon = hostPort.find(':');
+    std::string host = hostPort.substr(0, colon);
+    std::string port = colon == std::string::npos ? "80" : hostPort.substr(colon + 1);
+
+    addrinfo hints = {}, *res = nullptr;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res) {
+        err = "unable to resolve " + host;
+        return false;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        freeaddrinfo(res);
+        err = "unable to connect to " + hostPort;
+        return false;
+    }
+    freeaddrinfo(res);
+
+    std::string req = "GET " + path + " HTTP/1.0\r\nHost: " + hostPort + "\r\n\r\n";
+    send(fd, req.data(), req.size(), 0);
+
+    std::string header;
+    bool inBody = false;
+    uint8_t buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        if (inBody) {
+            onData(buf, (size_t)n);
+            continue;
+        }
+        header.append((const char *)buf, (size_t)n);
+        size_t end = header.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            continue;
+        }
+        if (header.compare(0, 12, "HTTP/1.0 200") != 0 && header.compare(0, 12, "HTTP/1.1 200") != 0) {
+            err = header.substr(0, header.find("\r\n"));
+            close(fd);
+            return false;
+        }
+        inBody = true;
+        if (header.size() > end + 4) {
+            onData((const uint8_t *)header.data() + end + 4, header.size() - end - 4);
+        }
+    }
+    close(fd);
+    return inBody;
+}
+
+static int Stream(const std::string &url, double prebuffer) {
+    embla::JitterBuffer jitter(prebuffer);
+    embla::MP3FrameParser parser([&jitter](const uint8_t *frame, const embla::MP3FrameInfo &info) {
+        jitter.push(frame, info.size, info.duration());
+    });
+
+    // Simulated playback: pops a buffer's worth of frames and waits for
+    // as long as they'd take to play, like the audio queue does
+    Clock::time_point start = Clock::now();
+    std::atomic<double> firstAudio(-1.0);
+    std::atomic<bool> done(false);
+    double played = 0.0;
+    std::thread player([&] {
+        std::vector<uint8_t> buffer(PLAYBACK_BUFFER_SIZE);
+        uint32_t sizes[PLAYBACK_MAX_PACKETS];
+        double frameDuration = 0.0;
+        while (!jitter.drained() && !done) {
+            size_t bytes;
+            size_t count = jitter.pop(buffer.data(), buffer.size(), PLAYBACK_MAX_PACKETS, sizes, bytes);
+            if (count == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                continue;
+            }
+            if (firstAudio < 0) {
+                firstAudio = Since(start);
+            }
+            // All frames in the stream have the same duration
+            if (frameDuration == 0.0) {
+                frameDuration = parser.stats().duration / std::max<uint64_t>(1, parser.stats().frames);
+            }
+            played += count * frameDuration;
+            std::this_thread::sleep_for(std::chrono::duration<double>(count * frameDuration));
+        }
+    });
+
+    double firstByte = -1.0;
+    std::string err;
+    bool ok = HTTPGet(url, [&](const uint8_t *data, size_t length) {
+        if (firstByte < 0) {
+            firstByte = Since(start);
+        }
+        parser.push(data, length);
+    }, err);
+    double download = Since(start);
+    parser.finish();
+    jitter.finish();
+    if (!ok) {
+        done = true;
+        player.join();
+        fprintf(stderr, "Download failed: %s\n", err.c_str());
+        return 1;
+    }
+    player.join();
+    double total = Since(start);
+
+    embla::MP3FrameParserStats ps = parser.stats();
+    embla::JitterBufferStats js = jitter.stats();
+    printf("{\n");
+    printf("  \"url\": \"%s\",\n", url.c_str());
+    printf("  \"prebuffer_ms\": %.0f,\n", prebuffer * 1000);
+    printf("  \"frames\": %llu,\n", (unsigned long long)ps.frames);
+    printf("  \"audio_s\": %.3f,\n", ps.duration);
+    printf("  \"time_to_first_byte_ms\": %.1f,\n", firstByte * 1000);
+    printf("  \"time_to_first_audio_ms\": %.1f,\n", firstAudio * 1000);
+    printf("  \"download_ms\": %.1f,\n", download * 1000);
+    printf("  \"playback_done_ms\": %.1f,\n", total * 1000);
+    printf("  \"underruns\": %llu,\n", (unsigned long long)js.underruns);
+    printf("  \"max_buffered_s\": %.3f\n", js.maxBuffered);
+    printf("}\n");
+    return 0;
+}
+
+// Main
+
+static void Usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s --synth FILE [--seconds S] [--bitrate KBPS] [--sample-rate HZ]\n"
+            "       %s --check FILE\n"
+            "       %s --url URL [--prebuffer-ms N]\n",
+            prog, prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+    std::string synth, check, url;
+    double seconds = 10.0;
+    int bitrate = DEFAULT_BITRATE;
+    int sampleRate = DEFAULT_SAMPLE_RATE;
+    int prebufferMs = DEFAULT_PREBUFFER_MS;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if (a == "--synth" && hasValue) {
+            synth = argv[++i];
+        } else if (a == "--check" && hasValue) {
+            check = argv[++i];
+        } else if (a == "--url" && hasValue) {
+            url = argv[++i];
+        } else if (a == "--seconds" && hasValue) {
+            seconds = atof(argv[++i]);
+        } else if (a == "--bitrate" && hasValue) {
+            bitrate = atoi(argv[++i]);
+        } else if (a == "--sample-rate" && hasValue) {
+            sampleRate = atoi(argv[++i]);
+        } else if (a == "--prebuffer-ms" && hasValue) {
+            prebufferMs = atoi(argv[++i]);
+        } else {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!synth.empty()) {
+        return Synthesize(synth.c_str(), seconds, bitrate, sampleRate) ? 0 : 1;
+    }
+    if (!check.empty()) {
+        return Check(check.c_str());
+    }
+    if (!url.empty()) {
+        return Stream(url, prebufferMs / 1000.0);
+    }
+    Usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,361 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Checks and benchmarks the packed sound clips (VoiceAssetPack.cpp and
+    Embla/Audio/pack_voices.py).
+
+    The check opens a pack made by pack_voices.py and compares every
+    clip of every voice with its source WAV file: same format, same
+    samples, and a WAV file that parses to the same thing. UI sounds
+    must be shared by all voices. Truncated and corrupted copies of the
+    pack must either fail to open or only give clips within the file.
+    Any failure is reported and the exit status is nonzero.
+
+    The benchmark compares opening the pack and looking up clips by ID
+    with the way SessionViewController used to do it: map each of the
+    39 WAV files separately into a dictionary by name, then build the
+    name from the asciified voice ID for every clip played.
+
+    $ python3 Embla/Audio/pack_voices.py Embla/Audio VoiceAssets.pack
+    $ build/voicepackbench Embla/Audio VoiceAssets.pack
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "BenchCheck.h"
+#include "IcelandicAsciify.h"
+#include "VoiceAssetPack.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#define MIN_BENCH_SECONDS   0.5
+
+typedef std::chrono::steady_clock Clock;
+using embla::VoiceClip;
+
+// Voice IDs as stored in the VoiceID default, and their directories
+static const char *Voices[][2] = {
+    { "Dóra", "Dora" }, { "Guðrún", "Gudrun" }, { "Gunnar", "Gunnar" }, { "Karl", "Karl" },
+};
+
+static const char *UISounds[] = { "rec_begin", "rec_cancel", "rec_confirm" };
+
+static std::vector<uint8_t> ReadFile(const std::string &path) {
+    std::ifstream f(path, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+static bool WriteFile(const std::string &path, const std::vector<uint8_t> &data) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+// WAV files
+
+struct Wav {
+    uint16_t channels = 0;
+    uint32_t sampleRate = 0;
+    uint16_t bits = 0;
+    std::vector<uint8_t> pcm;
+};
+
+static bool ParseWav(const uint8_t *data, size_t size, Wav &wav) {
+    if (size < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0) {
+        return false;
+    }
+    bool fmt = false, pcm = false;
+    for (size_t pos = 12; pos + 8 <= size;) {
+        uint32_t chunkSize;
+        memcpy(&chunkSize, data + pos + 4, 4);
+        const uint8_t *body = data + pos + 8;
+        if (chunkSize > size - pos - 8) {
+            return false;
+        }
+        if (memcmp(data + pos, "fmt ", 4) == 0 && chunkSize >= 16) {
+            memcpy(&wav.channels, body + 2, 2);
+            memcpy(&wav.sampleRate, body + 4, 4);
+            memcpy(&wav.bits, body + 14, 2);
+            fmt = true;
+        } else if (memcmp(data + pos, "data", 4) == 0) {
+            wav.pcm.assign(body, body + chunkSize);
+            pcm = true;
+        }
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+    return fmt && pcm;
+}
+
+// Checks
+
+static void CheckClip(const embla::VoiceAssetPack &pack, size_t voice, VoiceClip clip, const std::string &path) {
+    std::string name = pack.voiceName(voice) + "/" + embla::voiceClipName(clip);
+    const embla::VoiceClipData *data = pack.clip(voice, clip);
+    std::vector<uint8_t> file = ReadFile(path);
+    Wav source, packed;
+    if (!ParseWav(file.data(), file.size(), source)) {
+        Fail(path + ": unable to read");
+        return;
+    }
+    if (data == nullptr) {
+        Fail(name + ": missing");
+        return;
+    }
+    if (!ParseWav(data->wav, data->wavSize, packed)) {
+        Fail(name + ": packed WAV doesn't parse");
+        return;
+    }
+    size_t frameBytes = 2 * source.channels;
+    size_t frames = source.pcm.size() / frameBytes;
+    if (data->channels != source.channels || data->sampleRate != source.sampleRate || data->frames != frames) {
+        Fail(name + ": format differs from " + path);
+    }
+    if (packed.pcm.size() != frames * frameBytes || memcmp(packed.pcm.data(), source.pcm.data(), packed.pcm.size()) ||
+        memcmp(data->samples, source.pcm.data(), frames * frameBytes)) {
+        Fail(name + ": samples differ from " + path);
+    }
+    if (packed.channels != source.channels || packed.sampleRate != source.sampleRate || packed.bits != 16) {
+        Fail(name + ": packed WAV header differs from " + path);
+    }
+}
+
+static void CheckPack(const embla::VoiceAssetPack &pack, const std::string &audioDir) {
+    if (pack.voiceCount() != sizeof(Voices) / sizeof(Voices[0])) {
+        Fail("Expected " + std::to_string(sizeof(Voices) / sizeof(Voices[0])) + " voices");
+    }
+    for (auto &v : Voices) {
+        std::string dir = v[1];
+        // As VoiceAssets looks up the VoiceID default
+        std::string lower = embla::icelandicAsciify(v[0]);
+        for (char &c : lower) {
+            c = (char)tolower((unsigned char)c);
+        }
+        int voice = pack.voiceIndex(lower);
+        if (voice < 0) {
+            Fail(std::string("No voice for ") + v[0]);
+            continue;
+        }
+        for (size_t c = 0; c < (size_t)VoiceClip::Count; c++) {
+            VoiceClip clip = (VoiceClip)c;
+            std::string name = embla::voiceClipName(clip);
+            bool ui = false;
+            for (const char *s : UISounds) {
+                ui |= name == s;
+            }
+            std::string path = ui ? audioDir + "/" + name + ".wav"
+                                  : audioDir + "/" + dir + "/" + name + "-" + lower + ".wav";
+            CheckClip(pack, (size_t)voice, clip, path);
+            const embla::VoiceClipData *data = pack.clip((size_t)voice, clip);
+            if (data && data->voiced == ui) {
+                Fail(std::string(v[0]) + "/" + name + ": wrong voiced flag");
+            }
+            if (data && ui && data->wav != pack.clip(0, clip)->wav) {
+                Fail(std::string(v[0]) + "/" + name + ": UI sound not shared");
+            }
+        }
+    }
+    if (pack.clip(pack.voiceCount(), VoiceClip::Conn) || pack.clip(0, VoiceClip::Count)) {
+        Fail("Out of range lookup returned a clip");
+    }
+}
+
+// Damaged packs must be rejected or stay within the file
+static void CheckDamaged(const std::string &packPath, uint32_t seed) {
+    std::vector<uint8_t> original = ReadFile(packPath);
+    std::string path = packPath + ".damaged";
+    std::mt19937 rng(seed);
+    for (int round = 0; round < 200; round++) {
+        std::vector<uint8_t> data = original;
+        if (round % 2) {
+            data.resize(rng() % data.size());
+        } else {
+            // Corrupt the index
+            size_t indexSize = std::min<size_t>(data.size(), 2048);
+            for (int i = 0; i < 4; i++) {
+                data[rng() % indexSize] = (uint8_t)rng();
+            }
+        }
+        if (!WriteFile(path, data)) {
+            Fail("Unable to write " + path);
+            break;
+        }
+        // Touch the last byte of every clip, which crashes if out of bounds
+        embla::VoiceAssetPack pack(path);
+        for (size_t v = 0; v < pack.voiceCount(); v++) {
+            for (size_t c = 0; c < (size_t)VoiceClip::Count; c++) {
+                const embla::VoiceClipData *clip = pack.clip(v, (VoiceClip)c);
+                if (clip == nullptr) {
+                    continue;
+                }
+                volatile uint8_t sink = clip->wav[clip->wavSize - 1];
+                sink = ((const uint8_t *)clip->samples)[clip->frames * clip->channels * 2 - 1];
+                (void)sink;
+            }
+        }
+    }
+    unlink(path.c_str());
+}
+
+// The old way
+
+struct Mapping {
+    void *data = nullptr;
+    size_t size = 0;
+};
+
+static std::unordered_map<std::string, Mapping> LoadOldWay(const std::string &audioDir) {
+    std::unordered_map<std::string, Mapping> sounds;
+    std::vector<std::string> files;
+    for (const char *s : UISounds) {
+        files.push_back(std::string(s) + ".wav");
+    }
+    for (auto &v : Voices) {
+        std::string voice = embla::icelandicAsciify(v[1]);
+        for (char &c : voice) {
+            c = (char)tolower((unsigned char)c);
+        }
+        files.push_back(std::string(v[1]) + "/err-" + voice + ".wav");
+        files.push_back(std::string(v[1]) + "/conn-" + voice + ".wav");
+        for (int i = 1; i < 8; i++) {
+            char name[64];
+            snprintf(name, sizeof(name), "%s/dunno%02d-%s.wav", v[1], i, voice.c_str());
+            files.push_back(name);
+        }
+    }
+    for (const std::string &file : files) {
+        int fd = open((audioDir + "/" + file).c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            Fail("Unable to open " + file);
+            continue;
+        }
+        Mapping m;
+        m.size = (size_t)st.st_size;
+        m.data = mmap(nullptr, m.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        std::string key = file.substr(file.rfind('/') + 1);
+        sounds[key.substr(0, key.size() - 4)] = m;
+    }
+    return sounds;
+}
+
+static void UnloadOldWay(std::unordered_map<std::string, Mapping> &sounds) {
+    for (auto &s : sounds) {
+        munmap(s.second.data, s.second.size);
+    }
+}
+
+static const Mapping *LookUpOldWay(const std::unordered_map<std::string, Mapping> &sounds, const char *voiceID,
+                                   const char *clip, bool voiced) {
+    std::string name = clip;
+    if (voiced) {
+        std::string suffix = embla::icelandicAsciify(voiceID);
+        for (char &c : suffix) {
+            c = (char)tolower((unsigned char)c);
+        }
+        name += "-" + suffix;
+    }
+    auto it = sounds.find(name);
+    return it == sounds.end() ? nullptr : &it->second;
+}
+
+// Benchmark
+
+template <typename F>
+static double MicrosecondsPer(F f) {
+    size_t runs = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0.0;
+    while (elapsed < MIN_BENCH_SECONDS) {
+        f(runs);
+        runs++;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return elapsed / runs * 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <audio directory> <pack file>\n", argv[0]);
+        return 1;
+    }
+    std::string audioDir = argv[1];
+    std::string packPath = argv[2];
+
+    std::unique_ptr<embla::VoiceAssetPack> pack(new embla::VoiceAssetPack(packPath));
+    if (!pack->isOpen()) {
+        fprintf(stderr, "Unable to open %s\n", packPath.c_str());
+        return 1;
+    }
+    CheckPack(*pack, audioDir);
+    CheckDamaged(packPath, 1);
+    if (!ChecksPassed()) {
+        return 1;
+    }
+
+    size_t files = 0;
+    double oldOpen = MicrosecondsPer([&](size_t) {
+        auto sounds = LoadOldWay(audioDir);
+        files = sounds.size();
+        UnloadOldWay(sounds);
+    });
+    double newOpen = MicrosecondsPer([&](size_t) { embla::VoiceAssetPack p(packPath); });
+
+    // Lookups as played: mostly UI sounds, with the odd voiced clip
+    static const VoiceClip plays[] = { VoiceClip::RecBegin, VoiceClip::RecConfirm, VoiceClip::RecBegin,
+                                       VoiceClip::RecCancel, VoiceClip::Conn, VoiceClip::Dunno03 };
+    auto sounds = LoadOldWay(audioDir);
+    size_t found = 0;
+    double oldLookup = MicrosecondsPer([&](size_t i) {
+        VoiceClip clip = plays[i % 6];
+        bool voiced = clip >= VoiceClip::Conn;
+        found += LookUpOldWay(sounds, Voices[1][0], embla::voiceClipName(clip), voiced) != nullptr;
+    });
+    UnloadOldWay(sounds);
+    int voice = pack->voiceIndex("gudrun");
+    double newLookup = MicrosecondsPer([&](size_t i) { found += pack->clip((size_t)voice, plays[i % 6]) != nullptr; });
+
+    printf("{\n");
+    printf("  \"voices\": %zu,\n", pack->voiceCount());
+    printf("  \"old_files_mapped\": %zu,\n", files);
+    printf("  \"old_open_us\": %.1f,\n", oldOpen);
+    printf("  \"new_open_us\": %.1f,\n", newOpen);
+    printf("  \"old_lookup_ns\": %.1f,\n", oldLookup * 1000);
+    printf("  \"new_lookup_ns\": %.1f,\n", newLookup * 1000);
+    printf("  \"found\": %s\n", found ? "true" : "false");
+    printf("}\n");
+    return 0;
+}
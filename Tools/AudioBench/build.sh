@@ -0,0 +1,92 @@
+# Build script for the audio processing microbenchmarks.
+# Run from the repository root:
+#
+#   $ bash Tools/AudioBench/build.sh
+#
+# Binaries are written to build/, which git ignores, unless OUTDIR is set.
+
+CXX=${CXX:-c++}
+OUTDIR=${OUTDIR:-build}
+mkdir -p "$OUTDIR" || exit 1
+CXXFLAGS="-std=c++17 -O2 -Wall -I Tools -I Embla/DSP"
+
+$CXX $CXXFLAGS -pthread \
+    Tools/AudioBench/AudioRingBufferBench.cpp \
+    -o "$OUTDIR/ringbench" || exit 1
+
+$CXX $CXXFLAGS \
+    Tools/AudioBench/ChunkAssemblerBench.cpp \
+    Embla/DSP/ChunkAssembler.cpp \
+    -o "$OUTDIR/chunkbench" || exit 1
+
+$CXX $CXXFLAGS -I Embla/Services/HotwordDetection \
+    Tools/AudioBench/ChunkAggregatorBench.cpp \
+    Embla/Services/HotwordDetection/ChunkAggregator.cpp \
+    -o "$OUTDIR/aggregatorbench" || exit 1
+
+$CXX $CXXFLAGS -pthread -I Embla/Services/HotwordDetection \
+    Tools/AudioBench/DetectionWorkerBench.cpp \
+    Embla/Services/HotwordDetection/DetectionWorker.cpp \
+    -o "$OUTDIR/workerbench" || exit 1
+
+$CXX $CXXFLAGS \
+    Tools/AudioBench/LevelMeterBench.cpp \
+    Embla/DSP/LevelMeter.cpp \
+    -o "$OUTDIR/levelbench" || exit 1
+
+# Same again with the AVX2 kernel on x86 hosts that support it
+if [ "$(uname -m)" = "x86_64" ]; then
+    $CXX $CXXFLAGS -mavx2 \
+        Tools/AudioBench/LevelMeterBench.cpp \
+        Embla/DSP/LevelMeter.cpp \
+        -o "$OUTDIR/levelbench-avx2" || exit 1
+fi
+
+$CXX $CXXFLAGS \
+    Tools/AudioBench/FlacEncoderBench.cpp \
+    Embla/DSP/FlacEncoder.cpp \
+    -o "$OUTDIR/flacbench" || exit 1
+
+$CXX $CXXFLAGS -pthread \
+    Tools/AudioBench/MP3StreamBench.cpp \
+    Embla/DSP/MP3FrameParser.cpp \
+    Embla/DSP/JitterBuffer.cpp \
+    -o "$OUTDIR/mp3bench" || exit 1
+
+$CXX $CXXFLAGS \
+    Tools/AudioBench/EarconMixerBench.cpp \
+    Embla/DSP/EarconMixer.cpp \
+    -o "$OUTDIR/earconbench" || exit 1
+
+$CXX $CXXFLAGS -I Embla/Cache \
+    Tools/AudioBench/CacheBench.cpp \
+    Embla/Cache/DiskCache.cpp \
+    -o "$OUTDIR/cachebench" || exit 1
+
+$CXX $CXXFLAGS -I Embla/Util \
+    Tools/AudioBench/DataURIBench.cpp \
+    Embla/Util/DataURIDecoder.cpp \
+    -o "$OUTDIR/datauribench" || exit 1
+
+if [ "$(uname -m)" = "x86_64" ]; then
+    $CXX $CXXFLAGS -mavx2 -I Embla/Util \
+        Tools/AudioBench/DataURIBench.cpp \
+        Embla/Util/DataURIDecoder.cpp \
+        -o "$OUTDIR/datauribench-avx2" || exit 1
+fi
+
+$CXX $CXXFLAGS -I Embla/Util \
+    Tools/AudioBench/AsciifyBench.cpp \
+    Embla/Util/IcelandicAsciify.cpp \
+    -o "$OUTDIR/asciifybench" || exit 1
+
+$CXX $CXXFLAGS -I Embla/Util \
+    Tools/AudioBench/VoicePackBench.cpp \
+    Embla/Util/VoiceAssetPack.cpp \
+    Embla/Util/IcelandicAsciify.cpp \
+    -o "$OUTDIR/voicepackbench" || exit 1
+
+$CXX $CXXFLAGS \
+    Tools/AudioBench/EchoCancellerBench.cpp \
+    Embla/DSP/EchoCanceller.cpp \
+    -o "$OUTDIR/echobench" || exit 1
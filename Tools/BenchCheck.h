@@ -0,0 +1,74 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Bookkeeping of checks, shared by the harnesses under Tools. Each
+    harness is a single program that runs its checks first, counting
+    failures as it goes, and only goes on to measure and report if they
+    all passed. Failures are printed to stderr, the first few in full.
+
+    Build scripts put Tools on the include path.
+*/
+
+#pragma once
+
+#include <cstdarg>
+#include <cstdio>
+#include <string>
+
+// Failures printed before the rest are only counted
+#ifndef BENCH_MAX_PRINTED_FAILURES
+#define BENCH_MAX_PRINTED_FAILURES  10
+#endif
+
+inline int failures = 0;
+
+// Count a failed check, printing what failed
+inline void Fail(const std::string &what) {
+    if (failures++ < BENCH_MAX_PRINTED_FAILURES) {
+        fprintf(stderr, "%s\n", what.c_str());
+    }
+}
+
+// As above, with a printf-style description
+__attribute__((format(printf, 1, 2)))
+inline void FailFormat(const char *format, ...) {
+    if (failures++ < BENCH_MAX_PRINTED_FAILURES) {
+        va_list args;
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+        fputc('\n', stderr);
+    }
+}
+
+#define CHECK(cond)                                                                 \
+    do {                                                                            \
+        if (!(cond)) {                                                              \
+            FailFormat("%s:%d: check failed: %s", __FILE__, __LINE__, #cond);       \
+        }                                                                           \
+    } while (0)
+
+// Print how many checks failed, if any. Returns whether they all passed.
+inline bool ChecksPassed() {
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,521 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Offline hotword replay and benchmark harness.
+
+    Streams WAV recordings through snowboy::SnowboyDetect using the same
+    chunking as SnowboyDetector.mm and reports real-time factor,
+    detections per hour of audio, detection latency relative to labelled
+    hotword timestamps and false accepts, as JSON.
+
+    Recordings must be 16-bit mono PCM at 16 kHz. A recording foo.wav may
+    be accompanied by foo.labels listing one hotword utterance per line
+    as "<start> <end>" in seconds (end is optional). Recordings without
+    a labels file are treated as containing no hotword, so every
+    detection in them is a false accept.
+
+    With --vad the audio first passes through the same voice activity
+    gate as in the app, and the report includes the gate's duty cycle.
+    Comparing detector calls and processing time with and without it
+    on long, mostly silent recordings shows what the gate saves.
+
+    Several comma-separated models may be given with --model, as in the
+    app. Each detection is reported with the 1-based index of the model
+    that fired. model_overhead.sh runs the harness with an increasing
+    number of models to measure the cost of each additional hotword.
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "ChunkAggregator.h"
+#include "Snowboy.h"
+#include "VADGate.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Defaults mirror the configuration in SnowboyDetector.mm
+#define DEFAULT_RESOURCE        "Snowboy/common.res"
+#define DEFAULT_MODEL           "Snowboy/old.pmdl"
+#define DEFAULT_SENSITIVITY     "0.5"
+#define DEFAULT_AUDIO_GAIN      1.0f
+#define DEFAULT_WINDOW_MS       30
+#define DEFAULT_BLOCK_MS        10
+#define DEFAULT_TOLERANCE_S     1.0
+#define DEFAULT_VAD_PREROLL_MS  500
+#define DEFAULT_VAD_HANGOVER_MS 700
+#define SAMPLE_RATE             16000
+
+struct Options {
+    std::string resource = DEFAULT_RESOURCE;
+    std::string model = DEFAULT_MODEL;
+    std::string sensitivity = DEFAULT_SENSITIVITY;
+    float gain = DEFAULT_AUDIO_GAIN;
+    bool frontend = false;
+    int windowMs = DEFAULT_WINDOW_MS;
+    int blockMs = DEFAULT_BLOCK_MS;
+    double tolerance = DEFAULT_TOLERANCE_S;
+    bool vad = false;
+    int vadPreRollMs = DEFAULT_VAD_PREROLL_MS;
+    int vadHangoverMs = DEFAULT_VAD_HANGOVER_MS;
+    std::string output;
+    std::vector<std::string> inputs;
+};
+
+struct Label {
+    double start;
+    double end;
+    bool matched = false;
+};
+
+struct FileResult {
+    std::string path;
+    double duration = 0.0;
+    double processing = 0.0;
+    double gateProcessing = 0.0;
+    uint64_t detectorCalls = 0;
+    uint64_t passedSamples = 0;
+    uint64_t gateOpenings = 0;
+    int hotwords = 0;
+    std::vector<double> detections;
+    std::vector<double> detectionHotwords;
+    std::vector<double> latenciesMs;
+    size_t labels = 0;
+    size_t trueAccepts = 0;
+    size_t falseAccepts = 0;
+    size_t misses = 0;
+};
+
+// Input
+
+static bool ReadWAV(const std::string &path, std::vector<int16_t> &samples, std::string &err) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) {
+        err = "unable to open file";
+        return false;
+    }
+    char riff[12];
+    if (!f.read(riff, 12) || memcmp(riff, "RIFF", 4) || memcmp(riff + 8, "WAVE", 4)) {
+        err = "not a RIFF/WAVE file";
+        return false;
+    }
+    bool haveFormat = false;
+    char hdr[8];
+    while (f.read(hdr, 8)) {
+        uint32_t size;
+        memcpy(&size, hdr + 4, 4);
+        if (!memcmp(hdr, "fmt ", 4)) {
+            std::vector<char> fmt(size);
+            f.read(fmt.data(), size);
+            uint16_t format, channels, bits;
+            uint32_t rate;
+            memcpy(&format, fmt.data(), 2);
+            memcpy(&channels, fmt.data() + 2, 2);
+            memcpy(&rate, fmt.data() + 4, 4);
+            memcpy(&bits, fmt.data() + 14, 2);
+            if (format != 1 || channels != 1 || bits != 16 || rate != SAMPLE_RATE) {
+                err = "unsupported format, need 16-bit mono PCM at 16 kHz";
+                return false;
+            }
+            haveFormat = true;
+        } else if (!memcmp(hdr, "data", 4)) {
+            if (!haveFormat) {
+                err = "data chunk before fmt chunk";
+                return false;
+            }
+            samples.resize(size / 2);
+            f.read((char *)samples.data(), samples.size() * 2);
+            samples.resize(f.gcount() / 2);
+            return true;
+        } else {
+            f.seekg(size + (size & 1), std::ios::cur);
+        }
+    }
+    err = "no data chunk";
+    return false;
+}
+
+static std::vector<Label> ReadLabels(const std::string &wavPath) {
+    std::vector<Label> labels;
+    std::ifstream f(fs::path(wavPath).replace_extension(".labels"));
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream ss(line);
+        Label l;
+        if (!(ss >> l.start)) {
+            continue;
+        }
+        if (!(ss >> l.end)) {
+            l.end = l.start;
+        }
+        labels.push_back(l);
+    }
+    return labels;
+}
+
+static std::vector<std::string> CollectInputs(const std::vector<std::string> &args) {
+    std::vector<std::string> files;
+    for (const std::string &a : args) {
+        if (fs::is_directory(a)) {
+            for (const auto &e : fs::recursive_directory_iterator(a)) {
+                if (e.is_regular_file() && e.path().extension() == ".wav") {
+                    files.push_back(e.path().string());
+                }
+            }
+        } else {
+            files.push_back(a);
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// Replay
+
+static FileResult Replay(const Options &opts, const std::string &path, const std::vector<int16_t> &samples) {
+    typedef std::chrono::steady_clock Clock;
+
+    FileResult r;
+    r.path = path;
+    r.duration = (double)samples.size() / SAMPLE_RATE;
+
+    snowboy::SnowboyDetect detect(opts.resource, opts.model);
+    detect.SetSensitivity(opts.sensitivity);
+    detect.SetAudioGain(opts.gain);
+    detect.ApplyFrontend(opts.frontend);
+    r.hotwords = detect.NumHotwords();
+
+    // Same aggregation stage the app puts in front of the detector
+    size_t position = 0;
+    embla::ChunkAggregatorConfig config;
+    config.sampleRate = SAMPLE_RATE;
+    config.normalWindowMs = opts.windowMs;
+    config.reducedWindowMs = opts.windowMs;
+    config.minimalWindowMs = opts.windowMs;
+    embla::ChunkAggregator aggregator(config, [&](const int16_t *chunk, size_t count, uint64_t end) {
+        Clock::time_point start = Clock::now();
+        int result = detect.RunDetection(chunk, (int)count);
+        r.processing += std::chrono::duration<double>(Clock::now() - start).count();
+        r.detectorCalls++;
+        if (result > 0) {
+            // Timed at the end of the window, as the app rewinds to
+            r.detections.push_back((double)end / SAMPLE_RATE);
+            r.detectionHotwords.push_back(result);
+        }
+    });
+
+    // Optional voice activity gate, wired up like in SnowboyDetector.mm
+    embla::VADGateConfig vadConfig;
+    vadConfig.sampleRate = SAMPLE_RATE;
+    vadConfig.preRollMs = opts.vadPreRollMs;
+    vadConfig.hangoverMs = opts.vadHangoverMs;
+    embla::VADGate gate(vadConfig, [&](const int16_t *chunk, size_t count, uint64_t end) {
+        aggregator.push(chunk, count, end);
+    }, [&](bool open) {
+        if (open) {
+            aggregator.reset();
+            detect.Reset();
+        } else {
+            aggregator.flush();
+        }
+    });
+
+    // Feed audio in RemoteIO-sized blocks
+    size_t block = std::max<size_t>(1, (size_t)SAMPLE_RATE * opts.blockMs / 1000);
+    while (position < samples.size()) {
+        size_t n = std::min(block, samples.size() - position);
+        position += n;
+        if (opts.vad) {
+            Clock::time_point start = Clock::now();
+            double before = r.processing;
+            gate.push(samples.data() + position - n, n);
+            // Gate time excludes the detector calls it triggered
+            r.gateProcessing += std::chrono::duration<double>(Clock::now() - start).count() - (r.processing - before);
+        } else {
+            aggregator.push(samples.data() + position - n, n, position);
+        }
+    }
+    aggregator.flush();
+    r.passedSamples = opts.vad ? gate.stats().passedSamples : samples.size();
+    r.gateOpenings = gate.stats().openings;
+
+    // Match detections against labelled utterances
+    std::vector<Label> labels = ReadLabels(path);
+    r.labels = labels.size();
+    for (double t : r.detections) {
+        bool matched = false;
+        for (Label &l : labels) {
+            if (!l.matched && t >= l.start && t <= l.end + opts.tolerance) {
+                l.matched = true;
+                matched = true;
+                r.latenciesMs.push_back((t - l.end) * 1000.0);
+                break;
+            }
+        }
+        if (matched) {
+            r.trueAccepts++;
+        } else {
+            r.falseAccepts++;
+        }
+    }
+    r.misses = r.labels - r.trueAccepts;
+    return r;
+}
+
+// Output
+
+static std::string JSONString(const std::string &s) {
+    std::string out = "\"";
+    for (char c : s) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+static std::string JSONNumber(double d) {
+    if (!std::isfinite(d)) {
+        return "null";
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.6g", d);
+    return buf;
+}
+
+static std::string JSONArray(const std::vector<double> &v) {
+    std::string out = "[";
+    for (size_t i = 0; i < v.size(); i++) {
+        out += (i ? ", " : "") + JSONNumber(v[i]);
+    }
+    return out + "]";
+}
+
+static double Percentile(std::vector<double> v, double p) {
+    if (v.empty()) {
+        return NAN;
+    }
+    std::sort(v.begin(), v.end());
+    size_t i = (size_t)std::min<double>(v.size() - 1, std::floor(p * (v.size() - 1) + 0.5));
+    return v[i];
+}
+
+static std::string Report(const Options &opts, const std::vector<FileResult> &results) {
+    std::ostringstream o;
+    o << "{\n";
+    o << "  \"config\": {\n";
+    o << "    \"resource\": " << JSONString(opts.resource) << ",\n";
+    o << "    \"model\": " << JSONString(opts.model) << ",\n";
+    o << "    \"sensitivity\": " << JSONString(opts.sensitivity) << ",\n";
+    o << "    \"audio_gain\": " << JSONNumber(opts.gain) << ",\n";
+    o << "    \"apply_frontend\": " << (opts.frontend ? "true" : "false") << ",\n";
+    o << "    \"window_ms\": " << opts.windowMs << ",\n";
+    o << "    \"block_ms\": " << opts.blockMs << ",\n";
+    o << "    \"tolerance_s\": " << JSONNumber(opts.tolerance) << ",\n";
+    o << "    \"vad\": " << (opts.vad ? "true" : "false") << ",\n";
+    o << "    \"vad_preroll_ms\": " << opts.vadPreRollMs << ",\n";
+    o << "    \"vad_hangover_ms\": " << opts.vadHangoverMs << "\n";
+    o << "  },\n";
+
+    double duration = 0.0, processing = 0.0, gateProcessing = 0.0;
+    size_t detections = 0, labels = 0, ta = 0, fa = 0, misses = 0;
+    uint64_t calls = 0, totalSamples = 0, passedSamples = 0, openings = 0;
+    std::vector<double> latencies;
+
+    o << "  \"files\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const FileResult &r = results[i];
+        o << (i ? ",\n" : "\n") << "    {\n";
+        o << "      \"path\": " << JSONString(r.path) << ",\n";
+        o << "      \"duration_s\": " << JSONNumber(r.duration) << ",\n";
+        o << "      \"processing_s\": " << JSONNumber(r.processing) << ",\n";
+        o << "      \"rtf\": " << JSONNumber(r.duration ? r.processing / r.duration : NAN) << ",\n";
+        o << "      \"detector_calls\": " << r.detectorCalls << ",\n";
+        o << "      \"vad_duty_cycle\": " << JSONNumber(r.duration ? r.passedSamples / (r.duration * SAMPLE_RATE) : NAN)
+          << ",\n";
+        o << "      \"vad_openings\": " << r.gateOpenings << ",\n";
+        o << "      \"hotwords\": " << r.hotwords << ",\n";
+        o << "      \"detections_s\": " << JSONArray(r.detections) << ",\n";
+        o << "      \"detection_hotwords\": " << JSONArray(r.detectionHotwords) << ",\n";
+        o << "      \"labels\": " << r.labels << ",\n";
+        o << "      \"true_accepts\": " << r.trueAccepts << ",\n";
+        o << "      \"false_accepts\": " << r.falseAccepts << ",\n";
+        o << "      \"misses\": " << r.misses << ",\n";
+        o << "      \"latencies_ms\": " << JSONArray(r.latenciesMs) << "\n";
+        o << "    }";
+        duration += r.duration;
+        processing += r.processing;
+        calls += r.detectorCalls;
+        gateProcessing += r.gateProcessing;
+        totalSamples += (uint64_t)std::llround(r.duration * SAMPLE_RATE);
+        passedSamples += r.passedSamples;
+        openings += r.gateOpenings;
+        detections += r.detections.size();
+        labels += r.labels;
+        ta += r.trueAccepts;
+        fa += r.falseAccepts;
+        misses += r.misses;
+        latencies.insert(latencies.end(), r.latenciesMs.begin(), r.latenciesMs.end());
+    }
+    o << (results.empty() ? "],\n" : "\n  ],\n");
+
+    double hours = duration / 3600.0;
+    double meanLatency = NAN;
+    if (!latencies.empty()) {
+        meanLatency = 0.0;
+        for (double l : latencies) {
+            meanLatency += l;
+        }
+        meanLatency /= latencies.size();
+    }
+
+    o << "  \"summary\": {\n";
+    o << "    \"files\": " << results.size() << ",\n";
+    o << "    \"audio_hours\": " << JSONNumber(hours) << ",\n";
+    o << "    \"processing_s\": " << JSONNumber(processing) << ",\n";
+    o << "    \"rtf\": " << JSONNumber(duration ? processing / duration : NAN) << ",\n";
+    o << "    \"detector_calls\": " << calls << ",\n";
+    o << "    \"mean_call_us\": " << JSONNumber(calls ? processing * 1e6 / calls : NAN) << ",\n";
+    o << "    \"vad_processing_s\": " << JSONNumber(gateProcessing) << ",\n";
+    o << "    \"vad_duty_cycle\": " << JSONNumber(totalSamples ? (double)passedSamples / totalSamples : NAN) << ",\n";
+    o << "    \"vad_openings\": " << openings << ",\n";
+    o << "    \"detections\": " << detections << ",\n";
+    o << "    \"detections_per_hour\": " << JSONNumber(hours ? detections / hours : NAN) << ",\n";
+    o << "    \"labels\": " << labels << ",\n";
+    o << "    \"true_accepts\": " << ta << ",\n";
+    o << "    \"false_accepts\": " << fa << ",\n";
+    o << "    \"false_accepts_per_hour\": " << JSONNumber(hours ? fa / hours : NAN) << ",\n";
+    o << "    \"misses\": " << misses << ",\n";
+    o << "    \"recall\": " << JSONNumber(labels ? (double)ta / labels : NAN) << ",\n";
+    o << "    \"latency_ms\": {\n";
+    o << "      \"mean\": " << JSONNumber(meanLatency) << ",\n";
+    o << "      \"p50\": " << JSONNumber(Percentile(latencies, 0.5)) << ",\n";
+    o << "      \"p95\": " << JSONNumber(Percentile(latencies, 0.95)) << ",\n";
+    o << "      \"max\": " << JSONNumber(Percentile(latencies, 1.0)) << "\n";
+    o << "    }\n";
+    o << "  }\n";
+    o << "}\n";
+    return o.str();
+}
+
+static void Usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] <file.wav|directory>...\n"
+            "  --resource PATH      Snowboy resource file (default %s)\n"
+            "  --model PATHS        Comma-separated hotword models (default %s)\n"
+            "  --sensitivity STR    Sensitivity string (default %s)\n"
+            "  --gain F             Audio gain (default %.1f)\n"
+            "  --frontend           Apply Snowboy frontend processing\n"
+            "  --window-ms N        Detection window size (default %d)\n"
+            "  --block-ms N         Size of simulated RemoteIO buffers (default %d)\n"
+            "  --tolerance S        Seconds after labelled end a detection still counts (default %.1f)\n"
+            "  --vad                Gate the detector with the voice activity detector\n"
+            "  --vad-preroll-ms N   Audio passed on ahead of the gate opening (default %d)\n"
+            "  --vad-hangover-ms N  How long the gate stays open after speech (default %d)\n"
+            "  --output FILE        Write JSON report to file instead of stdout\n",
+            prog, DEFAULT_RESOURCE, DEFAULT_MODEL, DEFAULT_SENSITIVITY, DEFAULT_AUDIO_GAIN, DEFAULT_WINDOW_MS,
+            DEFAULT_BLOCK_MS, DEFAULT_TOLERANCE_S, DEFAULT_VAD_PREROLL_MS, DEFAULT_VAD_HANGOVER_MS);
+}
+
+static bool ParseArgs(int argc, char *argv[], Options &opts) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if (a == "--frontend") {
+            opts.frontend = true;
+        } else if (a == "--vad") {
+            opts.vad = true;
+        } else if (a == "--vad-preroll-ms" && hasValue) {
+            opts.vadPreRollMs = std::max(0, std::stoi(argv[++i]));
+        } else if (a == "--vad-hangover-ms" && hasValue) {
+            opts.vadHangoverMs = std::max(0, std::stoi(argv[++i]));
+        } else if (a == "--resource" && hasValue) {
+            opts.resource = argv[++i];
+        } else if (a == "--model" && hasValue) {
+            opts.model = argv[++i];
+        } else if (a == "--sensitivity" && hasValue) {
+            opts.sensitivity = argv[++i];
+        } else if (a == "--gain" && hasValue) {
+            opts.gain = std::stof(argv[++i]);
+        } else if (a == "--window-ms" && hasValue) {
+            opts.windowMs = std::max(1, std::stoi(argv[++i]));
+        } else if (a == "--block-ms" && hasValue) {
+            opts.blockMs = std::max(1, std::stoi(argv[++i]));
+        } else if (a == "--tolerance" && hasValue) {
+            opts.tolerance = std::stod(argv[++i]);
+        } else if (a == "--output" && hasValue) {
+            opts.output = argv[++i];
+        } else if (a.size() > 1 && a[0] == '-') {
+            return false;
+        } else {
+            opts.inputs.push_back(a);
+        }
+    }
+    return !opts.inputs.empty();
+}
+
+int main(int argc, char *argv[]) {
+    Options opts;
+    if (!ParseArgs(argc, argv, opts)) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<FileResult> results;
+    for (const std::string &path : CollectInputs(opts.inputs)) {
+        std::vector<int16_t> samples;
+        std::string err;
+        if (!ReadWAV(path, samples, err)) {
+            fprintf(stderr, "Skipping %s: %s\n", path.c_str(), err.c_str());
+            continue;
+        }
+        results.push_back(Replay(opts, path, samples));
+    }
+
+    std::string report = Report(opts, results);
+    if (opts.output.empty()) {
+        fputs(report.c_str(), stdout);
+    } else {
+        std::ofstream(opts.output) << report;
+    }
+    return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Stand-in implementation of the snowboy::SnowboyDetect API declared in
+    Snowboy/Snowboy.framework/Headers/Snowboy.h, for machines where the
+    real Snowboy library isn't available (the bundled framework binary
+    is iOS-only).
+
+    This is NOT a hotword detector. It triggers on any sustained burst of
+    energy above a sensitivity-dependent threshold, which is enough to
+    exercise the replay harness end to end and to measure the harness'
+    own overhead. Link against the real libsnowboy-detect instead of this
+    file to get meaningful accuracy numbers.
+*/
+
+#include "Snowboy.h"
+#include <cmath>
+#include <sstream>
+#include <vector>
+
+namespace snowboy {
+
+struct WaveHeader {
+    int sampleRate = 16000;
+    int numChannels = 1;
+    int bitsPerSample = 16;
+};
+
+class PipelineDetect {
+public:
+    explicit PipelineDetect(int numHotwords) : sensitivities(numHotwords, 0.5f) {}
+
+    int run(const float *samples, int count) {
+        double sum = 0.0;
+        for (int i = 0; i < count; i++) {
+            float s = samples[i] * gain;
+            sum += (double)s * s;
+        }
+        double rms = count ? sqrt(sum / count) : 0.0;
+        double dbfs = rms > 0.0 ? 20.0 * log10(rms) : -120.0;
+
+        // Higher sensitivity means a lower energy threshold
+        double threshold = -20.0 - 30.0 * sensitivities[0];
+        if (dbfs < threshold) {
+            voicedSamples = 0;
+            triggered = false;
+            return -2;
+        }
+        voicedSamples += count;
+        if (!triggered && voicedSamples >= kMinVoicedSamples) {
+            triggered = true;
+            return 1;
+        }
+        return 0;
+    }
+
+    void reset() {
+        voicedSamples = 0;
+        triggered = false;
+    }
+
+    static const int kMinVoicedSamples = 16000 * 3 / 10; // 300 ms
+
+    std::vector<float> sensitivities;
+    float gain = 1.0f;
+    int voicedSamples = 0;
+    bool triggered = false;
+};
+
+static int CountModels(const std::string &modelStr) {
+    int n = 1;
+    for (char c : modelStr) {
+        n += (c == ',');
+    }
+    return n;
+}
+
+SnowboyDetect::SnowboyDetect(const std::string &resource_filename, const std::string &model_str)
+    : wave_header_(new WaveHeader()), detect_pipeline_(new PipelineDetect(CountModels(model_str))) {
+    (void)resource_filename;
+}
+
+SnowboyDetect::~SnowboyDetect() {}
+
+bool SnowboyDetect::Reset() {
+    detect_pipeline_->reset();
+    return true;
+}
+
+int SnowboyDetect::RunDetection(const std::string &data) {
+    return RunDetection((const int16_t *)data.data(), (int)(data.size() / 2));
+}
+
+int SnowboyDetect::RunDetection(const float *const data, const int array_length) {
+    return detect_pipeline_->run(data, array_length);
+}
+
+int SnowboyDetect::RunDetection(const int16_t *const data, const int array_length) {
+    std::vector<float> f(array_length);
+    for (int i = 0; i < array_length; i++) {
+        f[i] = data[i] / 32768.0f;
+    }
+    return RunDetection(f.data(), array_length);
+}
+
+int SnowboyDetect::RunDetection(const int32_t *const data, const int array_length) {
+    std::vector<float> f(array_length);
+    for (int i = 0; i < array_length; i++) {
+        f[i] = data[i] / 2147483648.0f;
+    }
+    return RunDetection(f.data(), array_length);
+}
+
+void SnowboyDetect::SetSensitivity(const std::string &sensitivity_str) {
+    std::stringstream ss(sensitivity_str);
+    std::string item;
+    size_t i = 0;
+    while (std::getline(ss, item, ',') && i < detect_pipeline_->sensitivities.size()) {
+        detect_pipeline_->sensitivities[i++] = std::stof(item);
+    }
+}
+
+std::string SnowboyDetect::GetSensitivity() const {
+    std::stringstream ss;
+    for (size_t i = 0; i < detect_pipeline_->sensitivities.size(); i++) {
+        ss << (i ? "," : "") << detect_pipeline_->sensitivities[i];
+    }
+    return ss.str();
+}
+
+void SnowboyDetect::SetAudioGain(const float audio_gain) {
+    detect_pipeline_->gain = audio_gain;
+}
+
+void SnowboyDetect::UpdateModel() const {}
+
+int SnowboyDetect::NumHotwords() const {
+    return (int)detect_pipeline_->sensitivities.size();
+}
+
+void SnowboyDetect::ApplyFrontend(const bool apply_frontend) {
+    (void)apply_frontend;
+}
+
+int SnowboyDetect::SampleRate() const {
+    return wave_header_->sampleRate;
+}
+
+int SnowboyDetect::NumChannels() const {
+    return wave_header_->numChannels;
+}
+
+int SnowboyDetect::BitsPerSample() const {
+    return wave_header_->bitsPerSample;
+}
+
+} // namespace snowboy
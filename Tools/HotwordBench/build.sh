@@ -0,0 +1,31 @@
+# Build script for the offline hotword replay/benchmark harness.
+# Run from the repository root:
+#
+#   $ bash Tools/HotwordBench/build.sh
+#
+# By default the harness is linked against a stand-in implementation of
+# the Snowboy API, since the bundled Snowboy.framework is iOS-only. To
+# benchmark the real detector, point SNOWBOY_LIB at a libsnowboy-detect.a
+# built for the host (and its BLAS dependency via EXTRA_LIBS), e.g.
+#
+#   $ SNOWBOY_LIB=/path/to/libsnowboy-detect.a EXTRA_LIBS="-lcblas" \
+#     bash Tools/HotwordBench/build.sh
+#
+# The binary is written to build/, which git ignores, unless OUT is set.
+
+CXX=${CXX:-c++}
+OUT=${OUT:-build/hotwordbench}
+mkdir -p "$(dirname "$OUT")" || exit 1
+SNOWBOY_SRC=${SNOWBOY_LIB:-Tools/HotwordBench/SnowboyStub.cpp}
+
+$CXX -std=c++17 -O2 -Wall \
+    -I Snowboy/Snowboy.framework/Headers \
+    -I Embla/Services/HotwordDetection \
+    -I Embla/DSP \
+    Tools/HotwordBench/HotwordBench.cpp \
+    Embla/Services/HotwordDetection/ChunkAggregator.cpp \
+    Embla/DSP/VADGate.cpp \
+    Embla/DSP/LevelMeter.cpp \
+    $SNOWBOY_SRC \
+    $EXTRA_LIBS \
+    -o "$OUT"
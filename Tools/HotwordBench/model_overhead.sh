@@ -0,0 +1,32 @@
+# Measures the per-call cost of running additional hotword models in the
+# same Snowboy detector, by replaying the given recordings with the first
+# 1, 2, ..., N of the given models. Run from the repository root after
+# building the harness with build.sh:
+#
+#   $ bash Tools/HotwordBench/model_overhead.sh recordings/ \
+#     Snowboy/old.pmdl model2.pmdl model3.pmdl
+#
+# Prints one line per model count with the mean cost of a detector call
+# and the real-time factor.
+
+BENCH=${BENCH:-build/hotwordbench}
+INPUT=$1
+shift
+
+if [ -z "$INPUT" ] || [ $# -eq 0 ]; then
+    echo "usage: $0 <file.wav|directory> <model> [model...]" >&2
+    exit 1
+fi
+
+MODELS=""
+SENSITIVITIES=""
+N=0
+for MODEL in "$@"; do
+    MODELS="${MODELS:+$MODELS,}$MODEL"
+    SENSITIVITIES="${SENSITIVITIES:+$SENSITIVITIES,}0.5"
+    N=$((N + 1))
+    REPORT=$("$BENCH" --model "$MODELS" --sensitivity "$SENSITIVITIES" "$INPUT") || exit 1
+    CALL_US=$(echo "$REPORT" | grep '"mean_call_us"' | tail -1 | sed 's/.*: //; s/,$//')
+    RTF=$(echo "$REPORT" | grep '"rtf"' | tail -1 | sed 's/.*: //; s/,$//')
+    echo "models: $N  mean_call_us: $CALL_US  rtf: $RTF"
+done
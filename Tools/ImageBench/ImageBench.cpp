@@ -0,0 +1,594 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Checks and benchmarks decoding answer images downsampled to the
+    width they're displayed at (ImageDownsampler.cpp).
+
+    The app decodes with ImageIO. Here the same approach is built on
+    libjpeg and libpng: JPEGs are decoded scaled down by the largest
+    factor of 2 that still leaves them wide enough, and both formats are
+    fed row by row into RowDownsampler (RowDownsampler.cpp in this
+    directory), so the full-size bitmap never exists. This is compared with decoding the full bitmap and then
+    scaling it, as SessionViewController used to.
+
+    The checks compare RowDownsampler with a plain area average on
+    random images, check the sizing functions, and check that both ways
+    of decoding agree: exactly for PNG, and within 30 dB PSNR for JPEG,
+    where scaled decoding works on the DCT coefficients. Any failure is
+    reported and the exit status is nonzero.
+
+    The benchmark decodes a 12 megapixel JPEG photo and a 3 megapixel
+    PNG to 1170 pixels wide (an iPhone's text view at 3x), each way in
+    a fresh process of its own, and reports the peak memory of each over
+    a process that only reads the image file, and the time per decode.
+
+    $ build/imagebench [--width N] [--seed N]
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "BenchCheck.h"
+#include "RowDownsampler.h"
+#include <chrono>
+#include <cmath>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <jpeglib.h>
+#include <memory>
+#include <png.h>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#define DEFAULT_WIDTH       1170
+#define JPEG_WIDTH          4032
+#define JPEG_HEIGHT         3024
+#define PNG_WIDTH           2048
+#define PNG_HEIGHT          1536
+#define MIN_BENCH_SECONDS   1.0
+
+typedef std::chrono::steady_clock Clock;
+using embla::ImageSize;
+
+struct Image {
+    ImageSize size;
+    unsigned channels = 0;
+    std::vector<uint8_t> pixels;
+};
+
+// Test images
+
+// Smooth gradients with some edges and a little noise, like a photo
+static Image SyntheticPhoto(uint32_t width, uint32_t height, unsigned channels, std::mt19937 &rng) {
+    Image image;
+    image.size = { width, height };
+    image.channels = channels;
+    image.pixels.resize((size_t)width * height * channels);
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint8_t *p = &image.pixels[((size_t)y * width + x) * channels];
+            double u = (double)x / width, v = (double)y / height;
+            bool inside = std::hypot(u - 0.6, v - 0.4) < 0.2;
+            double noise = (int)(rng() % 9) - 4;
+            p[0] = (uint8_t)std::min(255.0, std::max(0.0, 200 * u + (inside ? 40 : 0) + noise));
+            p[1] = (uint8_t)std::min(255.0, std::max(0.0, 160 * v + 60 * std::sin(12 * u) + 60 + noise));
+            p[2] = (uint8_t)std::min(255.0, std::max(0.0, inside ? 220 - 100 * v : 90 + 80 * u * v + noise));
+            if (channels == 4) {
+                p[3] = (uint8_t)(255 - 100 * v);
+            }
+        }
+    }
+    return image;
+}
+
+static std::vector<uint8_t> EncodeJpeg(const Image &image, int quality) {
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    unsigned char *buffer = nullptr;
+    unsigned long size = 0;
+    jpeg_mem_dest(&cinfo, &buffer, &size);
+    cinfo.image_width = image.size.width;
+    cinfo.image_height = image.size.height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = (JSAMPROW)&image.pixels[(size_t)cinfo.next_scanline * image.size.width * 3];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    std::vector<uint8_t> out(buffer, buffer + size);
+    jpeg_destroy_compress(&cinfo);
+    free(buffer);
+    return out;
+}
+
+static void PngWrite(png_structp png, png_bytep data, png_size_t length) {
+    std::vector<uint8_t> *out = (std::vector<uint8_t> *)png_get_io_ptr(png);
+    out->insert(out->end(), data, data + length);
+}
+
+static void PngFlush(png_structp) {}
+
+static std::vector<uint8_t> EncodePng(const Image &image) {
+    std::vector<uint8_t> out;
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png_create_info_struct(png);
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return std::vector<uint8_t>();
+    }
+    png_set_write_fn(png, &out, PngWrite, PngFlush);
+    png_set_IHDR(png, info, image.size.width, image.size.height, 8,
+                 image.channels == 4 ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    for (uint32_t y = 0; y < image.size.height; y++) {
+        png_write_row(png, &image.pixels[(size_t)y * image.size.width * image.channels]);
+    }
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+    return out;
+}
+
+// Decoding. Both decoders hand each row to a callback, once they know
+// the size of the image as decoded.
+
+typedef std::function<void(ImageSize size, unsigned channels)> SizeHandler;
+typedef std::function<void(const uint8_t *row)> RowHandler;
+
+static bool DecodeJpegRows(const std::vector<uint8_t> &data, unsigned denominator, SizeHandler sizeHandler,
+                           RowHandler rowHandler) {
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data.data(), data.size());
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denominator;
+    jpeg_start_decompress(&cinfo);
+    sizeHandler({ cinfo.output_width, cinfo.output_height }, 3);
+    std::vector<uint8_t> row((size_t)cinfo.output_width * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW p = row.data();
+        jpeg_read_scanlines(&cinfo, &p, 1);
+        rowHandler(row.data());
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+static ImageSize JpegSize(const std::vector<uint8_t> &data) {
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data.data(), data.size());
+    jpeg_read_header(&cinfo, TRUE);
+    ImageSize size = { cinfo.image_width, cinfo.image_height };
+    jpeg_destroy_decompress(&cinfo);
+    return size;
+}
+
+struct PngReader {
+    const std::vector<uint8_t> *data;
+    size_t offset;
+};
+
+static void PngRead(png_structp png, png_bytep out, png_size_t length) {
+    PngReader *r = (PngReader *)png_get_io_ptr(png);
+    if (r->offset + length > r->data->size()) {
+        png_error(png, "Truncated");
+    }
+    memcpy(out, r->data->data() + r->offset, length);
+    r->offset += length;
+}
+
+// Non-interlaced only, as interlaced images can't be read row by row
+static bool DecodePngRows(const std::vector<uint8_t> &data, SizeHandler sizeHandler, RowHandler rowHandler) {
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png_create_info_struct(png);
+    std::vector<uint8_t> row;
+    PngReader reader = { &data, 0 };
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return false;
+    }
+    png_set_read_fn(png, &reader, PngRead);
+    png_read_info(png, info);
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_read_update_info(png, info);
+    if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return false;
+    }
+    uint32_t width = png_get_image_width(png, info);
+    uint32_t height = png_get_image_height(png, info);
+    unsigned channels = png_get_channels(png, info);
+    sizeHandler({ width, height }, channels);
+    row.resize((size_t)width * channels);
+    for (uint32_t y = 0; y < height; y++) {
+        png_read_row(png, row.data(), nullptr);
+        rowHandler(row.data());
+    }
+    png_read_end(png, nullptr);
+    png_destroy_read_struct(&png, &info, nullptr);
+    return true;
+}
+
+// The two ways
+
+enum Format { Jpeg, Png };
+
+// Decode the full bitmap, then scale it
+static Image DecodeOldWay(Format format, const std::vector<uint8_t> &data, uint32_t maxWidth) {
+    Image full;
+    auto onSize = [&](ImageSize size, unsigned channels) {
+        full.size = size;
+        full.channels = channels;
+        full.pixels.reserve((size_t)size.width * size.height * channels);
+    };
+    auto onRow = [&](const uint8_t *row) {
+        full.pixels.insert(full.pixels.end(), row, row + (size_t)full.size.width * full.channels);
+    };
+    bool ok = format == Jpeg ? DecodeJpegRows(data, 1, onSize, onRow) : DecodePngRows(data, onSize, onRow);
+    Image out;
+    if (!ok) {
+        return out;
+    }
+    ImageSize size = embla::downsampledSize(full.size.width, full.size.height, maxWidth);
+    embla::RowDownsampler downsampler(full.size, size, full.channels);
+    for (uint32_t y = 0; y < full.size.height; y++) {
+        downsampler.pushRow(&full.pixels[(size_t)y * full.size.width * full.channels]);
+    }
+    out.size = size;
+    out.channels = full.channels;
+    out.pixels.swap(downsampler.pixels());
+    return out;
+}
+
+// Decode scaled where possible, downsampling row by row
+static Image DecodeNewWay(Format format, const std::vector<uint8_t> &data, uint32_t maxWidth) {
+    std::unique_ptr<embla::RowDownsampler> downsampler;
+    auto onSize = [&](ImageSize size, unsigned channels) {
+        ImageSize target = embla::downsampledSize(size.width, size.height, maxWidth);
+        downsampler.reset(new embla::RowDownsampler(size, target, channels));
+    };
+    auto onRow = [&](const uint8_t *row) { downsampler->pushRow(row); };
+    bool ok;
+    if (format == Jpeg) {
+        ImageSize size = JpegSize(data);
+        ImageSize target = embla::downsampledSize(size.width, size.height, maxWidth);
+        // The scaled size keeps the aspect ratio, so the target is computed from the original size
+        auto onScaledSize = [&](ImageSize scaled, unsigned channels) {
+            downsampler.reset(new embla::RowDownsampler(scaled, target, channels));
+        };
+        ok = DecodeJpegRows(data, embla::jpegScaleDenominator(size.width, target.width), onScaledSize, onRow);
+    } else {
+        ok = DecodePngRows(data, onSize, onRow);
+    }
+    Image out;
+    if (!ok || !downsampler || !downsampler->done()) {
+        return out;
+    }
+    out.size = downsampler->size();
+    out.channels = downsampler->channels();
+    out.pixels.swap(downsampler->pixels());
+    return out;
+}
+
+// Checks
+
+static Image AreaAverage(const Image &in, ImageSize size) {
+    Image out;
+    out.size = size;
+    out.channels = in.channels;
+    out.pixels.resize((size_t)size.width * size.height * in.channels);
+    double sx = (double)in.size.width / size.width, sy = (double)in.size.height / size.height;
+    for (uint32_t y = 0; y < size.height; y++) {
+        for (uint32_t x = 0; x < size.width; x++) {
+            for (unsigned c = 0; c < in.channels; c++) {
+                double sum = 0.0;
+                for (uint32_t iy = (uint32_t)(y * sy); iy < std::min<double>(in.size.height, (y + 1) * sy); iy++) {
+                    double wy = std::min((y + 1) * sy, iy + 1.0) - std::max(y * sy, (double)iy);
+                    for (uint32_t ix = (uint32_t)(x * sx); ix < std::min<double>(in.size.width, (x + 1) * sx); ix++) {
+                        double wx = std::min((x + 1) * sx, ix + 1.0) - std::max(x * sx, (double)ix);
+                        sum += wx * wy * in.pixels[((size_t)iy * in.size.width + ix) * in.channels + c];
+                    }
+                }
+                out.pixels[((size_t)y * size.width + x) * in.channels + c] = (uint8_t)std::lround(sum / (sx * sy));
+            }
+        }
+    }
+    return out;
+}
+
+static void CheckDownsampler(std::mt19937 &rng) {
+    for (int round = 0; round < 300; round++) {
+        Image in;
+        in.size = { 1 + (uint32_t)(rng() % 64), 1 + (uint32_t)(rng() % 64) };
+        in.channels = 1 + (unsigned)(rng() % 4);
+        in.pixels.resize((size_t)in.size.width * in.size.height * in.channels);
+        for (uint8_t &p : in.pixels) {
+            p = (uint8_t)rng();
+        }
+        ImageSize size = { 1 + (uint32_t)(rng() % in.size.width), 1 + (uint32_t)(rng() % in.size.height) };
+        embla::RowDownsampler downsampler(in.size, size, in.channels);
+        for (uint32_t y = 0; y < in.size.height; y++) {
+            if (downsampler.done()) {
+                Fail("Downsampler done early");
+            }
+            downsampler.pushRow(&in.pixels[(size_t)y * in.size.width * in.channels]);
+        }
+        Image expected = AreaAverage(in, size);
+        int maxDiff = 0;
+        for (size_t i = 0; i < expected.pixels.size(); i++) {
+            maxDiff = std::max(maxDiff, std::abs((int)downsampler.pixels()[i] - (int)expected.pixels[i]));
+        }
+        if (!downsampler.done() || maxDiff > 1) {
+            Fail("Downsampling " + std::to_string(in.size.width) + "x" + std::to_string(in.size.height) + " to " +
+                 std::to_string(size.width) + "x" + std::to_string(size.height) + ": off by " +
+                 std::to_string(maxDiff));
+        }
+    }
+}
+
+static void CheckSizing() {
+    struct {
+        uint32_t width, height, maxWidth, expectedWidth, expectedHeight;
+    } cases[] = {
+        { 4032, 3024, 1170, 1170, 878 }, { 800, 600, 1170, 800, 600 }, { 1170, 10, 1170, 1170, 10 },
+        { 10000, 1, 100, 100, 1 }, { 3000, 2000, 0, 3000, 2000 }, { 0, 100, 100, 0, 0 },
+    };
+    for (auto &c : cases) {
+        ImageSize s = embla::downsampledSize(c.width, c.height, c.maxWidth);
+        if (s.width != c.expectedWidth || s.height != c.expectedHeight) {
+            Fail("downsampledSize(" + std::to_string(c.width) + ", " + std::to_string(c.height) + ", " +
+                 std::to_string(c.maxWidth) + ") is " + std::to_string(s.width) + "x" + std::to_string(s.height));
+        }
+    }
+    for (uint32_t width = 1; width < 5000; width += 7) {
+        for (uint32_t target = 1; target <= width; target += 13) {
+            unsigned d = embla::jpegScaleDenominator(width, target);
+            uint32_t scaled = (width + d - 1) / d;
+            uint32_t next = (width + 2 * d - 1) / (2 * d);
+            if (scaled < target || (d < 8 && next >= target)) {
+                Fail("jpegScaleDenominator(" + std::to_string(width) + ", " + std::to_string(target) + ") is " +
+                     std::to_string(d));
+                return;
+            }
+        }
+    }
+}
+
+static double Psnr(const Image &a, const Image &b) {
+    if (a.pixels.size() != b.pixels.size() || a.pixels.empty()) {
+        return 0.0;
+    }
+    double se = 0.0;
+    for (size_t i = 0; i < a.pixels.size(); i++) {
+        double d = (double)a.pixels[i] - b.pixels[i];
+        se += d * d;
+    }
+    return se == 0.0 ? INFINITY : 10.0 * std::log10(255.0 * 255.0 / (se / a.pixels.size()));
+}
+
+static void CheckDecoders(const std::vector<uint8_t> &jpeg, const std::vector<uint8_t> &png, uint32_t maxWidth) {
+    Image oldJpeg = DecodeOldWay(Jpeg, jpeg, maxWidth), newJpeg = DecodeNewWay(Jpeg, jpeg, maxWidth);
+    Image oldPng = DecodeOldWay(Png, png, maxWidth), newPng = DecodeNewWay(Png, png, maxWidth);
+    if (newJpeg.size.width != std::min(maxWidth, (uint32_t)JPEG_WIDTH) || newJpeg.size.height != oldJpeg.size.height) {
+        Fail("JPEG decoded to the wrong size");
+    }
+    double psnr = Psnr(oldJpeg, newJpeg);
+    if (psnr < 30.0) {
+        Fail("Scaled JPEG decoding differs too much, PSNR " + std::to_string(psnr) + " dB");
+    }
+    if (newPng.channels != 4 || oldPng.pixels != newPng.pixels || newPng.pixels.empty()) {
+        Fail("PNG decoded differently");
+    }
+}
+
+// Benchmark
+
+// Decode the image in file with the given method ("none" only reads the
+// file) in a fresh process, so that nothing is inherited from this one,
+// and return its peak resident memory in kilobytes. The child reports
+// this itself, as the rusage of a child includes what it was forked from.
+static long ChildPeakKB(const char *method, const std::string &file, uint32_t width) {
+    char exe[4096];
+    ssize_t length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (length <= 0) {
+        Fail("Can't find the benchmark executable");
+        return 0;
+    }
+    exe[length] = '\0';
+    std::string command = std::string("'") + exe + "' --decode " + method + " '" + file + "' --width " +
+                          std::to_string(width);
+    FILE *child = popen(command.c_str(), "r");
+    long kb = -1;
+    if (!child || fscanf(child, "%ld", &kb) != 1 || pclose(child) != 0 || kb < 0) {
+        Fail(std::string("Benchmark child process failed: ") + method);
+        return 0;
+    }
+    return kb;
+}
+
+// Peak resident memory of this process, in kilobytes
+static long PeakKB() {
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    return kb;
+}
+
+static bool WriteFile(const std::string &path, const std::vector<uint8_t> &data) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+static bool ReadFile(const std::string &path, std::vector<uint8_t> &data) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    uint8_t buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        data.insert(data.end(), buffer, buffer + n);
+    }
+    fclose(f);
+    return true;
+}
+
+// Child side of ChildPeakKB()
+static int DecodeFile(const std::string &method, const std::string &file, uint32_t width) {
+    std::vector<uint8_t> data;
+    if (!ReadFile(file, data)) {
+        return 1;
+    }
+    Format format = (data.size() > 2 && data[0] == 0xFF && data[1] == 0xD8) ? Jpeg : Png;
+    Image image;
+    if (method == "old") {
+        image = DecodeOldWay(format, data, width);
+    } else if (method == "new") {
+        image = DecodeNewWay(format, data, width);
+    } else if (method != "none") {
+        return 1;
+    }
+    if (method != "none" && image.pixels.empty()) {
+        return 1;
+    }
+    printf("%ld\n", PeakKB());
+    return 0;
+}
+
+template <typename F>
+static double MillisecondsPer(F f) {
+    size_t runs = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0.0;
+    while (elapsed < MIN_BENCH_SECONDS || runs < 3) {
+        f();
+        runs++;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return elapsed / runs * 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t width = DEFAULT_WIDTH;
+    uint32_t seed = 1;
+    std::string decodeMethod, decodeFile;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--width" && i + 1 < argc) {
+            width = (uint32_t)atoi(argv[++i]);
+        } else if (a == "--seed" && i + 1 < argc) {
+            seed = (uint32_t)atoi(argv[++i]);
+        } else if (a == "--decode" && i + 2 < argc) {
+            decodeMethod = argv[++i];
+            decodeFile = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--width N] [--seed N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!decodeMethod.empty()) {
+        return DecodeFile(decodeMethod, decodeFile, width);
+    }
+
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> jpeg, png;
+    {
+        Image photo = SyntheticPhoto(JPEG_WIDTH, JPEG_HEIGHT, 3, rng);
+        jpeg = EncodeJpeg(photo, 85);
+        Image graphic = SyntheticPhoto(PNG_WIDTH, PNG_HEIGHT, 4, rng);
+        png = EncodePng(graphic);
+    }
+
+    CheckDownsampler(rng);
+    CheckSizing();
+    CheckDecoders(jpeg, png, width);
+    if (!ChecksPassed()) {
+        return 1;
+    }
+
+    char dir[] = "/tmp/imagebench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "Can't create a temporary directory\n");
+        return 1;
+    }
+    std::string jpegFile = std::string(dir) + "/photo.jpg", pngFile = std::string(dir) + "/graphic.png";
+    if (!WriteFile(jpegFile, jpeg) || !WriteFile(pngFile, png)) {
+        fprintf(stderr, "Can't write test images to %s\n", dir);
+        return 1;
+    }
+    long jpegBaseline = ChildPeakKB("none", jpegFile, width);
+    long pngBaseline = ChildPeakKB("none", pngFile, width);
+    long oldJpegKB = ChildPeakKB("old", jpegFile, width) - jpegBaseline;
+    long newJpegKB = ChildPeakKB("new", jpegFile, width) - jpegBaseline;
+    long oldPngKB = ChildPeakKB("old", pngFile, width) - pngBaseline;
+    long newPngKB = ChildPeakKB("new", pngFile, width) - pngBaseline;
+    unlink(jpegFile.c_str());
+    unlink(pngFile.c_str());
+    rmdir(dir);
+
+    double oldJpegMs = MillisecondsPer([&]() { DecodeOldWay(Jpeg, jpeg, width); });
+    double newJpegMs = MillisecondsPer([&]() { DecodeNewWay(Jpeg, jpeg, width); });
+    double oldPngMs = MillisecondsPer([&]() { DecodeOldWay(Png, png, width); });
+    double newPngMs = MillisecondsPer([&]() { DecodeNewWay(Png, png, width); });
+
+    printf("{\n");
+    printf("  \"width\": %u,\n", width);
+    printf("  \"jpeg\": { \"bytes\": %zu, \"old_peak_kb\": %ld, \"new_peak_kb\": %ld, \"old_ms\": %.1f, "
+           "\"new_ms\": %.1f },\n", jpeg.size(), oldJpegKB, newJpegKB, oldJpegMs, newJpegMs);
+    printf("  \"png\": { \"bytes\": %zu, \"old_peak_kb\": %ld, \"new_peak_kb\": %ld, \"old_ms\": %.1f, "
+           "\"new_ms\": %.1f }\n", png.size(), oldPngKB, newPngKB, oldPngMs, newPngMs);
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "RowDownsampler.h"
+#include <algorithm>
+#include <cmath>
+
+namespace embla {
+
+// Sizing
+
+unsigned jpegScaleDenominator(uint32_t width, uint32_t targetWidth) {
+    unsigned denominator = 1;
+    // libjpeg rounds scaled sizes up
+    while (denominator < 8 && (width + denominator * 2 - 1) / (denominator * 2) >= targetWidth) {
+        denominator *= 2;
+    }
+    return denominator;
+}
+
+// Downsampler
+
+RowDownsampler::RowDownsampler(ImageSize source, ImageSize output, unsigned channels)
+    : _source(source), _output(output), _channels(std::max(1u, std::min(4u, channels))),
+      _rowScale(output.height ? (double)source.height / output.height : 1.0), _tapStart(output.width + 1),
+      _rowSums((size_t)output.width * _channels), _accumulators((size_t)output.width * _channels),
+      _pixels((size_t)output.width * output.height * _channels) {
+    // Each output column covers [x * scale, (x + 1) * scale) of the source
+    double scale = output.width ? (double)source.width / output.width : 1.0;
+    for (uint32_t x = 0; x < output.width; x++) {
+        _tapStart[x] = (uint32_t)_taps.size();
+        double begin = x * scale;
+        double end = std::min((double)source.width, (x + 1) * scale);
+        for (uint32_t sx = (uint32_t)begin; sx < end; sx++) {
+            double overlap = std::min(end, sx + 1.0) - std::max(begin, (double)sx);
+            if (overlap > 1e-9) {
+                _taps.push_back({ sx, (float)(overlap / scale) });
+            }
+        }
+    }
+    _tapStart[output.width] = (uint32_t)_taps.size();
+}
+
+void RowDownsampler::pushRow(const uint8_t *row) {
+    if (done()) {
+        return;
+    }
+    const unsigned ch = _channels;
+    for (uint32_t x = 0; x < _output.width; x++) {
+        float sums[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        for (uint32_t t = _tapStart[x]; t < _tapStart[x + 1]; t++) {
+            const uint8_t *p = row + (size_t)_taps[t].x * ch;
+            for (unsigned c = 0; c < ch; c++) {
+                sums[c] += p[c] * _taps[t].weight;
+            }
+        }
+        for (unsigned c = 0; c < ch; c++) {
+            _rowSums[(size_t)x * ch + c] = sums[c];
+        }
+    }
+
+    // This source row covers [y, y + 1), split between at most two output
+    // rows as output rows are at least one source row high
+    double y = _sourceRow;
+    while (_outputRow < _output.height) {
+        double rowEnd = (_outputRow + 1) * _rowScale;
+        double overlap = std::min(y + 1.0, rowEnd) - std::max(y, _outputRow * _rowScale);
+        if (overlap > 0.0) {
+            float weight = (float)(overlap / _rowScale);
+            for (size_t i = 0; i < _accumulators.size(); i++) {
+                _accumulators[i] += _rowSums[i] * weight;
+            }
+        }
+        if (rowEnd > y + 1.0 + 1e-9) {
+            break;
+        }
+        emitRow();
+    }
+    _sourceRow++;
+    // Rounding may leave the last output row a hair short of complete
+    if (done() && _outputRow < _output.height) {
+        emitRow();
+    }
+}
+
+void RowDownsampler::emitRow() {
+    uint8_t *out = _pixels.data() + (size_t)_outputRow * _output.width * _channels;
+    for (size_t i = 0; i < _accumulators.size(); i++) {
+        out[i] = (uint8_t)std::min(255.0f, std::max(0.0f, _accumulators[i] + 0.5f));
+        _accumulators[i] = 0.0f;
+    }
+    _outputRow++;
+}
+
+} // namespace embla
@@ -0,0 +1,86 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Downsampling of images while they're decoded, with libjpeg and
+    libpng, the way the app does it with ImageIO (see ImagePipeline.mm).
+
+    A decoder that can scale while decoding (JPEG by a factor of 2, 4 or
+    8, see jpegScaleDenominator()) gets as close to the size given by
+    downsampledSize() as it can, and RowDownsampler takes it the rest of
+    the way: it's fed the decoded image one row at a time and averages
+    the source pixels covering each output pixel, by area. It only holds
+    one row of accumulators and the output.
+*/
+
+#pragma once
+
+#include "ImageDownsampler.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace embla {
+
+// Largest JPEG scaling denominator (1, 2, 4 or 8) which still decodes an
+// image of the given width to at least targetWidth pixels.
+unsigned jpegScaleDenominator(uint32_t width, uint32_t targetWidth);
+
+class RowDownsampler {
+public:
+    // Source and output sizes, with the output no larger than the source,
+    // for 8-bit pixels of 1-4 channels.
+    RowDownsampler(ImageSize source, ImageSize output, unsigned channels);
+
+    // Add the next source row, source.width * channels bytes.
+    void pushRow(const uint8_t *row);
+
+    // Whether all source rows have been pushed, and the output is complete.
+    bool done() const { return _sourceRow >= _source.height; }
+
+    ImageSize size() const { return _output; }
+    unsigned channels() const { return _channels; }
+    // output.width * output.height * channels bytes, row by row
+    const std::vector<uint8_t> &pixels() const { return _pixels; }
+    std::vector<uint8_t> &pixels() { return _pixels; }
+
+private:
+    struct Tap {
+        uint32_t x;             // Source column
+        float weight;           // Share of the output pixel it covers
+    };
+
+    void emitRow();
+
+    const ImageSize _source;
+    const ImageSize _output;
+    const unsigned _channels;
+    const double _rowScale;     // Source rows per output row
+
+    // Taps of each output column, _tapStart[x] to _tapStart[x + 1]
+    std::vector<Tap> _taps;
+    std::vector<uint32_t> _tapStart;
+
+    std::vector<float> _rowSums;        // Current source row, reduced horizontally
+    std::vector<float> _accumulators;   // Current output row
+    std::vector<uint8_t> _pixels;
+    uint32_t _sourceRow = 0;
+    uint32_t _outputRow = 0;
+};
+
+} // namespace embla
@@ -0,0 +1,18 @@
+# Build script for the answer image decoding benchmark. Needs the libjpeg
+# and libpng development packages, which the app itself doesn't use (it
+# decodes with ImageIO). Run from the repository root:
+#
+#   $ bash Tools/ImageBench/build.sh
+#
+# The binary is written to build/, which git ignores, unless OUTDIR is set.
+
+CXX=${CXX:-c++}
+OUTDIR=${OUTDIR:-build}
+mkdir -p "$OUTDIR" || exit 1
+
+$CXX -std=c++17 -O2 -Wall -I Tools -I Embla/Util \
+    Tools/ImageBench/ImageBench.cpp \
+    Tools/ImageBench/RowDownsampler.cpp \
+    Embla/Util/ImageDownsampler.cpp \
+    -ljpeg -lpng \
+    -o "$OUTDIR/imagebench" || exit 1
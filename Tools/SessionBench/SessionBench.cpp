@@ -0,0 +1,789 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Checks and benchmarks the query session state machine
+    (SessionMachine.cpp) against simulated capture, speech recognition,
+    query server and playback, in simulated time.
+
+    Capture delivers 64 ms buffers of synthetic audio in real time. The
+    recognizer answers with a scripted sequence of interim results, end
+    of utterance and final transcript, each due once it has received a
+    given amount of audio. Network delays are half the round trip time
+    each way, plus server processing time with lognormal jitter.
+
+    The checks run one session per scenario (plain, speculative hit,
+    miss and failure, recognition timeout and error, a local command,
+    answers opening a URL or without audio, termination mid-query,
+    exhausted chunk slots, FLAC) and compare the states visited, the
+    listener calls, the queries sent and the audio that reached the
+    recognizer to what's expected, and that speculative queries are
+    flagged as such. Any failure is reported and the exit status is
+    nonzero.
+
+    The benchmark runs the sessions given for each round trip time,
+    with speculative queries off and on, and reports the p50 and p95 of
+    the time from the start of capture, and from the final transcript,
+    to the first speech audio, along with the CPU time the session
+    logic takes per second of audio, with and without FLAC.
+
+    $ build/sessionbench [--sessions N] [--rtt-ms 0,60,200] [--seed N]
+
+    See build.sh in this directory for how to build.
+*/
+
+#define BENCH_MAX_PRINTED_FAILURES  20
+#include "BenchCheck.h"
+#include "SessionMachine.h"
+#include "ChunkAssembler.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+#define DEFAULT_SESSIONS        200
+#define DEFAULT_RTTS            "0,60,200"
+#define SAMPLE_RATE             16000
+#define CAPTURE_BUFFER_SAMPLES  1024
+#define SOURCE_SECONDS          3.0
+#define CPU_SESSIONS            200
+
+using namespace embla;
+
+// Simulated time
+
+class Simulation {
+public:
+    double now() const { return _now; }
+
+    void after(double seconds, std::function<void()> task) {
+        _tasks.push({ _now + std::max(0.0, seconds), _sequence++, std::move(task) });
+    }
+
+    void run() {
+        while (!_tasks.empty()) {
+            Task task = _tasks.top();
+            _tasks.pop();
+            _now = task.when;
+            task.run();
+        }
+    }
+
+private:
+    struct Task {
+        double when;
+        uint64_t sequence;
+        std::function<void()> run;
+        bool operator<(const Task &other) const {
+            return when != other.when ? when > other.when : sequence > other.sequence;
+        }
+    };
+
+    double _now = 0.0;
+    uint64_t _sequence = 0;
+    std::priority_queue<Task> _tasks;
+};
+
+// Scenario
+
+struct ScriptedResponse {
+    double audioMs;                 // Due once this much audio has reached the server
+    const char *transcript;         // Interim result, or nullptr for end of utterance
+    const char *alternative;        // Second alternative, if any
+    float stability;
+};
+
+// Roughly what the speech recognition service returns for "hvað er klukkan"
+static const ScriptedResponse klukkanScript[] = {
+    { 500, "hvað", nullptr, 0.01f },
+    { 800, "hvað er", nullptr, 0.5f },
+    { 1200, "hvað er klukkan", "hvað er klukka", 0.9f },
+    { 1700, nullptr, nullptr, 0.0f },
+};
+
+enum class AnswerKind { Audio, OpenURL, NoAudio };
+
+struct Scenario {
+    double rtt = 0.06;
+    double sttDelay = 0.08;         // Server time per response
+    double finalDelay = 0.15;       // Server time from end of utterance to final transcript
+    double queryTime = 0.1;         // Query server processing
+    double firstAudioTime = 0.1;    // Speech synthesis to first audio
+    double playSeconds = 2.0;
+    double jitter = 0.0;            // Sigma of lognormal jitter on server times
+    double uplinkKbps = 0.0;        // Limits how fast chunks go out, 0 for no limit
+    bool speculative = false;
+    bool flac = false;
+    std::vector<std::string> finalAlternatives = { "hvað er klukkan", "hvað er klukka" };
+    AnswerKind answer = AnswerKind::Audio;
+    bool failSpeculativeQueries = false;
+    bool recognitionTimesOut = false;       // No final transcript after end of utterance
+    double recognitionErrorMs = -1;         // Fail once this much audio has been received
+    bool terminateOnTranscripts = false;    // As the app does for local commands
+    double terminateAt = -1;
+};
+
+// Synthetic speech-like audio: noise shaped by a slow envelope
+static std::vector<int16_t> SourceAudio(uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> noise(0.0, 1.0);
+    std::vector<int16_t> samples((size_t)(SOURCE_SECONDS * SAMPLE_RATE));
+    double lowpass = 0.0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        double t = (double)i / SAMPLE_RATE;
+        double envelope = 0.05 + 0.3 * std::max(0.0, sin(2 * M_PI * 3.0 * t));
+        lowpass = 0.7 * lowpass + 0.3 * noise(rng);
+        samples[i] = (int16_t)std::max(-32768.0, std::min(32767.0, 32767.0 * envelope * lowpass));
+    }
+    return samples;
+}
+
+// Everything outside the machine, simulated, and a record of what the machine did
+class World : public SessionAudioInput, public SessionRecognizer, public SessionQueryClient,
+              public SessionPlayer, public SessionListener {
+public:
+    World(const Scenario &scenario, const std::vector<int16_t> &source, uint32_t seed)
+        : _scenario(scenario), _source(source), _rng(seed), _jitter(0.0, scenario.jitter > 0 ? scenario.jitter : 1.0) {
+        SessionConfig config;
+        config.sampleRate = SAMPLE_RATE;
+        config.flac = scenario.flac;
+        config.speculativeQueries = scenario.speculative;
+        SessionServices services;
+        services.audio = this;
+        services.recognizer = this;
+        services.query = this;
+        services.player = this;
+        services.listener = this;
+        services.clock = [this]() { return _sim.now(); };
+        _machine.reset(new SessionMachine(config, services));
+    }
+
+    void run() {
+        _machine->start(0);
+        if (_scenario.terminateAt >= 0) {
+            _sim.after(_scenario.terminateAt, [this]() { _machine->terminate(); });
+        }
+        _sim.run();
+    }
+
+    SessionMachine &machine() { return *_machine; }
+
+    // Record
+    std::vector<SessionState> states;
+    std::vector<std::string> calls;
+    std::vector<std::vector<std::string>> queries;
+    size_t misflaggedQueries = 0;           // Flagged speculative or not, whichever they weren't
+    std::vector<std::string> marks;         // Speculation trace marks
+    std::vector<std::string> transcripts;
+    std::vector<uint8_t> received;          // Audio as received by the recognizer
+    size_t chunksHoldingSlots = 0;
+    size_t releases = 0;
+    size_t cancelledQueries = 0;
+    int terminations = 0;
+    double captureStart = -1, finalTime = -1, firstAudioTime = -1;
+
+    // SessionAudioInput
+
+    void startCapture(uint64_t position) override {
+        captureStart = _sim.now();
+        int generation = ++_captureGeneration;
+        deliver(0, generation);
+    }
+
+    void stopCapture() override { ++_captureGeneration; }
+
+    // SessionRecognizer
+
+    void sendAudio(const SessionAudioChunk &chunk) override {
+        received.insert(received.end(), chunk.data, chunk.data + chunk.length);
+        chunksHoldingSlots += chunk.holdsSlot();
+        // The chunk is held until it's been sent
+        double sent = _sim.now();
+        if (_scenario.uplinkKbps > 0) {
+            _linkFree = std::max(_linkFree, _sim.now()) + chunk.length * 8 / (_scenario.uplinkKbps * 1000);
+            sent = _linkFree;
+        }
+        SessionAudioChunk held = chunk;
+        size_t samples = chunk.samples;
+        _sim.after(sent - _sim.now(), [this, held]() {
+            held.release();
+            releases += held.holdsSlot();
+        });
+        _sim.after(sent - _sim.now() + _scenario.rtt / 2, [this, samples]() { serverReceived(samples); });
+    }
+
+    void finishAudio() override {
+        double sent = std::max(_linkFree, _sim.now());
+        _sim.after(sent - _sim.now() + _scenario.rtt / 2, [this]() { serverEndOfAudio(); });
+    }
+
+    // SessionQueryClient
+
+    int sendQuery(const std::vector<std::string> &alternatives, bool speculative) override {
+        int id = (int)queries.size();
+        queries.push_back(alternatives);
+        // Speculative queries are only sent before the final transcript
+        if (speculative != (_machine->state() == SessionState::Recording ||
+                            _machine->state() == SessionState::Recognizing)) {
+            misflaggedQueries++;
+        }
+        _cancelled.push_back(false);
+        double delay = _scenario.rtt + serverTime(_scenario.queryTime);
+        _sim.after(delay, [this, id, speculative, alternatives]() {
+            if (_cancelled[id]) {
+                _machine->queryFailed(id, "cancelled");
+            } else if (speculative && _scenario.failSpeculativeQueries) {
+                _machine->queryFailed(id, "The request timed out.");
+            } else {
+                _machine->queryAnswered(id, answerTo(alternatives));
+            }
+        });
+        return id;
+    }
+
+    void cancelQuery(int requestID) override {
+        _cancelled[requestID] = true;
+        cancelledQueries++;
+    }
+
+    // SessionPlayer
+
+    void play(const std::string &url, const std::string &text) override {
+        int generation = ++_playGeneration;
+        _sim.after(_scenario.rtt + serverTime(_scenario.firstAudioTime), [this, generation]() {
+            if (generation == _playGeneration) {
+                firstAudio();
+                _sim.after(_scenario.playSeconds, [this, generation]() {
+                    if (generation == _playGeneration) {
+                        _machine->playbackFinished(true);
+                    }
+                });
+            }
+        });
+    }
+
+    bool playCachedSpeech(const std::string &text) override { return false; }
+
+    std::string playDunno() override {
+        int generation = ++_playGeneration;
+        firstAudio();
+        _sim.after(1.0, [this, generation]() {
+            if (generation == _playGeneration) {
+                _machine->playbackFinished(true);
+            }
+        });
+        return "Ég veit það ekki.";
+    }
+
+    void stop() override { ++_playGeneration; }
+
+    // SessionListener
+
+    void sessionDidStartRecording() override { record("start"); }
+    void sessionDidStopRecording() override { record("stop"); }
+    void sessionDidReceiveInterimResults(const std::vector<std::string> &alternatives) override {}
+
+    void sessionDidReceiveTranscripts(const std::vector<std::string> &alternatives) override {
+        record(alternatives.empty() ? "no transcripts" : "transcripts");
+        transcripts = alternatives;
+        finalTime = _sim.now();
+        if (_scenario.terminateOnTranscripts) {
+            _machine->terminate();
+        }
+    }
+
+    void sessionDidReceiveAnswer(const QueryAnswer &answer) override { record("answer:" + answer.answer); }
+    void sessionDidFail(const std::string &message) override { record("fail"); }
+
+    void sessionDidTerminate() override {
+        record("terminate");
+        terminations++;
+    }
+
+    void sessionDidResolveSpeculation(bool hit, double secondsSaved, double roundTrip) override {
+        record(hit ? "speculation hit" : "speculation miss");
+    }
+
+    void sessionTraceMark(const char *name) override {
+        if (strncmp(name, "Speculation ", 12) == 0) {
+            marks.push_back(name);
+        }
+    }
+
+private:
+    void record(const std::string &call) {
+        calls.push_back(call);
+        if (states.empty() || states.back() != _machine->state()) {
+            states.push_back(_machine->state());
+        }
+    }
+
+    double serverTime(double seconds) {
+        return _scenario.jitter > 0 ? seconds * _jitter(_rng) : seconds;
+    }
+
+    // Capture delivers a buffer every 64 ms, as the recording service does
+    void deliver(size_t offset, int generation) {
+        if (generation != _captureGeneration || offset >= _source.size()) {
+            return;
+        }
+        size_t count = std::min<size_t>(CAPTURE_BUFFER_SAMPLES, _source.size() - offset);
+        _sim.after((double)count / SAMPLE_RATE, [this, offset, count, generation]() {
+            if (generation != _captureGeneration) {
+                return;
+            }
+            _machine->audioReceived(_source.data() + offset, count);
+            deliver(offset + count, generation);
+        });
+    }
+
+    void respond(const RecognitionResponse &response) {
+        _sim.after(serverTime(_scenario.sttDelay) + _scenario.rtt / 2,
+                   [this, response]() { _machine->recognitionResponse(response); });
+    }
+
+    void serverReceived(size_t samples) {
+        if (_serverDone) {
+            return;
+        }
+        _serverSamples += samples;
+        double ms = _serverSamples * 1000.0 / SAMPLE_RATE;
+        if (_scenario.recognitionErrorMs >= 0 && ms >= _scenario.recognitionErrorMs) {
+            _serverDone = true;
+            _sim.after(_scenario.rtt / 2, [this]() { _machine->recognitionFailed("Stream removed"); });
+            return;
+        }
+        for (; _scriptIndex < sizeof(klukkanScript) / sizeof(klukkanScript[0]); _scriptIndex++) {
+            const ScriptedResponse &r = klukkanScript[_scriptIndex];
+            if (ms < r.audioMs) {
+                break;
+            }
+            RecognitionResponse response;
+            if (r.transcript) {
+                RecognitionResult result;
+                result.alternatives.push_back(r.transcript);
+                if (r.alternative) {
+                    result.alternatives.push_back(r.alternative);
+                }
+                result.stability = r.stability;
+                response.results.push_back(result);
+            } else {
+                response.endOfUtterance = true;
+                finalize();
+            }
+            respond(response);
+        }
+    }
+
+    void serverEndOfAudio() { finalize(); }
+
+    // The final transcript follows the end of utterance or of the audio, whichever comes first
+    void finalize() {
+        if (_serverDone) {
+            return;
+        }
+        _serverDone = true;
+        double delay = serverTime(_scenario.finalDelay) + _scenario.rtt / 2;
+        if (_scenario.recognitionTimesOut) {
+            _sim.after(delay, [this]() { _machine->recognitionEnded(); });
+            return;
+        }
+        RecognitionResponse response;
+        RecognitionResult result;
+        result.alternatives = _scenario.finalAlternatives;
+        result.isFinal = true;
+        response.results.push_back(result);
+        _sim.after(delay, [this, response]() { _machine->recognitionResponse(response); });
+    }
+
+    QueryAnswer answerTo(const std::vector<std::string> &alternatives) {
+        QueryAnswer answer;
+        answer.question = alternatives.empty() ? "" : alternatives[0];
+        answer.answer = "Klukkan er tólf.";
+        if (_scenario.answer == AnswerKind::Audio) {
+            answer.audioURL = "https://example.com/audio/answer.mp3";
+        } else if (_scenario.answer == AnswerKind::OpenURL) {
+            answer.openURL = "https://example.com/";
+        }
+        return answer;
+    }
+
+    void firstAudio() {
+        if (firstAudioTime < 0) {
+            firstAudioTime = _sim.now();
+        }
+    }
+
+    const Scenario _scenario;
+    const std::vector<int16_t> &_source;
+    Simulation _sim;
+    std::unique_ptr<SessionMachine> _machine;
+    std::mt19937 _rng;
+    std::lognormal_distribution<double> _jitter;
+
+    int _captureGeneration = 0;
+    int _playGeneration = 0;
+    double _linkFree = 0.0;
+    std::vector<bool> _cancelled;
+    size_t _serverSamples = 0;
+    size_t _scriptIndex = 0;
+    bool _serverDone = false;
+};
+
+// Checks
+
+static std::string Join(const std::vector<std::string> &strings) {
+    std::string s;
+    for (const std::string &string : strings) {
+        s += (s.empty() ? "" : ", ") + string;
+    }
+    return s;
+}
+
+static std::string StateNames(const std::vector<SessionState> &states) {
+    std::vector<std::string> names;
+    for (SessionState state : states) {
+        names.push_back(sessionStateName(state));
+    }
+    return Join(names);
+}
+
+static void Expect(const char *scenario, const char *what, const std::string &got, const std::string &expected) {
+    if (got != expected) {
+        Fail(std::string(scenario) + ": " + what + " were [" + got + "], expected [" + expected + "]");
+    }
+}
+
+static void ExpectQueries(const char *scenario, const World &world, const std::vector<std::string> &expected) {
+    std::vector<std::string> queries;
+    for (const auto &alternatives : world.queries) {
+        queries.push_back(Join(alternatives));
+    }
+    // Shown as one query per line
+    std::string got, want;
+    for (const std::string &q : queries) {
+        got += q + "; ";
+    }
+    for (const std::string &q : expected) {
+        want += q + "; ";
+    }
+    Expect(scenario, "queries", got, want);
+}
+
+// Every session ends exactly once, with every chunk slot returned and every
+// query flagged for what it was
+static void ExpectCleanEnd(const char *scenario, const World &world) {
+    if (world.misflaggedQueries != 0) {
+        Fail(std::string(scenario) + ": " + std::to_string(world.misflaggedQueries) +
+             " queries flagged speculative or not, whichever they weren't");
+    }
+    if (world.terminations != 1) {
+        Fail(std::string(scenario) + ": terminated " + std::to_string(world.terminations) + " times");
+    }
+    if (world.releases != world.chunksHoldingSlots) {
+        Fail(std::string(scenario) + ": " + std::to_string(world.chunksHoldingSlots - world.releases) +
+             " chunk slots never released");
+    }
+}
+
+static void CheckAudioSent(const char *scenario, World &world, const std::vector<int16_t> &source, bool flac) {
+    SessionStats stats = world.machine().stats();
+    if (stats.bytes != world.received.size()) {
+        Fail(std::string(scenario) + ": stats count " + std::to_string(stats.bytes) + " bytes sent, " +
+             std::to_string(world.received.size()) + " received");
+    }
+    if (stats.samples % (SAMPLE_RATE / 10) != 0 || stats.chunks != stats.samples / (SAMPLE_RATE / 10)) {
+        Fail(std::string(scenario) + ": audio wasn't sent in whole 100 ms chunks");
+    }
+    if (flac) {
+        if (world.received.size() < 4 || memcmp(world.received.data(), "fLaC", 4) != 0 ||
+            world.received.size() >= stats.samples * sizeof(int16_t)) {
+            Fail(std::string(scenario) + ": FLAC stream missing its marker or not compressed");
+        }
+    } else if (world.received.size() != stats.samples * sizeof(int16_t) ||
+               memcmp(world.received.data(), source.data(), world.received.size()) != 0) {
+        Fail(std::string(scenario) + ": audio received differs from what was captured");
+    }
+}
+
+static void RunChecks(const std::vector<int16_t> &source) {
+    const std::string final = "hvað er klukkan, hvað er klukka";
+    const std::string normal = "start, stop, transcripts, answer:Klukkan er tólf., terminate";
+
+    {
+        Scenario s;
+        World w(s, source, 1);
+        w.run();
+        Expect("Plain", "states", StateNames(w.states), "recording, recognizing, querying, playing, terminated");
+        Expect("Plain", "calls", Join(w.calls), normal);
+        ExpectQueries("Plain", w, { final });
+        ExpectCleanEnd("Plain", w);
+        CheckAudioSent("Plain", w, source, false);
+        if (w.firstAudioTime < w.finalTime || w.finalTime < w.captureStart) {
+            Fail("Plain: first audio came before the final transcript");
+        }
+    }
+    {
+        Scenario s;
+        s.speculative = true;
+        World w(s, source, 1);
+        w.run();
+        Expect("Speculative hit", "calls", Join(w.calls),
+               "start, stop, transcripts, speculation hit, answer:Klukkan er tólf., terminate");
+        ExpectQueries("Speculative hit", w, { final });
+        Expect("Speculative hit", "trace marks", Join(w.marks), "Speculation hit");
+        ExpectCleanEnd("Speculative hit", w);
+    }
+    {
+        // Case and surrounding space don't matter, Icelandic letters included
+        Scenario s;
+        s.speculative = true;
+        s.finalAlternatives = { " HVAÐ ER KLUKKAN", "HVAÐ ER KLUKKA " };
+        World w(s, source, 1);
+        w.run();
+        ExpectQueries("Speculative hit, different case", w, { final });
+    }
+    {
+        Scenario s;
+        s.speculative = true;
+        s.finalAlternatives = { "hvað er klukkan orðin" };
+        World w(s, source, 1);
+        w.run();
+        Expect("Speculative miss", "calls", Join(w.calls),
+               "start, stop, transcripts, speculation miss, answer:Klukkan er tólf., terminate");
+        ExpectQueries("Speculative miss", w, { final, "hvað er klukkan orðin" });
+        Expect("Speculative miss", "trace marks", Join(w.marks), "Speculation miss");
+        ExpectCleanEnd("Speculative miss", w);
+    }
+    {
+        // Same top alternative, but the server could pick another one
+        Scenario s;
+        s.speculative = true;
+        s.finalAlternatives = { "hvað er klukkan", "hvað er klukkan orðin" };
+        World w(s, source, 1);
+        w.run();
+        Expect("Speculative miss, other alternatives", "calls", Join(w.calls),
+               "start, stop, transcripts, speculation miss, answer:Klukkan er tólf., terminate");
+        ExpectQueries("Speculative miss, other alternatives", w, { final, "hvað er klukkan, hvað er klukkan orðin" });
+        ExpectCleanEnd("Speculative miss, other alternatives", w);
+    }
+    {
+        Scenario s;
+        s.speculative = true;
+        s.failSpeculativeQueries = true;
+        World w(s, source, 1);
+        w.run();
+        Expect("Speculative failure", "calls", Join(w.calls),
+               "start, stop, transcripts, speculation miss, answer:Klukkan er tólf., terminate");
+        ExpectQueries("Speculative failure", w, { final, final });
+        ExpectCleanEnd("Speculative failure", w);
+    }
+    {
+        Scenario s;
+        s.recognitionTimesOut = true;
+        World w(s, source, 1);
+        w.run();
+        Expect("Recognition timeout", "calls", Join(w.calls), "start, stop, no transcripts, terminate");
+        Expect("Recognition timeout", "states", StateNames(w.states), "recording, recognizing, terminated");
+        ExpectQueries("Recognition timeout", w, {});
+        ExpectCleanEnd("Recognition timeout", w);
+    }
+    {
+        Scenario s;
+        s.recognitionErrorMs = 600;
+        World w(s, source, 1);
+        w.run();
+        Expect("Recognition error", "calls", Join(w.calls), "start, stop, fail, terminate");
+        ExpectQueries("Recognition error", w, {});
+        ExpectCleanEnd("Recognition error", w);
+    }
+    {
+        Scenario s;
+        s.terminateOnTranscripts = true;
+        World w(s, source, 1);
+        w.run();
+        Expect("Local command", "calls", Join(w.calls), "start, stop, transcripts, terminate");
+        ExpectQueries("Local command", w, {});
+        ExpectCleanEnd("Local command", w);
+    }
+    {
+        Scenario s;
+        s.answer = AnswerKind::OpenURL;
+        World w(s, source, 1);
+        w.run();
+        Expect("URL answer", "calls", Join(w.calls), "start, stop, transcripts, answer:Klukkan er tólf.");
+        if (w.machine().state() != SessionState::Answered || w.firstAudioTime >= 0) {
+            Fail("URL answer: expected to end up answered, without playback");
+        }
+        w.machine().terminate();
+        ExpectCleanEnd("URL answer", w);
+    }
+    {
+        Scenario s;
+        s.answer = AnswerKind::NoAudio;
+        World w(s, source, 1);
+        w.run();
+        Expect("No audio", "calls", Join(w.calls), "start, stop, transcripts, answer:Ég veit það ekki., terminate");
+    }
+    {
+        // Terminated while the query is in flight, whose answer is then ignored
+        Scenario s;
+        s.queryTime = 1.0;
+        s.speculative = true;
+        s.finalAlternatives = { "hvað er klukkan orðin" };
+        World probe(s, source, 1);
+        probe.run();
+        s.terminateAt = probe.finalTime + 0.5;
+        World late(s, source, 1);
+        late.run();
+        Expect("Terminated mid-query", "calls", Join(late.calls),
+               "start, stop, transcripts, speculation miss, terminate");
+        if (late.cancelledQueries != 2) {
+            Fail("Terminated mid-query: expected both queries cancelled, " +
+                 std::to_string(late.cancelledQueries) + " were");
+        }
+        ExpectCleanEnd("Terminated mid-query", late);
+    }
+    {
+        // Slow uplink, so every slot is in flight and chunks get copied
+        Scenario s;
+        s.uplinkKbps = 100;
+        World w(s, source, 1);
+        w.run();
+        SessionStats stats = w.machine().stats();
+        if (stats.transientChunks == 0) {
+            Fail("Slow uplink: no chunks were copied, the slots can't have run out");
+        }
+        Expect("Slow uplink", "calls", Join(w.calls), normal);
+        ExpectCleanEnd("Slow uplink", w);
+        CheckAudioSent("Slow uplink", w, source, false);
+    }
+    {
+        Scenario s;
+        s.flac = true;
+        World w(s, source, 1);
+        w.run();
+        Expect("FLAC", "calls", Join(w.calls), normal);
+        ExpectCleanEnd("FLAC", w);
+        CheckAudioSent("FLAC", w, source, true);
+        if (w.chunksHoldingSlots) {
+            Fail("FLAC: encoded chunks shouldn't hold slots");
+        }
+    }
+}
+
+// Benchmark
+
+static double Percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(p / 100.0 * values.size());
+    return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+static std::vector<double> ParseList(const char *s) {
+    std::vector<double> values;
+    while (*s) {
+        char *end;
+        values.push_back(strtod(s, &end));
+        s = *end ? end + 1 : end;
+    }
+    return values;
+}
+
+// CPU time of the session logic per second of audio, in microseconds
+static double CPUPerSecond(const std::vector<int16_t> &source, bool flac) {
+    Scenario s;
+    s.flac = flac;
+    s.speculative = true;
+    double audioSeconds = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < CPU_SESSIONS; i++) {
+        World w(s, source, i);
+        w.run();
+        audioSeconds += w.machine().speechSeconds();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return elapsed * 1e6 / audioSeconds;
+}
+
+int main(int argc, char *argv[]) {
+    int sessions = DEFAULT_SESSIONS;
+    const char *rtts = DEFAULT_RTTS;
+    uint32_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--sessions") && i + 1 < argc) {
+            sessions = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--rtt-ms") && i + 1 < argc) {
+            rtts = argv[++i];
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = (uint32_t)atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--sessions N] [--rtt-ms 0,60,200] [--seed N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<int16_t> source = SourceAudio(seed);
+    RunChecks(source);
+
+    printf("{\n");
+    printf("  \"sessions\": %d,\n", sessions);
+    printf("  \"latency\": [\n");
+    std::vector<double> rttList = ParseList(rtts);
+    for (size_t r = 0; r < rttList.size(); r++) {
+        for (int speculative = 0; speculative < 2; speculative++) {
+            Scenario s;
+            s.rtt = rttList[r] / 1000.0;
+            s.jitter = 0.25;
+            s.speculative = speculative;
+            std::vector<double> total, afterFinal;
+            for (int i = 0; i < sessions; i++) {
+                World w(s, source, seed + i);
+                w.run();
+                if (w.firstAudioTime < 0) {
+                    Fail("Benchmark session never played audio");
+                    continue;
+                }
+                total.push_back((w.firstAudioTime - w.captureStart) * 1000);
+                afterFinal.push_back((w.firstAudioTime - w.finalTime) * 1000);
+            }
+            printf("    { \"rtt_ms\": %.0f, \"speculative\": %s, "
+                   "\"capture_to_first_audio_ms\": { \"p50\": %.1f, \"p95\": %.1f }, "
+                   "\"final_to_first_audio_ms\": { \"p50\": %.1f, \"p95\": %.1f } }%s\n",
+                   rttList[r], speculative ? "true" : "false", Percentile(total, 50), Percentile(total, 95),
+                   Percentile(afterFinal, 50), Percentile(afterFinal, 95),
+                   r + 1 < rttList.size() || !speculative ? "," : "");
+        }
+    }
+    printf("  ],\n");
+    printf("  \"cpu_us_per_audio_second\": { \"pcm\": %.1f, \"flac\": %.1f },\n", CPUPerSecond(source, false),
+           CPUPerSecond(source, true));
+    printf("  \"failures\": %d\n", failures);
+    printf("}\n");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,18 @@
+# Build script for the query session state machine harness. Run from the
+# repository root:
+#
+#   $ bash Tools/SessionBench/build.sh
+#
+# The binary is written to build/, which git ignores, unless OUTDIR is set.
+
+CXX=${CXX:-c++}
+OUTDIR=${OUTDIR:-build}
+mkdir -p "$OUTDIR" || exit 1
+
+$CXX -std=c++17 -O2 -Wall -I Tools -I Embla/Session -I Embla/DSP \
+    Tools/SessionBench/SessionBench.cpp \
+    Embla/Session/SessionMachine.cpp \
+    Embla/DSP/ChunkAssembler.cpp \
+    Embla/DSP/FlacEncoder.cpp \
+    Embla/DSP/LevelMeter.cpp \
+    -o "$OUTDIR/sessionbench" || exit 1
@@ -0,0 +1,107 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Splits 16-bit mono PCM into the chunks QuerySession sends to the
+    speech recognition server, using the same ChunkAssembler and, with
+    --flac, FlacEncoder. Used by the pipeline benchmark, see chunker.py.
+
+    PCM is read from stdin and pushed in slices of --slice samples, as
+    the recording service delivers it. Each chunk is written to stdout
+    as a 4-byte little-endian length, an 8-byte little-endian sample
+    position and the chunk itself. The position is the end of the slice
+    that completed the chunk, i.e. how much audio the app has captured
+    by the time it sends the chunk.
+
+    $ ./chunker [--flac] [--rate N] [--chunk-ms N] [--slice N] < audio.pcm > chunks
+*/
+
+#include "ChunkAssembler.h"
+#include "FlacEncoder.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// As in QuerySession.mm
+#define DEFAULT_CHUNK_MS        100
+#define CHUNK_SLOTS             16
+
+static void WriteChunk(const uint8_t *data, size_t size, uint64_t position) {
+    uint8_t header[12];
+    for (int i = 0; i < 4; i++) {
+        header[i] = (uint8_t)(size >> (8 * i));
+    }
+    for (int i = 0; i < 8; i++) {
+        header[4 + i] = (uint8_t)(position >> (8 * i));
+    }
+    fwrite(header, 1, sizeof(header), stdout);
+    fwrite(data, 1, size, stdout);
+}
+
+int main(int argc, char *argv[]) {
+    bool flac = false;
+    int rate = 16000;
+    int chunkMs = DEFAULT_CHUNK_MS;
+    size_t slice = 1024;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--flac") {
+            flac = true;
+        } else if (a == "--rate" && i + 1 < argc) {
+            rate = atoi(argv[++i]);
+        } else if (a == "--chunk-ms" && i + 1 < argc) {
+            chunkMs = atoi(argv[++i]);
+        } else if (a == "--slice" && i + 1 < argc) {
+            slice = (size_t)std::max(1, atoi(argv[++i]));
+        } else {
+            fprintf(stderr, "usage: %s [--flac] [--rate N] [--chunk-ms N] [--slice N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    size_t chunkSamples = (size_t)rate * chunkMs / 1000;
+    std::unique_ptr<embla::FlacEncoder> encoder;
+    if (flac) {
+        encoder.reset(new embla::FlacEncoder(rate, chunkSamples));
+    }
+    uint64_t position = 0;
+    embla::ChunkAssembler *assembler = nullptr;
+    auto handler = [&](const int16_t *samples, size_t count, int slot) {
+        if (encoder) {
+            const std::vector<uint8_t> &frame = encoder->encode(samples, count);
+            WriteChunk(frame.data(), frame.size(), position);
+        } else {
+            WriteChunk((const uint8_t *)samples, count * sizeof(int16_t), position);
+        }
+        assembler->release(slot);
+    };
+    embla::ChunkAssembler chunks(chunkSamples, CHUNK_SLOTS, handler);
+    assembler = &chunks;
+
+    std::vector<int16_t> buffer(slice);
+    size_t n;
+    while ((n = fread(buffer.data(), sizeof(int16_t), slice, stdin)) > 0) {
+        position += n;
+        chunks.push(buffer.data(), n);
+    }
+    chunks.flush();
+    return ferror(stdout) ? 1 : 0;
+}
@@ -0,0 +1,72 @@
+# This file is part of the Embla iOS app
+# Copyright (c) 2019-2023 Miðeind ehf.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+"""
+Splits audio into the chunks the app sends to the speech recognition
+server, with the app's own ChunkAssembler and FlacEncoder. The chunker.cpp
+helper is compiled on first import, with the C++ compiler in $CXX or c++.
+"""
+
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+import wave
+
+REPO_ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), "..", ".."))
+SOURCES = [
+    "Tools/StandIn/chunker.cpp",
+    "Embla/DSP/ChunkAssembler.cpp",
+    "Embla/DSP/FlacEncoder.cpp",
+]
+
+_binary = os.path.join(tempfile.gettempdir(), "embla-chunker", "chunker")
+
+
+def _compile():
+    sources = [os.path.join(REPO_ROOT, s) for s in SOURCES]
+    headers = [os.path.join(REPO_ROOT, "Embla/DSP", h) for h in ("ChunkAssembler.h", "FlacEncoder.h")]
+    if os.path.exists(_binary) and all(os.path.getmtime(_binary) >= os.path.getmtime(f) for f in sources + headers):
+        return
+    os.makedirs(os.path.dirname(_binary), exist_ok=True)
+    args = [os.environ.get("CXX", "c++"), "-std=c++17", "-O2", "-I", os.path.join(REPO_ROOT, "Embla/DSP")]
+    if subprocess.call(args + sources + ["-o", _binary]) != 0:
+        sys.exit("Failed to compile the chunker")
+
+
+_compile()
+
+
+def read_pcm(path):
+    """16-bit mono PCM samples of a WAV file, and its sample rate."""
+    with wave.open(path, "rb") as w:
+        if w.getsampwidth() != 2 or w.getnchannels() != 1:
+            sys.exit("%s is not 16-bit mono" % path)
+        return w.readframes(w.getnframes()), w.getframerate()
+
+
+def chunk(pcm, rate, flac=True, chunk_ms=100, slice_samples=1024):
+    """The chunks sent for the audio, as (data, sample position when sent) tuples."""
+    args = [_binary, "--rate", str(rate), "--chunk-ms", str(chunk_ms), "--slice", str(slice_samples)]
+    if flac:
+        args.append("--flac")
+    out = subprocess.run(args, input=pcm, stdout=subprocess.PIPE, check=True).stdout
+    chunks = []
+    pos = 0
+    while pos + 12 <= len(out):
+        size, position = struct.unpack_from("<IQ", out, pos)
+        chunks.append((out[pos + 12 : pos + 12 + size], position))
+        pos += 12 + size
+    return chunks
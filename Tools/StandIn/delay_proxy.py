@@ -0,0 +1,99 @@
+# This file is part of the Embla iOS app
+# Copyright (c) 2019-2023 Miðeind ehf.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+
+"""
+TCP proxy that delays traffic to simulate network round trip time,
+so that connection setup and request latency against the local
+stand-in servers cost what they would over a mobile network.
+
+Packet loss can be simulated too. TCP hides loss from the application
+as a stall, so a lost read is delivered a retransmission timeout late,
+holding up everything behind it. The losses are drawn from a seeded
+generator, so runs can be repeated.
+"""
+
+import asyncio
+import random
+import threading
+import time
+
+# Minimum TCP retransmission timeout, on Linux and iOS alike
+MIN_RTO_S = 0.2
+
+
+class DelayProxy:
+    """TCP proxy delaying data by half the round trip time in each direction,
+    and by a retransmission timeout for the given fraction of reads."""
+
+    def __init__(self, target_host, target_port, rtt_ms, loss=0.0, seed=None):
+        self.target = (target_host, target_port)
+        self.delay = rtt_ms / 2000.0
+        self.loss = loss
+        self.rto = max(MIN_RTO_S, 2 * rtt_ms / 1000.0)
+        self.random = random.Random(seed)
+        self.retransmits = 0
+        self.port = None
+        ready = threading.Event()
+        threading.Thread(target=self._run, args=(ready,), daemon=True).start()
+        ready.wait()
+
+    def _run(self, ready):
+        loop = asyncio.new_event_loop()
+        server = loop.run_until_complete(asyncio.start_server(self._connection, "127.0.0.1", 0))
+        self.port = server.sockets[0].getsockname()[1]
+        ready.set()
+        loop.run_forever()
+
+    async def _pump(self, reader, writer):
+        # Chunks are released in order, each no earlier than delay after it arrived
+        pending = asyncio.Queue()
+
+        async def release():
+            while True:
+                due, data = await pending.get()
+                if data is None:
+                    break
+                await asyncio.sleep(max(0.0, due - time.monotonic()))
+                writer.write(data)
+                await writer.drain()
+            writer.close()
+
+        releaser = asyncio.ensure_future(release())
+        try:
+            while True:
+                data = await reader.read(65536)
+                if not data:
+                    break
+                due = time.monotonic() + self.delay
+                if self.loss and self.random.random() < self.loss:
+                    due += self.rto
+                    self.retransmits += 1
+                pending.put_nowait((due, data))
+        except ConnectionError:
+            pass
+        pending.put_nowait((0, None))
+        await releaser
+
+    async def _connection(self, client_reader, client_writer):
+        # Connection setup costs a round trip
+        await asyncio.sleep(2 * self.delay)
+        try:
+            server_reader, server_writer = await asyncio.open_connection(*self.target)
+        except OSError:
+            client_writer.close()
+            return
+        await asyncio.gather(self._pump(client_reader, server_writer), self._pump(server_reader, client_writer),
+                             return_exceptions=True)
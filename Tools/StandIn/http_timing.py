@@ -0,0 +1,105 @@
+# This file is part of the Embla iOS app
+# Copyright (c) 2019-2023 Miðeind ehf.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+
+"""
+Measures query server request timings with and without connection
+reuse, normally against query_standin.py:
+
+    new     new connection for every request, as QueryService used to
+            do by creating a session per request
+    reuse   one keep-alive connection for all requests, as with the
+            shared session manager
+
+Reports connect time, time to first byte and total time per request.
+--rtt-ms routes traffic through a local proxy that delays it by the
+given round trip time. The proxy accepts connections locally and only
+then connects upstream, so with it the cost of a new connection shows
+up in the time to first byte. TLS is not simulated, so against a real
+HTTPS server the difference is larger still.
+
+    $ python3 Tools/StandIn/query_standin.py --quiet &
+    $ python3 Tools/StandIn/http_timing.py --rtt-ms 60
+"""
+
+import argparse
+import http.client
+import json
+import statistics
+import time
+from urllib.parse import urlencode, urlparse
+
+from delay_proxy import DelayProxy
+
+QUERY_API_PATH = "/query.api/v1"
+
+
+def timed_request(conn, path):
+    t0 = time.monotonic()
+    if conn.sock is None:
+        conn.connect()
+    t1 = time.monotonic()
+    conn.request("GET", path)
+    response = conn.getresponse()
+    t2 = time.monotonic()
+    response.read()
+    t3 = time.monotonic()
+    return {"connect_ms": (t1 - t0) * 1000, "ttfb_ms": (t2 - t1) * 1000, "total_ms": (t3 - t0) * 1000}
+
+
+def summarize(samples):
+    result = {}
+    for key in ["connect_ms", "ttfb_ms", "total_ms"]:
+        values = [s[key] for s in samples]
+        result[key] = {"median": round(statistics.median(values), 1), "max": round(max(values), 1)}
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--server", default="http://localhost:8000")
+    parser.add_argument("--requests", type=int, default=20)
+    parser.add_argument("--rtt-ms", type=float, default=0.0, help="simulated network round trip time")
+    args = parser.parse_args()
+
+    url = urlparse(args.server)
+    host, port = url.hostname, url.port or 80
+    if args.rtt_ms > 0:
+        proxy = DelayProxy(host, port, args.rtt_ms)
+        host, port = "127.0.0.1", proxy.port
+    path = QUERY_API_PATH + "?" + urlencode({"q": "hvað er klukkan", "voice": 1})
+
+    results = {}
+    samples = []
+    for _ in range(args.requests):
+        conn = http.client.HTTPConnection(host, port, timeout=10)
+        samples.append(timed_request(conn, path))
+        conn.close()
+    results["new"] = summarize(samples)
+
+    samples = []
+    conn = http.client.HTTPConnection(host, port, timeout=10)
+    for _ in range(args.requests):
+        samples.append(timed_request(conn, path))
+    conn.close()
+    # The first request pays for the connection either way
+    results["reuse"] = summarize(samples[1:] if len(samples) > 1 else samples)
+
+    print(json.dumps({"server": args.server, "rtt_ms": args.rtt_ms, "requests": args.requests, "modes": results},
+                     indent=2))
+
+
+if __name__ == "__main__":
+    main()
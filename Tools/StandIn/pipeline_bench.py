@@ -0,0 +1,394 @@
+# This file is part of the Embla iOS app
+# Copyright (c) 2019-2023 Miðeind ehf.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+"""
+End-to-end benchmark of the query session pipeline against the local
+stand-ins in this directory, so that regressions in it can be caught
+without a device or the real services.
+
+Each session is run by the app's own SessionMachine (session_driver.py),
+which is fed a recording as it would be captured, or faster with
+--speedup. Its audio chunks go to speech_standin.py, which replays the
+canned responses in --script, its queries (speculative ones too, with
+--speculative) go to query_standin.py, and the answer's speech audio is
+downloaded, as it's streamed to the audio queue. The session ends once
+the download does.
+
+Traffic goes through a DelayProxy for each combination of --rtt-ms and
+--loss given, with losses drawn from --seed, and --sessions sessions
+are run with each. Reported for each are the median, p95 and max of:
+
+    first_result_ms   first audio sent to first interim result
+    final_ms          end of utterance (or last audio sent) to final transcript
+    query_ms          final transcript to answer, near 0 if a speculative query was used
+    first_audio_ms    final transcript to first speech audio received
+    total_ms          start of capture to first speech audio received
+
+along with the upload rate and the share of speculative queries used.
+
+    $ python3 Tools/StandIn/pipeline_bench.py --rtt-ms 0,60,200 --loss 0,0.02
+"""
+
+import argparse
+import http.client
+import json
+import os
+import queue
+import statistics
+import sys
+import tempfile
+import threading
+import time
+from urllib.parse import urlencode, urlparse
+
+import grpc
+
+import chunker
+import query_standin
+import session_driver
+import speech_standin
+from delay_proxy import DelayProxy
+from speech_proto import speech_pb2, speech_pb2_grpc
+
+R = speech_pb2.StreamingRecognizeResponse
+HERE = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_WAV = os.path.join(HERE, "..", "..", "Embla", "Audio", "Dora", "conn-dora.wav")
+DEFAULT_SCRIPT = os.path.join(HERE, "klukkan.json")
+
+# Samples delivered at a time, as by the recording service
+CAPTURE_SLICE = 1024
+# MPEG-1 Layer III, 128 kbps, 44.1 kHz, no padding
+MP3_FRAME_HEADER = b"\xff\xfb\x90\x64"
+MP3_FRAME_BYTES = 417
+MP3_FRAME_SECONDS = 1152 / 44100.0
+
+
+def write_silent_mp3(path, seconds):
+    """An MP3 file of the given length, for the stand-in to serve as speech audio."""
+    frames = int(seconds / MP3_FRAME_SECONDS) + 1
+    with open(path, "wb") as f:
+        f.write((MP3_FRAME_HEADER + bytes(MP3_FRAME_BYTES - 4)) * frames)
+
+
+def config_request(rate, flac):
+    encoding = speech_pb2.RecognitionConfig.FLAC if flac else speech_pb2.RecognitionConfig.LINEAR16
+    config = speech_pb2.RecognitionConfig(encoding=encoding, sample_rate_hertz=rate, language_code="is-IS",
+                                          max_alternatives=10)
+    streaming = speech_pb2.StreamingRecognitionConfig(config=config, single_utterance=True, interim_results=True)
+    return speech_pb2.StreamingRecognizeRequest(streaming_config=streaming)
+
+
+class HTTPClient:
+    """Keep-alive connection to the query server, reconnecting as needed, as the shared sessions do."""
+
+    def __init__(self, host, port):
+        self.host, self.port = host, port
+        self.conn = None
+        self.lock = threading.Lock()
+
+    def get(self, path, on_data=None):
+        with self.lock:
+            return self._get(path, on_data)
+
+    def _get(self, path, on_data):
+        for attempt in range(2):
+            if self.conn is None:
+                self.conn = http.client.HTTPConnection(self.host, self.port, timeout=30)
+            try:
+                self.conn.request("GET", path)
+                response = self.conn.getresponse()
+                body = b""
+                while on_data and response.length:
+                    data = response.read1(65536)
+                    if not data:
+                        break
+                    body += data
+                    on_data(data)
+                # Reading to the end marks the response done, so the connection can be reused
+                body += response.read()
+                return response.status, body
+            except (http.client.HTTPException, OSError):
+                self.conn.close()
+                self.conn = None
+                if attempt:
+                    raise
+
+
+class Session:
+    """One query session, run by the app's SessionMachine, from the start of capture to the first speech audio
+    received. The machine's calls are handled as they come, with the network on threads of its own."""
+
+    def __init__(self, stub, pcm_path, rate, args, query_client, speculative_client):
+        self.stub = stub
+        self.rate = rate
+        self.samples = os.path.getsize(pcm_path) // 2
+        self.args = args
+        self.query_client = query_client
+        self.speculative_client = speculative_client
+        self.driver = session_driver.SessionDriver(pcm_path, rate, flac=not args.linear16,
+                                                   speculative=args.speculative)
+        self.config = None
+        self.capturing = threading.Event()
+        self.audio = queue.Queue()
+        self.cancelled = set()
+        self.t = {}
+        self.bytes_sent = 0
+        self.used_speculation = False
+
+    def _mark(self, name):
+        self.t.setdefault(name, time.monotonic())
+
+    def _thread(self, target, *args):
+        threading.Thread(target=target, args=args, daemon=True).start()
+
+    # Capture
+
+    def _capture(self):
+        start = time.monotonic()
+        for position in range(0, self.samples, CAPTURE_SLICE):
+            due = start + (position + CAPTURE_SLICE) / self.rate / self.args.speedup
+            time.sleep(max(0.0, due - time.monotonic()))
+            if not self.capturing.is_set():
+                break
+            self.driver.send("audio", CAPTURE_SLICE)
+
+    def on_capture(self, position):
+        self._mark("start")
+        self.capturing.set()
+        self._thread(self._capture)
+
+    def on_stop_capture(self):
+        self.capturing.clear()
+
+    # Speech recognition
+
+    def _requests(self):
+        yield self.config
+        while True:
+            data = self.audio.get()
+            if data is None:
+                # Half-close once recording stops, as stopStreaming does
+                return
+            yield speech_pb2.StreamingRecognizeRequest(audio_content=data)
+
+    def _recognize(self):
+        try:
+            for response in self.stub.StreamingRecognize(self._requests(), timeout=self.args.timeout):
+                if response.speech_event_type == R.END_OF_SINGLE_UTTERANCE:
+                    self._mark("end_of_utterance")
+                results = [(r.is_final, r.stability, [a.transcript for a in r.alternatives])
+                           for r in response.results]
+                self.driver.send_response(response.speech_event_type == R.END_OF_SINGLE_UTTERANCE, results)
+            self.driver.send("recognition_ended")
+        except grpc.RpcError as e:
+            self.driver.send("recognition_failed", e.details())
+
+    def on_chunk(self, data):
+        if "first_audio_sent" not in self.t:
+            self._mark("first_audio_sent")
+            self._thread(self._recognize)
+        self.t["last_audio_sent"] = time.monotonic()
+        data = bytes.fromhex(data)
+        self.bytes_sent += len(data)
+        self.audio.put(data)
+
+    def on_finish_audio(self):
+        self.audio.put(None)
+
+    # Query
+
+    def _query(self, request_id, speculative, alternatives):
+        params = {"q": "|".join(alternatives), "voice": 1}
+        if speculative:
+            params["private"] = 1
+        client = self.speculative_client if speculative else self.query_client
+        try:
+            status, body = client.get(query_standin.QUERY_API_PATH + "?" + urlencode(params))
+            answer = json.loads(body) if status == 200 else None
+        except (OSError, http.client.HTTPException, ValueError) as e:
+            status, answer = str(e), None
+        if request_id in self.cancelled:
+            return
+        if answer is None:
+            self.driver.send("query_failed", request_id, "Query failed: %s" % status)
+        else:
+            self.driver.send("answered", request_id, answer.get("answer", ""), answer.get("audio", ""),
+                             answer.get("open_url", ""))
+
+    def on_query(self, request_id, speculative, *alternatives):
+        self._thread(self._query, request_id, speculative == "1", alternatives)
+
+    def on_cancel(self, request_id):
+        self.cancelled.add(request_id)
+
+    def on_transcripts(self, *alternatives):
+        self._mark("final")
+
+    def on_answer(self, answer):
+        self._mark("answer")
+
+    def on_speculation(self, hit, ms_saved):
+        self.used_speculation = hit == "1"
+
+    def on_mark(self, name):
+        if name == "First interim result":
+            self._mark("first_result")
+
+    def on_fail(self, message):
+        print("Session failed: %s" % message, file=sys.stderr)
+
+    # Playback
+
+    def _play(self, url):
+        # The speech audio starts playing as soon as it starts arriving
+        try:
+            self.query_client.get(urlparse(url).path, on_data=lambda data: self._mark("first_speech_audio"))
+            self.driver.send("playback_finished")
+        except (OSError, http.client.HTTPException) as e:
+            self.driver.send("playback_failed", str(e))
+
+    def on_play(self, url):
+        self._thread(self._play, url)
+
+    def on_dunno(self):
+        self.driver.send("playback_finished")
+
+    def run(self, config):
+        self.config = config
+        self.driver.send("start")
+        for call in self.driver.calls():
+            handler = getattr(self, "on_" + call[0], None)
+            if handler:
+                handler(*call[1:])
+            if call[0] == "terminated":
+                break
+        self.capturing.clear()
+        self.audio.put(None)
+        self.driver.close()
+        return "first_speech_audio" in self.t
+
+    def metrics(self):
+        t = self.t
+        end_of_speech = t.get("end_of_utterance", t.get("last_audio_sent"))
+        return {
+            "first_result_ms": (t["first_result"] - t["first_audio_sent"]) * 1000 if "first_result" in t else None,
+            "final_ms": (t["final"] - end_of_speech) * 1000,
+            "query_ms": (t["answer"] - t["final"]) * 1000,
+            "first_audio_ms": (t["first_speech_audio"] - t["final"]) * 1000,
+            "total_ms": (t["first_speech_audio"] - t["start"]) * 1000,
+        }
+
+
+def summarize(values):
+    values = sorted(v for v in values if v is not None)
+    if not values:
+        return None
+    return {
+        "median": round(statistics.median(values), 1),
+        "p95": round(values[min(len(values) - 1, int(0.95 * len(values)))], 1),
+        "max": round(values[-1], 1),
+    }
+
+
+def run_configuration(speech_port, query_port, pcm_path, rate, args, rtt_ms, loss):
+    speech_proxy = DelayProxy("127.0.0.1", speech_port, rtt_ms, loss, args.seed)
+    query_proxy = DelayProxy("127.0.0.1", query_port, rtt_ms, loss, args.seed + 1)
+    channel = grpc.insecure_channel("127.0.0.1:%d" % speech_proxy.port)
+    grpc.channel_ready_future(channel).result(timeout=args.timeout)
+    stub = speech_pb2_grpc.SpeechStub(channel)
+    query_client = HTTPClient("127.0.0.1", query_proxy.port)
+    speculative_client = HTTPClient("127.0.0.1", query_proxy.port)
+    config = config_request(rate, not args.linear16)
+
+    metrics = []
+    failures = 0
+    speculated = 0
+    bytes_sent = 0
+    upload_seconds = 0.0
+    for _ in range(args.sessions):
+        session = Session(stub, pcm_path, rate, args, query_client, speculative_client)
+        if not session.run(config):
+            failures += 1
+            continue
+        metrics.append(session.metrics())
+        speculated += session.used_speculation
+        bytes_sent += session.bytes_sent
+        upload_seconds += session.t["last_audio_sent"] - session.t["first_audio_sent"]
+    channel.close()
+
+    result = {"rtt_ms": rtt_ms, "loss": loss, "sessions": len(metrics), "failures": failures}
+    for key in ["first_result_ms", "final_ms", "query_ms", "first_audio_ms", "total_ms"]:
+        result[key] = summarize([m[key] for m in metrics])
+    result["upload_kbps"] = round(bytes_sent * 8 / 1000 / upload_seconds, 1) if upload_seconds else None
+    result["speculation_used"] = round(speculated / len(metrics), 2) if metrics else None
+    result["retransmits"] = speech_proxy.retransmits + query_proxy.retransmits
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--wav", default=DEFAULT_WAV, help="16-bit mono recording to send")
+    parser.add_argument("--script", default=DEFAULT_SCRIPT, help="speech recognition responses to replay")
+    parser.add_argument("--sessions", type=int, default=10, help="sessions per configuration")
+    parser.add_argument("--rtt-ms", default="0,60", help="round trip times to simulate, comma separated")
+    parser.add_argument("--loss", default="0", help="fractions of reads lost, comma separated")
+    parser.add_argument("--seed", type=int, default=1, help="seed for the losses")
+    parser.add_argument("--speedup", type=float, default=1.0, help="send audio this much faster than real time")
+    parser.add_argument("--speculative", action="store_true", help="send speculative queries")
+    parser.add_argument("--linear16", action="store_true", help="send uncompressed audio, not FLAC")
+    parser.add_argument("--query-delay-ms", type=float, default=100.0, help="query server processing time")
+    parser.add_argument("--audio-seconds", type=float, default=3.0, help="length of the speech audio answer")
+    parser.add_argument("--timeout", type=float, default=30.0)
+    args = parser.parse_args()
+
+    pcm, rate = chunker.read_pcm(args.wav)
+    chunks = chunker.chunk(pcm, rate, flac=not args.linear16)
+    workdir = tempfile.mkdtemp(prefix="embla-pipeline-")
+    pcm_path = os.path.join(workdir, "capture.pcm")
+    with open(pcm_path, "wb") as f:
+        f.write(pcm)
+
+    speech_args = speech_standin.parser().parse_args(["--port", "0", "--script", args.script])
+    speech_server, speech_port = speech_standin.start(speech_args)
+    mp3 = os.path.join(workdir, "answer.mp3")
+    write_silent_mp3(mp3, args.audio_seconds)
+    # Speech audio is streamed out about as fast as it's synthesized
+    query_args = query_standin.parser().parse_args(["--port", "0", "--quiet", "--audio", mp3,
+                                                    "--delay-ms", str(args.query_delay_ms),
+                                                    "--audio-chunk-bytes", "4096",
+                                                    "--audio-chunk-delay-ms", "20"])
+    query_server = query_standin.start(query_args)
+
+    results = []
+    for rtt_ms in [float(v) for v in args.rtt_ms.split(",")]:
+        for loss in [float(v) for v in args.loss.split(",")]:
+            results.append(run_configuration(speech_port, query_server.server_port, pcm_path, rate, args, rtt_ms,
+                                             loss))
+
+    speech_server.stop(0)
+    query_server.shutdown()
+    print(json.dumps({
+        "wav": os.path.basename(args.wav),
+        "chunks": len(chunks),
+        "chunk_bytes": sum(len(c[0]) for c in chunks),
+        "encoding": "LINEAR16" if args.linear16 else "FLAC",
+        "speedup": args.speedup,
+        "configurations": results,
+    }, indent=2))
+    return 1 if any(r["failures"] for r in results) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
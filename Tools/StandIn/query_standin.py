@@ -0,0 +1,169 @@
+# This file is part of the Embla iOS app
+# Copyright (c) 2019-2023 Miðeind ehf.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+
+"""
+Stand-in for the query server (greynir.is), for testing the app's HTTP
+client without depending on the real service.
+
+Serves the query, speech synthesis, voices and query history APIs
+with canned JSON answers over HTTP/1.1 with keep-alive. --delay-ms
+simulates server processing time. Each request is logged with the
+connection it arrived on, so connection reuse by the client can be
+checked. If --audio is given, answers refer to that file, which is
+served from /audio/, optionally in chunks with a delay between them
+(--audio-chunk-bytes, --audio-chunk-delay-ms) to mimic a speech
+synthesis server streaming its output. Point the app at the stand-in by setting the
+QueryServer default to e.g. http://localhost:8000.
+
+    $ python3 Tools/StandIn/query_standin.py --port 8000
+"""
+
+import argparse
+import itertools
+import json
+import os
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+QUERY_API_PATH = "/query.api/v1"
+CLEAR_QHISTORY_API_PATH = "/query_history.api/v1"
+SPEECH_API_PATH = "/speech.api/v1"
+VOICES_API_PATH = "/voices.api/v1"
+AUDIO_PATH = "/audio/"
+
+_connections = itertools.count(1)
+
+
+class QueryHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    args = None
+
+    def setup(self):
+        super().setup()
+        self.connection_id = next(_connections)
+        self.request_count = 0
+
+    def log_message(self, fmt, *args):
+        if not self.args.quiet:
+            sys.stderr.write("[conn %d #%d] %s\n" % (self.connection_id, self.request_count, fmt % args))
+
+    def _base_url(self):
+        return "http://%s" % (self.headers.get("Host") or "localhost:%d" % self.server.server_port)
+
+    def _send(self, status, body, content_type="application/json; charset=utf-8"):
+        if isinstance(body, (dict, list)):
+            body = json.dumps(body, ensure_ascii=False).encode("utf-8")
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(body)
+
+    def _send_audio(self):
+        with open(self.args.audio, "rb") as f:
+            body = f.read()
+        self.send_response(200)
+        self.send_header("Content-Type", "audio/mpeg")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if self.command == "HEAD":
+            return
+        step = self.args.audio_chunk_bytes or len(body)
+        for i in range(0, len(body), step):
+            if i > 0:
+                time.sleep(self.args.audio_chunk_delay_ms / 1000.0)
+            self.wfile.write(body[i : i + step])
+            self.wfile.flush()
+
+    def _audio_url(self):
+        if not self.args.audio:
+            return None
+        return self._base_url() + AUDIO_PATH + os.path.basename(self.args.audio)
+
+    def _handle(self):
+        self.request_count += 1
+        url = urlparse(self.path)
+        params = parse_qs(url.query)
+        if self.command == "POST":
+            length = int(self.headers.get("Content-Length") or 0)
+            params.update(parse_qs(self.rfile.read(length).decode("utf-8")))
+        time.sleep(self.args.delay_ms / 1000.0)
+
+        if url.path == QUERY_API_PATH:
+            alternatives = params.get("q", [""])[0].split("|")
+            answer = {
+                "valid": True,
+                "q": alternatives[0],
+                "answer": self.args.answer,
+                "source": "Stand-in",
+            }
+            if self._audio_url():
+                answer["audio"] = self._audio_url()
+            self._send(200, answer)
+        elif url.path == SPEECH_API_PATH:
+            self._send(200, {"err": False, "audio_url": self._audio_url() or ""})
+        elif url.path == VOICES_API_PATH:
+            self._send(200, {"default": "Dora", "supported": ["Dora", "Karl"]})
+        elif url.path == CLEAR_QHISTORY_API_PATH:
+            self._send(200, {"valid": True})
+        elif url.path.startswith(AUDIO_PATH) and self.args.audio:
+            self._send_audio()
+        elif url.path == "/":
+            self._send(200, b"Embla query server stand-in\n", "text/plain")
+        else:
+            self._send(404, {"valid": False, "error": "Not found"})
+
+    do_GET = _handle
+    do_POST = _handle
+    do_HEAD = _handle
+
+
+def parser():
+    p = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("--port", type=int, default=8000)
+    p.add_argument("--delay-ms", type=float, default=0.0, help="processing time per request")
+    p.add_argument("--answer", default="Klukkan er tólf.")
+    p.add_argument("--audio", help="audio file to refer to in answers")
+    p.add_argument("--audio-chunk-bytes", type=int, default=0, help="send audio in chunks of this size")
+    p.add_argument("--audio-chunk-delay-ms", type=float, default=0.0, help="delay between audio chunks")
+    p.add_argument("--quiet", action="store_true", help="don't log requests")
+    return p
+
+
+def start(args):
+    """Start serving on args.port, 0 for any free port, on a thread of its own. Returns the server."""
+    QueryHandler.args = args
+    server = ThreadingHTTPServer(("", args.port), QueryHandler)
+    server.daemon_threads = True
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+
+def main():
+    server = start(parser().parse_args())
+    print("Query stand-in listening on port %d" % server.server_port, flush=True)
+    try:
+        threading.Event().wait()
+    except KeyboardInterrupt:
+        server.shutdown()
+
+
+if __name__ == "__main__":
+    main()
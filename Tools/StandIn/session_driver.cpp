@@ -0,0 +1,301 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Runs one query session through the app's own SessionMachine, with
+    the network and playback left to the caller. Used by the pipeline
+    benchmark, see session_driver.py.
+
+    The captured audio is the 16-bit mono PCM file given. Events go in
+    on stdin and the machine's calls come out on stdout, one per line,
+    as tab-separated fields with the name first. In:
+
+        start
+        audio <samples>                 that much more audio captured
+        response <eou> <results> [<final> <stability> <alternatives> <alternative>...]...
+        recognition_ended
+        recognition_failed <message>
+        answered <id> <answer> <audio url> <open url>
+        query_failed <id> <message>
+        playback_finished
+        playback_failed <message>
+        terminate
+
+    Out:
+
+        capture <position>, stop_capture
+        chunk <hex>, finish_audio
+        query <id> <speculative> <alternative>..., cancel <id>
+        play <url>, dunno, stop
+        recording, stopped_recording, transcripts <alternative>...,
+        answer <answer>, fail <message>, speculation <hit> <ms saved>,
+        mark <name>, terminated
+
+    Answers that open a URL end the session, as the app does once it
+    has opened it.
+
+    $ ./session_driver --pcm audio.pcm [--rate N] [--flac] [--speculative]
+*/
+
+#include "SessionMachine.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace embla;
+
+static std::string Field(const std::string &s) {
+    std::string f = s;
+    for (char &c : f) {
+        if (c == '\t' || c == '\n' || c == '\r') {
+            c = ' ';
+        }
+    }
+    return f;
+}
+
+static void Emit(const std::vector<std::string> &fields) {
+    std::string line;
+    for (const std::string &f : fields) {
+        line += (line.empty() ? "" : "\t") + Field(f);
+    }
+    printf("%s\n", line.c_str());
+    fflush(stdout);
+}
+
+static std::vector<std::string> Split(const std::string &line) {
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t tab = line.find('\t', start);
+        fields.push_back(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+        if (tab == std::string::npos) {
+            return fields;
+        }
+        start = tab + 1;
+    }
+}
+
+class Driver : public SessionAudioInput, public SessionRecognizer, public SessionQueryClient, public SessionPlayer,
+               public SessionListener {
+public:
+    explicit Driver(const std::vector<int16_t> &pcm) : _pcm(pcm) {}
+
+    void setMachine(SessionMachine *machine) { _machine = machine; }
+
+    // Push the next samples of the recording, as capture delivers them
+    void capture(size_t count) {
+        if (!_capturing || _position >= _pcm.size()) {
+            return;
+        }
+        count = std::min(count, _pcm.size() - (size_t)_position);
+        const int16_t *samples = _pcm.data() + _position;
+        _position += count;
+        _machine->audioReceived(samples, count);
+    }
+
+    // SessionAudioInput
+
+    void startCapture(uint64_t position) override {
+        _capturing = true;
+        _position = position;
+        Emit({ "capture", std::to_string(position) });
+    }
+
+    void stopCapture() override {
+        _capturing = false;
+        Emit({ "stop_capture" });
+    }
+
+    // SessionRecognizer
+
+    void sendAudio(const SessionAudioChunk &chunk) override {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(chunk.length * 2, '0');
+        for (size_t i = 0; i < chunk.length; i++) {
+            hex[2 * i] = digits[chunk.data[i] >> 4];
+            hex[2 * i + 1] = digits[chunk.data[i] & 15];
+        }
+        chunk.release();
+        Emit({ "chunk", hex });
+    }
+
+    void finishAudio() override { Emit({ "finish_audio" }); }
+
+    // SessionQueryClient
+
+    int sendQuery(const std::vector<std::string> &alternatives, bool speculative) override {
+        int id = _nextQueryID++;
+        std::vector<std::string> fields = { "query", std::to_string(id), speculative ? "1" : "0" };
+        fields.insert(fields.end(), alternatives.begin(), alternatives.end());
+        Emit(fields);
+        return id;
+    }
+
+    void cancelQuery(int requestID) override { Emit({ "cancel", std::to_string(requestID) }); }
+
+    // SessionPlayer
+
+    void play(const std::string &url, const std::string &text) override { Emit({ "play", url }); }
+    bool playCachedSpeech(const std::string &text) override { return false; }
+
+    std::string playDunno() override {
+        Emit({ "dunno" });
+        return "Ég veit það ekki.";
+    }
+
+    void stop() override { Emit({ "stop" }); }
+
+    // SessionListener
+
+    void sessionDidStartRecording() override { Emit({ "recording" }); }
+    void sessionDidStopRecording() override { Emit({ "stopped_recording" }); }
+
+    void sessionDidReceiveTranscripts(const std::vector<std::string> &alternatives) override {
+        std::vector<std::string> fields = { "transcripts" };
+        fields.insert(fields.end(), alternatives.begin(), alternatives.end());
+        Emit(fields);
+    }
+
+    void sessionDidReceiveAnswer(const QueryAnswer &answer) override { Emit({ "answer", answer.answer }); }
+    void sessionDidFail(const std::string &message) override { Emit({ "fail", message }); }
+    void sessionDidTerminate() override { Emit({ "terminated" }); }
+
+    void sessionDidResolveSpeculation(bool hit, double secondsSaved, double roundTrip) override {
+        Emit({ "speculation", hit ? "1" : "0", std::to_string((int)(secondsSaved * 1000)) });
+    }
+
+    void sessionTraceMark(const char *name) override { Emit({ "mark", name }); }
+
+private:
+    const std::vector<int16_t> &_pcm;
+    SessionMachine *_machine = nullptr;
+    bool _capturing = false;
+    uint64_t _position = 0;
+    int _nextQueryID = 0;
+};
+
+static RecognitionResponse ParseResponse(const std::vector<std::string> &f) {
+    RecognitionResponse response;
+    response.endOfUtterance = f.size() > 1 && f[1] == "1";
+    size_t results = f.size() > 2 ? (size_t)atoi(f[2].c_str()) : 0;
+    size_t i = 3;
+    for (size_t r = 0; r < results && i + 2 < f.size(); r++) {
+        RecognitionResult result;
+        result.isFinal = f[i] == "1";
+        result.stability = (float)atof(f[i + 1].c_str());
+        size_t alternatives = (size_t)atoi(f[i + 2].c_str());
+        i += 3;
+        for (size_t a = 0; a < alternatives && i < f.size(); a++, i++) {
+            result.alternatives.push_back(f[i]);
+        }
+        response.results.push_back(result);
+    }
+    return response;
+}
+
+static bool ReadPCM(const std::string &path, std::vector<int16_t> &pcm) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    int16_t buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, sizeof(int16_t), 4096, f)) > 0) {
+        pcm.insert(pcm.end(), buffer, buffer + n);
+    }
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    SessionConfig config;
+    std::string pcmPath;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--pcm" && i + 1 < argc) {
+            pcmPath = argv[++i];
+        } else if (a == "--rate" && i + 1 < argc) {
+            config.sampleRate = atoi(argv[++i]);
+        } else if (a == "--flac") {
+            config.flac = true;
+        } else if (a == "--speculative") {
+            config.speculativeQueries = true;
+        } else {
+            pcmPath.clear();
+            break;
+        }
+    }
+    std::vector<int16_t> pcm;
+    if (pcmPath.empty() || !ReadPCM(pcmPath, pcm)) {
+        fprintf(stderr, "usage: %s --pcm audio.pcm [--rate N] [--flac] [--speculative]\n", argv[0]);
+        return 1;
+    }
+
+    Driver driver(pcm);
+    SessionServices services;
+    services.audio = &driver;
+    services.recognizer = &driver;
+    services.query = &driver;
+    services.player = &driver;
+    services.listener = &driver;
+    SessionMachine machine(config, services);
+    driver.setMachine(&machine);
+
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::vector<std::string> f = Split(line);
+        const std::string &event = f[0];
+        std::string arg = f.size() > 1 ? f[1] : "";
+        if (event == "start") {
+            machine.start(0);
+        } else if (event == "audio") {
+            driver.capture((size_t)atoi(arg.c_str()));
+        } else if (event == "response") {
+            machine.recognitionResponse(ParseResponse(f));
+        } else if (event == "recognition_ended") {
+            machine.recognitionEnded();
+        } else if (event == "recognition_failed") {
+            machine.recognitionFailed(arg);
+        } else if (event == "answered" && f.size() > 4) {
+            QueryAnswer answer;
+            answer.answer = f[2];
+            answer.audioURL = f[3];
+            answer.openURL = f[4];
+            machine.queryAnswered(atoi(arg.c_str()), answer);
+        } else if (event == "query_failed") {
+            machine.queryFailed(atoi(arg.c_str()), f.size() > 2 ? f[2] : "");
+        } else if (event == "playback_finished") {
+            machine.playbackFinished(true);
+        } else if (event == "playback_failed") {
+            machine.playbackFailed(arg);
+        } else if (event == "terminate") {
+            machine.terminate();
+        } else {
+            fprintf(stderr, "Unknown event: %s\n", event.c_str());
+        }
+        if (machine.state() == SessionState::Answered) {
+            machine.terminate();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+# This file is part of the Embla iOS app
+# Copyright (c) 2019-2023 Miðeind ehf.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+"""
+Runs query sessions through the app's own SessionMachine, leaving the
+network and playback to the caller. The session_driver.cpp helper is
+compiled on first import, with the C++ compiler in $CXX or c++.
+"""
+
+import os
+import subprocess
+import sys
+import tempfile
+import threading
+
+REPO_ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), "..", ".."))
+SOURCES = [
+    "Tools/StandIn/session_driver.cpp",
+    "Embla/Session/SessionMachine.cpp",
+    "Embla/DSP/ChunkAssembler.cpp",
+    "Embla/DSP/FlacEncoder.cpp",
+    "Embla/DSP/LevelMeter.cpp",
+]
+HEADERS = [
+    "Embla/Session/SessionMachine.h",
+    "Embla/DSP/ChunkAssembler.h",
+    "Embla/DSP/FlacEncoder.h",
+    "Embla/DSP/LevelMeter.h",
+]
+
+_binary = os.path.join(tempfile.gettempdir(), "embla-session-driver", "session_driver")
+
+
+def _compile():
+    files = [os.path.join(REPO_ROOT, f) for f in SOURCES + HEADERS]
+    if os.path.exists(_binary) and all(os.path.getmtime(_binary) >= os.path.getmtime(f) for f in files):
+        return
+    os.makedirs(os.path.dirname(_binary), exist_ok=True)
+    args = [os.environ.get("CXX", "c++"), "-std=c++17", "-O2",
+            "-I", os.path.join(REPO_ROOT, "Embla/Session"), "-I", os.path.join(REPO_ROOT, "Embla/DSP")]
+    if subprocess.call(args + [os.path.join(REPO_ROOT, s) for s in SOURCES] + ["-o", _binary]) != 0:
+        sys.exit("Failed to compile the session driver")
+
+
+_compile()
+
+
+def _field(value):
+    return str(value).replace("\t", " ").replace("\n", " ").replace("\r", " ")
+
+
+class SessionDriver:
+    """One session of the machine, capturing from a file of 16-bit mono PCM.
+
+    Events are sent with send() from any thread. The machine's calls are
+    read with calls(), as lists of fields with the name first, see
+    session_driver.cpp.
+    """
+
+    def __init__(self, pcm_path, rate, flac=True, speculative=False):
+        args = [_binary, "--pcm", pcm_path, "--rate", str(rate)]
+        if flac:
+            args.append("--flac")
+        if speculative:
+            args.append("--speculative")
+        self.process = subprocess.Popen(args, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                        encoding="utf-8", bufsize=1)
+        self.lock = threading.Lock()
+
+    def send(self, *fields):
+        with self.lock:
+            if self.process.stdin.closed:
+                return
+            try:
+                self.process.stdin.write("\t".join(_field(f) for f in fields) + "\n")
+                self.process.stdin.flush()
+            except BrokenPipeError:
+                pass
+
+    def send_response(self, end_of_utterance, results):
+        """A recognition response, with results as (is_final, stability, alternatives) tuples."""
+        fields = ["response", int(end_of_utterance), len(results)]
+        for is_final, stability, alternatives in results:
+            fields += [int(is_final), stability, len(alternatives)] + list(alternatives)
+        self.send(*fields)
+
+    def calls(self):
+        for line in self.process.stdout:
+            yield line.rstrip("\n").split("\t")
+
+    def close(self):
+        with self.lock:
+            self.process.stdin.close()
+        self.process.wait()
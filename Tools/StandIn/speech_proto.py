@@ -0,0 +1,59 @@
+# This file is part of the Embla iOS app
+# Copyright (c) 2019-2023 Miðeind ehf.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+"""
+Compiles the speech recognition protos in the repository with grpc_tools
+on first import and exposes the generated modules as speech_pb2 and
+speech_pb2_grpc. Requires the grpcio and grpcio-tools packages.
+"""
+
+import os
+import sys
+import tempfile
+
+import grpc_tools
+from grpc_tools import protoc
+
+REPO_ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), "..", ".."))
+PROTO = "google/cloud/speech/v1/cloud_speech.proto"
+DEPS = [
+    "google/api/annotations.proto",
+    "google/api/http.proto",
+    "google/longrunning/operations.proto",
+    "google/rpc/status.proto",
+]
+
+_out = os.path.join(tempfile.gettempdir(), "embla-speech-proto")
+
+
+def _compile():
+    os.makedirs(_out, exist_ok=True)
+    stamp = os.path.join(_out, "google", "cloud", "speech", "v1", "cloud_speech_pb2_grpc.py")
+    if os.path.exists(stamp) and os.path.getmtime(stamp) >= os.path.getmtime(os.path.join(REPO_ROOT, PROTO)):
+        return
+    builtin = os.path.join(os.path.dirname(grpc_tools.__file__), "_proto")
+    for proto in DEPS + [PROTO]:
+        args = ["protoc", "-I", REPO_ROOT, "-I", builtin, "--python_out", _out]
+        if proto == PROTO:
+            args += ["--grpc_python_out", _out]
+        if protoc.main(args + [proto]) != 0:
+            sys.exit("Failed to compile %s" % proto)
+
+
+_compile()
+sys.path.insert(0, _out)
+
+from google.cloud.speech.v1 import cloud_speech_pb2 as speech_pb2  # noqa: E402
+from google.cloud.speech.v1 import cloud_speech_pb2_grpc as speech_pb2_grpc  # noqa: E402
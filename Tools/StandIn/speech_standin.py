@@ -0,0 +1,248 @@
+# This file is part of the Embla iOS app
+# Copyright (c) 2019-2023 Miðeind ehf.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+
+"""
+Stand-in for the streaming speech recognition server, for measuring
+client-side latency without depending on the real service.
+
+Accepts StreamingRecognize calls on an insecure port. By default it
+answers with interim results for a fixed transcript, revealed a word at
+a time as audio arrives, followed by a final result. With --script it
+replays a canned sequence of responses instead, from a JSON file like
+klukkan.json in this directory:
+
+    {"responses": [
+        {"audio_ms": 600, "delay_ms": 80, "transcript": "hvað er", "stability": 0.9},
+        {"audio_ms": 1400, "event": "end_of_single_utterance"},
+        {"delay_ms": 150, "final": true, "alternatives": ["hvað er klukkan", "hvað er klukka"]}
+    ]}
+
+Each response is sent delay_ms after the call has received audio_ms of
+audio, and no earlier than the one before it. Responses without audio_ms
+are sent once the audio ends, which is when the client half-closes the
+call or, with single_utterance, after the end of utterance event. Audio
+is timed by its samples, whether LINEAR16 or FLAC, so clients may send it
+faster than real time.
+
+Latencies are simulated: --call-setup-ms delays the start of each call
+(authentication and stream setup on the real service), --result-delay-ms
+delays every response. Point the app at it by setting the
+Speech2TextServer default to e.g. localhost:50051.
+
+    $ python3 Tools/StandIn/speech_standin.py --port 50051
+"""
+
+import argparse
+import json
+import sys
+import threading
+import time
+from concurrent import futures
+
+import grpc
+
+from speech_proto import speech_pb2, speech_pb2_grpc
+
+R = speech_pb2.StreamingRecognizeResponse
+FLAC = speech_pb2.RecognitionConfig.FLAC
+
+
+def _flac_samples(data):
+    """Samples in the FLAC frames of an audio chunk, skipping the stream header if any."""
+    pos = 0
+    if data.startswith(b"fLaC"):
+        pos = 4
+        while pos + 4 <= len(data):
+            last = data[pos] & 0x80
+            pos += 4 + int.from_bytes(data[pos + 1 : pos + 4], "big")
+            if last:
+                break
+    samples = 0
+    # Frames are self-delimiting only by their sync code, so count the first
+    # one, which the app sends one of per chunk
+    if pos + 4 <= len(data) and data[pos] == 0xFF and data[pos + 1] & 0xFE == 0xF8:
+        code = data[pos + 2] >> 4
+        # Skip the UTF-8 coded frame number to reach an explicit block size,
+        # its length being the number of leading one bits, if any
+        lead = data[pos + 4] if pos + 4 < len(data) else 0
+        n = 1
+        if lead & 0x80:
+            n = 0
+            while n < 8 and lead & (0x80 >> n):
+                n += 1
+        end = pos + 4 + n
+        if code == 1:
+            samples = 192
+        elif 2 <= code <= 5:
+            samples = 576 << (code - 2)
+        elif code == 6:
+            samples = data[end] + 1
+        elif code == 7:
+            samples = int.from_bytes(data[end : end + 2], "big") + 1
+        elif code >= 8:
+            samples = 256 << (code - 8)
+    return samples
+
+
+def audio_ms(request, config):
+    """Duration of the audio in a request, in ms."""
+    rate = config.config.sample_rate_hertz or 16000
+    if config.config.encoding == FLAC:
+        return _flac_samples(request.audio_content) / rate * 1000.0
+    return len(request.audio_content) / 2 / rate * 1000.0
+
+
+def _result(alternatives, final, stability):
+    alts = [
+        speech_pb2.SpeechRecognitionAlternative(transcript=t, confidence=0.9 if final else 0.0)
+        for t in alternatives
+    ]
+    return speech_pb2.StreamingRecognitionResult(alternatives=alts, is_final=final, stability=stability)
+
+
+class StandInSpeech(speech_pb2_grpc.SpeechServicer):
+    def __init__(self, args):
+        self.args = args
+        self.words = args.transcript.split()
+        self.script = None
+        if args.script:
+            with open(args.script, encoding="utf-8") as f:
+                self.script = json.load(f)["responses"]
+
+    def _response(self, words, final):
+        return R(results=[_result([" ".join(words)], final, 1.0 if final else 0.8)])
+
+    def StreamingRecognize(self, request_iterator, context):
+        time.sleep(self.args.call_setup_ms / 1000.0)
+        if self.script is not None:
+            yield from self._replay(request_iterator, context)
+            return
+
+        args = self.args
+        config = None
+        received_ms = 0.0
+        revealed = 0
+        for req in request_iterator:
+            if req.HasField("streaming_config"):
+                config = req.streaming_config
+                continue
+            if config is None:
+                context.abort(grpc.StatusCode.INVALID_ARGUMENT, "First request must contain streaming_config")
+            received_ms += audio_ms(req, config)
+
+            # Reveal one more word for every interval of audio received
+            target = min(len(self.words), int(received_ms // args.word_ms))
+            if target > revealed:
+                revealed = target
+                if config.interim_results:
+                    time.sleep(args.result_delay_ms / 1000.0)
+                    yield self._response(self.words[:revealed], False)
+            if revealed == len(self.words) and config.single_utterance:
+                yield R(speech_event_type=R.END_OF_SINGLE_UTTERANCE)
+                break
+
+        if config is None:
+            return
+        time.sleep(args.result_delay_ms / 1000.0)
+        yield self._response(self.words, True)
+
+    def _replay(self, request_iterator, context):
+        # Requests are read on a thread of their own, so that response
+        # delays don't hold up the audio
+        state = {"config": None, "ms": 0.0, "ended": False}
+        changed = threading.Condition()
+
+        def read():
+            try:
+                for req in request_iterator:
+                    with changed:
+                        if req.HasField("streaming_config"):
+                            state["config"] = req.streaming_config
+                        elif state["config"] is not None:
+                            state["ms"] += audio_ms(req, state["config"])
+                        changed.notify_all()
+            except grpc.RpcError:
+                pass
+            with changed:
+                state["ended"] = True
+                changed.notify_all()
+
+        threading.Thread(target=read, daemon=True).start()
+        previous = time.monotonic()
+        for r in self.script:
+            event = r.get("event") == "end_of_single_utterance"
+            with changed:
+                if "audio_ms" in r:
+                    changed.wait_for(lambda: state["ended"] or state["ms"] >= r["audio_ms"])
+                    if state["ms"] < r["audio_ms"]:
+                        continue    # Audio ended first
+                else:
+                    changed.wait_for(lambda: state["ended"])
+                config = state["config"]
+            if config is None:
+                return
+            if event and not config.single_utterance:
+                continue
+            if not event and not r.get("final") and not config.interim_results:
+                continue
+            due = max(previous, time.monotonic() + (r.get("delay_ms", 0) + self.args.result_delay_ms) / 1000.0)
+            time.sleep(max(0.0, due - time.monotonic()))
+            previous = due
+            if event:
+                yield R(speech_event_type=R.END_OF_SINGLE_UTTERANCE)
+                # The audio ends here, whether or not the client stops sending
+                with changed:
+                    state["ended"] = True
+                    changed.notify_all()
+            else:
+                alternatives = r.get("alternatives") or [r["transcript"]]
+                final = bool(r.get("final"))
+                yield R(results=[_result(alternatives, final, r.get("stability", 1.0 if final else 0.8))])
+
+
+def parser():
+    p = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("--port", type=int, default=50051)
+    p.add_argument("--transcript", default="hvað er klukkan")
+    p.add_argument("--word-ms", type=float, default=100.0, help="audio per revealed word")
+    p.add_argument("--script", help="JSON file of responses to replay instead")
+    p.add_argument("--call-setup-ms", type=float, default=0.0, help="delay before a call is served")
+    p.add_argument("--result-delay-ms", type=float, default=0.0, help="delay before each response")
+    return p
+
+
+def start(args):
+    """Start serving on args.port, 0 for any free port. Returns the server and its port."""
+    server = grpc.server(futures.ThreadPoolExecutor(max_workers=16))
+    speech_pb2_grpc.add_SpeechServicer_to_server(StandInSpeech(args), server)
+    port = server.add_insecure_port("[::]:%d" % args.port)
+    if port == 0:
+        sys.exit("Unable to listen on port %d" % args.port)
+    server.start()
+    return server, port
+
+
+def main():
+    server, port = start(parser().parse_args())
+    print("Speech stand-in listening on port %d" % port, flush=True)
+    try:
+        server.wait_for_termination()
+    except KeyboardInterrupt:
+        server.stop(0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,192 @@
+# This file is part of the Embla iOS app
+# Copyright (c) 2019-2023 Miðeind ehf.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+
+"""
+Measures time to first interim result against a streaming speech
+recognition server, normally speech_standin.py, for three ways of
+starting a session:
+
+    cold     new channel and call when the session starts
+    channel  persistent channel, new call when the session starts
+    warm     persistent channel and a call opened ahead of time with the
+             config already sent, as SpeechRecognitionService does while
+             the hotword detector is listening
+
+Time is measured from the first audio chunk sent to the first response
+containing results. --rtt-ms routes traffic through a local proxy that
+delays it by the given round trip time, so that connection and call
+setup cost what they would over a mobile network.
+
+    $ python3 Tools/StandIn/speech_standin.py --call-setup-ms 50 &
+    $ python3 Tools/StandIn/ttfr.py --rtt-ms 60 --sessions 20
+"""
+
+import argparse
+import json
+import queue
+import statistics
+import sys
+import threading
+import time
+import wave
+
+import grpc
+
+from delay_proxy import DelayProxy
+from speech_proto import speech_pb2, speech_pb2_grpc
+
+MODES = ["cold", "channel", "warm"]
+
+
+class Call:
+    """A streaming call fed from a queue, recording when the first result arrives."""
+
+    def __init__(self, stub, config):
+        self.requests = queue.Queue()
+        self.first_audio = None
+        self.first_result = None
+        self.done = threading.Event()
+        self.ended = threading.Event()
+        self.requests.put(config)
+        self.responses = stub.StreamingRecognize(self._generate())
+        threading.Thread(target=self._read, daemon=True).start()
+
+    def _generate(self):
+        while True:
+            req = self.requests.get()
+            if req is None:
+                return
+            yield req
+
+    def _read(self):
+        try:
+            for resp in self.responses:
+                if resp.results and self.first_result is None:
+                    self.first_result = time.monotonic()
+                    self.done.set()
+        except grpc.RpcError as e:
+            print("Call failed: %s" % e.details(), file=sys.stderr)
+        self.done.set()
+        self.ended.set()
+
+    def send(self, audio):
+        if self.first_audio is None:
+            self.first_audio = time.monotonic()
+        self.requests.put(speech_pb2.StreamingRecognizeRequest(audio_content=audio))
+
+    def finish(self):
+        self.requests.put(None)
+
+
+def config_request(rate):
+    config = speech_pb2.RecognitionConfig(encoding=speech_pb2.RecognitionConfig.LINEAR16, sample_rate_hertz=rate,
+                                          language_code="is-IS", max_alternatives=10)
+    streaming = speech_pb2.StreamingRecognitionConfig(config=config, single_utterance=True, interim_results=True)
+    return speech_pb2.StreamingRecognizeRequest(streaming_config=streaming)
+
+
+def load_audio(path, seconds, rate):
+    if path is None:
+        return bytes(int(seconds * rate) * 2), rate
+    with wave.open(path, "rb") as w:
+        if w.getsampwidth() != 2 or w.getnchannels() != 1:
+            sys.exit("%s: expected 16-bit mono PCM" % path)
+        return w.readframes(w.getnframes()), w.getframerate()
+
+
+def run_session(stub, call, audio, rate, args):
+    chunk = int(rate * args.chunk_ms / 1000) * 2
+    for offset in range(0, len(audio), chunk):
+        call.send(audio[offset:offset + chunk])
+        if call.done.wait(args.chunk_ms / 1000.0 if args.realtime else 0):
+            break
+    call.finish()
+    call.ended.wait(args.timeout)
+    if call.first_result is None:
+        return None
+    return (call.first_result - call.first_audio) * 1000.0
+
+
+def summarize(values):
+    if not values:
+        return {"sessions": 0}
+    ordered = sorted(values)
+    return {
+        "sessions": len(values),
+        "mean_ms": round(statistics.mean(values), 1),
+        "median_ms": round(statistics.median(values), 1),
+        "p90_ms": round(ordered[min(len(ordered) - 1, int(0.9 * len(ordered)))], 1),
+        "max_ms": round(ordered[-1], 1),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--server", default="localhost:50051")
+    parser.add_argument("--sessions", type=int, default=10)
+    parser.add_argument("--mode", choices=MODES, action="append", help="mode(s) to run, default all")
+    parser.add_argument("--rtt-ms", type=float, default=0.0, help="simulated network round trip time")
+    parser.add_argument("--idle-ms", type=float, default=500.0, help="time a warm call is open before audio")
+    parser.add_argument("--chunk-ms", type=float, default=100.0)
+    parser.add_argument("--no-realtime", dest="realtime", action="store_false", help="send audio without pacing")
+    parser.add_argument("--wav", help="16-bit mono recording to send, default 3 s of silence")
+    parser.add_argument("--timeout", type=float, default=10.0)
+    args = parser.parse_args()
+
+    audio, rate = load_audio(args.wav, 3.0, 16000)
+    config = config_request(rate)
+
+    target = args.server
+    if args.rtt_ms > 0:
+        host, port = args.server.rsplit(":", 1)
+        proxy = DelayProxy(host, int(port), args.rtt_ms)
+        target = "127.0.0.1:%d" % proxy.port
+
+    results = {}
+    for mode in args.mode or MODES:
+        times = []
+        failures = 0
+        persistent = None
+        if mode != "cold":
+            persistent = grpc.insecure_channel(target)
+            grpc.channel_ready_future(persistent).result(timeout=args.timeout)
+        for _ in range(args.sessions):
+            channel = persistent or grpc.insecure_channel(target)
+            stub = speech_pb2_grpc.SpeechStub(channel)
+            if mode == "warm":
+                call = Call(stub, config)
+                time.sleep(args.idle_ms / 1000.0)
+            else:
+                time.sleep(args.idle_ms / 1000.0)
+                call = Call(stub, config)
+            ms = run_session(stub, call, audio, rate, args)
+            if ms is None:
+                failures += 1
+            else:
+                times.append(ms)
+            if channel is not persistent:
+                channel.close()
+        if persistent:
+            persistent.close()
+        results[mode] = summarize(times)
+        results[mode]["failures"] = failures
+
+    report = {"server": args.server, "rtt_ms": args.rtt_ms, "chunk_ms": args.chunk_ms, "modes": results}
+    print(json.dumps(report, indent=2))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,601 @@
+/*
+ * This file is part of the Embla iOS app
+ * Copyright (c) 2019-2023 Miðeind ehf.
+ * Author: Sveinbjorn Thordarson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Checks and benchmarks the query latency tracer (LatencyTracer.cpp),
+    and summarizes traces.
+
+    The checks cover recording and reading back on one thread, rings
+    overwriting their oldest events, buffers being reused once their
+    thread exits, and reading while several threads record, where no
+    event may come back torn. Any failure is reported and the exit
+    status is nonzero.
+
+    The benchmark measures the cost of recording an event, with tracing
+    on and off, and from several threads at once. It then replays a
+    scripted query session the number of times given, with stages on
+    main, audio and network threads handing over to each other after
+    random delays (as the app's session does, see SessionTrace.mm),
+    exports the trace as Chrome trace JSON, reads it back, and reports
+    the p50 and p95 of each span and of the time from hotword to first
+    audio. Delays are scaled down to run quickly and reported at full
+    scale.
+
+    Given a trace written by the app (Caches/Traces/latency.json), it
+    only prints the same summary for that, along with how many
+    speculative queries hit and missed, so releases can be compared.
+
+    $ build/tracebench [--sessions N] [--scale X] [--seed N] [--out trace.json]
+    $ build/tracebench --summarize latency.json
+
+    See build.sh in this directory for how to build.
+*/
+
+#include "BenchCheck.h"
+#include "LatencyTracer.h"
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define DEFAULT_SESSIONS        100
+#define DEFAULT_SCALE           0.02
+#define OVERHEAD_EVENTS         (1 << 22)
+#define STRESS_THREADS          4
+#define STRESS_EVENTS           200000
+
+typedef std::chrono::steady_clock Clock;
+using embla::LatencyTracer;
+using embla::TraceEvent;
+using embla::TracePhase;
+
+// Run f on a thread of its own, which has exited when this returns
+template <typename F>
+static void OnNewThread(F f) {
+    std::thread thread(f);
+    thread.join();
+}
+
+// Checks
+
+static void CheckSingleThread(LatencyTracer &tracer) {
+    tracer.clear();
+    OnNewThread([&]() {
+        tracer.begin("a", 1);
+        tracer.instant("b", 1);
+        tracer.end("a", 2);
+    });
+    std::vector<TraceEvent> events = tracer.events();
+    if (events.size() != 3 || strcmp(events[0].name, "a") || events[0].phase != TracePhase::Begin ||
+        strcmp(events[1].name, "b") || events[1].phase != TracePhase::Instant || events[2].id != 2 ||
+        events[2].phase != TracePhase::End || events[0].time > events[1].time || events[1].time > events[2].time) {
+        Fail("Events recorded on one thread don't read back as recorded");
+    }
+
+    tracer.clear();
+    tracer.setEnabled(false);
+    OnNewThread([&]() { tracer.instant("c", 1); });
+    tracer.setEnabled(true);
+    if (!tracer.events().empty()) {
+        Fail("Events recorded while tracing was off");
+    }
+}
+
+static void CheckOverwrite(LatencyTracer &tracer) {
+    tracer.clear();
+    uint64_t overwritten = tracer.stats().overwritten;
+    size_t extra = 10;
+    OnNewThread([&]() {
+        for (size_t i = 0; i < LatencyTracer::capacityPerThread + extra; i++) {
+            tracer.instant("x", i);
+        }
+    });
+    std::vector<TraceEvent> events = tracer.events();
+    if (events.size() != LatencyTracer::capacityPerThread || events.front().id != extra ||
+        events.back().id != LatencyTracer::capacityPerThread + extra - 1) {
+        Fail("A full ring doesn't hold the latest events");
+    }
+    // The thread may have reused a buffer already holding events
+    if (tracer.stats().overwritten < overwritten + extra) {
+        Fail("Overwritten events aren't counted");
+    }
+}
+
+static void CheckBufferReuse(LatencyTracer &tracer) {
+    size_t threads = tracer.stats().threads;
+    for (int i = 0; i < 50; i++) {
+        OnNewThread([&]() { tracer.instant("y", i); });
+    }
+    if (tracer.stats().threads > threads + 1) {
+        Fail("Buffers of threads that have exited aren't reused, " +
+             std::to_string(tracer.stats().threads - threads) + " allocated for 50 threads in turn");
+    }
+}
+
+static const char *stressNames[] = { "one", "two", "three", "four", "five" };
+
+// Each event's name and phase follow from its id, so torn events show
+static void CheckConcurrentReads(LatencyTracer &tracer) {
+    tracer.clear();
+    uint64_t before = tracer.stats().events;
+    std::atomic<int> running{ STRESS_THREADS };
+    std::vector<std::thread> writers;
+    for (uint64_t t = 0; t < STRESS_THREADS; t++) {
+        writers.emplace_back([&, t]() {
+            for (uint64_t i = 0; i < STRESS_EVENTS; i++) {
+                uint64_t id = (t << 32) | i;
+                switch (i % 3) {
+                    case 0: tracer.begin(stressNames[i % 5], id); break;
+                    case 1: tracer.end(stressNames[i % 5], id); break;
+                    default: tracer.instant(stressNames[i % 5], id); break;
+                }
+            }
+            running--;
+        });
+    }
+    size_t snapshots = 0, read = 0;
+    while (running > 0 || snapshots == 0) {
+        std::vector<TraceEvent> events = tracer.events();
+        std::map<uint32_t, uint64_t> lastByThread;
+        for (const TraceEvent &e : events) {
+            uint64_t i = e.id & 0xffffffff;
+            TracePhase phase = i % 3 == 0 ? TracePhase::Begin : i % 3 == 1 ? TracePhase::End : TracePhase::Instant;
+            if (e.name != stressNames[i % 5] || e.phase != phase || (e.id >> 32) >= STRESS_THREADS) {
+                Fail("Torn event read while threads were recording");
+                break;
+            }
+            auto last = lastByThread.find(e.thread);
+            if (last != lastByThread.end() && (last->second >> 32) == (e.id >> 32) && last->second >= e.id) {
+                Fail("Events of a thread read out of order");
+                break;
+            }
+            lastByThread[e.thread] = e.id;
+        }
+        snapshots++;
+        read += events.size();
+    }
+    for (auto &w : writers) {
+        w.join();
+    }
+    if (tracer.stats().events - before != (uint64_t)STRESS_THREADS * STRESS_EVENTS) {
+        Fail("Events recorded concurrently went missing from the count");
+    }
+}
+
+// Trace files. Reads back what chromeTraceJSON() writes, one event per line.
+
+struct FileEvent {
+    std::string name;
+    std::string phase;
+    uint64_t id = 0;
+    double ms = 0.0;
+};
+
+static bool Field(const std::string &line, const char *key, std::string &value) {
+    std::string pattern = std::string("\"") + key + "\":";
+    size_t start = line.find(pattern);
+    if (start == std::string::npos) {
+        return false;
+    }
+    start += pattern.size();
+    if (start < line.size() && line[start] == '"') {
+        value.clear();
+        for (size_t i = start + 1; i < line.size() && line[i] != '"'; i++) {
+            if (line[i] == '\\' && i + 1 < line.size()) {
+                i++;
+            }
+            value += line[i];
+        }
+        return true;
+    }
+    size_t end = line.find_first_of(",}", start);
+    value = line.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    return true;
+}
+
+static std::vector<FileEvent> ParseTrace(const std::string &json) {
+    std::vector<FileEvent> events;
+    size_t pos = 0;
+    while (pos < json.size()) {
+        size_t end = json.find('\n', pos);
+        std::string line = json.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        pos = end == std::string::npos ? json.size() : end + 1;
+        FileEvent e;
+        std::string id, ts;
+        if (Field(line, "name", e.name) && Field(line, "ph", e.phase) && Field(line, "id", id) &&
+            Field(line, "ts", ts)) {
+            e.id = strtoull(id.c_str(), nullptr, 0);
+            e.ms = atof(ts.c_str()) / 1000.0;
+            events.push_back(e);
+        }
+    }
+    return events;
+}
+
+// Summary
+
+#define HOTWORD_TO_FIRST_AUDIO  "Hotword to first audio"
+
+// Durations of each span in ms, and of hotword to the first audio after it
+static std::map<std::string, std::vector<double>> Durations(const std::vector<FileEvent> &events) {
+    std::map<std::string, std::vector<double>> durations;
+    std::map<std::pair<std::string, uint64_t>, double> open;
+    std::map<uint64_t, double> hotwords;
+    for (const FileEvent &e : events) {
+        auto key = std::make_pair(e.name, e.id);
+        if (e.phase == "b") {
+            open[key] = e.ms;
+        } else if (e.phase == "e") {
+            auto begin = open.find(key);
+            if (begin != open.end()) {
+                durations[e.name].push_back(e.ms - begin->second);
+                open.erase(begin);
+            }
+        } else if (e.name == "Hotword") {
+            hotwords[e.id] = e.ms;
+        } else if (e.name == "First audio") {
+            auto hotword = hotwords.find(e.id);
+            if (hotword != hotwords.end()) {
+                durations[HOTWORD_TO_FIRST_AUDIO].push_back(e.ms - hotword->second);
+                hotwords.erase(hotword);
+            }
+        }
+    }
+    return durations;
+}
+
+// Instants with the given name
+static size_t Count(const std::vector<FileEvent> &events, const char *name) {
+    return (size_t)std::count_if(events.begin(), events.end(),
+                                 [name](const FileEvent &e) { return e.phase == "n" && e.name == name; });
+}
+
+static double Percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(p / 100.0 * values.size());
+    return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+static void PrintSummary(const std::map<std::string, std::vector<double>> &durations, double scale,
+                         const char *indent, bool last) {
+    printf("%s\"spans\": {\n", indent);
+    size_t n = 0;
+    for (auto &d : durations) {
+        printf("%s  \"%s\": { \"count\": %zu, \"p50_ms\": %.1f, \"p95_ms\": %.1f }%s\n", indent, d.first.c_str(),
+               d.second.size(), Percentile(d.second, 50) / scale, Percentile(d.second, 95) / scale,
+               ++n < durations.size() ? "," : "");
+    }
+    printf("%s}%s\n", indent, last ? "" : ",");
+}
+
+// Replay
+
+// Runs tasks at given times on a thread of its own
+class Worker {
+public:
+    Worker() : _thread([this]() { run(); }) {}
+
+    ~Worker() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _wake.notify_one();
+        _thread.join();
+    }
+
+    void post(Clock::time_point when, std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _tasks.push({ when, _sequence++, std::move(task) });
+        }
+        _wake.notify_one();
+    }
+
+private:
+    struct Task {
+        Clock::time_point when;
+        uint64_t sequence;
+        std::function<void()> run;
+        bool operator<(const Task &other) const {
+            return when != other.when ? when > other.when : sequence > other.sequence;
+        }
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            if (_tasks.empty()) {
+                if (_stopping) {
+                    return;
+                }
+                _wake.wait(lock);
+                continue;
+            }
+            Clock::time_point when = _tasks.top().when;
+            if (Clock::now() < when) {
+                _wake.wait_until(lock, when);
+                continue;
+            }
+            Task task = _tasks.top();
+            _tasks.pop();
+            lock.unlock();
+            task.run();
+            lock.lock();
+        }
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::priority_queue<Task> _tasks;
+    uint64_t _sequence = 0;
+    bool _stopping = false;
+    std::thread _thread;
+};
+
+// Stage delays of the scripted session, lognormal around these medians (ms)
+struct Script {
+    double sessionStart = 15;       // didHearHotword: to recording
+    double firstChunk = 100;        // One chunk of audio
+    double firstInterim = 350;      // First audio sent to first interim result
+    double finalTranscript = 900;   // First audio sent to final transcript
+    double query = 180;             // Query round trip
+    double firstAudio = 150;        // Speech audio request to playback
+    double download = 400;          // Speech audio request to download complete
+    double playback = 2500;         // First audio to end of session
+};
+
+struct ReplayResult {
+    std::vector<double> scripted;   // Hotword to first audio, ms at full scale
+    std::vector<TraceEvent> events;
+};
+
+static ReplayResult Replay(LatencyTracer &tracer, int sessions, double scale, std::mt19937 &rng) {
+    Script script;
+    Worker main, audio, network;
+    ReplayResult result;
+    tracer.clear();
+    std::lognormal_distribution<double> jitter(0.0, 0.25);
+    for (int s = 1; s <= sessions; s++) {
+        auto delay = [&](double ms) { return ms * jitter(rng); };
+        double start = delay(script.sessionStart), chunk = script.firstChunk;
+        double interim = delay(script.firstInterim), final = std::max(interim, delay(script.finalTranscript));
+        double query = delay(script.query), firstAudio = delay(script.firstAudio);
+        double download = std::max(firstAudio, delay(script.download)), playback = delay(script.playback);
+        result.scripted.push_back(start + chunk + final + query + firstAudio);
+
+        auto at = [scale](Clock::time_point from, double ms) {
+            return from + std::chrono::nanoseconds((int64_t)(ms * scale * 1e6));
+        };
+        uint64_t id = (uint64_t)s;
+        std::mutex doneMutex;
+        std::condition_variable doneCondition;
+        bool done = false;
+        Clock::time_point t0 = Clock::now();
+        main.post(t0, [&]() {
+            tracer.begin("Session", id);
+            tracer.instant("Hotword", id);
+            tracer.begin("Session start", id);
+            audio.post(at(t0, start), [&]() {
+                tracer.end("Session start", id);
+                Clock::time_point t1 = at(Clock::now(), chunk);
+                audio.post(t1, [&, t1]() {
+                    tracer.instant("First audio sent", id);
+                    tracer.begin("Speech recognition", id);
+                    network.post(at(t1, interim), [&]() { tracer.instant("First interim result", id); });
+                    network.post(at(t1, final), [&]() {
+                        tracer.end("Speech recognition", id);
+                        tracer.instant("Final transcript", id);
+                        main.post(Clock::now(), [&]() {
+                            tracer.begin("Query", id);
+                            Clock::time_point t2 = at(Clock::now(), query);
+                            network.post(t2, [&, t2]() {
+                                tracer.end("Query", id);
+                                tracer.begin("Speech audio download", id);
+                                audio.post(at(t2, firstAudio), [&]() { tracer.instant("First audio", id); });
+                                network.post(at(t2, download), [&]() {
+                                    tracer.end("Speech audio download", id);
+                                });
+                                main.post(at(t2, firstAudio + playback), [&]() {
+                                    tracer.end("Session", id);
+                                    std::lock_guard<std::mutex> lock(doneMutex);
+                                    done = true;
+                                    doneCondition.notify_one();
+                                });
+                            });
+                        });
+                    });
+                });
+            });
+        });
+        std::unique_lock<std::mutex> lock(doneMutex);
+        doneCondition.wait(lock, [&]() { return done; });
+        // Let the download finish, if it's still going
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::nanoseconds((int64_t)(download * scale * 1e6)));
+    }
+    result.events = tracer.events();
+    return result;
+}
+
+// Benchmark
+
+template <typename F>
+static double NanosecondsPerEvent(F f, size_t count) {
+    Clock::time_point start = Clock::now();
+    f();
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / count;
+}
+
+static bool ReadFile(const std::string &path, std::string &contents) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        contents.append(buffer, n);
+    }
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    int sessions = DEFAULT_SESSIONS;
+    double scale = DEFAULT_SCALE;
+    uint32_t seed = 1;
+    std::string out, summarize;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--sessions" && i + 1 < argc) {
+            sessions = std::max(1, atoi(argv[++i]));
+        } else if (a == "--scale" && i + 1 < argc) {
+            scale = std::max(0.001, atof(argv[++i]));
+        } else if (a == "--seed" && i + 1 < argc) {
+            seed = (uint32_t)atoi(argv[++i]);
+        } else if (a == "--out" && i + 1 < argc) {
+            out = argv[++i];
+        } else if (a == "--summarize" && i + 1 < argc) {
+            summarize = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--sessions N] [--scale X] [--seed N] [--out trace.json]\n"
+                            "       %s --summarize trace.json\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    if (!summarize.empty()) {
+        std::string json;
+        if (!ReadFile(summarize, json)) {
+            fprintf(stderr, "Can't read %s\n", summarize.c_str());
+            return 1;
+        }
+        std::vector<FileEvent> events = ParseTrace(json);
+        printf("{\n");
+        printf("  \"events\": %zu,\n", events.size());
+        printf("  \"speculation\": { \"hits\": %zu, \"misses\": %zu },\n", Count(events, "Speculation hit"),
+               Count(events, "Speculation miss"));
+        PrintSummary(Durations(events), 1.0, "  ", true);
+        printf("}\n");
+        return 0;
+    }
+
+    LatencyTracer &tracer = LatencyTracer::shared();
+    tracer.setEnabled(true);
+    CheckSingleThread(tracer);
+    CheckOverwrite(tracer);
+    CheckBufferReuse(tracer);
+    CheckConcurrentReads(tracer);
+
+    // Cost of recording
+    double enabledNs = NanosecondsPerEvent([&]() {
+        for (uint64_t i = 0; i < OVERHEAD_EVENTS; i++) {
+            tracer.instant("bench", i);
+        }
+    }, OVERHEAD_EVENTS);
+    tracer.setEnabled(false);
+    double disabledNs = NanosecondsPerEvent([&]() {
+        for (uint64_t i = 0; i < OVERHEAD_EVENTS; i++) {
+            tracer.instant("bench", i);
+        }
+    }, OVERHEAD_EVENTS);
+    tracer.setEnabled(true);
+    double concurrentNs = NanosecondsPerEvent([&]() {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < STRESS_THREADS; t++) {
+            threads.emplace_back([&]() {
+                for (uint64_t i = 0; i < OVERHEAD_EVENTS; i++) {
+                    tracer.instant("bench", i);
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+    }, OVERHEAD_EVENTS);
+
+    // Scripted sessions, through the exported trace
+    std::mt19937 rng(seed);
+    ReplayResult replay = Replay(tracer, sessions, scale, rng);
+    std::string json = LatencyTracer::chromeTraceJSON(replay.events);
+    std::vector<FileEvent> parsed = ParseTrace(json);
+    if (parsed.size() != replay.events.size()) {
+        Fail("Exported trace reads back with " + std::to_string(parsed.size()) + " of " +
+             std::to_string(replay.events.size()) + " events");
+    }
+    std::map<std::string, std::vector<double>> durations = Durations(parsed);
+    std::vector<double> &measured = durations[HOTWORD_TO_FIRST_AUDIO];
+    const char *spans[] = { "Session", "Session start", "Speech recognition", "Query", "Speech audio download" };
+    for (const char *span : spans) {
+        if (durations[span].size() != (size_t)sessions) {
+            Fail(std::string("Trace has ") + std::to_string(durations[span].size()) + " " + span + " spans for " +
+                 std::to_string(sessions) + " sessions");
+        }
+    }
+    if (measured.size() != (size_t)sessions) {
+        Fail("Trace has hotword to first audio for " + std::to_string(measured.size()) + " of " +
+             std::to_string(sessions) + " sessions");
+    } else {
+        // Sleeps only ever overshoot, allow for rounding of timestamps
+        for (int s = 0; s < sessions; s++) {
+            if (measured[s] / scale < replay.scripted[s] - 0.1 / scale) {
+                Fail("Session " + std::to_string(s + 1) + " traced shorter than scripted");
+                break;
+            }
+        }
+    }
+    if (!out.empty()) {
+        FILE *f = fopen(out.c_str(), "wb");
+        if (!f || fwrite(json.data(), 1, json.size(), f) != json.size()) {
+            Fail("Can't write " + out);
+        }
+        if (f) {
+            fclose(f);
+        }
+    }
+
+    embla::LatencyTracerStats stats = tracer.stats();
+    printf("{\n");
+    printf("  \"event_ns\": { \"enabled\": %.1f, \"disabled\": %.2f, \"%d_threads\": %.1f },\n", enabledNs,
+           disabledNs, STRESS_THREADS, concurrentNs / STRESS_THREADS);
+    printf("  \"tracer\": { \"events\": %" PRIu64 ", \"overwritten\": %" PRIu64 ", \"threads\": %zu },\n",
+           stats.events, stats.overwritten, stats.threads);
+    printf("  \"sessions\": %d,\n", sessions);
+    printf("  \"scale\": %g,\n", scale);
+    printf("  \"scripted\": { \"p50_ms\": %.1f, \"p95_ms\": %.1f },\n", Percentile(replay.scripted, 50),
+           Percentile(replay.scripted, 95));
+    PrintSummary(durations, scale, "  ", true);
+    printf("}\n");
+
+    return ChecksPassed() ? 0 : 1;
+}
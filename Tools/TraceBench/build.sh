@@ -0,0 +1,15 @@
+# Build script for the query latency tracing harness. Run from the
+# repository root:
+#
+#   $ bash Tools/TraceBench/build.sh
+#
+# The binary is written to build/, which git ignores, unless OUTDIR is set.
+
+CXX=${CXX:-c++}
+OUTDIR=${OUTDIR:-build}
+mkdir -p "$OUTDIR" || exit 1
+
+$CXX -std=c++17 -O2 -Wall -pthread -I Tools -I Embla/Util \
+    Tools/TraceBench/TraceBench.cpp \
+    Embla/Util/LatencyTracer.cpp \
+    -o "$OUTDIR/tracebench" || exit 1